@@ -0,0 +1,59 @@
+#!/bin/sh
+# Compiles each example which has a matching `.expect` file, and checks the
+# assembly output against it. Each line of an `.expect` file is one of:
+#   run <flags>           Compile the example with these flags.
+#   reparse               The last optimized IR output compiles again.
+#   contains <pattern>    The last output has a line matching the pattern.
+#   lacks <pattern>       The last output has no line matching the pattern.
+#   count <n> <pattern>   The last output has exactly n lines matching it.
+# Patterns are extended regular expressions, as `grep -E` takes them.
+
+BIN=${1:-./bin/dcc-backend}
+OUT=${TMPDIR:-/tmp}/dcc-check.$$.asm
+IR=${TMPDIR:-/tmp}/dcc-check.$$.dcc
+failed=0
+
+for expect in examples/*.expect; do
+    example=${expect%.expect}.dcc
+    while read -r directive rest; do
+        case $directive in
+        run)
+            flags=$rest
+            if ! $BIN $flags -i "$example" -o "$OUT" -r "$IR" >/dev/null 2>&1; then
+                echo "$example ($flags): failed to compile"
+                failed=1
+            fi
+            ;;
+        reparse)
+            if ! $BIN -i "$IR" -o /dev/null >/dev/null 2>&1; then
+                echo "$example ($flags): optimized IR failed to compile again"
+                failed=1
+            fi
+            ;;
+        contains)
+            if ! grep -Eq -- "$rest" "$OUT"; then
+                echo "$example ($flags): no line matches '$rest'"
+                failed=1
+            fi
+            ;;
+        lacks)
+            if grep -Eq -- "$rest" "$OUT"; then
+                echo "$example ($flags): a line matches '$rest'"
+                failed=1
+            fi
+            ;;
+        count)
+            n=${rest%% *}
+            pattern=${rest#* }
+            found=$(grep -Ec -- "$pattern" "$OUT")
+            if [ "$found" != "$n" ]; then
+                echo "$example ($flags): $found lines match '$pattern', not $n"
+                failed=1
+            fi
+            ;;
+        esac
+    done < "$expect"
+done
+
+rm -f "$OUT" "$IR"
+exit $failed
@@ -0,0 +1,301 @@
+#include <stdbool.h>
+
+#include "cfg.h"
+#include "exception.h"
+#include "parser.h"
+#include "statements.h"
+#include "varray.h"
+
+// Loops deeper than this are all considered equally hot.
+#define MAX_WEIGHTED_DEPTH 10
+
+// Find the index of the basic block with a given label. Returns NO_BLOCK if the
+// label does not exist.
+size_t find_block(Function* func, const char* label) {
+    for (size_t i = 0; i < va_len(func->basic_blocks); i++) {
+        if (func->basic_blocks[i].label && strequ(func->basic_blocks[i].label, label))
+            return i;
+    }
+    return NO_BLOCK;
+}
+
+// Collect the indices of the blocks which may execute directly after a given
+// block. Returns the number of successors written to `successors`.
+size_t block_successors(Function* func, size_t block, size_t successors[2]) {
+    Statement* final = func->basic_blocks[block].final;
+    size_t count = 0;
+
+    if (final == NULL)
+        return 0;
+
+    switch (final->type) {
+    case JUMP: {
+        size_t target = find_block(func, ((Jump*) final)->label);
+        if (target != NO_BLOCK)
+            successors[count++] = target;
+    } break;
+    case BRANCH: {
+        size_t on_true = find_block(func, ((Branch*) final)->true_label);
+        size_t on_false = find_block(func, ((Branch*) final)->false_label);
+        if (on_true != NO_BLOCK)
+            successors[count++] = on_true;
+        if (on_false != NO_BLOCK && on_false != on_true)
+            successors[count++] = on_false;
+    } break;
+    }
+
+    return count;
+}
+
+// Collect the blocks reachable from the entry in reverse postorder, returned as
+// a new VArray of block indices.
+size_t* reverse_postorder(Function* func) {
+    size_t block_count = va_len(func->basic_blocks);
+    size_t* order = va_new(0);
+    bool* visited = calloc(block_count, sizeof(bool));
+    // Explicit DFS stack of (block, next successor to visit) pairs.
+    size_t* stack = va_new(0);
+
+    visited[0] = true;
+    va_append(stack, (size_t) 0);
+    va_append(stack, (size_t) 0);
+
+    while (va_len(stack)) {
+        size_t block = stack[va_len(stack) - 2];
+        size_t* next = &stack[va_len(stack) - 1];
+        size_t successors[2];
+        size_t count = block_successors(func, block, successors);
+
+        if (*next < count) {
+            size_t successor = successors[(*next)++];
+            if (!visited[successor]) {
+                visited[successor] = true;
+                va_append(stack, successor);
+                va_append(stack, (size_t) 0);
+            }
+        } else {
+            va_append(order, block);
+            va_header(stack)->size -= 2 * sizeof(size_t);
+        }
+    }
+
+    // Reverse the postorder.
+    for (size_t i = 0; i < va_len(order) / 2; i++) {
+        size_t temp = order[i];
+        order[i] = order[va_len(order) - 1 - i];
+        order[va_len(order) - 1 - i] = temp;
+    }
+
+    free(visited);
+    va_free(stack);
+    return order;
+}
+
+// Collect the predecessors of every block, returned as an array of VArrays of
+// block indices. Free it with `free_predecessors()`.
+size_t** collect_predecessors(Function* func) {
+    size_t block_count = va_len(func->basic_blocks);
+    size_t** predecessors = malloc(block_count * sizeof(size_t*));
+
+    for (size_t i = 0; i < block_count; i++)
+        predecessors[i] = va_new(0);
+    for (size_t i = 0; i < block_count; i++) {
+        size_t successors[2];
+        size_t count = block_successors(func, i, successors);
+        for (size_t j = 0; j < count; j++)
+            va_append(predecessors[successors[j]], i);
+    }
+    return predecessors;
+}
+
+void free_predecessors(Function* func, size_t** predecessors) {
+    for (size_t i = 0; i < va_len(func->basic_blocks); i++)
+        va_free(predecessors[i]);
+    free(predecessors);
+}
+
+// Find the immediate dominator of every block using the iterative algorithm of
+// Cooper, Harvey and Kennedy. Unreachable blocks are given an idom of NO_BLOCK.
+void compute_dominators(Function* func) {
+    size_t block_count = va_len(func->basic_blocks);
+    size_t* order = reverse_postorder(func);
+    size_t* order_index = malloc(block_count * sizeof(size_t));
+    size_t** predecessors = collect_predecessors(func);
+
+    for (size_t i = 0; i < block_count; i++) {
+        func->basic_blocks[i].idom = NO_BLOCK;
+        order_index[i] = NO_BLOCK;
+    }
+    for (size_t i = 0; i < va_len(order); i++)
+        order_index[order[i]] = i;
+
+    func->basic_blocks[0].idom = 0;
+
+    for (bool changed = true; changed;) {
+        changed = false;
+        for (size_t i = 1; i < va_len(order); i++) {
+            size_t block = order[i];
+            size_t new_idom = NO_BLOCK;
+
+            for (size_t j = 0; j < va_len(predecessors[block]); j++) {
+                size_t pred = predecessors[block][j];
+                if (func->basic_blocks[pred].idom == NO_BLOCK)
+                    continue;
+                if (new_idom == NO_BLOCK) {
+                    new_idom = pred;
+                    continue;
+                }
+                // Walk both blocks up the tree until they meet.
+                size_t finger1 = pred;
+                size_t finger2 = new_idom;
+                while (finger1 != finger2) {
+                    while (order_index[finger1] > order_index[finger2])
+                        finger1 = func->basic_blocks[finger1].idom;
+                    while (order_index[finger2] > order_index[finger1])
+                        finger2 = func->basic_blocks[finger2].idom;
+                }
+                new_idom = finger1;
+            }
+
+            if (func->basic_blocks[block].idom != new_idom) {
+                func->basic_blocks[block].idom = new_idom;
+                changed = true;
+            }
+        }
+    }
+
+    free_predecessors(func, predecessors);
+    free(order_index);
+    va_free(order);
+}
+
+// Check if every path from the entry to block `b` passes through block `a`.
+// Requires `compute_dominators()`.
+bool dominates(Function* func, size_t a, size_t b) {
+    while (b != NO_BLOCK) {
+        if (a == b)
+            return true;
+        if (b == 0)
+            return false;
+        b = func->basic_blocks[b].idom;
+    }
+    return false;
+}
+
+// Check if a block belongs to a loop.
+bool loop_contains(Loop* loop, size_t block) {
+    for (size_t i = 0; i < va_len(loop->blocks); i++) {
+        if (loop->blocks[i] == block)
+            return true;
+    }
+    return false;
+}
+
+void free_loops(Function* func) {
+    if (func->loops == NULL)
+        return;
+    for (size_t i = 0; i < va_len(func->loops); i++) {
+        va_free(func->loops[i]->blocks);
+        va_free(func->loops[i]->children);
+        free(func->loops[i]);
+    }
+    va_free(func->loops);
+    func->loops = NULL;
+}
+
+// Find the natural loops of a function and how they nest. An edge to a block
+// which dominates its source is a loop's back edge, and the loop is made up of
+// every block which reaches a back edge without passing through its header.
+// This holds however the blocks are ordered. Loops are listed from smallest to
+// largest, so each comes before the loops which contain it.
+void find_loops(Function* func) {
+    size_t block_count = va_len(func->basic_blocks);
+    size_t** predecessors = collect_predecessors(func);
+    bool* in_loop = malloc(block_count * sizeof(bool));
+    size_t* worklist = va_new(0);
+
+    free_loops(func);
+    func->loops = va_new(0);
+    compute_dominators(func);
+
+    for (size_t header = 0; header < block_count; header++) {
+        for (size_t i = 0; i < va_len(predecessors[header]); i++) {
+            if (dominates(func, header, predecessors[header][i]))
+                va_append(worklist, predecessors[header][i]);
+        }
+        if (va_len(worklist) == 0)
+            continue;
+
+        // Every back edge to the same header belongs to a single loop.
+        memset(in_loop, 0, block_count * sizeof(bool));
+        in_loop[header] = true;
+        while (va_len(worklist)) {
+            size_t block = va_last(worklist);
+            va_header(worklist)->size -= sizeof(size_t);
+            if (in_loop[block] || func->basic_blocks[block].idom == NO_BLOCK)
+                continue;
+            in_loop[block] = true;
+            for (size_t i = 0; i < va_len(predecessors[block]); i++)
+                va_append(worklist, predecessors[block][i]);
+        }
+
+        Loop* loop = malloc(sizeof(Loop));
+        loop->header = header;
+        loop->blocks = va_new(0);
+        loop->parent = NULL;
+        loop->children = va_new(0);
+        for (size_t i = 0; i < block_count; i++) {
+            if (in_loop[i])
+                va_append(loop->blocks, i);
+        }
+
+        size_t position = va_len(func->loops);
+        while (position > 0 && va_len(func->loops[position - 1]->blocks) > va_len(loop->blocks))
+            position--;
+        va_append(func->loops, loop);
+        memmove(&func->loops[position + 1], &func->loops[position],
+                (va_len(func->loops) - 1 - position) * sizeof(Loop*));
+        func->loops[position] = loop;
+    }
+
+    // Natural loops with different headers are either disjoint or nested, so
+    // the smallest larger loop holding a loop's header is its parent.
+    for (size_t i = 0; i < va_len(func->loops); i++) {
+        Loop* loop = func->loops[i];
+        for (size_t j = i + 1; j < va_len(func->loops); j++) {
+            if (loop_contains(func->loops[j], loop->header)) {
+                loop->parent = func->loops[j];
+                va_append(loop->parent->children, loop);
+                break;
+            }
+        }
+    }
+
+    va_free(worklist);
+    free(in_loop);
+    free_predecessors(func, predecessors);
+}
+
+// Find how deeply nested each block is within loops.
+void compute_loop_depths(Function* func) {
+    find_loops(func);
+    for (size_t i = 0; i < va_len(func->basic_blocks); i++)
+        func->basic_blocks[i].loop_depth = 0;
+    for (size_t i = 0; i < va_len(func->loops); i++) {
+        for (size_t j = 0; j < va_len(func->loops[i]->blocks); j++)
+            func->basic_blocks[func->loops[i]->blocks[j]].loop_depth += 1;
+    }
+}
+
+// Estimate how often a block executes relative to the function's entry. A
+// profile is trusted when there is one, and a block it never saw run weighs
+// nothing. Otherwise, each level of loop nesting is assumed to run eight times.
+uint64_t block_weight(BasicBlock* bb) {
+    if (bb->profile_weight != UNPROFILED)
+        return bb->profile_weight;
+
+    uint32_t depth = bb->loop_depth;
+    if (depth > MAX_WEIGHTED_DEPTH)
+        depth = MAX_WEIGHTED_DEPTH;
+    return (uint64_t) 1 << (3 * depth);
+}
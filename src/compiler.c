@@ -0,0 +1,1314 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <inttypes.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "cfg.h"
+#include "compiler.h"
+#include "exception.h"
+#include "optimizer.h"
+#include "gb/banks.h"
+#include "gb/data.h"
+#include "gb/operations.h"
+#include "gb/relax.h"
+#include "gb/runtime.h"
+#include "link.h"
+#include "parser.h"
+#include "registers.h"
+#include "statements.h"
+#include "varray.h"
+
+// Where a value is stored: either a register, or memory. Locals which have
+// been spilled are stored in their own memory slot.
+typedef struct Location {
+    CPUReg* reg;
+    const char* symbol;
+} Location;
+
+typedef struct Emitter {
+    FILE* out;
+    Function* func;
+    // The index of the statement being compiled.
+    size_t when;
+    // Whether `a` may be overwritten without saving it first.
+    bool a_free;
+    // The label of each local's memory slot.
+    char** slot_names;
+    // Whether each local's memory slot is used to break a cycle of moves,
+    // which needs it even if the local is never spilled.
+    bool* slot_used;
+    // The local which the flags were left describing by the previous
+    // statement, and the condition code which holds if it is nonzero. This is
+    // UINT64_MAX if the flags describe nothing useful.
+    uint64_t flags_local;
+    const char* flags_condition;
+    // The global which `hl` was left pointing into by the previous read or
+    // write, and the offset of the byte it points at. The symbol is NULL if
+    // `hl` holds nothing known.
+    const char* hl_symbol;
+    unsigned hl_offset;
+    // Set once a tail call has been made in place of the following return.
+    bool tail_called;
+    // How many tail calls were made, and how many of them loop back to the
+    // start of the function.
+    size_t tail_call_count;
+    size_t loop_count;
+} Emitter;
+
+// A move of a local from one location to another, made between statements.
+typedef struct Move {
+    uint64_t id;
+    CPUReg* from;
+    CPUReg* to;
+    bool done;
+} Move;
+
+static inline Location reg_location(CPUReg* reg) {
+    return (Location) {reg, NULL};
+}
+
+static inline Location symbol_location(const char* symbol) {
+    return (Location) {NULL, symbol};
+}
+
+// The location of a local, given the register it occupies (or NULL, for its
+// memory slot).
+static inline Location local_location_of(Emitter* em, uint64_t id, CPUReg* reg) {
+    return (Location) {reg, reg ? NULL : em->slot_names[id]};
+}
+
+// The label of a function's memory slot for a local. Callers write parameters
+// which are passed in memory straight to the callee's slots for them.
+static char* local_slot_name(const char* function, size_t id) {
+    size_t length = snprintf(NULL, 0, "%s.local%zu", function, id) + 1;
+    char* name = malloc(length);
+    snprintf(name, length, "%s.local%zu", function, id);
+    return name;
+}
+
+// The label of the memory a function returns a result too wide for any
+// register in.
+static char* result_slot_name(const char* function) {
+    size_t length = snprintf(NULL, 0, "%s.result", function) + 1;
+    char* name = malloc(length);
+    snprintf(name, length, "%s.result", function);
+    return name;
+}
+
+// Get one byte of a location, counting from the least significant.
+static ByteOperand location_byte(const Location* loc, unsigned i) {
+    ByteOperand byte = {0};
+
+    if (loc->reg) {
+        // Components are listed from the most significant byte.
+        byte.reg = loc->reg->components[loc->reg->size - 1 - i];
+    } else {
+        byte.symbol = loc->symbol;
+        byte.offset = i;
+    }
+    return byte;
+}
+
+static ByteOperand const_byte(uint64_t value, unsigned i) {
+    return (ByteOperand) {.is_const = true, .value = (value >> (i * 8)) & 0xFF};
+}
+
+// Check if a byte operand is in HRAM, which `ldh` must be used to reach.
+static bool is_high_byte(ByteOperand* byte) {
+    return !byte->reg && !byte->is_const && is_high_data(byte->symbol);
+}
+
+static void emit_load(Emitter* em, ByteOperand* dest, ByteOperand* src) {
+    fputs(is_high_byte(dest) || is_high_byte(src) ? "    ldh " : "    ld ", em->out);
+    fprint_byte_operand(em->out, dest);
+    fputs(", ", em->out);
+    fprint_byte_operand(em->out, src);
+    fputc('\n', em->out);
+}
+
+// `a` is the only register which can be loaded from or stored to an absolute
+// address. When it holds a live value, it is preserved on the stack.
+static void borrow_a(Emitter* em) {
+    if (!em->a_free)
+        fputs("    push af\n", em->out);
+}
+
+static void return_a(Emitter* em) {
+    if (!em->a_free)
+        fputs("    pop af\n", em->out);
+}
+
+static bool same_byte(ByteOperand* a, ByteOperand* b) {
+    if (a->reg || b->reg)
+        return a->reg == b->reg;
+    if (a->is_const || b->is_const)
+        return false;
+    return a->offset == b->offset && a->symbol == b->symbol;
+}
+
+static void move_byte(Emitter* em, ByteOperand dest, ByteOperand src) {
+    ByteOperand a = {.reg = &a_reg};
+
+    if (same_byte(&dest, &src))
+        return;
+
+    // Registers can be loaded from anywhere except memory, and `a` can be
+    // loaded from anywhere.
+    if (dest.reg && (src.symbol == NULL || dest.reg == &a_reg)) {
+        emit_load(em, &dest, &src);
+    } else if (dest.symbol && src.reg == &a_reg) {
+        emit_load(em, &dest, &src);
+    } else {
+        borrow_a(em);
+        emit_load(em, &a, &src);
+        emit_load(em, &dest, &a);
+        return_a(em);
+    }
+}
+
+// Move a value of type `src_type` into a location of type `dest_type`,
+// truncating or extending it as needed.
+static void move_value(Emitter* em, const Location* dest, uint8_t dest_type,
+                       const Location* src, uint8_t src_type) {
+    unsigned dest_width = type_widths[dest_type];
+    unsigned src_width = type_widths[src_type];
+    unsigned common = dest_width < src_width ? dest_width : src_width;
+
+    // When moving between overlapping register unions, copy in whichever
+    // direction avoids overwriting bytes which are yet to be read.
+    bool descending = false;
+    if (dest->reg && src->reg && match_registers(dest->reg, src->reg)) {
+        for (unsigned i = 0; i < common && !descending; i++) {
+            ByteOperand written = location_byte(dest, i);
+            for (unsigned j = i + 1; j < common; j++) {
+                ByteOperand read = location_byte(src, j);
+                if (same_byte(&written, &read))
+                    descending = true;
+            }
+        }
+    }
+
+    for (unsigned k = 0; k < common; k++) {
+        unsigned i = descending ? common - 1 - k : k;
+        move_byte(em, location_byte(dest, i), location_byte(src, i));
+    }
+
+    if (dest_width <= src_width)
+        return;
+
+    // Fill the remaining bytes with zero, or with copies of the sign bit.
+    ByteOperand a = {.reg = &a_reg};
+    borrow_a(em);
+    if (is_signed_type(src_type)) {
+        ByteOperand top = location_byte(dest, common - 1);
+        if (top.reg != &a_reg)
+            emit_load(em, &a, &top);
+        fputs("    add a, a\n    sbc a, a\n", em->out);
+    } else {
+        fputs("    xor a, a\n", em->out);
+    }
+    for (unsigned i = common; i < dest_width; i++) {
+        ByteOperand byte = location_byte(dest, i);
+        emit_load(em, &byte, &a);
+    }
+    return_a(em);
+}
+
+// Load a constant into a location.
+static void move_const(Emitter* em, const Location* dest, uint8_t type, uint64_t value) {
+    value = truncate_to_type(type, value);
+
+    if (dest->reg && dest->reg->size == 2) {
+        fprintf(em->out, "    ld %s, %" PRIu64 "\n", dest->reg->name, value & 0xFFFF);
+        return;
+    }
+    for (unsigned i = 0; i < type_widths[type]; i++)
+        move_byte(em, location_byte(dest, i), const_byte(value, i));
+}
+
+static void move_operand(Emitter* em, const Location* dest, uint8_t dest_type, Value* val) {
+    if (val->is_const) {
+        move_const(em, dest, dest_type, val->const_unsigned);
+    } else {
+        LocalVar* local = em->func->locals[val->local_id];
+        Location src = local_location_of(em, val->local_id, local_location(local, em->when));
+        move_value(em, dest, dest_type, &src, local->type);
+    }
+}
+
+/*
+ * Liveness
+ */
+
+// Check if a local holds a value immediately before statement `when`.
+static bool is_live_before(LocalVar* local, size_t when) {
+    return (local->origin == NULL || local->lifetime_start < when) && local->lifetime_end >= when;
+}
+
+// Check if a register can be used as scratch around a statement. Before the
+// statement, every local it reads or which lives through it must be preserved.
+// Afterwards, only those which live on do.
+static bool is_reg_free(Function* func, CPUReg* reg, size_t when, bool after, uint64_t except) {
+    LocalVar* local = NULL;
+    for (size_t i = 0; local = iterate_locals(func, &i); i++) {
+        if (i == except)
+            continue;
+        if (after) {
+            if (local->lifetime_start > when || local->lifetime_end <= when)
+                continue;
+            CPUReg* at = local_location(local, when);
+            if (at && match_registers(at, reg))
+                return false;
+        } else {
+            if (!is_live_before(local, when))
+                continue;
+            CPUReg* before = local_location_before(local, when);
+            CPUReg* at = local_location(local, when);
+            if ((before && match_registers(before, reg)) || (at && match_registers(at, reg)))
+                return false;
+        }
+    }
+    return true;
+}
+
+static bool is_a_free(Function* func, size_t when, bool after, uint64_t except) {
+    return is_reg_free(func, &a_reg, when, after, except);
+}
+
+/*
+ * Globals through `hl`
+ */
+
+// Check if a global lies in the same page as the global which `hl` points
+// into, so that the two addresses differ only in their low byte.
+static bool is_hl_in_page(Emitter* em, const char* symbol) {
+    return em->hl_symbol && is_same_page(symbol, em->hl_symbol);
+}
+
+// Find how far a byte of a global is from the byte which `hl` points at. This
+// is only known when `hl` points into the same global, or the same page.
+static bool hl_distance(Emitter* em, const char* symbol, unsigned offset, int* distance) {
+    if (em->hl_symbol && !strcmp(em->hl_symbol, symbol))
+        *distance = (int) offset - (int) em->hl_offset;
+    else if (is_hl_in_page(em, symbol))
+        *distance = (int) (data_offset(symbol) + offset) - (int) (data_offset(em->hl_symbol) + em->hl_offset);
+    else
+        return false;
+    return true;
+}
+
+// Step `hl` to the next or previous byte of a global, or of its page. Only `l`
+// changes within a page, which is faster to step unless the flags must be kept.
+static void step_hl(Emitter* em, const char* symbol, bool up) {
+    bool low = data_page(symbol) != NO_PAGE && em->flags_local == UINT64_MAX;
+    fprintf(em->out, "    %s %s\n", up ? "inc" : "dec", low ? "l" : "hl");
+}
+
+// Point `hl` at a byte of a global, stepping it there if it is next to it, or
+// only loading `l` if it already points into the same page.
+static void point_hl_at(Emitter* em, const char* symbol, unsigned offset) {
+    int distance;
+
+    if (hl_distance(em, symbol, offset, &distance) && distance >= -1 && distance <= 1) {
+        if (distance)
+            step_hl(em, symbol, distance > 0);
+    } else if (is_hl_in_page(em, symbol) && offset) {
+        fprintf(em->out, "    ld l, LOW(%s + %u)\n", symbol, offset);
+    } else if (is_hl_in_page(em, symbol)) {
+        fprintf(em->out, "    ld l, LOW(%s)\n", symbol);
+    } else if (offset) {
+        fprintf(em->out, "    ld hl, %s + %u\n", symbol, offset);
+    } else {
+        fprintf(em->out, "    ld hl, %s\n", symbol);
+    }
+    em->hl_symbol = symbol;
+    em->hl_offset = offset;
+}
+
+// Check if `hl` is cheaper to point at either end of a global than `a` is to
+// reach it by address. This is so when `hl` only needs stepping once, or when
+// it points into the same page and the local is not in `a`, so that loading
+// `l` replaces a copy through `a`. HRAM is reached by `ldh`, which a load of `l`
+// does not beat.
+static bool is_hl_near(Emitter* em, const char* symbol, const Location* local, unsigned width) {
+    int first, last;
+
+    if (!hl_distance(em, symbol, 0, &first) || !hl_distance(em, symbol, width - 1, &last))
+        return false;
+    if (abs(first) <= 1 || abs(last) <= 1)
+        return true;
+    return local->reg != &a_reg && data_page(symbol) != HRAM_PAGE && is_hl_in_page(em, symbol);
+}
+
+// Check if a read or write of a global in `hl` is better made through `hl`
+// than by its address, which only `a` can reach. This pays off for values
+// wider than a byte, which `hl` steps through, for bytes which would
+// otherwise borrow `a`, and for those which `hl` is already near.
+// The local must be in a register, which may only overlap `hl` when all of
+// `hl` is being read.
+static bool is_hl_access(Emitter* em, const char* symbol, const Location* local, unsigned width, bool store) {
+    if (local->reg == NULL)
+        return false;
+    if (match_registers(local->reg, &hl_reg))
+        return !store && local->reg == &hl_reg;
+    return width > 1 || (local->reg != &a_reg && !em->a_free) || is_hl_near(em, symbol, local, width);
+}
+
+// Read or write a global through `hl`, which must be free. Its bytes are
+// visited in whichever direction `hl` is already closest to, and `hl` is left
+// pointing at the last of them, so that a following access to the same global
+// only needs to step it.
+static void access_through_hl(Emitter* em, const char* symbol, const Location* local, unsigned width, bool store) {
+    int first, last;
+    bool descending = width > 1 && hl_distance(em, symbol, 0, &first) && hl_distance(em, symbol, width - 1, &last)
+                      && abs(last) < abs(first);
+    const char* step = descending ? "-" : "+";
+
+    point_hl_at(em, symbol, descending ? width - 1 : 0);
+
+    // A pointer loaded into `hl` keeps its first byte in `a` until the second
+    // is loaded.
+    if (local->reg == &hl_reg) {
+        borrow_a(em);
+        fprintf(em->out, "    ld a, [hl%s]\n    ld %s, [hl]\n    ld %s, a\n", step, descending ? "l" : "h",
+                descending ? "h" : "l");
+        return_a(em);
+        em->hl_symbol = NULL;
+        return;
+    }
+
+    for (unsigned k = 0; k < width; k++) {
+        unsigned i = descending ? width - 1 - k : k;
+        ByteOperand byte = location_byte(local, i);
+        const char* name = byte.reg->name;
+
+        if (k == width - 1) {
+            if (store)
+                fprintf(em->out, "    ld [hl], %s\n", name);
+            else
+                fprintf(em->out, "    ld %s, [hl]\n", name);
+        } else if (byte.reg == &a_reg || em->a_free) {
+            if (store && byte.reg != &a_reg)
+                fprintf(em->out, "    ld a, %s\n", name);
+            if (store)
+                fprintf(em->out, "    ld [hl%s], a\n", step);
+            else
+                fprintf(em->out, "    ld a, [hl%s]\n", step);
+            if (!store && byte.reg != &a_reg)
+                fprintf(em->out, "    ld %s, a\n", name);
+        } else {
+            if (store)
+                fprintf(em->out, "    ld [hl], %s\n", name);
+            else
+                fprintf(em->out, "    ld %s, [hl]\n", name);
+            step_hl(em, symbol, !descending);
+        }
+    }
+    em->hl_offset = descending ? 0 : width - 1;
+}
+
+/*
+ * Moves between statements
+ */
+
+// Perform a set of moves as if they happened simultaneously. Spills are made
+// first, since they can not overwrite anything. Moves into registers are then
+// made once nothing else needs to read the register, with moves into `a` left
+// until last since the others may borrow it. If every remaining move waits on
+// another, one of them is broken by going through memory.
+static void emit_parallel_moves(Emitter* em, Move* moves) {
+    Function* func = em->func;
+    size_t remaining = va_len(moves);
+
+    // A local which is yet to be moved out of `a` must not be overwritten.
+    for (size_t i = 0; i < va_len(moves); i++) {
+        if (moves[i].from && match_registers(moves[i].from, &a_reg))
+            em->a_free = false;
+    }
+
+    for (size_t i = 0; i < va_len(moves); i++) {
+        if (moves[i].to == NULL) {
+            Location dest = local_location_of(em, moves[i].id, NULL);
+            Location src = local_location_of(em, moves[i].id, moves[i].from);
+            move_value(em, &dest, func->locals[moves[i].id]->type, &src, func->locals[moves[i].id]->type);
+            moves[i].done = true;
+            remaining--;
+        }
+    }
+
+    while (remaining) {
+        bool progress = false;
+
+        for (size_t i = 0; i < va_len(moves); i++) {
+            if (moves[i].done)
+                continue;
+
+            bool into_a = match_registers(moves[i].to, &a_reg);
+            bool blocked = false;
+            for (size_t j = 0; j < va_len(moves) && !blocked; j++) {
+                if (j == i || moves[j].done)
+                    continue;
+                blocked = (moves[j].from && match_registers(moves[j].from, moves[i].to))
+                          || (into_a && !match_registers(moves[j].to, &a_reg)
+                              && !(moves[i].from && match_registers(moves[j].to, moves[i].from)));
+            }
+            if (blocked)
+                continue;
+
+            uint8_t type = func->locals[moves[i].id]->type;
+            Location dest = local_location_of(em, moves[i].id, moves[i].to);
+            Location src = local_location_of(em, moves[i].id, moves[i].from);
+            move_value(em, &dest, type, &src, type);
+            if (into_a)
+                em->a_free = false;
+            moves[i].done = true;
+            remaining--;
+            progress = true;
+        }
+
+        if (!progress) {
+            // Break the cycle by sending one local through its memory slot.
+            for (size_t i = 0; i < va_len(moves); i++) {
+                if (moves[i].done || moves[i].from == NULL)
+                    continue;
+                uint8_t type = func->locals[moves[i].id]->type;
+                Location dest = local_location_of(em, moves[i].id, NULL);
+                Location src = local_location_of(em, moves[i].id, moves[i].from);
+                move_value(em, &dest, type, &src, type);
+                moves[i].from = NULL;
+                em->slot_used[moves[i].id] = true;
+                break;
+            }
+        }
+    }
+}
+
+// Make any moves which the register allocator placed before a statement.
+static void emit_statement_moves(Emitter* em) {
+    Function* func = em->func;
+    Move* moves = va_new(0);
+    LocalVar* local = NULL;
+
+    for (size_t i = 0; local = iterate_locals(func, &i); i++) {
+        if (!is_live_before(local, em->when))
+            continue;
+        CPUReg* from = local_location_before(local, em->when);
+        CPUReg* to = local_location(local, em->when);
+        if (from != to) {
+            Move move = {i, from, to, false};
+            va_append(moves, move);
+            // A local reloaded into `hl` loses track of where it pointed.
+            if (to && match_registers(to, &hl_reg))
+                em->hl_symbol = NULL;
+        }
+    }
+
+    em->a_free = is_a_free(func, em->when, false, UINT64_MAX);
+    emit_parallel_moves(em, moves);
+    va_free(moves);
+}
+
+// Collect the moves needed for a jump from statement `when` into a block
+// beginning at statement `target`, so that each local is where the target
+// expects it.
+static Move* collect_edge_moves(Emitter* em, size_t target) {
+    Function* func = em->func;
+    Move* moves = va_new(0);
+    LocalVar* local = NULL;
+
+    for (size_t i = 0; local = iterate_locals(func, &i); i++) {
+        // Only locals which exist at the jump and are expected by the target
+        // need moving. On a loop's back edge, a local may be live at the target
+        // even though the jump is its final use.
+        if (!is_live_before(local, target) || !is_live_before(local, em->when))
+            continue;
+        CPUReg* from = local_location(local, em->when);
+        CPUReg* to = local_location_before(local, target);
+        if (from != to) {
+            Move move = {i, from, to, false};
+            va_append(moves, move);
+        }
+    }
+
+    return moves;
+}
+
+// Check if `a` can be used as a scratch register on the way from a jump into a
+// block beginning at statement `target`. A local which the target reads, and
+// which is in `a` at the jump, ends its lifetime there when the jump is a
+// loop's back edge, but is still needed.
+static bool is_a_free_on_edge(Emitter* em, size_t target) {
+    LocalVar* local = NULL;
+
+    if (!is_a_free(em->func, em->when, true, UINT64_MAX))
+        return false;
+    for (size_t i = 0; local = iterate_locals(em->func, &i); i++) {
+        if (!is_live_before(local, target) || !is_live_before(local, em->when))
+            continue;
+        CPUReg* reg = local_location(local, em->when);
+        if (reg && match_registers(reg, &a_reg))
+            return false;
+    }
+    return true;
+}
+
+static void emit_edge_moves(Emitter* em, size_t target) {
+    Move* moves = collect_edge_moves(em, target);
+
+    em->a_free = is_a_free_on_edge(em, target);
+    emit_parallel_moves(em, moves);
+    va_free(moves);
+}
+
+/*
+ * Statements
+ */
+
+// Compile an operation which reads its operands wherever they were allocated.
+static void compile_in_place(Emitter* em, Operation* op, const Location* dest) {
+    Function* func = em->func;
+    LocalVar* lhs = func->locals[op->lhs];
+    Location lhs_location = local_location_of(em, op->lhs, local_location(lhs, em->when));
+    OperandBytes bytes = {type_widths[lhs->type], type_widths[op->var_type]};
+
+    for (unsigned i = 0; i < bytes.dest_width; i++)
+        bytes.dest[i] = location_byte(dest, i);
+    for (unsigned i = 0; i < bytes.width; i++)
+        bytes.lhs[i] = location_byte(&lhs_location, i);
+
+    if (op->type == NOT || op->type == NEGATE || op->type == COMPLEMENT) {
+        for (unsigned i = 0; i < bytes.width; i++)
+            bytes.rhs[i] = const_byte(0, i);
+    } else if (op->rhs.is_const) {
+        uint64_t value = truncate_to_type(lhs->type, op->rhs.const_unsigned);
+        for (unsigned i = 0; i < bytes.width; i++)
+            bytes.rhs[i] = const_byte(value, i);
+    } else {
+        LocalVar* rhs = func->locals[op->rhs.local_id];
+        Location rhs_location = local_location_of(em, op->rhs.local_id, local_location(rhs, em->when));
+        for (unsigned i = 0; i < bytes.width; i++)
+            bytes.rhs[i] = location_byte(&rhs_location, i);
+    }
+
+    op->cpu_info.bytes = &bytes;
+    op->cpu_info.operation->compile(em->out, &op->cpu_info);
+    op->cpu_info.bytes = NULL;
+}
+
+// Check if a comparison's only reader is a branch directly after it, in which
+// case its result never needs to leave the flags.
+static bool is_branch_condition(Emitter* em, Operation* op) {
+    Statement* next = op->statement.next;
+
+    if (!((op->type >= LESS && op->type <= EQU) || op->type == NOT || op->type == L_AND || op->type == L_OR))
+        return false;
+    return next && next->type == BRANCH && ((Branch*) next)->cond == op->dest
+           && va_len(em->func->locals[op->dest]->uses) == 1;
+}
+
+// Check if a byte load through a pointer is directly followed by stepping the
+// same pointer, where it dies, into `hl`. The load can then step `hl` itself,
+// and the step is folded into it. Returns how far the load steps `hl`.
+static int8_t fold_pointer_step(Emitter* em, Operation* op) {
+    Function* func = em->func;
+    Statement* next = op->statement.next;
+
+    if (op->type != DEREFERENCE || type_widths[op->var_type] != 1 || next == NULL || next->type != OPERATION)
+        return 0;
+    Operation* step = (Operation*) next;
+    if (step->cpu_info.operation == NULL || step->cpu_info.operation->hl_step == 0 || step->lhs != op->lhs)
+        return 0;
+
+    // Nothing may be moved through `hl` between the two, and the pointer must
+    // not be needed afterwards.
+    LocalVar* ptr = func->locals[op->lhs];
+    CPUReg* dest = local_location(func->locals[op->dest], em->when);
+    size_t when = em->when + 1;
+    if (ptr->lifetime_end != when || local_location_before(ptr, when) != local_location(ptr, when)
+        || local_location(func->locals[step->dest], when) != &hl_reg || (dest && match_registers(dest, &hl_reg)))
+        return 0;
+
+    step->cpu_info.folded = true;
+    return step->cpu_info.operation->hl_step;
+}
+
+static void compile_operation(Emitter* em, Operation* op) {
+    Function* func = em->func;
+    const CpuOp* cpu_op = op->cpu_info.operation;
+    Location dest = local_location_of(em, op->dest, local_location(func->locals[op->dest], em->when));
+
+    if (op->type == ASSIGN) {
+        em->a_free = is_a_free(func, em->when, true, op->dest);
+        move_operand(em, &dest, op->var_type, &op->rhs);
+        return;
+    }
+
+    if (cpu_op == NULL) {
+        error("Unable to compile %%%" PRIu64 " in %s; no operation was selected.",
+              op->dest, func->declaration.identifier);
+        return;
+    }
+
+    // A load through the pointer has already stepped it.
+    if (op->cpu_info.folded)
+        return;
+
+    if (cpu_op->in_place) {
+        op->cpu_info.flags_only = is_branch_condition(em, op);
+        compile_in_place(em, op, &dest);
+        if (op->cpu_info.flags_only) {
+            em->flags_local = op->dest;
+            em->flags_condition = op->cpu_info.condition;
+        }
+        return;
+    }
+
+    // Place the operands where the operation expects them. The rhs goes first,
+    // since the register allocator ensures that it is never in the way of the
+    // lhs.
+    em->a_free = is_a_free(func, em->when, false, UINT64_MAX);
+    switch (op->type) {
+    case NOT: case NEGATE: case COMPLEMENT: case ADDRESS: case DEREFERENCE:
+        break;
+    default:
+        if (cpu_op->rhs_reg) {
+            Location rhs = reg_location(cpu_op->rhs_reg);
+            move_operand(em, &rhs, op->var_type, &op->rhs);
+        } else if (!op->rhs.is_const) {
+            op->cpu_info.registers[0] = local_location(func->locals[op->rhs.local_id], em->when);
+        }
+    }
+
+    Location lhs = reg_location(cpu_op->lhs_reg ? cpu_op->lhs_reg : cpu_op->result_reg);
+    Value lhs_value = {.is_const = false, .local_id = op->lhs};
+    move_operand(em, &lhs, func->locals[op->lhs]->type, &lhs_value);
+
+    op->cpu_info.hl_step = fold_pointer_step(em, op);
+    cpu_op->compile(em->out, &op->cpu_info);
+
+    Location result = reg_location(cpu_op->result_reg);
+    em->a_free = is_a_free(func, em->when, true, op->dest);
+    move_value(em, &dest, op->var_type, &result, op->var_type);
+
+    // Copying the result leaves the flags alone.
+    if (cpu_op->sets_zero) {
+        em->flags_local = op->dest;
+        em->flags_condition = "nz";
+    }
+}
+
+static const char* invert_condition(const char* condition) {
+    if (strequ(condition, "z")) return "nz";
+    if (strequ(condition, "nz")) return "z";
+    if (strequ(condition, "c")) return "nc";
+    return "c";
+}
+
+// Set the zero flag if a local is zero, and clear it otherwise. The register
+// allocator frees `a` for values wider than a byte, and `hl` as well for those
+// in memory.
+static void test_local(Emitter* em, uint64_t id) {
+    LocalVar* local = em->func->locals[id];
+    Location loc = local_location_of(em, id, local_location(local, em->when));
+    unsigned width = type_widths[local->type];
+    ByteOperand a = {.reg = &a_reg};
+    ByteOperand first = location_byte(&loc, 0);
+
+    if (width == 1 && first.reg == &a_reg) {
+        fputs("    and a, a\n", em->out);
+    } else if (width == 1 && first.reg) {
+        fprintf(em->out, "    inc %s\n    dec %s\n", first.reg->name, first.reg->name);
+    } else {
+        emit_load(em, &a, &first);
+        for (unsigned i = 1; i < width; i++) {
+            ByteOperand byte = location_byte(&loc, i);
+            if (byte.symbol) {
+                if (i == 1)
+                    fprintf(em->out, "    ld hl, %s + 1\n", byte.symbol);
+                else
+                    fputs("    inc hl\n", em->out);
+                fputs("    or a, [hl]\n", em->out);
+            } else {
+                fprintf(em->out, "    or a, %s\n", byte.reg->name);
+            }
+        }
+    }
+}
+
+// Decrement a loop counter in place, leaving the zero flag set once it runs
+// out.
+static void decrement_local(Emitter* em, uint64_t id) {
+    Location loc = local_location_of(em, id, local_location(em->func->locals[id], em->when));
+    ByteOperand a = {.reg = &a_reg};
+    ByteOperand byte = location_byte(&loc, 0);
+
+    if (byte.reg) {
+        fprintf(em->out, "    dec %s\n", byte.reg->name);
+    } else {
+        emit_load(em, &a, &byte);
+        fputs("    dec a\n", em->out);
+        emit_load(em, &byte, &a);
+    }
+}
+
+// Jump to one of two blocks. The side which the next block is on is fallen
+// into, and the other is jumped to directly unless its edge needs moves.
+static void compile_branch(Emitter* em, Branch* br, size_t* block_starts, size_t block_id) {
+    Function* func = em->func;
+    size_t taken = find_block(func, br->true_label);
+    size_t other = find_block(func, br->false_label);
+    const char* condition = "nz";
+
+    if (taken != other || br->countdown) {
+        if (br->countdown)
+            decrement_local(em, br->cond);
+        else if (em->flags_local == br->cond)
+            condition = em->flags_condition;
+        else
+            test_local(em, br->cond);
+
+        if (taken == block_id + 1) {
+            taken = find_block(func, br->false_label);
+            other = find_block(func, br->true_label);
+            condition = invert_condition(condition);
+        }
+
+        Move* moves = collect_edge_moves(em, block_starts[taken]);
+        if (va_len(moves) == 0) {
+            fprintf(em->out, "    jp %s, .%s\n", condition, func->basic_blocks[taken].label);
+        } else {
+            fprintf(em->out, "    jp %s, :+\n", invert_condition(condition));
+            em->a_free = is_a_free_on_edge(em, block_starts[taken]);
+            emit_parallel_moves(em, moves);
+            fprintf(em->out, "    jp .%s\n:\n", func->basic_blocks[taken].label);
+        }
+        va_free(moves);
+    }
+
+    emit_edge_moves(em, block_starts[other]);
+    if (other != block_id + 1)
+        fprintf(em->out, "    jp .%s\n", func->basic_blocks[other].label);
+}
+
+// The stack only holds register pairs, so saving a register saves its pair.
+static const char* const SAVED_PAIRS[] = {"af", "bc", "de", "hl"};
+static CPUReg* const SAVED_PAIR_REGS[] = {&a_reg, &bc_reg, &de_reg, &hl_reg};
+
+// Check if a call can be made with a jump, leaving the callee to return to the
+// caller's caller. The callee must return its result where the caller would.
+// A call to the function itself becomes a loop back to its start.
+static bool is_tail_jump(Emitter* em, Call* call) {
+    Function* func = em->func;
+
+    if (!tail_calls || !is_tail_call(func, call))
+        return false;
+    if (func->declaration.type == VOID)
+        return true;
+    return call->callee->result_reg && call->callee->result_reg == func->result_reg
+           && local_location(func->locals[call->dest], em->when + 1) == func->result_reg;
+}
+
+// Call a function. Registers holding locals which live through the call are
+// pushed first, if either the callee or the arguments may overwrite them, and
+// then the arguments are moved into the registers the callee expects them in,
+// all at once since they may trade places. Arguments passed in memory are
+// written before that, while the registers they are read from are intact.
+// Nothing lives through a tail call, so it is made with a jump in place of the
+// return which follows it.
+static void compile_call(Emitter* em, Call* call) {
+    Function* func = em->func;
+    CPUReg** parameter_regs = call->callee->parameter_regs;
+    bool is_tail = is_tail_jump(em, call);
+    RegisterSet live = 0;
+    RegisterSet clobbers = call->callee->clobbers;
+    bool saved[4] = {false};
+    LocalVar* local = NULL;
+
+    // A local's lifetime may reach past a tail call into another block, but
+    // its value is never needed after it.
+    for (size_t i = 0; local = iterate_locals(func, &i); i++) {
+        if (is_tail || !is_live_before(local, em->when) || local->lifetime_end <= em->when)
+            continue;
+        CPUReg* reg = local_location(local, em->when);
+        if (reg)
+            live |= register_set(reg);
+    }
+    for (size_t i = 0; i < va_len(call->args); i++) {
+        if (parameter_regs[i]
+            && (call->args[i].is_const
+                || local_location(func->locals[call->args[i].local_id], em->when) != parameter_regs[i]))
+            clobbers |= register_set(parameter_regs[i]);
+    }
+    for (size_t i = 0; i < 4; i++) {
+        RegisterSet pair = register_set(SAVED_PAIR_REGS[i]);
+        saved[i] = (live & pair) && (clobbers & pair);
+        if (saved[i])
+            fprintf(em->out, "    push %s\n", SAVED_PAIRS[i]);
+    }
+
+    Move* moves = va_new(0);
+    // Moving the arguments may borrow `a`, unless it holds a local which is
+    // not saved.
+    em->a_free = saved[0] || !(live & register_set(&a_reg));
+    for (size_t i = 0; i < va_len(call->args); i++) {
+        if (call->args[i].is_const)
+            continue;
+        CPUReg* from = local_location(func->locals[call->args[i].local_id], em->when);
+        // An argument already in `a` must stay there while the others move.
+        if (from && match_registers(from, &a_reg))
+            em->a_free = false;
+        if (parameter_regs[i] && from != parameter_regs[i]) {
+            Move move = {call->args[i].local_id, from, parameter_regs[i], false};
+            va_append(moves, move);
+        }
+    }
+    for (size_t i = 0; i < va_len(call->args); i++) {
+        if (parameter_regs[i] == NULL) {
+            char* slot = local_slot_name(call->callee->declaration.identifier, i);
+            Location dest = symbol_location(slot);
+            move_operand(em, &dest, call->callee->parameter_types[i], &call->args[i]);
+            free(slot);
+        }
+    }
+    emit_parallel_moves(em, moves);
+    // Constants overwrite nothing which is still needed, so they go last.
+    for (size_t i = 0; i < va_len(call->args); i++) {
+        if (call->args[i].is_const && parameter_regs[i]) {
+            Location dest = reg_location(parameter_regs[i]);
+            move_const(em, &dest, call->callee->parameter_types[i], call->args[i].const_unsigned);
+        }
+    }
+    va_free(moves);
+
+    if (is_tail) {
+        fprintf(em->out, "    jp %s\n", call->function);
+        em->tail_called = true;
+        em->tail_call_count += 1;
+        if (call->callee == func)
+            em->loop_count += 1;
+        return;
+    }
+    fprintf(em->out, "    call %s\n", call->function);
+    // A result returned in memory is copied to the local's slot before
+    // anything is restored, borrowing `a` unless it was saved.
+    if (call->var_type != VOID && call->callee->result_reg == NULL) {
+        char* slot = result_slot_name(call->callee->declaration.identifier);
+        Location src = symbol_location(slot);
+        Location dest = local_location_of(em, call->dest, NULL);
+        em->a_free = saved[0] || !(live & register_set(&a_reg));
+        move_value(em, &dest, call->var_type, &src, call->callee->declaration.type);
+        free(slot);
+    }
+    for (size_t i = 4; i-- > 0;) {
+        if (saved[i])
+            fprintf(em->out, "    pop %s\n", SAVED_PAIRS[i]);
+    }
+}
+
+static void compile_statement(Emitter* em, Statement* statement, size_t* block_starts, size_t block_id) {
+    Function* func = em->func;
+
+    switch (statement->type) {
+    case OPERATION:
+        compile_operation(em, (Operation*) statement);
+        break;
+    case READ: {
+        Read* read = (Read*) statement;
+        Location dest = local_location_of(em, read->dest, local_location(func->locals[read->dest], em->when));
+        Location src = symbol_location(read->src);
+        bool hl_free = is_reg_free(func, &hl_reg, em->when, false, UINT64_MAX)
+                       && is_reg_free(func, &hl_reg, em->when, true, read->dest);
+        em->a_free = is_a_free(func, em->when, true, read->dest);
+        if (hl_free && is_hl_access(em, read->src, &dest, type_widths[read->var_type], false)) {
+            access_through_hl(em, read->src, &dest, type_widths[read->var_type], false);
+        } else {
+            move_value(em, &dest, read->var_type, &src, read->var_type);
+            if (dest.reg && match_registers(dest.reg, &hl_reg))
+                em->hl_symbol = NULL;
+        }
+    } break;
+    case WRITE: {
+        Write* write = (Write*) statement;
+        LocalVar* local = func->locals[write->src];
+        Location dest = symbol_location(write->dest);
+        Location src = local_location_of(em, write->src, local_location(local, em->when));
+        bool hl_free = is_reg_free(func, &hl_reg, em->when, false, UINT64_MAX)
+                       && is_reg_free(func, &hl_reg, em->when, true, UINT64_MAX);
+        em->a_free = is_a_free(func, em->when, false, UINT64_MAX);
+        if (hl_free && is_hl_access(em, write->dest, &src, type_widths[local->type], true))
+            access_through_hl(em, write->dest, &src, type_widths[local->type], true);
+        else
+            move_value(em, &dest, local->type, &src, local->type);
+    } break;
+    case JUMP: {
+        size_t target = find_block(func, ((Jump*) statement)->label);
+        emit_edge_moves(em, block_starts[target]);
+        // Jumping to the very next block is unnecessary.
+        if (target != block_id + 1)
+            fprintf(em->out, "    jp .%s\n", ((Jump*) statement)->label);
+    } break;
+    case BRANCH:
+        compile_branch(em, (Branch*) statement, block_starts, block_id);
+        break;
+    case RETURN: {
+        Return* ret = (Return*) statement;
+        uint8_t type = func->declaration.type;
+        if (type != VOID && func->result_reg == NULL) {
+            // Results too wide for any register are returned in memory.
+            char* slot = result_slot_name(func->declaration.identifier);
+            Location dest = symbol_location(slot);
+            em->a_free = true;
+            move_operand(em, &dest, type, &ret->val);
+            free(slot);
+        } else if (type != VOID) {
+            Location dest = reg_location(func->result_reg);
+            em->a_free = true;
+            move_operand(em, &dest, type, &ret->val);
+        }
+        fputs(is_interrupt_handler(&func->declaration) ? "    reti\n" : "    ret\n", em->out);
+    } break;
+    case CALL:
+        compile_call(em, (Call*) statement);
+        break;
+    }
+}
+
+/*
+ * Instrumentation
+ */
+
+// The number of block counters handed out so far.
+static size_t counter_count = 0;
+
+// Increment a block's 16-bit counter, and list it in the symbol map's counter
+// table. Unless `a` is free, it is preserved on the stack along with the flags.
+static void emit_block_counter(Emitter* em, size_t block) {
+    size_t offset = counter_count * 2;
+
+    if (symbol_map) {
+        char* symbol = block_symbol(em->func, block);
+        fprintf(symbol_map, "counter %zu %s\n", counter_count, symbol);
+        free(symbol);
+    }
+    counter_count += 1;
+
+    borrow_a(em);
+    fprintf(em->out, "    ld a, [block_counters + %zu]\n    inc a\n    ld [block_counters + %zu], a\n", offset, offset);
+    fprintf(em->out, "    jp nz, :+\n");
+    fprintf(em->out, "    ld a, [block_counters + %zu]\n    inc a\n    ld [block_counters + %zu], a\n", offset + 1,
+            offset + 1);
+    fprintf(em->out, ":\n");
+    return_a(em);
+}
+
+/*
+ * Declarations
+ */
+
+// The M-cycles which the CPU takes to enter an interrupt handler's vector.
+#define INTERRUPT_DISPATCH_CYCLES 5
+// By default, an interrupt handler should fit in VBlank, which lasts for 1140
+// M-cycles.
+#define DEFAULT_INTERRUPT_CYCLES 1140
+
+// Every declaration in the program being compiled.
+static Declaration** compiled_declarations = NULL;
+
+// Find the registers which a call to a routine may overwrite. Only functions
+// which have already been compiled are known to leave anything alone.
+static RegisterSet routine_writes(const char* name, size_t length) {
+    for (size_t i = 0; i < va_len(compiled_declarations); i++) {
+        Declaration* decl = compiled_declarations[i];
+        if (decl->is_fn && strlen(decl->identifier) == length && strncmp(decl->identifier, name, length) == 0)
+            return ((Function*) decl)->clobbers;
+    }
+    return ALL_REGISTERS;
+}
+
+// Estimate the speed of a call to a routine, other than the `call` itself.
+// Functions are compiled after those they call, so theirs are already known.
+// Routines defined elsewhere are not, and count for nothing.
+static unsigned routine_cycles(const char* name, size_t length) {
+    for (size_t i = 0; i < va_len(compiled_declarations); i++) {
+        Declaration* decl = compiled_declarations[i];
+        if (decl->is_fn && strlen(decl->identifier) == length && strncmp(decl->identifier, name, length) == 0)
+            return ((Function*) decl)->cycles;
+    }
+    return runtime_routine_cycles(name, length);
+}
+
+// Save the pairs which an interrupt handler or its callees overwrite as it is
+// entered, and restore them before each `reti`, since the code it interrupted
+// expects every register and the flags to be left alone. The handler's code
+// begins at `body_start`, after its labels. Returns the new code, and frees the
+// old.
+static char* save_interrupted_registers(Function* func, char* code, size_t body_start) {
+    static const char restore[] = "    reti\n";
+    char* saving = NULL;
+    size_t saving_size = 0;
+    FILE* out = open_memstream(&saving, &saving_size);
+    bool saved[4];
+
+    for (size_t i = 0; i < 4; i++)
+        saved[i] = func->clobbers & register_set(SAVED_PAIR_REGS[i]);
+    saved[0] |= code_writes_flags(code);
+
+    fwrite(code, 1, body_start, out);
+    for (size_t i = 0; i < 4; i++) {
+        if (saved[i])
+            fprintf(out, "    push %s\n", SAVED_PAIRS[i]);
+    }
+    for (const char* line = code + body_start; *line;) {
+        const char* end = strchr(line, '\n');
+        size_t length = end ? (size_t) (end - line) + 1 : strlen(line);
+        if (length == strlen(restore) && strncmp(line, restore, length) == 0) {
+            for (size_t i = 4; i-- > 0;) {
+                if (saved[i])
+                    fprintf(out, "    pop %s\n", SAVED_PAIRS[i]);
+            }
+        }
+        fwrite(line, 1, length, out);
+        line += length;
+    }
+
+    fclose(out);
+    free(code);
+    // Nothing the handler overwrites is seen outside of it.
+    func->clobbers = 0;
+    return saving;
+}
+
+// Read the budget given by -finterrupt-cycles.
+static unsigned long interrupt_budget(void) {
+    if (interrupt_cycles == NULL)
+        return DEFAULT_INTERRUPT_CYCLES;
+
+    char* end;
+    unsigned long cycles = strtoul(interrupt_cycles, &end, 0);
+    if (*interrupt_cycles == '\0' || *end != '\0') {
+        error("Invalid interrupt handler budget \"%s\".", interrupt_cycles);
+        return DEFAULT_INTERRUPT_CYCLES;
+    }
+    return cycles;
+}
+
+// Warn about each interrupt handler which may run for longer than the budget,
+// counting from when the CPU begins to enter it.
+static void check_interrupt_budgets(Declaration** declarations) {
+    unsigned long budget = 0;
+    bool any = false;
+
+    for (size_t i = 0; i < va_len(declarations); i++) {
+        if (!has_body(declarations[i]) || !is_interrupt_handler(declarations[i]))
+            continue;
+        if (!any)
+            budget = interrupt_budget();
+        any = true;
+        unsigned cycles = ((Function*) declarations[i])->cycles + INTERRUPT_DISPATCH_CYCLES;
+        if (cycles > budget) {
+            warn("Interrupt handler \"%s\" may take an estimated %u M-cycles, more than the budget of %lu.",
+                 declarations[i]->identifier, cycles, budget);
+        }
+    }
+}
+
+// Reserve memory for any local which is spilled at some point, and for a
+// result returned in memory. Callers write parameters passed in memory and
+// read the result under any name of the function, so those slots are labelled
+// for each alias, and exported along with the function.
+static void compile_local_slots(Emitter* em) {
+    Function* func = em->func;
+    const char* export = is_exported(compiled_declarations, &func->declaration) ? ":" : "";
+    bool any = false;
+    LocalVar* local = NULL;
+
+    for (size_t i = 0; local = iterate_locals(func, &i); i++) {
+        bool spilled = em->slot_used[i];
+        for (size_t j = 0; j < va_len(local->reg_reallocs); j++)
+            spilled |= local->reg_reallocs[j].reg == NULL;
+        if (!spilled)
+            continue;
+
+        if (!any)
+            fprintf(em->out, "\nSECTION \"%s locals\", WRAM0\n", func->declaration.identifier);
+        any = true;
+        if (i >= func->parameter_count || func->parameter_regs[i]) {
+            fprintf(em->out, "%s: ds %u\n", em->slot_names[i], type_widths[local->type]);
+            continue;
+        }
+        for (size_t j = 0; func->aliases && j < va_len(func->aliases); j++)
+            fprintf(em->out, "%s.local%zu::\n", func->aliases[j], i);
+        fprintf(em->out, "%s:%s ds %u\n", em->slot_names[i], export, type_widths[local->type]);
+    }
+
+    if (func->declaration.type == VOID || func->result_reg)
+        return;
+    if (!any)
+        fprintf(em->out, "\nSECTION \"%s locals\", WRAM0\n", func->declaration.identifier);
+    for (size_t j = 0; func->aliases && j < va_len(func->aliases); j++)
+        fprintf(em->out, "%s.result::\n", func->aliases[j]);
+    fprintf(em->out, "%s.result:%s ds %u\n", func->declaration.identifier, export,
+            type_widths[func->declaration.type]);
+}
+
+// Compile a function, other than the section it is placed in. Returns the size
+// of its code in bytes.
+static size_t compile_function(FILE* out, Function* func) {
+    Emitter em = {out, func, 0, false, NULL, NULL, UINT64_MAX, NULL, false, 0, 0};
+    size_t local_count = va_len(func->locals);
+    size_t* block_starts = malloc(va_len(func->basic_blocks) * sizeof(size_t));
+    Statement* statement = NULL;
+    size_t block_id = 0;
+
+    while (statement = iterate_statements(func, statement, &em.when, &block_id)) {
+        if (statement->last == NULL)
+            block_starts[block_id] = em.when;
+    }
+
+    em.slot_names = calloc(local_count, sizeof(char*));
+    em.slot_used = calloc(local_count, sizeof(bool));
+    for (size_t i = 0; i < local_count; i++) {
+        if (func->locals[i])
+            em.slot_names[i] = local_slot_name(func->declaration.identifier, i);
+    }
+
+    // The function's code is collected first so that the registers it writes
+    // can be found, and so that its jumps can be relaxed once the size of
+    // everything between them is known. This includes the function's label,
+    // which calls to itself may loop back to.
+    char* code = NULL;
+    size_t code_size = 0;
+    em.out = open_memstream(&code, &code_size);
+    for (size_t i = 0; func->aliases && i < va_len(func->aliases); i++)
+        fprintf(em.out, "%s::\n", func->aliases[i]);
+    fprintf(em.out, "%s:%s\n", func->declaration.identifier,
+            is_exported(compiled_declarations, &func->declaration) ? ":" : "");
+    fflush(em.out);
+    size_t body_start = code_size;
+
+    statement = NULL;
+    bool counted = true;
+    while (statement = iterate_statements(func, statement, &em.when, &block_id)) {
+        // The return after a tail call is never reached.
+        if (em.tail_called) {
+            em.tail_called = false;
+            continue;
+        }
+        if (statement->last == NULL) {
+            if (func->basic_blocks[block_id].label)
+                fprintf(em.out, ".%s:\n", func->basic_blocks[block_id].label);
+            // Whatever the flags held is lost on the way into a block.
+            em.flags_local = UINT64_MAX;
+            counted = !instrument_blocks;
+        }
+
+        // Reads and writes only copy values, which leaves the flags alone.
+        if (statement->type != BRANCH && statement->type != READ && statement->type != WRITE)
+            em.flags_local = UINT64_MAX;
+        // Only a run of reads and writes is known to leave `hl` alone.
+        if (statement->last == NULL || (statement->type != READ && statement->type != WRITE))
+            em.hl_symbol = NULL;
+
+        // Count the block at its first statement where neither `a` nor the
+        // flags hold anything, or failing that, before its final statement.
+        // A tail call is the last statement to be reached.
+        if (!counted) {
+            em.a_free = em.flags_local == UINT64_MAX && is_a_free(func, em.when, false, UINT64_MAX);
+            if (em.a_free || statement == func->basic_blocks[block_id].final
+                || (statement->type == CALL && is_tail_jump(&em, (Call*) statement))) {
+                emit_block_counter(&em, block_id);
+                counted = true;
+            }
+        }
+        emit_statement_moves(&em);
+        compile_statement(&em, statement, block_starts, block_id);
+    }
+
+    fclose(em.out);
+    em.out = out;
+    func->clobbers = code_writes(code, routine_writes);
+    if (is_interrupt_handler(&func->declaration))
+        code = save_interrupted_registers(func, code, body_start);
+    func->cycles = code_cycles(code, routine_cycles);
+    if (layout_report && em.tail_call_count) {
+        fprintf(layout_report, "%s: %zu tail calls made with jumps, %zu of which loop back to the start\n",
+                func->declaration.identifier, em.tail_call_count, em.loop_count);
+    }
+    size_t bytes;
+    if (relax_jumps) {
+        bytes = relax_branches(out, code);
+    } else {
+        bytes = code_bytes(code);
+        fputs(code, out);
+    }
+    free(code);
+
+    free(block_starts);
+    compile_local_slots(&em);
+    for (size_t i = 0; i < local_count; i++)
+        free(em.slot_names[i]);
+    free(em.slot_names);
+    free(em.slot_used);
+    return bytes;
+}
+
+// Compile each declaration into RGBASM assembly, followed by any runtime
+// routines which they reference. Register allocation must already have been
+// performed. Each declaration is output to the file of the input it was read
+// from, and the first file also holds the runtime and the block counters.
+//
+// Functions are compiled after those they call, so that each call only saves
+// the registers which the callee overwrites. Their code is still output in the
+// order they were declared, and globals follow as the data layout placed them.
+void compile_ir(FILE** outs, Declaration** declarations) {
+    size_t count = va_len(declarations);
+    char** code = calloc(count, sizeof(char*));
+    size_t* sizes = calloc(count + 1, sizeof(size_t));
+    Function** order = order_call_graph(declarations);
+    // Symbols used by every file are exported once there is more than one.
+    bool shared = va_len(outs) > 1;
+
+    compiled_declarations = declarations;
+    layout_data(declarations);
+    for (size_t i = 0; i < va_len(order); i++) {
+        size_t j = 0;
+        while (declarations[j] != &order[i]->declaration)
+            j++;
+        size_t code_size = 0;
+        FILE* code_out = open_memstream(&code[j], &code_size);
+        sizes[j] = compile_function(code_out, order[i]);
+        fclose(code_out);
+    }
+
+    check_interrupt_budgets(declarations);
+
+    // Extern declarations are defined elsewhere, and RGBASM imports any symbol
+    // which is not defined in the file.
+    assign_banks(declarations, sizes);
+    for (size_t module = 0; module < va_len(outs); module++) {
+        FILE* out = outs[module];
+        for (size_t i = 0; i < count; i++) {
+            if (code[i] && declarations[i]->module == module)
+                fprint_banked_code(out, (Function*) declarations[i], code[i]);
+        }
+        fprint_far_stubs(out, declarations, module);
+        fprint_data(out, declarations, module);
+    }
+    if (counter_count) {
+        fprintf(outs[0], "\nSECTION \"block counters\", WRAM0\nblock_counters:%s ds %zu\n", shared ? ":" : "",
+                counter_count * 2);
+    }
+    fprint_runtime(outs[0], shared);
+
+    free_data_layout();
+    free_banks();
+    for (size_t i = 0; i < count; i++)
+        free(code[i]);
+    free(code);
+    free(sizes);
+    va_free(order);
+}
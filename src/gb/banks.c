@@ -0,0 +1,493 @@
+#include <inttypes.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cfg.h"
+#include "exception.h"
+#include "gb/banks.h"
+#include "gb/relax.h"
+#include "gb/runtime.h"
+#include "optimizer.h"
+#include "statements.h"
+#include "varray.h"
+
+// ROM bank assignment. Code which does not fit in ROM0 is moved to switchable
+// banks, where a call from anywhere but the same bank must first map the
+// callee in. Such far calls go through a stub in ROM0 for each callee, which
+// switches banks around the call and costs dozens of cycles, so the functions
+// called most often stay where they can be called directly.
+//
+// Each function's frequency is estimated from the call graph, multiplying
+// each caller's frequency by the weight of the block each call is made from.
+// ROM0 is then filled with the functions which are called most often for
+// their size. The rest are joined into clusters along their heaviest calls,
+// as far as a bank allows, and the clusters are packed into banks.
+//
+// Functions which the program exports may be called from code outside of it,
+// which calls them directly, so they always stay in ROM0. Calls between linked
+// inputs know the callee's bank, and go through stubs like any other.
+// Interrupt handlers may be entered whatever bank is mapped, so they stay in
+// ROM0 too, along with everything they call, which keeps the cost of far calls
+// out of their latency.
+
+// The number of bytes in each far-call stub.
+#define FAR_STUB_BYTES 36
+// The MBC register which selects the ROM bank mapped at $4000.
+#define ROM_BANK_REGISTER "$2000"
+// The switchable banks which a byte written to the register can select.
+#define MAX_ROM_BANKS 255
+// Frequencies are capped here, so that multiplying them down deep call chains
+// can not overflow.
+#define MAX_FREQUENCY ((uint64_t) 1 << 40)
+// Marks a function which has not been given a bank yet.
+#define UNPLACED UINT_MAX
+
+typedef struct CallEdge {
+    size_t caller;
+    size_t callee;
+    uint64_t weight;
+} CallEdge;
+
+typedef struct BankState {
+    Declaration** decls;
+    // The size of each function's code, by declaration index.
+    size_t* sizes;
+    // How often each function is estimated to be called, by declaration index.
+    uint64_t* frequencies;
+    // VArray of the calls between different functions defined in this file.
+    CallEdge* edges;
+} BankState;
+
+// VArray of the functions which need a far-call stub.
+static Function** far_callees = NULL;
+// The function whose calls are being redirected to far-call stubs.
+static Function* calling_function = NULL;
+
+static size_t function_index(Declaration** decls, Function* func) {
+    for (size_t i = 0; i < va_len(decls); i++) {
+        if (decls[i] == &func->declaration)
+            return i;
+    }
+    return SIZE_MAX;
+}
+
+static uint64_t add_frequency(uint64_t a, uint64_t b) {
+    return a + b > MAX_FREQUENCY ? MAX_FREQUENCY : a + b;
+}
+
+static uint64_t scale_frequency(uint64_t frequency, uint64_t weight) {
+    if (weight && frequency > MAX_FREQUENCY / weight)
+        return MAX_FREQUENCY;
+    return frequency * weight;
+}
+
+static void add_edge(BankState* st, size_t caller, size_t callee, uint64_t weight) {
+    for (size_t i = 0; i < va_len(st->edges); i++) {
+        if (st->edges[i].caller == caller && st->edges[i].callee == callee) {
+            st->edges[i].weight = add_frequency(st->edges[i].weight, weight);
+            return;
+        }
+    }
+    va_append(st->edges, ((CallEdge) {caller, callee, weight}));
+}
+
+// Estimate how often each function is called, and how heavily each calls the
+// others. Functions which are exported, or which nothing here calls, are
+// assumed to be entered once. A profiled block's count is already absolute, so
+// it is used as it is.
+static void estimate_frequencies(BankState* st) {
+    Function** order = order_call_graph(st->decls);
+
+    for (size_t i = 0; i < va_len(order); i++) {
+        Function* func = order[i];
+        for (size_t j = 0; j < va_len(func->basic_blocks); j++) {
+            for (Statement* state = func->basic_blocks[j].first; state; state = state->next) {
+                if (state->type == CALL && has_body(&((Call*) state)->callee->declaration)
+                    && ((Call*) state)->callee != func)
+                    st->frequencies[function_index(st->decls, ((Call*) state)->callee)] = 1;
+            }
+        }
+    }
+    for (size_t i = 0; i < va_len(st->decls); i++) {
+        if (has_body(st->decls[i]))
+            st->frequencies[i] = st->frequencies[i] && st->decls[i]->storage_class != EXPORT ? 0 : 1;
+    }
+
+    // Callers come later in the order than the functions they call.
+    for (size_t i = va_len(order); i-- > 0;) {
+        Function* func = order[i];
+        size_t caller = function_index(st->decls, func);
+        for (size_t j = 0; j < va_len(func->basic_blocks); j++) {
+            BasicBlock* bb = &func->basic_blocks[j];
+            uint64_t weight = bb->profile_weight != UNPROFILED ? bb->profile_weight
+                                                                : scale_frequency(st->frequencies[caller], block_weight(bb));
+            for (Statement* state = bb->first; state; state = state->next) {
+                if (state->type != CALL || !has_body(&((Call*) state)->callee->declaration)
+                    || ((Call*) state)->callee == func)
+                    continue;
+                size_t callee = function_index(st->decls, ((Call*) state)->callee);
+                st->frequencies[callee] = add_frequency(st->frequencies[callee], weight);
+                add_edge(st, caller, callee, weight);
+            }
+        }
+    }
+    va_free(order);
+}
+
+// Find the interrupt handlers, and every function which they may call, by
+// declaration index. Returns a new array.
+static bool* find_interrupt_code(Declaration** declarations) {
+    size_t count = va_len(declarations);
+    bool* found = calloc(count + 1, sizeof(bool));
+    size_t* worklist = va_new(0);
+
+    for (size_t i = 0; i < count; i++) {
+        if (has_body(declarations[i]) && is_interrupt_handler(declarations[i]))
+            va_append(worklist, i);
+    }
+    while (va_len(worklist)) {
+        size_t index = va_last(worklist);
+        va_remove(worklist, va_len(worklist) - 1);
+        if (found[index])
+            continue;
+        found[index] = true;
+
+        Function* func = (Function*) declarations[index];
+        for (size_t j = 0; j < va_len(func->basic_blocks); j++) {
+            for (Statement* state = func->basic_blocks[j].first; state; state = state->next) {
+                if (state->type == CALL && has_body(&((Call*) state)->callee->declaration))
+                    va_append(worklist, function_index(declarations, ((Call*) state)->callee));
+            }
+        }
+    }
+    va_free(worklist);
+    return found;
+}
+
+// Read the budget given by -fbank0-size.
+static size_t bank0_budget(void) {
+    if (bank0_size == NULL)
+        return DEFAULT_BANK0_SIZE;
+
+    char* end;
+    unsigned long size = strtoul(bank0_size, &end, 0);
+    if (*bank0_size == '\0' || *end != '\0' || size > BANK_SIZE) {
+        error("Invalid ROM0 size \"%s\". ROM0 holds at most %d bytes.", bank0_size, BANK_SIZE);
+        return DEFAULT_BANK0_SIZE;
+    }
+    return size;
+}
+
+static int compare_edges(const void* a, const void* b) {
+    const CallEdge* x = a;
+    const CallEdge* y = b;
+
+    if (x->weight != y->weight)
+        return x->weight > y->weight ? -1 : 1;
+    // Prefer keeping the source order between equally weighted calls.
+    if (x->caller != y->caller)
+        return x->caller < y->caller ? -1 : 1;
+    return x->callee < y->callee ? -1 : x->callee > y->callee;
+}
+
+// Check if one function is called more often for its size than another.
+static bool is_denser(BankState* st, size_t a, size_t b) {
+    // Frequencies are capped well short of overflowing when multiplied by a
+    // bank's worth of bytes.
+    uint64_t x = st->frequencies[a] * (st->sizes[b] + 1);
+    uint64_t y = st->frequencies[b] * (st->sizes[a] + 1);
+    return x != y ? x > y : a < b;
+}
+
+// Join the functions which are not placed into clusters along their heaviest
+// calls, as far as each fits in a bank, and pack the clusters into banks from
+// the largest down. Returns a new VArray of the fill of each switchable bank.
+static size_t* pack_banks(BankState* st) {
+    size_t count = va_len(st->decls);
+    size_t* cluster = malloc((count + 1) * sizeof(size_t));
+    size_t* cluster_sizes = calloc(count + 1, sizeof(size_t));
+    size_t* heads = va_new(0);
+    size_t* fill = va_new(0);
+
+    for (size_t i = 0; i < count; i++) {
+        cluster[i] = i;
+        if (has_body(st->decls[i]) && ((Function*) st->decls[i])->bank == UNPLACED) {
+            cluster_sizes[i] = st->sizes[i];
+            va_append(heads, i);
+        }
+    }
+
+    for (size_t i = 0; i < va_len(st->edges); i++) {
+        size_t a = cluster[st->edges[i].caller];
+        size_t b = cluster[st->edges[i].callee];
+        if (a == b || ((Function*) st->decls[a])->bank != UNPLACED || ((Function*) st->decls[b])->bank != UNPLACED
+            || cluster_sizes[a] + cluster_sizes[b] > BANK_SIZE)
+            continue;
+        for (size_t j = 0; j < count; j++) {
+            if (cluster[j] == b)
+                cluster[j] = a;
+        }
+        cluster_sizes[a] += cluster_sizes[b];
+        cluster_sizes[b] = 0;
+    }
+
+    // Place the largest clusters first, each in the first bank with room.
+    for (;;) {
+        size_t best = SIZE_MAX;
+        for (size_t i = 0; i < va_len(heads); i++) {
+            size_t head = heads[i];
+            if (cluster[head] != head || ((Function*) st->decls[head])->bank != UNPLACED)
+                continue;
+            if (best == SIZE_MAX || cluster_sizes[head] > cluster_sizes[best])
+                best = head;
+        }
+        if (best == SIZE_MAX)
+            break;
+
+        size_t bank = 0;
+        while (bank < va_len(fill) && fill[bank] + cluster_sizes[best] > BANK_SIZE)
+            bank++;
+        if (bank == va_len(fill))
+            va_append(fill, (size_t) 0);
+        fill[bank] += cluster_sizes[best];
+        if (cluster_sizes[best] > BANK_SIZE)
+            warn("Function \"%s\" is larger than a ROM bank.", st->decls[best]->identifier);
+        for (size_t i = 0; i < count; i++) {
+            if (cluster[i] == best)
+                ((Function*) st->decls[i])->bank = bank + 1;
+        }
+    }
+
+    free(cluster);
+    free(cluster_sizes);
+    va_free(heads);
+    return fill;
+}
+
+// Collect the functions which are called through a far-call stub. Returns the
+// number of calls which need one.
+static size_t collect_far_callees(BankState* st, uint64_t* weight) {
+    size_t calls = 0;
+
+    va_header(far_callees)->size = 0;
+    *weight = 0;
+    for (size_t i = 0; i < va_len(st->decls); i++) {
+        if (!has_body(st->decls[i]))
+            continue;
+        Function* func = (Function*) st->decls[i];
+        for (size_t j = 0; j < va_len(func->basic_blocks); j++) {
+            for (Statement* state = func->basic_blocks[j].first; state; state = state->next) {
+                if (state->type != CALL || !needs_far_call(func, ((Call*) state)->callee))
+                    continue;
+                Function* callee = ((Call*) state)->callee;
+                calls += 1;
+                bool listed = false;
+                for (size_t k = 0; k < va_len(far_callees); k++)
+                    listed |= far_callees[k] == callee;
+                if (!listed)
+                    va_append(far_callees, callee);
+            }
+        }
+    }
+    for (size_t i = 0; i < va_len(st->edges); i++) {
+        if (needs_far_call((Function*) st->decls[st->edges[i].caller], (Function*) st->decls[st->edges[i].callee]))
+            *weight = add_frequency(*weight, st->edges[i].weight);
+    }
+    return calls;
+}
+
+static void report_banks(size_t rom0_fill, size_t budget, size_t* fill, size_t far_calls, uint64_t far_weight) {
+    fprintf(layout_report, "bank 0: %zu of %zu bytes\n", rom0_fill, budget);
+    for (size_t i = 0; i < va_len(fill); i++)
+        fprintf(layout_report, "bank %zu: %zu of %d bytes\n", i + 1, fill[i], BANK_SIZE);
+    fprintf(layout_report, "%zu calls made through far-call stubs, with a weight of %" PRIu64 "\n", far_calls,
+            far_weight);
+}
+
+// Choose a ROM bank for each function, given the size of each one's code by
+// declaration index. Everything stays in ROM0 while it fits in -fbank0-size,
+// which also holds the runtime and any far-call stubs.
+void assign_banks(Declaration** declarations, size_t* sizes) {
+    size_t count = va_len(declarations);
+    BankState st = {declarations, sizes, calloc(count + 1, sizeof(uint64_t)), va_new(0)};
+    size_t budget = bank0_budget();
+    size_t fixed = runtime_bytes();
+    size_t total = fixed;
+    size_t* candidates = va_new(0);
+    bool* interrupt_code = find_interrupt_code(declarations);
+
+    far_callees = va_new(0);
+    for (size_t i = 0; i < count; i++) {
+        if (!has_body(declarations[i]))
+            continue;
+        ((Function*) declarations[i])->bank = 0;
+        total += sizes[i];
+        if (declarations[i]->storage_class == EXPORT || interrupt_code[i])
+            fixed += sizes[i];
+        else
+            va_append(candidates, i);
+    }
+
+    size_t* fill = va_new(0);
+    size_t far_calls = 0;
+    uint64_t far_weight = 0;
+    size_t rom0_fill = total;
+    if (total > budget) {
+        estimate_frequencies(&st);
+        qsort(st.edges, va_len(st.edges), sizeof(CallEdge), compare_edges);
+        // Order the candidates by how often they are called for their size.
+        for (size_t i = 1; i < va_len(candidates); i++) {
+            for (size_t j = i; j > 0 && is_denser(&st, candidates[j], candidates[j - 1]); j--) {
+                size_t swap = candidates[j];
+                candidates[j] = candidates[j - 1];
+                candidates[j - 1] = swap;
+            }
+        }
+
+        // Fill ROM0 from the densest candidate down. If the stubs which the
+        // rest then need do not fit, the last candidate placed is moved out
+        // along with everything after it, and the banks are packed again.
+        for (size_t limit = va_len(candidates);;) {
+            size_t last = SIZE_MAX;
+            rom0_fill = fixed;
+            for (size_t i = 0; i < va_len(candidates); i++) {
+                Function* func = (Function*) declarations[candidates[i]];
+                func->bank = UNPLACED;
+                if (i < limit && rom0_fill + sizes[candidates[i]] <= budget) {
+                    func->bank = 0;
+                    rom0_fill += sizes[candidates[i]];
+                    last = i;
+                }
+            }
+            va_free(fill);
+            fill = pack_banks(&st);
+            far_calls = collect_far_callees(&st, &far_weight);
+            rom0_fill += va_len(far_callees) * FAR_STUB_BYTES;
+            if (rom0_fill <= budget || last == SIZE_MAX)
+                break;
+            limit = last;
+        }
+    }
+
+    // Exported functions, interrupt code, the runtime and the stubs stay in
+    // ROM0 whatever the budget, so they may still overfill it.
+    if (rom0_fill > BANK_SIZE)
+        error("ROM0 needs %zu bytes of code, but holds at most %d.", rom0_fill, BANK_SIZE);
+    else if (rom0_fill > budget)
+        warn("ROM0 needs %zu bytes of code, more than the budget of %zu bytes.", rom0_fill, budget);
+    if (va_len(fill) > MAX_ROM_BANKS)
+        error("The code needs %zu switchable ROM banks, but at most %d can be selected.", va_len(fill), MAX_ROM_BANKS);
+    if (layout_report)
+        report_banks(rom0_fill, budget, fill, far_calls, far_weight);
+
+    va_free(fill);
+    va_free(candidates);
+    free(interrupt_code);
+    va_free(st.edges);
+    free(st.frequencies);
+}
+
+// Check if a call from one function to another must switch banks. Functions
+// declared elsewhere are taken to be in ROM0, as are those in this file until
+// they are assigned a bank.
+bool needs_far_call(Function* caller, Function* callee) {
+    return has_body(&callee->declaration) && callee->bank != 0 && callee->bank != caller->bank;
+}
+
+static bool is_far_routine(const char* name, size_t length) {
+    for (size_t i = 0; i < va_len(far_callees); i++) {
+        const char* identifier = far_callees[i]->declaration.identifier;
+        if (strlen(identifier) == length && strncmp(identifier, name, length) == 0)
+            return needs_far_call(calling_function, far_callees[i]);
+    }
+    return false;
+}
+
+// Output a function's code in the section for its bank, with each call which
+// must switch banks sent through the callee's far-call stub.
+void fprint_banked_code(FILE* out, Function* func, const char* code) {
+    if (func->bank == 0)
+        fprintf(out, "\nSECTION \"%s\", ROM0\n", func->declaration.identifier);
+    else
+        fprintf(out, "\nSECTION \"%s\", ROMX, BANK[%u]\n", func->declaration.identifier, func->bank);
+
+    calling_function = func;
+    if (va_len(far_callees))
+        redirect_far_calls(out, code, is_far_routine);
+    else
+        fputs(code, out);
+}
+
+// Check if a function of another input calls a function through its stub.
+static bool is_stub_shared(Declaration** declarations, Function* callee) {
+    for (size_t i = 0; i < va_len(declarations); i++) {
+        if (!has_body(declarations[i]) || declarations[i]->module == callee->declaration.module)
+            continue;
+        Function* func = (Function*) declarations[i];
+        for (size_t j = 0; j < va_len(func->basic_blocks); j++) {
+            for (Statement* state = func->basic_blocks[j].first; state; state = state->next) {
+                if (state->type == CALL && ((Call*) state)->callee == callee && needs_far_call(func, callee))
+                    return true;
+            }
+        }
+    }
+    return false;
+}
+
+// Output a far-call stub in ROM0 for each function of an input which needs
+// one, exported if another input calls through it. The bank
+// which is currently mapped is kept in HRAM, in a section which every file
+// shares, and is saved on the stack around the call. The shadow is written
+// before the MBC, so that an interrupt which switches banks in between still
+// restores the right one. Every register but the flags is passed through in
+// both directions, so the stub may stand in for its callee under any calling
+// convention.
+void fprint_far_stubs(FILE* out, Declaration** declarations, unsigned module) {
+    bool any = false;
+
+    for (size_t i = 0; far_callees && i < va_len(far_callees); i++) {
+        if (far_callees[i]->declaration.module != module)
+            continue;
+        if (!any)
+            fputs("\nSECTION UNION \"DCC ROM Bank\", HRAM\n__rom_bank: ds 1\n", out);
+        any = true;
+
+        const char* name = far_callees[i]->declaration.identifier;
+        fprintf(out,
+                "\nSECTION \"%s far\", ROM0\n"
+                "__far_%s:%s\n"
+                "    push af\n"
+                "    push af\n"
+                "    push hl\n"
+                "    ld hl, sp + 5\n"
+                "    ldh a, [__rom_bank]\n"
+                "    ld [hl], a\n"
+                "    ld a, BANK(%s)\n"
+                "    ldh [__rom_bank], a\n"
+                "    ld [" ROM_BANK_REGISTER "], a\n"
+                "    pop hl\n"
+                "    pop af\n"
+                "    call %s\n"
+                "    push af\n"
+                "    push hl\n"
+                "    ld hl, sp + 5\n"
+                "    ld a, [hl]\n"
+                "    ldh [__rom_bank], a\n"
+                "    ld [" ROM_BANK_REGISTER "], a\n"
+                "    pop hl\n"
+                "    pop af\n"
+                "    inc sp\n"
+                "    inc sp\n"
+                "    ret\n",
+                name, name, is_stub_shared(declarations, far_callees[i]) ? ":" : "", name, name);
+    }
+}
+
+void free_banks(void) {
+    va_free(far_callees);
+    far_callees = NULL;
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "statements.h"
+
+// The size of each switchable ROM bank.
+#define BANK_SIZE 0x4000
+// ROM0 less the vectors and the cartridge header, which take $0000 to $014F.
+#define DEFAULT_BANK0_SIZE (BANK_SIZE - 0x150)
+
+void assign_banks(Declaration** declarations, size_t* sizes);
+bool needs_far_call(Function* caller, Function* callee);
+void fprint_banked_code(FILE* out, Function* func, const char* code);
+void fprint_far_stubs(FILE* out, Declaration** declarations, unsigned module);
+void free_banks(void);
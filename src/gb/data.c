@@ -0,0 +1,359 @@
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cfg.h"
+#include "exception.h"
+#include "gb/data.h"
+#include "link.h"
+#include "optimizer.h"
+#include "parser.h"
+#include "statements.h"
+#include "varray.h"
+
+// Global data layout. Globals defined in this file are placed in memory
+// according to how the program accesses them, rather than one section each in
+// the order they were declared.
+//
+// The most heavily accessed bytes are moved to HRAM, where `ldh` reaches them
+// in a byte and a cycle less than `ld` reaches the rest of memory.
+//
+// The remaining globals are packed into pages of 256 bytes, each output as its
+// own aligned section, so that every byte within a page shares the same high
+// address byte. Within a page, `hl` moves between globals by changing `l`
+// alone. Globals which are accessed one after another are placed next to each
+// other where possible, so that `hl` only needs to step from one to the next.
+// Like blocks, they are first joined into chains along their heaviest pairs.
+//
+// When several inputs are linked, HRAM is shared between all of them, but each
+// page only holds the globals of one input, since each is output to its file.
+
+#define PAGE_SIZE 256
+// The size of HRAM.
+#define HRAM_LIMIT 127
+// Only globals this wide are moved to HRAM. Wider ones are stepped through
+// with `hl`, which gains nothing from `ldh`.
+#define HRAM_MAX_WIDTH 1
+
+// Returned by lookups of globals which are not placed.
+#define NO_VAR SIZE_MAX
+
+typedef struct Placement {
+    Declaration* var;
+    size_t page;
+    // The offset of the global within its page.
+    unsigned offset;
+    // How often the global is expected to be read or written.
+    uint64_t weight;
+} Placement;
+
+typedef struct Pair {
+    size_t from;
+    size_t to;
+    uint64_t weight;
+} Pair;
+
+// VArray of each global defined in this file, in the order it is output.
+static Placement* placements = NULL;
+
+// Find which global defined in this file a statement reads or writes, if any.
+static size_t access_index(Placement* vars, Statement* statement) {
+    Declaration* global = NULL;
+
+    if (statement->type == READ)
+        global = ((Read*) statement)->global;
+    else if (statement->type == WRITE)
+        global = ((Write*) statement)->global;
+    for (size_t i = 0; global && i < va_len(vars); i++) {
+        if (vars[i].var == global)
+            return i;
+    }
+    return NO_VAR;
+}
+
+// Weigh each global by how often it is read or written.
+static void weigh_globals(Declaration** declarations, Placement* vars) {
+    for (size_t i = 0; i < va_len(declarations); i++) {
+        if (!has_body(declarations[i]))
+            continue;
+        Function* func = (Function*) declarations[i];
+        for (size_t j = 0; j < va_len(func->basic_blocks); j++) {
+            uint64_t weight = block_weight(&func->basic_blocks[j]);
+            for (Statement* state = func->basic_blocks[j].first; state; state = state->next) {
+                size_t var = access_index(vars, state);
+                if (var != NO_VAR)
+                    vars[var].weight += weight;
+            }
+        }
+    }
+}
+
+// Collect how often each global in WRAM is accessed directly after another,
+// within a run of reads and writes which `hl` is kept pointing through. Globals
+// in HRAM are skipped over, since they are not reached through `hl`. Returns a
+// new VArray of pairs.
+static Pair* collect_pairs(Declaration** declarations, Placement* vars) {
+    size_t count = va_len(vars);
+    uint64_t* weights = calloc(count * count + 1, sizeof(uint64_t));
+    Pair* pairs = va_new(0);
+
+    for (size_t i = 0; i < va_len(declarations); i++) {
+        if (!has_body(declarations[i]))
+            continue;
+        Function* func = (Function*) declarations[i];
+        for (size_t j = 0; j < va_len(func->basic_blocks); j++) {
+            uint64_t weight = block_weight(&func->basic_blocks[j]);
+            size_t last = NO_VAR;
+            for (Statement* state = func->basic_blocks[j].first; state; state = state->next) {
+                size_t var = access_index(vars, state);
+                if (state->type != READ && state->type != WRITE)
+                    last = NO_VAR;
+                if (var == NO_VAR || vars[var].page == HRAM_PAGE)
+                    continue;
+                if (last != NO_VAR && last != var && vars[last].var->module == vars[var].var->module)
+                    weights[last * count + var] += weight;
+                last = var;
+            }
+        }
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        for (size_t j = 0; j < count; j++) {
+            if (weights[i * count + j])
+                va_append(pairs, ((Pair) {i, j, weights[i * count + j]}));
+        }
+    }
+    free(weights);
+    return pairs;
+}
+
+static int compare_pairs(const void* a, const void* b) {
+    const Pair* x = a;
+    const Pair* y = b;
+
+    if (x->weight != y->weight)
+        return x->weight > y->weight ? -1 : 1;
+    // Prefer keeping the source order between equally weighted pairs.
+    if (x->from != y->from)
+        return x->from < y->from ? -1 : 1;
+    return x->to < y->to ? -1 : x->to > y->to;
+}
+
+static int compare_weights(const void* a, const void* b) {
+    const Placement* x = *(const Placement**) a;
+    const Placement* y = *(const Placement**) b;
+
+    if (x->weight != y->weight)
+        return x->weight > y->weight ? -1 : 1;
+    return x < y ? -1 : x > y;
+}
+
+// Read the HRAM budget given by -fhram-size.
+static unsigned hram_budget(void) {
+    if (hram_size == NULL)
+        return DEFAULT_HRAM_SIZE;
+
+    char* end;
+    unsigned long size = strtoul(hram_size, &end, 0);
+    if (*hram_size == '\0' || *end != '\0' || size > HRAM_LIMIT) {
+        error("Invalid HRAM size \"%s\". HRAM holds at most %d bytes.", hram_size, HRAM_LIMIT);
+        return 0;
+    }
+    return size;
+}
+
+// Move the most heavily accessed small globals into HRAM, up to the budget.
+static void place_in_hram(Placement* vars, Placement** order) {
+    Placement** sorted = malloc((va_len(vars) + 1) * sizeof(Placement*));
+    unsigned budget = hram_budget();
+    unsigned used = 0;
+
+    for (size_t i = 0; i < va_len(vars); i++)
+        sorted[i] = &vars[i];
+    qsort(sorted, va_len(vars), sizeof(Placement*), compare_weights);
+
+    for (size_t i = 0; i < va_len(vars); i++) {
+        unsigned width = type_widths[sorted[i]->var->type];
+        if (sorted[i]->weight == 0 || width > HRAM_MAX_WIDTH || used + width > budget)
+            continue;
+        sorted[i]->page = HRAM_PAGE;
+        used += width;
+    }
+
+    // HRAM is output first, in source order, with a section for each input.
+    used = 0;
+    for (size_t i = 0; i < va_len(vars); i++) {
+        if (vars[i].page != HRAM_PAGE)
+            continue;
+        if (va_len(*order) && va_last(*order).var->module != vars[i].var->module)
+            used = 0;
+        vars[i].offset = used;
+        used += type_widths[vars[i].var->type];
+        va_append(*order, vars[i]);
+    }
+    free(sorted);
+}
+
+static size_t chain_head(size_t* prev, size_t var) {
+    while (prev[var] != NO_VAR)
+        var = prev[var];
+    return var;
+}
+
+// Join the globals left in WRAM into chains along their heaviest pairs, and
+// pack the chains into pages in the order their heads were declared.
+static void place_in_pages(Declaration** declarations, Placement* vars, Placement** order) {
+    size_t count = va_len(vars);
+    size_t* next = malloc((count + 1) * sizeof(size_t));
+    size_t* prev = malloc((count + 1) * sizeof(size_t));
+    Pair* pairs = collect_pairs(declarations, vars);
+
+    for (size_t i = 0; i < count; i++)
+        next[i] = prev[i] = NO_VAR;
+    qsort(pairs, va_len(pairs), sizeof(Pair), compare_pairs);
+    for (size_t i = 0; i < va_len(pairs); i++) {
+        size_t from = pairs[i].from;
+        size_t to = pairs[i].to;
+
+        if (next[from] != NO_VAR || prev[to] != NO_VAR || chain_head(prev, from) == to)
+            continue;
+        next[from] = to;
+        prev[to] = from;
+    }
+
+    size_t page = 0;
+    unsigned offset = 0;
+    unsigned module = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (vars[i].page == HRAM_PAGE || prev[i] != NO_VAR)
+            continue;
+        for (size_t var = i; var != NO_VAR; var = next[var]) {
+            unsigned width = type_widths[vars[var].var->type];
+            if (offset + width > PAGE_SIZE || (offset && vars[var].var->module != module)) {
+                page += 1;
+                offset = 0;
+            }
+            vars[var].page = page;
+            vars[var].offset = offset;
+            offset += width;
+            module = vars[var].var->module;
+            va_append(*order, vars[var]);
+        }
+    }
+
+    free(next);
+    free(prev);
+    va_free(pairs);
+}
+
+static void report_layout(void) {
+    for (size_t i = 0; i < va_len(placements); i++) {
+        Placement* place = &placements[i];
+        unsigned width = type_widths[place->var->type];
+
+        fprintf(layout_report, "%s: %u byte%s in ", place->var->identifier, width, width == 1 ? "" : "s");
+        if (place->page == HRAM_PAGE)
+            fputs("HRAM", layout_report);
+        else if (place->page == NO_PAGE)
+            fputs("its own section", layout_report);
+        else
+            fprintf(layout_report, "page %zu", place->page);
+        if (place->page != NO_PAGE)
+            fprintf(layout_report, " at offset %u", place->offset);
+        fprintf(layout_report, ", accessed with a weight of %" PRIu64 "\n", place->weight);
+    }
+}
+
+// Choose where each global defined in this file is placed. With
+// -fno-data-layout, each is given its own section in source order instead.
+void layout_data(Declaration** declarations) {
+    Placement* vars = va_new(0);
+
+    for (size_t i = 0; i < va_len(declarations); i++) {
+        if (!declarations[i]->is_fn && declarations[i]->storage_class != EXTERN)
+            va_append(vars, ((Placement) {.var = declarations[i], .page = NO_PAGE}));
+    }
+    weigh_globals(declarations, vars);
+
+    if (data_layout) {
+        placements = va_new(0);
+        place_in_hram(vars, &placements);
+        place_in_pages(declarations, vars, &placements);
+        va_free(vars);
+    } else {
+        placements = vars;
+    }
+
+    if (layout_report)
+        report_layout();
+}
+
+static Placement* find_placement(const char* symbol) {
+    for (size_t i = 0; i < va_len(placements); i++) {
+        if (strequ(placements[i].var->identifier, symbol))
+            return &placements[i];
+    }
+    return NULL;
+}
+
+// Find the page which a global was placed in. Every byte in a page has the same
+// high address byte. Returns NO_PAGE for globals which were not placed in one.
+size_t data_page(const char* symbol) {
+    Placement* place = find_placement(symbol);
+    return place ? place->page : NO_PAGE;
+}
+
+// Find the offset of a global within its page.
+unsigned data_offset(const char* symbol) {
+    Placement* place = find_placement(symbol);
+    return place ? place->offset : 0;
+}
+
+// Check if two globals were placed in the same page, so that their addresses
+// differ only in the low byte by the difference of their offsets. The HRAM of
+// each input is its own section, so globals of different inputs never are.
+bool is_same_page(const char* symbol, const char* other) {
+    Placement* place = find_placement(symbol);
+    Placement* other_place = find_placement(other);
+    return place && other_place && place->page != NO_PAGE && place->page == other_place->page
+           && place->var->module == other_place->var->module;
+}
+
+// Check if a global was placed in HRAM, and so must be reached with `ldh`
+// wherever `ld` would take its address.
+bool is_high_data(const char* symbol) {
+    return data_page(symbol) == HRAM_PAGE;
+}
+
+// Output a section for each page of an input's globals, and one for each
+// global which is in none. Sections are named after their first global.
+void fprint_data(FILE* out, Declaration** declarations, unsigned module) {
+    Placement* last = NULL;
+
+    for (size_t i = 0; i < va_len(placements); i++) {
+        Placement* place = &placements[i];
+        Declaration* var = place->var;
+
+        if (var->module != module)
+            continue;
+        if (last == NULL || place->page == NO_PAGE || place->page != last->page) {
+            if (place->page == HRAM_PAGE)
+                fprintf(out, "\nSECTION \"%s\", HRAM\n", var->identifier);
+            else if (place->page == NO_PAGE)
+                fprintf(out, "\nSECTION \"%s\", WRAM0\n", var->identifier);
+            else
+                fprintf(out, "\nSECTION \"%s\", WRAM0, ALIGN[8]\n", var->identifier);
+        }
+        fprintf(out, "%s:%s ds %u\n", var->identifier, is_exported(declarations, var) ? ":" : "",
+                type_widths[var->type]);
+        last = place;
+    }
+}
+
+void free_data_layout(void) {
+    va_free(placements);
+    placements = NULL;
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "statements.h"
+
+// Returned by page lookups for globals which are not placed in any page, such
+// as those declared elsewhere.
+#define NO_PAGE SIZE_MAX
+// The page of HRAM, $FF80 to $FFFE, which `ldh` reaches.
+#define HRAM_PAGE (SIZE_MAX - 1)
+
+// The most bytes of HRAM given to globals, unless -fhram-size says otherwise.
+#define DEFAULT_HRAM_SIZE 32
+
+void layout_data(Declaration** declarations);
+size_t data_page(const char* symbol);
+unsigned data_offset(const char* symbol);
+bool is_same_page(const char* symbol, const char* other);
+bool is_high_data(const char* symbol);
+void fprint_data(FILE* out, Declaration** declarations, unsigned module);
+void free_data_layout(void);
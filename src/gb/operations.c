@@ -1,30 +1,57 @@
+#include <limits.h>
 #include <stdio.h>
 
 #include "statements.h"
 #include "operations.h"
 
 /*
- * add a, r8
+ * 8-bit arithmetic and logic through `a`
  */
 
-static CPUReg* add_a_r8_rregs[] = { &a_reg, NULL };
-static const size_t add_a_r8_aregs[] = { 1, 0 };
-static void compile_add_a_r8(FILE* out, CpuOpInfo* info) {
-    fprintf(out, "    add a, %s\n", info->registers[0]->name);
-}
+static CPUReg* alu_a_rregs[] = { &a_reg, NULL };
+static const size_t alu_r8_aregs[] = { 1, 0 };
+static const size_t alu_n8_aregs[] = { 0 };
 
-static const CpuOp add_a_r8 = {
-    .result_width = 1,
-    .lhs_width = 1,
-    .rhs_width = 1,
+#define ALU_OPERATION(op, mnemonic) \
+    static void compile_##op##_a_r8(FILE* out, CpuOpInfo* info) { \
+        fprintf(out, "    " mnemonic " a, %s\n", info->registers[0]->name); \
+    } \
+    static void compile_##op##_a_n8(FILE* out, CpuOpInfo* info) { \
+        fprintf(out, "    " mnemonic " a, %u\n", (unsigned) (info->constant & 0xFF)); \
+    } \
+    static const CpuOp op##_a_r8 = { \
+        .result_width = 1, \
+        .lhs_width = 1, \
+        .rhs_width = 1, \
+        .result_reg = &a_reg, \
+        .sets_zero = true, \
+        .required_regs = alu_a_rregs, \
+        .additional_regs = alu_r8_aregs, \
+        .bytes = 1, \
+        .cycles = 1, \
+        .compile = &compile_##op##_a_r8, \
+    }; \
+    static const CpuOp op##_a_n8 = { \
+        .result_width = 1, \
+        .lhs_width = 1, \
+        .rhs_width = 0, \
+        .is_const = true, \
+        .result_reg = &a_reg, \
+        .sets_zero = true, \
+        .required_regs = alu_a_rregs, \
+        .additional_regs = alu_n8_aregs, \
+        .bytes = 2, \
+        .cycles = 2, \
+        .compile = &compile_##op##_a_n8, \
+    }
 
-    .result_reg = &a_reg,
-    .required_regs = add_a_r8_rregs,
-    .additional_regs = add_a_r8_aregs,
-    .bytes = 1,
-    .cycles = 1,
-    .compile = &compile_add_a_r8,
-};
+ALU_OPERATION(add, "add");
+ALU_OPERATION(sub, "sub");
+ALU_OPERATION(and, "and");
+ALU_OPERATION(or, "or");
+ALU_OPERATION(xor, "xor");
+
+#undef ALU_OPERATION
 
 /*
  * add hl, r16
@@ -49,8 +76,969 @@ static const CpuOp add_hl_r16 = {
     .compile = &compile_add_hl_r16,
 };
 
+/*
+ * Memory through `hl`
+ *
+ * Pointers are dereferenced through `hl`. A byte load may also step `hl` past
+ * the byte it read, when the pointer is stepped straight afterwards, in which
+ * case the step itself emits nothing.
+ */
+
+static CPUReg* deref_rregs[] = { &a_reg, &hl_reg, NULL };
+static const size_t deref_aregs[] = { 0 };
+static void compile_deref_a(FILE* out, CpuOpInfo* info) {
+    fprintf(out, "    ld a, [hl%s]\n", info->hl_step > 0 ? "+" : info->hl_step < 0 ? "-" : "");
+}
+
+static const CpuOp deref_a = {
+    .result_width = 1,
+    .lhs_width = 2,
+
+    .result_reg = &a_reg,
+    .lhs_reg = &hl_reg,
+    .required_regs = deref_rregs,
+    .additional_regs = deref_aregs,
+    .bytes = 1,
+    .cycles = 2,
+    .compile = &compile_deref_a,
+};
+
+static void compile_deref_hl(FILE* out, CpuOpInfo* info) {
+    fputs("    ld a, [hl+]\n    ld h, [hl]\n    ld l, a\n", out);
+}
+
+// A pointer which is already in `hl` is left there for whatever reads it next.
+static CPUReg* deref_in_hl_rregs[] = { &a_reg, NULL };
+static const CpuOp deref_a_in_hl = {
+    .result_width = 1,
+    .lhs_width = 2,
+
+    .result_reg = &a_reg,
+    .lhs_reg = &hl_reg,
+    .required_regs = deref_in_hl_rregs,
+    .additional_regs = deref_aregs,
+    .bytes = 1,
+    .cycles = 2,
+    .compile = &compile_deref_a,
+};
+
+static const CpuOp deref_hl = {
+    .result_width = 2,
+    .lhs_width = 2,
+
+    .result_reg = &hl_reg,
+    .required_regs = deref_rregs,
+    .additional_regs = deref_aregs,
+    .bytes = 3,
+    .cycles = 5,
+    .compile = &compile_deref_hl,
+};
+
+// Find the operation which dereferences a pointer to a value of a given width,
+// given whether the pointer is already in `hl`. Returns NULL if there is none.
+const CpuOp* get_dereference_operation(uint8_t width, bool in_hl) {
+    switch (width) {
+    case 1: return in_hl ? &deref_a_in_hl : &deref_a;
+    case 2: return &deref_hl;
+    }
+    return NULL;
+}
+
+static CPUReg* step_hl_rregs[] = { &hl_reg, NULL };
+
+#define STEP_OPERATION(name, mnemonic, step, amount) \
+    static bool name##_cost(uint64_t constant, uint16_t* bytes, uint16_t* cycles) { \
+        *bytes = 1; \
+        *cycles = 2; \
+        return (constant & 0xFFFF) == amount; \
+    } \
+    static void compile_##name(FILE* out, CpuOpInfo* info) { \
+        fputs("    " mnemonic " hl\n", out); \
+    } \
+    static const CpuOp name = { \
+        .result_width = 2, \
+        .lhs_width = 2, \
+        .rhs_width = 0, \
+        .is_const = true, \
+        .result_reg = &hl_reg, \
+        .required_regs = step_hl_rregs, \
+        .additional_regs = deref_aregs, \
+        .bytes = 1, \
+        .cycles = 2, \
+        .hl_step = step, \
+        .cost = &name##_cost, \
+        .compile = &compile_##name, \
+    }
+
+// Adding or subtracting one, or its 16-bit two's complement, only steps `hl`.
+STEP_OPERATION(add_inc_hl, "inc", 1, 1);
+STEP_OPERATION(add_dec_hl, "dec", -1, 0xFFFF);
+STEP_OPERATION(sub_dec_hl, "dec", -1, 1);
+STEP_OPERATION(sub_inc_hl, "inc", 1, 0xFFFF);
+
+#undef STEP_OPERATION
+
+/*
+ * Shifts by a constant
+ *
+ * Each strategy reports its own cost for a given shift amount, so that the
+ * cheapest one can be chosen for each operation.
+ */
+
+static CPUReg* shift_a_rregs[] = { &a_reg, NULL };
+static CPUReg* shift_hl_rregs[] = { &hl_reg, NULL };
+static CPUReg* shift_hl_a_rregs[] = { &hl_reg, &a_reg, NULL };
+static const size_t shift_aregs[] = { 0 };
+
+static void repeat_instruction(FILE* out, const char* instruction, uint64_t count) {
+    for (uint64_t i = 0; i < count; i++)
+        fprintf(out, "    %s\n", instruction);
+}
+
+// Fill in the cost of a sequence built from a fixed prefix followed by a
+// repeated instruction.
+static bool sequence_cost(uint16_t* bytes, uint16_t* cycles,
+                          unsigned prefix_bytes, unsigned prefix_cycles,
+                          uint64_t count, unsigned step_bytes, unsigned step_cycles) {
+    *bytes = prefix_bytes + count * step_bytes;
+    *cycles = prefix_cycles + count * step_cycles;
+    return true;
+}
+
+// add a, a
+static bool cost_lsh_a_add(uint64_t amount, uint16_t* bytes, uint16_t* cycles) {
+    return amount < 8 && sequence_cost(bytes, cycles, 0, 0, amount, 1, 1);
+}
+static void compile_lsh_a_add(FILE* out, CpuOpInfo* info) {
+    repeat_instruction(out, "add a, a", info->constant);
+}
+
+// rrca; and mask
+static bool cost_lsh_a_rotate(uint64_t amount, uint16_t* bytes, uint16_t* cycles) {
+    return amount > 0 && amount < 8 && sequence_cost(bytes, cycles, 2, 2, 8 - amount, 1, 1);
+}
+static void compile_lsh_a_rotate(FILE* out, CpuOpInfo* info) {
+    repeat_instruction(out, "rrca", 8 - info->constant);
+    fprintf(out, "    and a, $%02X\n", (0xFF << info->constant) & 0xFF);
+}
+
+// swap a; and $F0; add a, a
+static bool cost_lsh_a_swap(uint64_t amount, uint16_t* bytes, uint16_t* cycles) {
+    return amount >= 4 && amount < 8 && sequence_cost(bytes, cycles, 4, 4, amount - 4, 1, 1);
+}
+static void compile_lsh_a_swap(FILE* out, CpuOpInfo* info) {
+    fputs("    swap a\n    and a, $F0\n", out);
+    repeat_instruction(out, "add a, a", info->constant - 4);
+}
+
+// Shifting every bit out leaves zero.
+static bool cost_shift_a_clear(uint64_t amount, uint16_t* bytes, uint16_t* cycles) {
+    return amount >= 8 && sequence_cost(bytes, cycles, 1, 1, 0, 0, 0);
+}
+static void compile_shift_a_clear(FILE* out, CpuOpInfo* info) {
+    fputs("    xor a, a\n", out);
+}
+
+// srl a
+static bool cost_rsh_a_srl(uint64_t amount, uint16_t* bytes, uint16_t* cycles) {
+    return amount < 8 && sequence_cost(bytes, cycles, 0, 0, amount, 2, 2);
+}
+static void compile_rsh_a_srl(FILE* out, CpuOpInfo* info) {
+    repeat_instruction(out, "srl a", info->constant);
+}
+
+// rlca; and mask
+static bool cost_rsh_a_rotate(uint64_t amount, uint16_t* bytes, uint16_t* cycles) {
+    return amount > 0 && amount < 8 && sequence_cost(bytes, cycles, 2, 2, 8 - amount, 1, 1);
+}
+static void compile_rsh_a_rotate(FILE* out, CpuOpInfo* info) {
+    repeat_instruction(out, "rlca", 8 - info->constant);
+    fprintf(out, "    and a, $%02X\n", 0xFF >> info->constant);
+}
+
+// swap a; and $0F; srl a
+static bool cost_rsh_a_swap(uint64_t amount, uint16_t* bytes, uint16_t* cycles) {
+    return amount >= 4 && amount < 8 && sequence_cost(bytes, cycles, 4, 4, amount - 4, 2, 2);
+}
+static void compile_rsh_a_swap(FILE* out, CpuOpInfo* info) {
+    fputs("    swap a\n    and a, $0F\n", out);
+    repeat_instruction(out, "srl a", info->constant - 4);
+}
+
+// sra a
+static bool cost_sra_a(uint64_t amount, uint16_t* bytes, uint16_t* cycles) {
+    return amount < 7 && sequence_cost(bytes, cycles, 0, 0, amount, 2, 2);
+}
+static void compile_sra_a(FILE* out, CpuOpInfo* info) {
+    repeat_instruction(out, "sra a", info->constant);
+}
+
+// Shifting by 7 or more leaves only copies of the sign bit.
+static bool cost_sra_a_sign(uint64_t amount, uint16_t* bytes, uint16_t* cycles) {
+    return amount >= 7 && sequence_cost(bytes, cycles, 2, 2, 0, 0, 0);
+}
+static void compile_sra_a_sign(FILE* out, CpuOpInfo* info) {
+    fputs("    add a, a\n    sbc a, a\n", out);
+}
+
+// add hl, hl
+static bool cost_lsh_hl_add(uint64_t amount, uint16_t* bytes, uint16_t* cycles) {
+    return amount < 16 && sequence_cost(bytes, cycles, 0, 0, amount, 1, 2);
+}
+static void compile_lsh_hl_add(FILE* out, CpuOpInfo* info) {
+    repeat_instruction(out, "add hl, hl", info->constant);
+}
+
+// ld h, l; ld l, 0; add hl, hl
+static bool cost_lsh_hl_byte(uint64_t amount, uint16_t* bytes, uint16_t* cycles) {
+    return amount >= 8 && amount < 16 && sequence_cost(bytes, cycles, 3, 3, amount - 8, 1, 2);
+}
+static void compile_lsh_hl_byte(FILE* out, CpuOpInfo* info) {
+    fputs("    ld h, l\n    ld l, 0\n", out);
+    repeat_instruction(out, "add hl, hl", info->constant - 8);
+}
+
+static bool cost_shift_hl_clear(uint64_t amount, uint16_t* bytes, uint16_t* cycles) {
+    return amount >= 16 && sequence_cost(bytes, cycles, 3, 3, 0, 0, 0);
+}
+static void compile_shift_hl_clear(FILE* out, CpuOpInfo* info) {
+    fputs("    ld hl, 0\n", out);
+}
+
+// srl h; rr l
+static bool cost_rsh_hl_srl(uint64_t amount, uint16_t* bytes, uint16_t* cycles) {
+    return amount < 16 && sequence_cost(bytes, cycles, 0, 0, amount, 4, 4);
+}
+static void compile_rsh_hl_srl(FILE* out, CpuOpInfo* info) {
+    for (uint64_t i = 0; i < info->constant; i++)
+        fputs("    srl h\n    rr l\n", out);
+}
+
+// ld l, h; ld h, 0; srl l
+static bool cost_rsh_hl_byte(uint64_t amount, uint16_t* bytes, uint16_t* cycles) {
+    return amount >= 8 && amount < 16 && sequence_cost(bytes, cycles, 3, 3, amount - 8, 2, 2);
+}
+static void compile_rsh_hl_byte(FILE* out, CpuOpInfo* info) {
+    fputs("    ld l, h\n    ld h, 0\n", out);
+    repeat_instruction(out, "srl l", info->constant - 8);
+}
+
+// sra h; rr l
+static bool cost_sra_hl(uint64_t amount, uint16_t* bytes, uint16_t* cycles) {
+    return amount < 16 && sequence_cost(bytes, cycles, 0, 0, amount, 4, 4);
+}
+static void compile_sra_hl(FILE* out, CpuOpInfo* info) {
+    for (uint64_t i = 0; i < info->constant; i++)
+        fputs("    sra h\n    rr l\n", out);
+}
+
+// ld l, h; fill h with the sign; sra l
+static bool cost_sra_hl_byte(uint64_t amount, uint16_t* bytes, uint16_t* cycles) {
+    return amount >= 8 && sequence_cost(bytes, cycles, 5, 5, (amount < 15 ? amount : 15) - 8, 2, 2);
+}
+static void compile_sra_hl_byte(FILE* out, CpuOpInfo* info) {
+    fputs("    ld a, h\n    ld l, a\n    add a, a\n    sbc a, a\n    ld h, a\n", out);
+    repeat_instruction(out, "sra l", (info->constant < 15 ? info->constant : 15) - 8);
+}
+
+#define SHIFT_OPERATION(name, width, result, regs) \
+    static const CpuOp name = { \
+        .result_width = width, \
+        .lhs_width = width, \
+        .rhs_width = 0, \
+        .is_const = true, \
+        .result_reg = result, \
+        .required_regs = regs, \
+        .additional_regs = shift_aregs, \
+        .cost = &cost_##name, \
+        .compile = &compile_##name, \
+    }
+
+SHIFT_OPERATION(lsh_a_add, 1, &a_reg, shift_a_rregs);
+SHIFT_OPERATION(lsh_a_rotate, 1, &a_reg, shift_a_rregs);
+SHIFT_OPERATION(lsh_a_swap, 1, &a_reg, shift_a_rregs);
+SHIFT_OPERATION(shift_a_clear, 1, &a_reg, shift_a_rregs);
+SHIFT_OPERATION(rsh_a_srl, 1, &a_reg, shift_a_rregs);
+SHIFT_OPERATION(rsh_a_rotate, 1, &a_reg, shift_a_rregs);
+SHIFT_OPERATION(rsh_a_swap, 1, &a_reg, shift_a_rregs);
+SHIFT_OPERATION(sra_a, 1, &a_reg, shift_a_rregs);
+SHIFT_OPERATION(sra_a_sign, 1, &a_reg, shift_a_rregs);
+SHIFT_OPERATION(lsh_hl_add, 2, &hl_reg, shift_hl_rregs);
+SHIFT_OPERATION(lsh_hl_byte, 2, &hl_reg, shift_hl_rregs);
+SHIFT_OPERATION(shift_hl_clear, 2, &hl_reg, shift_hl_rregs);
+SHIFT_OPERATION(rsh_hl_srl, 2, &hl_reg, shift_hl_rregs);
+SHIFT_OPERATION(rsh_hl_byte, 2, &hl_reg, shift_hl_rregs);
+SHIFT_OPERATION(sra_hl, 2, &hl_reg, shift_hl_rregs);
+SHIFT_OPERATION(sra_hl_byte, 2, &hl_reg, shift_hl_a_rregs);
+
+#undef SHIFT_OPERATION
+
+/*
+ * In-place operations
+ *
+ * Values wider than a byte, and comparisons of any width, are worked through
+ * `a` one byte at a time, from the least significant byte, carrying between
+ * bytes. Each operand is read wherever it was allocated. The memory variants
+ * additionally use `hl` to reach rhs bytes in memory, since only `ld` can
+ * address memory directly.
+ */
+
+static CPUReg* chain_rregs[] = { &a_reg, NULL };
+static CPUReg* chain_memory_rregs[] = { &a_reg, &hl_reg, NULL };
+static const size_t chain_aregs[] = { 0 };
+
+typedef struct Chain {
+    FILE* out;
+    const OperandBytes* bytes;
+    // The rhs, which may be adjusted when it is a constant.
+    ByteOperand rhs[8];
+    // The memory which `hl` points to, or NULL.
+    const ByteOperand* hl;
+    // Where a comparison reports the condition it holds under, if its result
+    // is left in the flags. NULL if the result is written.
+    const char** condition;
+} Chain;
+
+void fprint_byte_operand(FILE* out, const ByteOperand* byte) {
+    if (byte->reg) {
+        fputs(byte->reg->name, out);
+    } else if (byte->is_const) {
+        fprintf(out, "%u", byte->value);
+    } else {
+        fprintf(out, "[%s", byte->symbol);
+        if (byte->offset)
+            fprintf(out, " + %u", byte->offset);
+        fputc(']', out);
+    }
+}
+
+static bool same_byte_operand(const ByteOperand* a, const ByteOperand* b) {
+    if (a->reg || b->reg)
+        return a->reg == b->reg;
+    if (a->is_const || b->is_const)
+        return false;
+    return a->symbol == b->symbol && a->offset == b->offset;
+}
+
+static inline ByteOperand const_byte_operand(uint8_t value) {
+    return (ByteOperand) {.is_const = true, .value = value};
+}
+
+// Emit an instruction which combines `a` with an operand byte. Memory is read
+// through `hl`, which is moved as little as possible.
+static void chain_instruction(Chain* ch, const char* mnemonic, const ByteOperand* byte) {
+    if (byte->symbol) {
+        if (ch->hl == NULL || ch->hl->symbol != byte->symbol || ch->hl->offset > byte->offset
+            || byte->offset - ch->hl->offset > 1) {
+            fprintf(ch->out, "    ld hl, %s", byte->symbol);
+            if (byte->offset)
+                fprintf(ch->out, " + %u", byte->offset);
+            fputc('\n', ch->out);
+        } else if (ch->hl->offset != byte->offset) {
+            // `inc hl` leaves the flags alone, so carries survive it.
+            fputs("    inc hl\n", ch->out);
+        }
+        ch->hl = byte;
+        fprintf(ch->out, "    %s a, [hl]\n", mnemonic);
+    } else {
+        fprintf(ch->out, "    %s a, ", mnemonic);
+        fprint_byte_operand(ch->out, byte);
+        fputc('\n', ch->out);
+    }
+}
+
+static void chain_load(Chain* ch, const ByteOperand* src) {
+    if (src->reg == &a_reg)
+        return;
+    fputs("    ld a, ", ch->out);
+    fprint_byte_operand(ch->out, src);
+    fputc('\n', ch->out);
+}
+
+static void chain_store(Chain* ch, const ByteOperand* dest) {
+    if (dest->reg == &a_reg)
+        return;
+    fputs("    ld ", ch->out);
+    fprint_byte_operand(ch->out, dest);
+    fputs(", a\n", ch->out);
+}
+
+// Copy a byte without disturbing the flags.
+static void chain_copy(Chain* ch, const ByteOperand* dest, const ByteOperand* src) {
+    if (same_byte_operand(dest, src))
+        return;
+    if (dest->reg && !src->symbol) {
+        fputs("    ld ", ch->out);
+        fprint_byte_operand(ch->out, dest);
+        fputs(", ", ch->out);
+        fprint_byte_operand(ch->out, src);
+        fputc('\n', ch->out);
+    } else {
+        chain_load(ch, src);
+        chain_store(ch, dest);
+    }
+}
+
+static bool is_zero_byte(const ByteOperand* byte) {
+    return byte->is_const && byte->value == 0;
+}
+
+// Write a comparison's result, left in `a` as 0 or 1, zeroing any wider bytes
+// of the destination.
+static void chain_result(Chain* ch) {
+    const OperandBytes* b = ch->bytes;
+    ByteOperand zero = const_byte_operand(0);
+
+    chain_store(ch, &b->dest[0]);
+    for (unsigned i = 1; i < b->dest_width; i++)
+        chain_copy(ch, &b->dest[i], &zero);
+}
+
+static void chain_known_result(Chain* ch, bool result) {
+    if (ch->condition) {
+        fputs(result ? "    scf\n" : "    and a, a\n", ch->out);
+        *ch->condition = "c";
+        return;
+    }
+    fprintf(ch->out, "    ld a, %u\n", result);
+    chain_result(ch);
+}
+
+static void compile_chain_add(Chain* ch, bool subtract) {
+    const OperandBytes* b = ch->bytes;
+    bool carry = false;
+
+    for (unsigned i = 0; i < b->width; i++) {
+        // Adding zero changes nothing until there is a carry to propagate.
+        if (!carry && is_zero_byte(&ch->rhs[i])) {
+            chain_copy(ch, &b->dest[i], &b->lhs[i]);
+            continue;
+        }
+        chain_load(ch, &b->lhs[i]);
+        chain_instruction(ch, carry ? (subtract ? "sbc" : "adc") : (subtract ? "sub" : "add"), &ch->rhs[i]);
+        chain_store(ch, &b->dest[i]);
+        carry = true;
+    }
+}
+
+// Subtract from zero.
+static void compile_chain_negate(Chain* ch) {
+    const OperandBytes* b = ch->bytes;
+
+    for (unsigned i = 0; i < b->width; i++) {
+        // `ld` preserves the borrow from the previous byte.
+        fputs(i ? "    ld a, 0\n" : "    xor a, a\n", ch->out);
+        chain_instruction(ch, i ? "sbc" : "sub", &b->lhs[i]);
+        chain_store(ch, &b->dest[i]);
+    }
+}
+
+static void compile_chain_bitwise(Chain* ch, uint8_t op_type) {
+    const OperandBytes* b = ch->bytes;
+    const char* mnemonic = op_type == B_AND ? "and" : op_type == B_OR ? "or" : "xor";
+
+    for (unsigned i = 0; i < b->width; i++) {
+        const ByteOperand* rhs = &ch->rhs[i];
+
+        // Constant bytes of all zeros or all ones often decide the result
+        // without reading the lhs.
+        if (rhs->is_const && (rhs->value == 0 || rhs->value == 0xFF)) {
+            bool ones = rhs->value == 0xFF;
+            if (op_type == B_AND && !ones) {
+                chain_copy(ch, &b->dest[i], rhs);
+                continue;
+            } else if (op_type == B_OR && ones) {
+                chain_copy(ch, &b->dest[i], rhs);
+                continue;
+            } else if (op_type == B_XOR && ones) {
+                chain_load(ch, &b->lhs[i]);
+                fputs("    cpl\n", ch->out);
+                chain_store(ch, &b->dest[i]);
+                continue;
+            } else {
+                chain_copy(ch, &b->dest[i], &b->lhs[i]);
+                continue;
+            }
+        }
+
+        chain_load(ch, &b->lhs[i]);
+        chain_instruction(ch, mnemonic, rhs);
+        chain_store(ch, &b->dest[i]);
+    }
+}
+
+// Compare for equality, stopping at the first pair of bytes which differ.
+static void compile_chain_equal(Chain* ch, bool equal) {
+    const OperandBytes* b = ch->bytes;
+
+    if (b->width == 1 && ch->condition == NULL) {
+        // a - b - 1 borrows only if a == b.
+        chain_load(ch, &b->lhs[0]);
+        if (!is_zero_byte(&ch->rhs[0]))
+            chain_instruction(ch, "sub", &ch->rhs[0]);
+        fprintf(ch->out, "    sub a, 1\n    sbc a, a\n    %s\n", equal ? "and a, 1" : "inc a");
+        chain_result(ch);
+        return;
+    }
+
+    for (unsigned i = 0; i < b->width; i++) {
+        chain_load(ch, &b->lhs[i]);
+        if (is_zero_byte(&ch->rhs[i]))
+            fputs("    and a, a\n", ch->out);
+        else
+            chain_instruction(ch, "cp", &ch->rhs[i]);
+        if (i + 1 < b->width)
+            fputs("    jr nz, :+\n", ch->out);
+    }
+    if (ch->condition) {
+        // Every early exit leaves the zero flag clear.
+        if (b->width > 1)
+            fputs(":\n", ch->out);
+        *ch->condition = equal ? "z" : "nz";
+        return;
+    }
+    fprintf(ch->out, ":   ld a, 0\n    jr %s, :+\n    inc a\n:\n", equal ? "nz" : "z");
+    chain_result(ch);
+}
+
+// Combine every byte of an operand in `a`, leaving the zero flag set only if
+// the operand is zero.
+static void chain_test(Chain* ch, const ByteOperand* bytes) {
+    bool tested = false;
+
+    chain_load(ch, &bytes[0]);
+    for (unsigned i = 1; i < ch->bytes->width; i++) {
+        if (!is_zero_byte(&bytes[i])) {
+            chain_instruction(ch, "or", &bytes[i]);
+            tested = true;
+        }
+    }
+    if (!tested)
+        fputs("    and a, a\n", ch->out);
+}
+
+// Test the lhs against zero, and only test the rhs if the lhs leaves the
+// result undecided. Either way, the zero flag ends up clear only if the
+// result is true.
+static void compile_chain_logical(Chain* ch, bool is_and) {
+    chain_test(ch, ch->bytes->lhs);
+    fprintf(ch->out, "    jr %s, :+\n", is_and ? "z" : "nz");
+    chain_test(ch, ch->rhs);
+    if (ch->condition) {
+        fputs(":\n", ch->out);
+        *ch->condition = "nz";
+        return;
+    }
+    fputs(":   ld a, 0\n    jr z, :+\n    inc a\n:\n", ch->out);
+    chain_result(ch);
+}
+
+// Find the largest value of a constant's width and signedness.
+static uint64_t max_chain_value(unsigned width, bool is_signed) {
+    uint64_t max = width >= 8 ? UINT64_MAX : ((uint64_t) 1 << (width * 8)) - 1;
+    return is_signed ? max >> 1 : max;
+}
+
+static void compile_chain_compare(Chain* ch, uint8_t op_type, bool is_signed) {
+    const OperandBytes* b = ch->bytes;
+    unsigned top = b->width - 1;
+    // The carry flag ends up set if lhs < rhs. a <= b is decided by a - b - 1
+    // instead, which borrows exactly when a <= b. Greater comparisons are the
+    // inverse of these.
+    bool inclusive = op_type == LESS_EQU || op_type == GREATER;
+    bool inverted = op_type == GREATER || op_type == GREATER_EQU;
+
+    if (inclusive && ch->rhs[0].is_const) {
+        uint64_t n = 0;
+        for (unsigned i = 0; i < b->width; i++)
+            n |= (uint64_t) ch->rhs[i].value << (i * 8);
+
+        // a <= n is a < n + 1, unless n is the largest value, when it always
+        // holds.
+        if (n == max_chain_value(b->width, is_signed)) {
+            chain_known_result(ch, !inverted);
+            return;
+        }
+        n += 1;
+        for (unsigned i = 0; i < b->width; i++)
+            ch->rhs[i] = const_byte_operand(n >> (i * 8));
+        inclusive = false;
+    }
+
+    bool carry = inclusive;
+    if (inclusive)
+        fputs("    scf\n", ch->out);
+
+    for (unsigned i = 0; i < b->width; i++) {
+        // Subtracting zero can not borrow.
+        if (!carry && is_zero_byte(&ch->rhs[i]))
+            continue;
+        chain_load(ch, &b->lhs[i]);
+        chain_instruction(ch, carry ? "sbc" : "cp", &ch->rhs[i]);
+        carry = true;
+    }
+
+    if (is_signed) {
+        // Signed values compare like unsigned values with their sign bits
+        // flipped, which flips the borrow whenever the signs differ.
+        if (carry) {
+            fputs("    sbc a, a\n", ch->out);
+            chain_instruction(ch, "xor", &b->lhs[top]);
+            if (!is_zero_byte(&ch->rhs[top]))
+                chain_instruction(ch, "xor", &ch->rhs[top]);
+        } else {
+            chain_load(ch, &b->lhs[top]);
+        }
+        fputs("    rla\n", ch->out);
+    } else if (!carry) {
+        // Nothing is less than zero.
+        chain_known_result(ch, inverted);
+        return;
+    }
+
+    if (ch->condition) {
+        *ch->condition = inverted ? "nc" : "c";
+        return;
+    }
+    fprintf(ch->out, "    sbc a, a\n    %s\n", inverted ? "inc a" : "and a, 1");
+    chain_result(ch);
+}
+
+// Shift one byte of a value a bit further, carrying into or out of the rest.
+// Memory has no such instructions, so its bytes are shifted through `a`, whose
+// own shifts are shorter.
+static void chain_shift_byte(Chain* ch, const ByteOperand* byte, const char* mnemonic, const char* a_mnemonic) {
+    if (byte->reg) {
+        fprintf(ch->out, "    %s %s\n", mnemonic, byte->reg->name);
+        return;
+    }
+    chain_load(ch, byte);
+    fprintf(ch->out, "    %s\n", a_mnemonic);
+    chain_store(ch, byte);
+}
+
+// Shift by a constant. Whole bytes are moved first, in the order which reads
+// each lhs byte before the result can overwrite it, and the rest of the amount
+// is shifted one bit at a time through every byte which can still hold one.
+static void compile_chain_shift(Chain* ch, bool left, bool is_signed, uint64_t amount) {
+    const OperandBytes* b = ch->bytes;
+    unsigned width = b->width;
+    ByteOperand zero = const_byte_operand(0);
+
+    if (is_signed && amount >= width * 8 - 1) {
+        // Only copies of the sign bit are left.
+        chain_load(ch, &b->lhs[width - 1]);
+        fputs("    add a, a\n    sbc a, a\n", ch->out);
+        for (unsigned i = 0; i < width; i++)
+            chain_store(ch, &b->dest[i]);
+        return;
+    }
+
+    unsigned bytes = amount < width * 8 ? amount / 8 : width;
+    unsigned bits = amount < width * 8 ? amount % 8 : 0;
+
+    if (left) {
+        for (unsigned i = width; i-- > 0;)
+            chain_copy(ch, &b->dest[i], i >= bytes ? &b->lhs[i - bytes] : &zero);
+        for (unsigned n = 0; n < bits; n++) {
+            for (unsigned i = bytes; i < width; i++)
+                chain_shift_byte(ch, &b->dest[i], i == bytes ? "sla" : "rl", i == bytes ? "add a, a" : "rla");
+        }
+        return;
+    }
+
+    unsigned kept = width - bytes;
+    for (unsigned i = 0; i < kept; i++)
+        chain_copy(ch, &b->dest[i], &b->lhs[i + bytes]);
+    if (bytes && is_signed) {
+        chain_load(ch, &b->dest[kept - 1]);
+        fputs("    add a, a\n    sbc a, a\n", ch->out);
+        for (unsigned i = kept; i < width; i++)
+            chain_store(ch, &b->dest[i]);
+    } else {
+        for (unsigned i = kept; i < width; i++)
+            chain_copy(ch, &b->dest[i], &zero);
+    }
+    for (unsigned n = 0; n < bits; n++) {
+        for (unsigned i = kept; i-- > 0;) {
+            bool first = i == kept - 1;
+            chain_shift_byte(ch, &b->dest[i], first ? (is_signed ? "sra" : "srl") : "rr",
+                             first ? (is_signed ? "sra a" : "srl a") : "rra");
+        }
+    }
+}
+
+static void compile_chain(FILE* out, CpuOpInfo* info, uint8_t op_type, bool is_signed) {
+    Chain ch = {out, info->bytes};
+
+    if (info->flags_only)
+        ch.condition = &info->condition;
+
+    for (unsigned i = 0; i < info->bytes->width; i++)
+        ch.rhs[i] = info->bytes->rhs[i];
+
+    switch (op_type) {
+    case ADD: case SUB:
+        compile_chain_add(&ch, op_type == SUB);
+        break;
+    case NEGATE:
+        compile_chain_negate(&ch);
+        break;
+    case COMPLEMENT:
+        for (unsigned i = 0; i < info->bytes->width; i++)
+            ch.rhs[i] = const_byte_operand(0xFF);
+        compile_chain_bitwise(&ch, B_XOR);
+        break;
+    case NOT:
+        for (unsigned i = 0; i < info->bytes->width; i++)
+            ch.rhs[i] = const_byte_operand(0);
+        compile_chain_equal(&ch, true);
+        break;
+    case LSH: case RSH:
+        compile_chain_shift(&ch, op_type == LSH, is_signed, info->constant);
+        break;
+    case B_AND: case B_OR: case B_XOR:
+        compile_chain_bitwise(&ch, op_type);
+        break;
+    case EQU: case NOT_EQU:
+        compile_chain_equal(&ch, op_type == EQU);
+        break;
+    case L_AND: case L_OR:
+        compile_chain_logical(&ch, op_type == L_AND);
+        break;
+    default:
+        compile_chain_compare(&ch, op_type, is_signed);
+    }
+}
+
+#define CHAIN_OPERATION(name, op_type, is_signed, lhs_memory, bytewise) \
+    static void compile_##name(FILE* out, CpuOpInfo* info) { \
+        compile_chain(out, info, op_type, is_signed); \
+    } \
+    static const CpuOp name = { \
+        .in_place = true, \
+        .lhs_in_memory = lhs_memory, \
+        .bytewise_result = bytewise, \
+        .required_regs = chain_rregs, \
+        .additional_regs = chain_aregs, \
+        .bytes = 3, \
+        .cycles = 3, \
+        .compile = &compile_##name, \
+    }; \
+    static const CpuOp name##_memory = { \
+        .in_place = true, \
+        .lhs_in_memory = true, \
+        .rhs_in_memory = true, \
+        .bytewise_result = bytewise, \
+        .required_regs = chain_memory_rregs, \
+        .additional_regs = chain_aregs, \
+        .bytes = 4, \
+        .cycles = 5, \
+        .compile = &compile_##name, \
+    }
+
+// The signed comparisons, negation and logical operations combine lhs bytes
+// with `a`, which can not be done directly from memory.
+CHAIN_OPERATION(add_chain, ADD, false, true, true);
+CHAIN_OPERATION(sub_chain, SUB, false, true, true);
+CHAIN_OPERATION(and_chain, B_AND, false, true, true);
+CHAIN_OPERATION(or_chain, B_OR, false, true, true);
+CHAIN_OPERATION(xor_chain, B_XOR, false, true, true);
+CHAIN_OPERATION(negate_chain, NEGATE, false, false, true);
+CHAIN_OPERATION(complement_chain, COMPLEMENT, false, true, true);
+CHAIN_OPERATION(not_chain, NOT, false, true, false);
+CHAIN_OPERATION(equ_chain, EQU, false, true, false);
+CHAIN_OPERATION(not_equ_chain, NOT_EQU, false, true, false);
+CHAIN_OPERATION(less_chain, LESS, false, true, false);
+CHAIN_OPERATION(greater_chain, GREATER, false, true, false);
+CHAIN_OPERATION(less_equ_chain, LESS_EQU, false, true, false);
+CHAIN_OPERATION(greater_equ_chain, GREATER_EQU, false, true, false);
+CHAIN_OPERATION(l_and_chain, L_AND, false, false, false);
+CHAIN_OPERATION(l_or_chain, L_OR, false, false, false);
+CHAIN_OPERATION(less_signed_chain, LESS, true, false, false);
+CHAIN_OPERATION(greater_signed_chain, GREATER, true, false, false);
+CHAIN_OPERATION(less_equ_signed_chain, LESS_EQU, true, false, false);
+CHAIN_OPERATION(greater_equ_signed_chain, GREATER_EQU, true, false, false);
+CHAIN_OPERATION(lsh_chain, LSH, false, true, true);
+CHAIN_OPERATION(rsh_chain, RSH, false, true, true);
+CHAIN_OPERATION(sra_chain, RSH, true, true, true);
+
+#undef CHAIN_OPERATION
+
+typedef struct ChainOperation {
+    uint8_t op_type;
+    bool is_signed;
+    const CpuOp* registers;
+    const CpuOp* memory;
+} ChainOperation;
+
+static const ChainOperation chain_operations[] = {
+    {ADD, false, &add_chain, &add_chain_memory},
+    {SUB, false, &sub_chain, &sub_chain_memory},
+    {B_AND, false, &and_chain, &and_chain_memory},
+    {B_OR, false, &or_chain, &or_chain_memory},
+    {B_XOR, false, &xor_chain, &xor_chain_memory},
+    {NEGATE, false, &negate_chain, &negate_chain_memory},
+    {COMPLEMENT, false, &complement_chain, &complement_chain_memory},
+    {NOT, false, &not_chain, &not_chain_memory},
+    {EQU, false, &equ_chain, &equ_chain_memory},
+    {NOT_EQU, false, &not_equ_chain, &not_equ_chain_memory},
+    {LESS, false, &less_chain, &less_chain_memory},
+    {GREATER, false, &greater_chain, &greater_chain_memory},
+    {LESS_EQU, false, &less_equ_chain, &less_equ_chain_memory},
+    {GREATER_EQU, false, &greater_equ_chain, &greater_equ_chain_memory},
+    {L_AND, false, &l_and_chain, &l_and_chain_memory},
+    {L_OR, false, &l_or_chain, &l_or_chain_memory},
+    {LESS, true, &less_signed_chain, &less_signed_chain_memory},
+    {GREATER, true, &greater_signed_chain, &greater_signed_chain_memory},
+    {LESS_EQU, true, &less_equ_signed_chain, &less_equ_signed_chain_memory},
+    {GREATER_EQU, true, &greater_equ_signed_chain, &greater_equ_signed_chain_memory},
+    {LSH, false, &lsh_chain, &lsh_chain_memory},
+    {RSH, false, &rsh_chain, &rsh_chain_memory},
+    {RSH, true, &sra_chain, &sra_chain_memory},
+};
+
+// Find the in-place operation for an IR operation. Signedness only matters to
+// ordered comparisons and right shifts. If `in_memory` is set, the variant
+// which can read operands from memory is returned. Returns NULL if there is no
+// such operation.
+const CpuOp* get_chain_operation(uint8_t op_type, bool is_signed, bool in_memory) {
+    is_signed &= (op_type >= LESS && op_type <= GREATER_EQU) || op_type == RSH;
+
+    for (size_t i = 0; i < sizeof(chain_operations) / sizeof(*chain_operations); i++) {
+        const ChainOperation* chain = &chain_operations[i];
+        if (chain->op_type == op_type && chain->is_signed == is_signed)
+            return in_memory ? chain->memory : chain->registers;
+    }
+    return NULL;
+}
+
 /*
  * Operation pools
  */
 
-const CpuOp* add_operations[] = { &add_a_r8, &add_hl_r16, NULL};
+const CpuOp* add_operations[] = { &add_a_r8, &add_a_n8, &add_hl_r16, &add_inc_hl, &add_dec_hl, NULL};
+const CpuOp* sub_operations[] = { &sub_a_r8, &sub_a_n8, &sub_dec_hl, &sub_inc_hl, NULL};
+const CpuOp* and_operations[] = { &and_a_r8, &and_a_n8, NULL};
+const CpuOp* or_operations[] = { &or_a_r8, &or_a_n8, NULL};
+const CpuOp* xor_operations[] = { &xor_a_r8, &xor_a_n8, NULL};
+const CpuOp* lsh_operations[] = {
+    &lsh_a_add, &lsh_a_rotate, &lsh_a_swap, &shift_a_clear,
+    &lsh_hl_add, &lsh_hl_byte, &shift_hl_clear, NULL
+};
+const CpuOp* rsh_operations[] = {
+    &rsh_a_srl, &rsh_a_rotate, &rsh_a_swap, &shift_a_clear,
+    &rsh_hl_srl, &rsh_hl_byte, &shift_hl_clear, NULL
+};
+const CpuOp* sra_operations[] = { &sra_a, &sra_a_sign, &sra_hl, &sra_hl_byte, NULL};
+
+// Get the pool of operations on `a` which implement an arithmetic or bitwise
+// operation.
+const CpuOp** get_operation_pool(uint8_t op_type) {
+    switch (op_type) {
+    case ADD: return add_operations;
+    case SUB: return sub_operations;
+    case B_AND: return and_operations;
+    case B_OR: return or_operations;
+    case B_XOR: return xor_operations;
+    }
+    return NULL;
+}
+
+/*
+ * Cost estimates
+ *
+ * These are used by IR passes which need to compare the cost of different
+ * sequences before any instructions are selected. Speeds are in M-cycles, and
+ * sizes in bytes.
+ */
+
+// Get the size and speed of an operation for a given constant operand. Returns
+// false if the operation can not handle the constant.
+bool get_operation_cost(const CpuOp* operation, uint64_t constant, uint16_t* bytes, uint16_t* cycles) {
+    if (operation->cost)
+        return operation->cost(constant, bytes, cycles);
+    *bytes = operation->bytes;
+    *cycles = operation->cycles;
+    return true;
+}
+
+// Estimate a shift worked through a byte at a time, with its bytes in
+// registers, where each instruction takes as many cycles as bytes. Whole bytes
+// are moved, and the rest shifted a bit at a time through the bytes left.
+static unsigned estimate_shift_chain(uint8_t width, uint64_t amount) {
+    if (amount >= width * 8u)
+        return width * 2;
+    unsigned bytes = amount / 8;
+    return (bytes ? width * 2 : 0) + amount % 8 * (width - bytes) * 2;
+}
+
+// Estimate the speed of the cheapest sequence which shifts a value by a
+// constant amount.
+unsigned estimate_shift_cycles(uint8_t width, bool left, bool is_signed, uint64_t amount) {
+    const CpuOp** pool = left ? lsh_operations : is_signed ? sra_operations : rsh_operations;
+    unsigned best = UINT_MAX;
+
+    for (size_t i = 0; pool[i]; i++) {
+        uint16_t bytes, cycles;
+        if (pool[i]->result_width == width && get_operation_cost(pool[i], amount, &bytes, &cycles)
+            && cycles < best)
+            best = cycles;
+    }
+
+    // Wider values are shifted a byte at a time.
+    if (best == UINT_MAX)
+        best = estimate_shift_chain(width, amount);
+    return best;
+}
+
+// Estimate the speed of adding or subtracting two values, including moving the
+// operands into place.
+unsigned estimate_add_cycles(uint8_t width, bool subtract) {
+    switch (width) {
+    case 1: return 2;
+    // There is no `sub hl, r16`, so 16-bit subtraction is done byte-wise.
+    case 2: return subtract ? 6 : 3;
+    }
+    // Each byte is loaded, combined with carry, and stored.
+    return width * 3;
+}
+
+// Estimate the size of an operation on operands of a given width, from the
+// smallest CpuOp which implements it. Anything without a dedicated instruction
+// is worked through a byte at a time. Returns 0 for operations which are not
+// compiled to a CpuOp of their own, such as assignments.
+unsigned estimate_operation_bytes(uint8_t op_type, uint8_t width, bool is_const, uint64_t constant) {
+    const CpuOp** pool = get_operation_pool(op_type);
+    unsigned best = UINT_MAX;
+
+    switch (op_type) {
+    case LSH: case RSH:
+        if (!is_const)
+            return 0;
+        pool = op_type == LSH ? lsh_operations : rsh_operations;
+        for (size_t i = 0; pool[i]; i++) {
+            uint16_t bytes, cycles;
+            if (pool[i]->result_width == width && get_operation_cost(pool[i], constant, &bytes, &cycles)
+                && bytes < best)
+                best = bytes;
+        }
+        // Wider values are shifted a byte at a time.
+        return best == UINT_MAX ? estimate_shift_chain(width, constant) : best;
+    case ADD: case SUB: case B_AND: case B_OR: case B_XOR:
+        for (size_t i = 0; pool[i]; i++) {
+            uint16_t bytes, cycles;
+            if (pool[i]->result_width == width && pool[i]->lhs_width == width
+                && pool[i]->rhs_width == (is_const ? 0 : width) && pool[i]->is_const == is_const
+                && get_operation_cost(pool[i], constant, &bytes, &cycles) && bytes < best)
+                best = bytes;
+        }
+        if (best != UINT_MAX)
+            return best;
+        // fallthrough
+    case LESS: case GREATER: case LESS_EQU: case GREATER_EQU: case NOT_EQU: case EQU:
+    case NOT: case NEGATE: case COMPLEMENT:
+        return get_chain_operation(op_type, false, false)->bytes * width;
+    }
+    return 0;
+}
@@ -1,10 +1,38 @@
 #pragma once
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 
 struct CPUReg;
 struct CpuOpInfo;
+struct RuntimeRoutine;
+
+// The most registers an operation may request through `additional_regs`.
+#define MAX_OPERATION_REGS 2
+
+// A single byte of an operand or result. Exactly one of `reg`, `symbol`, or
+// `is_const` describes where the byte is.
+typedef struct ByteOperand {
+    const struct CPUReg* reg;
+    // The label of the memory holding the value, and this byte's offset into it.
+    const char* symbol;
+    unsigned offset;
+    bool is_const;
+    uint8_t value;
+} ByteOperand;
+
+// Where each byte of an in-place operation's result and operands is, from the
+// least significant byte.
+typedef struct OperandBytes {
+    // The width of the operands, and of the result.
+    uint8_t width;
+    uint8_t dest_width;
+    ByteOperand dest[8];
+    ByteOperand lhs[8];
+    // A constant rhs is given as constant bytes.
+    ByteOperand rhs[8];
+} OperandBytes;
 
 // Constant information describing an operation. This can be used for things
 // other than operations, such as jumps, writes, and reads.
@@ -19,6 +47,30 @@ typedef struct CpuOp {
     bool is_const;
     // The register which the result of this operation in placed into.
     struct CPUReg* result_reg;
+    // The register which the lhs must be placed into. If NULL, this is the
+    // result register.
+    struct CPUReg* lhs_reg;
+    // The register which the rhs must be placed into. If NULL, the rhs may be
+    // in any register, which is passed using the CpuOpInfo struct.
+    struct CPUReg* rhs_reg;
+    // In-place operations work through their operands one byte at a time,
+    // reading and writing them wherever they were allocated instead of in
+    // `result_reg`, `lhs_reg` and `rhs_reg`. The locations are passed using the
+    // CpuOpInfo struct.
+    bool in_place;
+    // Whether an in-place operation can read its lhs or rhs from memory.
+    bool lhs_in_memory;
+    bool rhs_in_memory;
+    // Whether an in-place operation writes each byte of its result before it
+    // has read every byte of its operands. Its result must then not partially
+    // overlap either operand, nor any required register.
+    bool bytewise_result;
+    // Whether an in-place operation reads every operand byte, through `a`,
+    // before it overwrites any other required register. Its operands may then
+    // stay in those registers.
+    bool reads_operands_first;
+    // Whether the zero flag is left set if and only if the result is zero.
+    bool sets_zero;
     // A NULL-terminated array of registers which are required by the operation.
     // This is usually the result register.
     struct CPUReg** required_regs;
@@ -27,9 +79,18 @@ typedef struct CpuOp {
     // be passed using the CpuOpInfo struct.
     const size_t* additional_regs;
     // The size of this operation in bytes.
-    uint8_t bytes;
+    uint16_t bytes;
     // The speed of this operation in cycles.
-    uint8_t cycles;
+    uint16_t cycles;
+    // Estimates the cost of operations whose size and speed depend on their
+    // constant operand, such as shifts, overriding `bytes` and `cycles`.
+    // Returns false if the operation can not handle the constant. May be NULL.
+    bool (*cost)(uint64_t constant, uint16_t* bytes, uint16_t* cycles);
+    // How far an operation which only steps `hl` moves it, or 0 for any other
+    // operation.
+    int8_t hl_step;
+    // The runtime routine which this operation calls or expands, if any.
+    struct RuntimeRoutine* routine;
     // Compiles a CPU operation according to the operation info it was provided,
     // outputting assembly code.
     void (*compile)(FILE* out, struct CpuOpInfo* info);
@@ -39,8 +100,39 @@ typedef struct CpuOp {
 // registers being used.
 typedef struct CpuOpInfo {
     const CpuOp* operation;
+    // The constant operand, if the operation accepts one.
+    uint64_t constant;
     // Used as paremeters to the operation, to decide which registers are used.
-    const struct CPUReg* registers[];
+    const struct CPUReg* registers[MAX_OPERATION_REGS];
+    // The location of each operand byte of an in-place operation. Only valid
+    // while the operation is being compiled.
+    const OperandBytes* bytes;
+    // If set, an in-place comparison leaves its result in the flags rather
+    // than writing it, and reports the condition code under which the
+    // comparison holds through `condition`.
+    bool flags_only;
+    const char* condition;
+    // If set, a load through `hl` also steps it by this much, which stands in
+    // for the step operation after it. That operation is then `folded`, and
+    // emits nothing.
+    int8_t hl_step;
+    bool folded;
 } CpuOpInfo;
 
 extern const CpuOp* add_operations[];
+extern const CpuOp* sub_operations[];
+extern const CpuOp* and_operations[];
+extern const CpuOp* or_operations[];
+extern const CpuOp* xor_operations[];
+extern const CpuOp* lsh_operations[];
+extern const CpuOp* rsh_operations[];
+extern const CpuOp* sra_operations[];
+
+void fprint_byte_operand(FILE* out, const ByteOperand* byte);
+const CpuOp** get_operation_pool(uint8_t op_type);
+const CpuOp* get_chain_operation(uint8_t op_type, bool is_signed, bool in_memory);
+const CpuOp* get_dereference_operation(uint8_t width, bool in_hl);
+bool get_operation_cost(const CpuOp* operation, uint64_t constant, uint16_t* bytes, uint16_t* cycles);
+unsigned estimate_shift_cycles(uint8_t width, bool left, bool is_signed, uint64_t amount);
+unsigned estimate_add_cycles(uint8_t width, bool subtract);
+unsigned estimate_operation_bytes(uint8_t op_type, uint8_t width, bool is_const, uint64_t constant);
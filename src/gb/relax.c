@@ -0,0 +1,725 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <ctype.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gb/relax.h"
+#include "varray.h"
+
+// The size of the largest SM83 instruction, which unrecognized instructions are
+// assumed to be.
+#define MAX_INSTRUCTION_BYTES 3
+// The speed of the slowest SM83 instruction, `call`, in M-cycles, which
+// unrecognized instructions are assumed to take.
+#define MAX_INSTRUCTION_CYCLES 6
+#define JR_BYTES 2
+#define JP_BYTES 3
+#define NO_LINE SIZE_MAX
+
+/*
+ * Instruction sizes
+ */
+
+enum OperandKind {
+    OPERAND_NONE,
+    OPERAND_R8,
+    // [hl], including its incrementing and decrementing forms.
+    OPERAND_HL_MEMORY,
+    OPERAND_R16,
+    // [bc], [de] and [c], which only `a` can be loaded to or from.
+    OPERAND_A_MEMORY,
+    OPERAND_MEMORY,
+    OPERAND_IMMEDIATE,
+};
+
+static bool operand_is(const char* operand, size_t length, const char* name) {
+    return strlen(name) == length && strncmp(operand, name, length) == 0;
+}
+
+static enum OperandKind operand_kind(const char* operand, size_t length) {
+    static const char* r8[] = {"a", "b", "c", "d", "e", "h", "l", NULL};
+    static const char* hl_memory[] = {"[hl]", "[hl+]", "[hl-]", "[hli]", "[hld]", NULL};
+    static const char* r16[] = {"af", "bc", "de", "hl", "sp", NULL};
+    static const char* a_memory[] = {"[bc]", "[de]", "[c]", NULL};
+
+    if (length == 0)
+        return OPERAND_NONE;
+    for (size_t i = 0; r8[i]; i++)
+        if (operand_is(operand, length, r8[i])) return OPERAND_R8;
+    for (size_t i = 0; hl_memory[i]; i++)
+        if (operand_is(operand, length, hl_memory[i])) return OPERAND_HL_MEMORY;
+    for (size_t i = 0; r16[i]; i++)
+        if (operand_is(operand, length, r16[i])) return OPERAND_R16;
+    for (size_t i = 0; a_memory[i]; i++)
+        if (operand_is(operand, length, a_memory[i])) return OPERAND_A_MEMORY;
+    return operand[0] == '[' ? OPERAND_MEMORY : OPERAND_IMMEDIATE;
+}
+
+// Find the operands of an instruction, which follow its mnemonic and are
+// separated by commas. Returns the number of operands, up to two.
+static unsigned split_operands(const char* instr, const char* operands[2], size_t lengths[2]) {
+    const char* s = instr;
+    unsigned count = 0;
+
+    while (*s && !isspace((unsigned char) *s))
+        s++;
+    while (*s && count < 2) {
+        while (isspace((unsigned char) *s) || *s == ',')
+            s++;
+        if (*s == '\0' || *s == ';')
+            break;
+        operands[count] = s;
+        while (*s && *s != ',' && *s != ';')
+            s++;
+        lengths[count] = s - operands[count];
+        while (lengths[count] && isspace((unsigned char) operands[count][lengths[count] - 1]))
+            lengths[count] -= 1;
+        count++;
+    }
+    return count;
+}
+
+static bool mnemonic_is(const char* instr, const char* mnemonic) {
+    size_t length = strlen(mnemonic);
+    return strncmp(instr, mnemonic, length) == 0
+        && (instr[length] == '\0' || isspace((unsigned char) instr[length]));
+}
+
+// Determine the encoded size of an instruction in bytes. Instructions which are
+// not recognized are assumed to be as large as any instruction can be, so the
+// estimate never falls short.
+unsigned instruction_bytes(const char* instr) {
+    static const char* prefixed[] = {
+        "rlc", "rrc", "rl", "rr", "sla", "sra", "swap", "srl", "bit", "res", "set", NULL
+    };
+    static const char* alu[] = {"add", "adc", "sub", "sbc", "and", "or", "xor", "cp", NULL};
+    static const char* single[] = {
+        "nop", "ret", "reti", "halt", "di", "ei", "scf", "ccf", "cpl", "daa",
+        "rla", "rlca", "rra", "rrca", "push", "pop", "inc", "dec", "rst", NULL
+    };
+    const char* operands[2];
+    size_t lengths[2];
+    unsigned count = split_operands(instr, operands, lengths);
+    enum OperandKind first = count > 0 ? operand_kind(operands[0], lengths[0]) : OPERAND_NONE;
+    enum OperandKind last = count > 0 ? operand_kind(operands[count - 1], lengths[count - 1]) : OPERAND_NONE;
+
+    for (size_t i = 0; prefixed[i]; i++)
+        if (mnemonic_is(instr, prefixed[i])) return 2;
+    for (size_t i = 0; single[i]; i++)
+        if (mnemonic_is(instr, single[i])) return 1;
+
+    for (size_t i = 0; alu[i]; i++) {
+        if (!mnemonic_is(instr, alu[i]))
+            continue;
+        // `add hl, r16` and `add sp, e8`.
+        if (count == 2 && first == OPERAND_R16)
+            return operand_is(operands[0], lengths[0], "sp") ? 2 : 1;
+        return last == OPERAND_R8 || last == OPERAND_HL_MEMORY ? 1 : 2;
+    }
+
+    if (mnemonic_is(instr, "jr") || mnemonic_is(instr, "ldh") || mnemonic_is(instr, "stop"))
+        return 2;
+    if (mnemonic_is(instr, "jp"))
+        return first == OPERAND_R16 || first == OPERAND_HL_MEMORY ? 1 : JP_BYTES;
+    if (mnemonic_is(instr, "call"))
+        return 3;
+
+    if (mnemonic_is(instr, "ld") && count == 2) {
+        enum OperandKind dest = first;
+        enum OperandKind src = last;
+
+        if ((dest == OPERAND_R8 && (src == OPERAND_R8 || src == OPERAND_HL_MEMORY))
+            || (dest == OPERAND_HL_MEMORY && src == OPERAND_R8)
+            || dest == OPERAND_A_MEMORY || src == OPERAND_A_MEMORY)
+            return 1;
+        if ((dest == OPERAND_R8 || dest == OPERAND_HL_MEMORY) && src == OPERAND_IMMEDIATE)
+            return 2;
+        // `ld sp, hl` and `ld hl, sp + e8`.
+        if (dest == OPERAND_R16 && src == OPERAND_R16)
+            return 1;
+        if (dest == OPERAND_R16 && strncmp(operands[1], "sp", 2) == 0
+            && (operands[1][2] == ' ' || operands[1][2] == '+' || operands[1][2] == '-'))
+            return 2;
+    }
+
+    return MAX_INSTRUCTION_BYTES;
+}
+
+// Determine how many M-cycles an instruction takes, assuming that any condition
+// it has is met, which is never faster than when it is not. Instructions which
+// are not recognized are assumed to be as slow as any instruction can be.
+unsigned instruction_cycles(const char* instr) {
+    static const char* prefixed[] = {
+        "rlc", "rrc", "rl", "rr", "sla", "sra", "swap", "srl", "bit", "res", "set", NULL
+    };
+    static const char* alu[] = {"add", "adc", "sub", "sbc", "and", "or", "xor", "cp", NULL};
+    static const char* single[] = {
+        "nop", "halt", "stop", "di", "ei", "scf", "ccf", "cpl", "daa", "rla", "rlca", "rra", "rrca", NULL
+    };
+    const char* operands[2];
+    size_t lengths[2];
+    unsigned count = split_operands(instr, operands, lengths);
+    enum OperandKind first = count > 0 ? operand_kind(operands[0], lengths[0]) : OPERAND_NONE;
+    enum OperandKind last = count > 0 ? operand_kind(operands[count - 1], lengths[count - 1]) : OPERAND_NONE;
+
+    for (size_t i = 0; prefixed[i]; i++) {
+        if (mnemonic_is(instr, prefixed[i])) {
+            if (last != OPERAND_HL_MEMORY)
+                return 2;
+            return mnemonic_is(instr, "bit") ? 3 : 4;
+        }
+    }
+    for (size_t i = 0; single[i]; i++)
+        if (mnemonic_is(instr, single[i])) return 1;
+
+    for (size_t i = 0; alu[i]; i++) {
+        if (!mnemonic_is(instr, alu[i]))
+            continue;
+        // `add hl, r16` and `add sp, e8`.
+        if (count == 2 && first == OPERAND_R16)
+            return operand_is(operands[0], lengths[0], "sp") ? 4 : 2;
+        return last == OPERAND_R8 ? 1 : 2;
+    }
+
+    if (mnemonic_is(instr, "inc") || mnemonic_is(instr, "dec"))
+        return first == OPERAND_R16 ? 2 : first == OPERAND_HL_MEMORY ? 3 : 1;
+    if (mnemonic_is(instr, "push") || mnemonic_is(instr, "rst") || mnemonic_is(instr, "reti"))
+        return 4;
+    if (mnemonic_is(instr, "pop"))
+        return 3;
+    if (mnemonic_is(instr, "ret"))
+        return count ? 5 : 4;
+    if (mnemonic_is(instr, "jr"))
+        return 3;
+    if (mnemonic_is(instr, "jp"))
+        return first == OPERAND_R16 || first == OPERAND_HL_MEMORY ? 1 : 4;
+    if (mnemonic_is(instr, "call"))
+        return 6;
+    if (mnemonic_is(instr, "ldi") || mnemonic_is(instr, "ldd"))
+        return 2;
+    if (mnemonic_is(instr, "ldh") && count == 2)
+        return first == OPERAND_A_MEMORY || last == OPERAND_A_MEMORY ? 2 : 3;
+
+    if (mnemonic_is(instr, "ld") && count == 2) {
+        enum OperandKind dest = first;
+        enum OperandKind src = last;
+
+        if (dest == OPERAND_R8 && src == OPERAND_R8)
+            return 1;
+        if ((dest == OPERAND_R8 && src == OPERAND_HL_MEMORY) || (dest == OPERAND_HL_MEMORY && src == OPERAND_R8)
+            || dest == OPERAND_A_MEMORY || src == OPERAND_A_MEMORY)
+            return 2;
+        if (dest == OPERAND_R8 && src == OPERAND_IMMEDIATE)
+            return 2;
+        if (dest == OPERAND_HL_MEMORY && src == OPERAND_IMMEDIATE)
+            return 3;
+        if (dest == OPERAND_MEMORY)
+            return src == OPERAND_R16 ? 5 : 4;
+        if (src == OPERAND_MEMORY)
+            return 4;
+        // `ld sp, hl`, `ld hl, sp + e8` and `ld r16, n16`.
+        if (dest == OPERAND_R16 && src == OPERAND_R16)
+            return 2;
+        if (dest == OPERAND_R16)
+            return 3;
+    }
+
+    return MAX_INSTRUCTION_CYCLES;
+}
+
+/*
+ * Register writes
+ */
+
+// Find the registers named by an operand. The flags are not tracked, so `af`
+// only names `a`, and memory operands name nothing.
+static RegisterSet operand_registers(const char* operand, size_t length) {
+    static const char* names[] = {"a", "b", "c", "d", "e", "h", "l", "af", "bc", "de", "hl", NULL};
+    static CPUReg* regs[] = {&a_reg, &b_reg, &c_reg, &d_reg, &e_reg, &h_reg, &l_reg,
+                             &a_reg, &bc_reg, &de_reg, &hl_reg};
+
+    for (size_t i = 0; names[i]; i++) {
+        if (operand_is(operand, length, names[i]))
+            return register_set(regs[i]);
+    }
+    return 0;
+}
+
+// Find the registers which an instruction overwrites, other than the flags.
+// Calls are left to the caller, since they depend on the routine called.
+// Instructions which are not recognized are assumed to overwrite everything.
+RegisterSet instruction_writes(const char* instr) {
+    static const char* none[] = {
+        "nop", "halt", "stop", "di", "ei", "scf", "ccf", "jp", "jr", "call", "ret", "reti", "push", "cp", "bit", NULL
+    };
+    static const char* into_a[] = {"cpl", "daa", "rla", "rlca", "rra", "rrca", NULL};
+    static const char* into_first[] = {
+        "ld", "ldh", "ldi", "ldd", "inc", "dec", "pop", "rlc", "rrc", "rl", "rr", "sla", "sra", "srl", "swap", NULL
+    };
+    static const char* alu[] = {"add", "adc", "sub", "sbc", "and", "or", "xor", NULL};
+    const char* operands[2];
+    size_t lengths[2];
+    unsigned count = split_operands(instr, operands, lengths);
+    RegisterSet writes = 0;
+
+    // Loads through `hl` which step it also overwrite it.
+    for (unsigned i = 0; i < count; i++) {
+        if (operand_kind(operands[i], lengths[i]) == OPERAND_HL_MEMORY && !operand_is(operands[i], lengths[i], "[hl]"))
+            writes |= register_set(&hl_reg);
+    }
+    if (mnemonic_is(instr, "ldi") || mnemonic_is(instr, "ldd"))
+        writes |= register_set(&hl_reg);
+
+    for (size_t i = 0; none[i]; i++)
+        if (mnemonic_is(instr, none[i])) return writes;
+    for (size_t i = 0; into_a[i]; i++)
+        if (mnemonic_is(instr, into_a[i])) return writes | register_set(&a_reg);
+    for (size_t i = 0; into_first[i]; i++)
+        if (mnemonic_is(instr, into_first[i])) return writes | (count ? operand_registers(operands[0], lengths[0]) : 0);
+    for (size_t i = 0; alu[i]; i++) {
+        // Arithmetic without a destination works on `a`.
+        if (mnemonic_is(instr, alu[i]))
+            return writes | (count == 2 ? operand_registers(operands[0], lengths[0]) : register_set(&a_reg));
+    }
+    if ((mnemonic_is(instr, "res") || mnemonic_is(instr, "set")) && count == 2)
+        return writes | operand_registers(operands[1], lengths[1]);
+
+    return ALL_REGISTERS;
+}
+
+// Check if an instruction may overwrite the flags. Calls are assumed to, since
+// what each routine does to the flags is not tracked.
+static bool instruction_writes_flags(const char* instr) {
+    static const char* keep[] = {
+        "ld", "ldh", "ldi", "ldd", "push", "jp", "jr", "ret", "reti",
+        "nop", "halt", "stop", "di", "ei", "res", "set", NULL
+    };
+    const char* operands[2];
+    size_t lengths[2];
+    unsigned count = split_operands(instr, operands, lengths);
+
+    // `ld hl, sp + e8` sets the flags like `add sp, e8`, and `pop af` loads them.
+    if (mnemonic_is(instr, "ld") && count == 2 && strncmp(operands[1], "sp", 2) == 0
+        && (operands[1][2] == ' ' || operands[1][2] == '+' || operands[1][2] == '-'))
+        return true;
+    if (mnemonic_is(instr, "pop"))
+        return count && operand_is(operands[0], lengths[0], "af");
+    // 16-bit increments and decrements leave the flags alone.
+    if ((mnemonic_is(instr, "inc") || mnemonic_is(instr, "dec")) && count
+        && operand_kind(operands[0], lengths[0]) == OPERAND_R16)
+        return false;
+    for (size_t i = 0; keep[i]; i++)
+        if (mnemonic_is(instr, keep[i])) return false;
+    return true;
+}
+
+/*
+ * Branch relaxation
+ */
+
+// A line of a function's assembly.
+typedef struct Line {
+    char* text;
+    // The named label which this line defines, without its colons, or NULL.
+    char* label;
+    // Whether this line defines an anonymous label.
+    bool anonymous;
+    // The instruction on this line, or NULL if there is none.
+    char* instr;
+    // Jumps to labels may be relaxed. The condition is NULL if the jump is
+    // unconditional.
+    bool is_jump;
+    bool is_long;
+    // Set for jumps to the very next instruction, which are left out.
+    bool is_removed;
+    char* condition;
+    char* target;
+    size_t target_line;
+    size_t offset;
+} Line;
+
+static void parse_line(Line* line, char* text) {
+    *line = (Line) {.text = text, .target_line = NO_LINE};
+
+    char* instr = text;
+    if (text[0] == ':') {
+        line->anonymous = true;
+        instr++;
+    } else if (text[0] != '\0' && !isspace((unsigned char) text[0])) {
+        char* colon = strchr(text, ':');
+        if (colon == NULL || strncmp(text, "SECTION", 7) == 0)
+            return;
+        line->label = strndup(text, colon - text);
+        instr = colon;
+        while (*instr == ':')
+            instr++;
+    }
+    while (isspace((unsigned char) *instr))
+        instr++;
+    if (*instr == '\0' || *instr == ';')
+        return;
+    line->instr = instr;
+
+    const char* operands[2];
+    size_t lengths[2];
+    unsigned count = split_operands(instr, operands, lengths);
+    if (!mnemonic_is(instr, "jp") || count == 0)
+        return;
+    const char* target = operands[count - 1];
+    if (operand_kind(target, lengths[count - 1]) != OPERAND_IMMEDIATE)
+        return;
+    line->is_jump = true;
+    line->target = strndup(target, lengths[count - 1]);
+    if (count == 2)
+        line->condition = strndup(operands[0], lengths[0]);
+}
+
+// Split assembly into lines, which point into `code`. Returns a new VArray.
+static Line* parse_lines(char* code) {
+    Line* lines = va_new(0);
+
+    for (char* text = strtok(code, "\n"); text; text = strtok(NULL, "\n")) {
+        Line line;
+        parse_line(&line, text);
+        va_append(lines, line);
+    }
+    return lines;
+}
+
+static void free_lines(Line* lines) {
+    for (size_t i = 0; i < va_len(lines); i++) {
+        free(lines[i].label);
+        free(lines[i].condition);
+        free(lines[i].target);
+    }
+    va_free(lines);
+}
+
+// Find the line which defines the label that a jump targets. Anonymous labels
+// are referenced relative to the jump, with `:+` naming the next one, `:--` the
+// one before the previous, and so on.
+static size_t find_target(Line* lines, size_t jump) {
+    const char* target = lines[jump].target;
+    size_t count = va_len(lines);
+
+    if (target[0] != ':') {
+        for (size_t i = 0; i < count; i++) {
+            if (lines[i].label && strcmp(lines[i].label, target) == 0)
+                return i;
+        }
+        return NO_LINE;
+    }
+
+    size_t skip = strlen(target) - 1;
+    if (target[1] == '+') {
+        for (size_t i = jump + 1; i < count; i++) {
+            if (lines[i].anonymous && --skip == 0)
+                return i;
+        }
+    } else if (target[1] == '-') {
+        for (size_t i = jump + 1; i-- > 0;) {
+            if (lines[i].anonymous && --skip == 0)
+                return i;
+        }
+    }
+    return NO_LINE;
+}
+
+// Find the first instruction at or after a label.
+static Line* instruction_at(Line* lines, size_t label) {
+    for (size_t i = label; i < va_len(lines); i++) {
+        if (lines[i].instr)
+            return &lines[i];
+    }
+    return NULL;
+}
+
+// Send a jump which lands on an unconditional jump to a named label directly to
+// that label instead.
+static void thread_jump(Line* lines, Line* jump) {
+    // Passing through every line once is enough to reach the end of any chain,
+    // and stops jumps which loop forever.
+    for (size_t steps = 0; steps < va_len(lines); steps++) {
+        Line* next = instruction_at(lines, jump->target_line);
+        if (next == NULL || next == jump || !next->is_jump || next->condition
+            || next->target[0] != '.' || next->target_line == NO_LINE)
+            return;
+        free(jump->target);
+        jump->target = strdup(next->target);
+        jump->target_line = next->target_line;
+    }
+}
+
+// Check if a jump lands on the instruction directly after it.
+static bool jumps_to_next(Line* lines, size_t jump) {
+    size_t target = lines[jump].target_line;
+    if (target == NO_LINE || target <= jump)
+        return false;
+    for (size_t i = jump + 1; i < target; i++) {
+        if (lines[i].instr)
+            return false;
+    }
+    return true;
+}
+
+static size_t line_bytes(Line* line) {
+    if (line->instr == NULL || line->is_removed)
+        return 0;
+    if (line->is_jump)
+        return line->is_long ? JP_BYTES : JR_BYTES;
+    return instruction_bytes(line->instr);
+}
+
+// Output a function's assembly, given as a single string, with each jump to a
+// label in reach of `jr` shortened to it. Jumps which land on another jump are
+// first sent straight to its target, and jumps to the next instruction are
+// removed.
+//
+// Every jump begins short, and those found to be out of range are lengthened.
+// Lengthening a jump can only push others out of range, so this repeats until
+// nothing changes. Returns the size of the code output, in bytes.
+size_t relax_branches(FILE* out, char* code) {
+    Line* lines = parse_lines(code);
+    size_t bytes = 0;
+
+    for (size_t i = 0; i < va_len(lines); i++) {
+        if (!lines[i].is_jump)
+            continue;
+        lines[i].target_line = find_target(lines, i);
+        // Jumps to unknown labels may be anywhere. Those to other routines are
+        // left as they are.
+        lines[i].is_long = lines[i].target_line == NO_LINE;
+        if (lines[i].is_long && lines[i].target[0] != '.' && lines[i].target[0] != ':')
+            lines[i].is_jump = false;
+    }
+    for (size_t i = 0; i < va_len(lines); i++) {
+        if (lines[i].is_jump && lines[i].target_line != NO_LINE)
+            thread_jump(lines, &lines[i]);
+    }
+    for (size_t i = 0; i < va_len(lines); i++) {
+        if (lines[i].is_jump)
+            lines[i].is_removed = jumps_to_next(lines, i);
+    }
+
+    for (bool changed = true; changed;) {
+        changed = false;
+
+        size_t offset = 0;
+        for (size_t i = 0; i < va_len(lines); i++) {
+            lines[i].offset = offset;
+            offset += line_bytes(&lines[i]);
+        }
+
+        for (size_t i = 0; i < va_len(lines); i++) {
+            Line* line = &lines[i];
+            if (!line->is_jump || line->is_long || line->is_removed)
+                continue;
+            // `jr` is relative to the end of the instruction.
+            int64_t distance = (int64_t) lines[line->target_line].offset - (int64_t) (line->offset + JR_BYTES);
+            if (distance < INT8_MIN || distance > INT8_MAX) {
+                line->is_long = true;
+                changed = true;
+            }
+        }
+    }
+
+    for (size_t i = 0; i < va_len(lines); i++) {
+        Line* line = &lines[i];
+        bytes += line_bytes(line);
+        if (!line->is_jump) {
+            fprintf(out, "%s\n", line->text);
+            continue;
+        }
+        if (line->is_removed) {
+            // Keep any label which shares the line.
+            if (line->instr != line->text && !isspace((unsigned char) line->text[0]))
+                fprintf(out, "%.*s\n", (int) (line->instr - line->text), line->text);
+            continue;
+        }
+        fprintf(out, "%.*s%s ", (int) (line->instr - line->text), line->text, line->is_long ? "jp" : "jr");
+        if (line->condition)
+            fprintf(out, "%s, ", line->condition);
+        fprintf(out, "%s\n", line->target);
+    }
+
+    free_lines(lines);
+    return bytes;
+}
+
+// Find the size of assembly as it is, in bytes.
+size_t code_bytes(const char* code) {
+    char* copy = strdup(code);
+    Line* lines = parse_lines(copy);
+    size_t bytes = 0;
+
+    for (size_t i = 0; i < va_len(lines); i++) {
+        if (lines[i].instr)
+            bytes += instruction_bytes(lines[i].instr);
+    }
+
+    free_lines(lines);
+    free(copy);
+    return bytes;
+}
+
+// Output assembly with each call or jump to a routine which `is_far` picks
+// sent through the routine's far-call stub, `__far_<routine>`, instead.
+void redirect_far_calls(FILE* out, const char* code, bool (*is_far)(const char* name, size_t length)) {
+    char* copy = strdup(code);
+    Line* lines = parse_lines(copy);
+
+    for (size_t i = 0; i < va_len(lines); i++) {
+        const char* instr = lines[i].instr;
+        const char* operands[2];
+        size_t lengths[2];
+        unsigned count = instr ? split_operands(instr, operands, lengths) : 0;
+
+        if (count == 0 || !(mnemonic_is(instr, "call") || mnemonic_is(instr, "jp"))
+            || operand_kind(operands[count - 1], lengths[count - 1]) != OPERAND_IMMEDIATE
+            || !is_far(operands[count - 1], lengths[count - 1])) {
+            fprintf(out, "%s\n", lines[i].text);
+            continue;
+        }
+        const char* target = operands[count - 1];
+        fprintf(out, "%.*s__far_%s\n", (int) (target - lines[i].text), lines[i].text, target);
+    }
+
+    free_lines(lines);
+    free(copy);
+}
+
+/*
+ * Register writes of whole routines
+ */
+
+// Find the registers which a function's assembly may overwrite. The registers
+// which each routine it calls or jumps to may overwrite are given by
+// `routine_writes`.
+RegisterSet code_writes(const char* code, RegisterSet (*routine_writes)(const char* name, size_t length)) {
+    char* copy = strdup(code);
+    Line* lines = parse_lines(copy);
+    RegisterSet writes = 0;
+
+    for (size_t i = 0; i < va_len(lines); i++) {
+        const char* instr = lines[i].instr;
+        if (instr == NULL)
+            continue;
+
+        if (lines[i].is_jump) {
+            const char* target = lines[i].target;
+            if (target[0] != '.' && target[0] != ':' && find_target(lines, i) == NO_LINE)
+                writes |= routine_writes(target, strlen(target));
+        } else if (mnemonic_is(instr, "call")) {
+            const char* operands[2];
+            size_t lengths[2];
+            unsigned count = split_operands(instr, operands, lengths);
+            writes |= count ? routine_writes(operands[count - 1], lengths[count - 1]) : ALL_REGISTERS;
+        } else {
+            writes |= instruction_writes(instr);
+        }
+    }
+
+    free_lines(lines);
+    free(copy);
+    return writes;
+}
+
+// Check if a function's assembly may overwrite the flags, which the register
+// writes found by `code_writes` leave out. Any call or jump to another routine
+// is assumed to.
+bool code_writes_flags(const char* code) {
+    char* copy = strdup(code);
+    Line* lines = parse_lines(copy);
+    bool writes = false;
+
+    for (size_t i = 0; i < va_len(lines) && !writes; i++) {
+        const char* instr = lines[i].instr;
+        if (instr == NULL)
+            continue;
+        if (lines[i].is_jump) {
+            const char* target = lines[i].target;
+            writes = target[0] != '.' && target[0] != ':' && find_target(lines, i) == NO_LINE;
+        } else {
+            writes = instruction_writes_flags(instr);
+        }
+    }
+
+    free_lines(lines);
+    free(copy);
+    return writes;
+}
+
+/*
+ * Speed of whole routines
+ */
+
+// Estimate the most M-cycles which running a function's assembly may take, from
+// its first line until it returns. How often a loop repeats is not known here,
+// so each loop is counted as though it ran once. The cycles which each routine
+// it calls or jumps to takes are given by `routine_cycles`.
+unsigned code_cycles(const char* code, unsigned (*routine_cycles)(const char* name, size_t length)) {
+    char* copy = strdup(code);
+    Line* lines = parse_lines(copy);
+    size_t count = va_len(lines);
+    // The most cycles spent from each line on, with nothing after the last.
+    unsigned* longest = calloc(count + 1, sizeof(unsigned));
+
+    // `jr` is never relaxed, but is followed the same way as `jp`.
+    for (size_t i = 0; i < count; i++) {
+        const char* operands[2];
+        size_t lengths[2];
+        const char* instr = lines[i].instr;
+        unsigned operand_count = instr ? split_operands(instr, operands, lengths) : 0;
+        if (operand_count == 0 || !mnemonic_is(instr, "jr"))
+            continue;
+        lines[i].target = strndup(operands[operand_count - 1], lengths[operand_count - 1]);
+        if (operand_count == 2)
+            lines[i].condition = strndup(operands[0], lengths[0]);
+    }
+
+    // A line is only ever followed by itself or those after it once the back
+    // edges of loops are left out, so the lines are visited from the last up.
+    for (size_t i = count; i-- > 0;) {
+        Line* line = &lines[i];
+        const char* instr = line->instr;
+        if (instr == NULL) {
+            longest[i] = longest[i + 1];
+            continue;
+        }
+
+        unsigned cycles = instruction_cycles(instr);
+        const char* operands[2];
+        size_t lengths[2];
+        unsigned operand_count = split_operands(instr, operands, lengths);
+        if (line->target) {
+            size_t target = find_target(lines, i);
+            unsigned taken = 0;
+            if (target == NO_LINE && line->target[0] != '.' && line->target[0] != ':')
+                taken = routine_cycles(line->target, strlen(line->target));
+            else if (target != NO_LINE && target > i)
+                taken = longest[target];
+            longest[i] = cycles + taken;
+            if (line->condition && longest[i] < cycles + longest[i + 1])
+                longest[i] = cycles + longest[i + 1];
+        } else if (mnemonic_is(instr, "call") && operand_count) {
+            longest[i] = cycles + routine_cycles(operands[operand_count - 1], lengths[operand_count - 1])
+                       + longest[i + 1];
+        } else if (mnemonic_is(instr, "reti") || mnemonic_is(instr, "jp")
+                   || (mnemonic_is(instr, "ret") && operand_count == 0)) {
+            // Jumps through `hl` may go anywhere, so they are not followed.
+            longest[i] = cycles;
+        } else {
+            longest[i] = cycles + longest[i + 1];
+        }
+    }
+
+    unsigned cycles = longest[0];
+    free(longest);
+    free_lines(lines);
+    free(copy);
+    return cycles;
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#include "registers.h"
+
+unsigned instruction_bytes(const char* instr);
+unsigned instruction_cycles(const char* instr);
+RegisterSet instruction_writes(const char* instr);
+RegisterSet code_writes(const char* code, RegisterSet (*routine_writes)(const char* name, size_t length));
+bool code_writes_flags(const char* code);
+unsigned code_cycles(const char* code, unsigned (*routine_cycles)(const char* name, size_t length));
+size_t relax_branches(FILE* out, char* code);
+size_t code_bytes(const char* code);
+void redirect_far_calls(FILE* out, const char* code, bool (*is_far)(const char* name, size_t length));
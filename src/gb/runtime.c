@@ -0,0 +1,948 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "gb/operations.h"
+#include "gb/runtime.h"
+#include "optimizer.h"
+#include "registers.h"
+#include "statements.h"
+#include "varray.h"
+
+// The runtime library. Each routine comes in a speed-tuned variant, which is
+// usually unrolled, and a size-tuned variant, which loops. An operation may
+// either call a routine or expand its body inline, and the cheapest of these
+// is chosen for each operation according to the optimization objective and
+// how often the operation is expected to run.
+
+#define REPEAT3(x) x x x
+#define REPEAT4(x) x x x x
+#define REPEAT7(x) REPEAT3(x) REPEAT4(x)
+#define REPEAT8(x) x x x x x x x x
+#define REPEAT15(x) REPEAT7(x) REPEAT8(x)
+#define REPEAT16(x) REPEAT8(x) REPEAT8(x)
+
+/*
+ * Multiplication
+ *
+ * a = a * c
+ */
+
+static RuntimeRoutine mul8_speed = {
+    "__mul8_speed",
+    "    ld b, a\n"
+    "    xor a, a\n"
+    REPEAT8(
+    "    add a, a\n"
+    "    sla c\n"
+    "    jr nc, :+\n"
+    "    add a, b\n"
+    ":\n"
+    ),
+    50, 50,
+};
+
+static RuntimeRoutine mul8_size = {
+    "__mul8_size",
+    "    ld b, a\n"
+    "    xor a, a\n"
+    ":   srl c\n"
+    "    jr nc, :+\n"
+    "    add a, b\n"
+    ":   sla b\n"
+    "    inc c\n"
+    "    dec c\n"
+    "    jr nz, :--\n",
+    13, 97,
+};
+
+/*
+ * hl = hl * de
+ */
+
+static RuntimeRoutine mul16_speed = {
+    "__mul16_speed",
+    "    ld b, h\n"
+    "    ld c, l\n"
+    "    ld hl, 0\n"
+    REPEAT16(
+    "    add hl, hl\n"
+    "    sla e\n"
+    "    rl d\n"
+    "    jr nc, :+\n"
+    "    add hl, bc\n"
+    ":\n"
+    ),
+    133, 165,
+};
+
+static RuntimeRoutine mul16_size = {
+    "__mul16_size",
+    "    ld b, h\n"
+    "    ld c, l\n"
+    "    ld hl, 0\n"
+    "    ld a, 16\n"
+    ":   add hl, hl\n"
+    "    sla e\n"
+    "    rl d\n"
+    "    jr nc, :+\n"
+    "    add hl, bc\n"
+    ":   dec a\n"
+    "    jr nz, :--\n",
+    18, 230,
+};
+
+/*
+ * Unsigned division
+ *
+ * a = a / c, b = a % c
+ */
+
+// Each step shifts the next bit of the dividend into the remainder, and
+// subtracts the divisor if it fits. A carry out of the remainder means that it
+// certainly does.
+#define DIVMOD8_STEP \
+    "    sla d\n" \
+    "    rla\n" \
+    "    jr c, :+\n" \
+    "    cp a, c\n" \
+    "    jr c, :++\n" \
+    ":   sub a, c\n" \
+    "    inc d\n" \
+    ":\n"
+
+static RuntimeRoutine divmod8u_speed = {
+    "__divmod8u_speed",
+    "    ld d, a\n"
+    "    xor a, a\n"
+    REPEAT8(DIVMOD8_STEP)
+    "    ld b, a\n"
+    "    ld a, d\n",
+    84, 84,
+};
+
+static RuntimeRoutine divmod8u_size = {
+    "__divmod8u_size",
+    "    ld d, a\n"
+    "    xor a, a\n"
+    "    ld e, 8\n"
+    ":   sla d\n"
+    "    rla\n"
+    "    jr c, :+\n"
+    "    cp a, c\n"
+    "    jr c, :++\n"
+    ":   sub a, c\n"
+    "    inc d\n"
+    ":   dec e\n"
+    "    jr nz, :---\n"
+    "    ld b, a\n"
+    "    ld a, d\n",
+    19, 117,
+};
+
+/*
+ * hl = hl / de, de = hl % de
+ */
+
+// The divisor is negated first, so that it can be subtracted with `add`.
+#define NEGATE_DE \
+    "    ld a, e\n" \
+    "    cpl\n" \
+    "    ld e, a\n" \
+    "    ld a, d\n" \
+    "    cpl\n" \
+    "    ld d, a\n" \
+    "    inc de\n"
+
+static RuntimeRoutine divmod16u_speed = {
+    "__divmod16u_speed",
+    "    ld b, h\n"
+    "    ld c, l\n"
+    NEGATE_DE
+    "    ld hl, 0\n"
+    REPEAT16(
+    "    sla c\n"
+    "    rl b\n"
+    "    rl l\n"
+    "    rl h\n"
+    "    jr c, :+\n"
+    "    ld a, l\n"
+    "    add a, e\n"
+    "    ld a, h\n"
+    "    adc a, d\n"
+    "    jr nc, :++\n"
+    ":   add hl, de\n"
+    "    inc c\n"
+    ":\n"
+    )
+    "    ld d, h\n"
+    "    ld e, l\n"
+    "    ld h, b\n"
+    "    ld l, c\n",
+    304, 321,
+};
+
+static RuntimeRoutine divmod16u_size = {
+    "__divmod16u_size",
+    "    ld b, h\n"
+    "    ld c, l\n"
+    NEGATE_DE
+    "    ld hl, 0\n"
+    "    ld a, 16\n"
+    ":   sla c\n"
+    "    rl b\n"
+    "    rl l\n"
+    "    rl h\n"
+    "    jr c, :+\n"
+    "    push hl\n"
+    "    add hl, de\n"
+    "    pop hl\n"
+    "    jr nc, :++\n"
+    ":   add hl, de\n"
+    "    inc c\n"
+    ":   dec a\n"
+    "    jr nz, :---\n"
+    "    ld d, h\n"
+    "    ld e, l\n"
+    "    ld h, b\n"
+    "    ld l, c\n",
+    38, 466,
+};
+
+/*
+ * Signed division
+ *
+ * Both operands are made positive before an unsigned division. The quotient is
+ * negative if the signs of the operands differ, and the remainder takes the
+ * sign of the dividend.
+ */
+
+#define DIVMOD8S_BODY(divide) \
+    "    ld b, a\n" \
+    "    xor a, c\n" \
+    "    push af\n" \
+    "    ld a, b\n" \
+    "    push af\n" \
+    "    bit 7, c\n" \
+    "    jr z, :+\n" \
+    "    xor a, a\n" \
+    "    sub a, c\n" \
+    "    ld c, a\n" \
+    ":   ld a, b\n" \
+    "    bit 7, a\n" \
+    "    jr z, :+\n" \
+    "    cpl\n" \
+    "    inc a\n" \
+    ":   call " divide "\n" \
+    "    ld c, a\n" \
+    "    pop af\n" \
+    "    add a, a\n" \
+    "    jr nc, :+\n" \
+    "    xor a, a\n" \
+    "    sub a, b\n" \
+    "    ld b, a\n" \
+    ":   pop af\n" \
+    "    add a, a\n" \
+    "    ld a, c\n" \
+    "    jr nc, :+\n" \
+    "    cpl\n" \
+    "    inc a\n" \
+    ":\n"
+
+static RuntimeRoutine divmod8s_speed = {
+    "__divmod8s_speed", DIVMOD8S_BODY("__divmod8u_speed"), 37, 50, &divmod8u_speed,
+};
+
+static RuntimeRoutine divmod8s_size = {
+    "__divmod8s_size", DIVMOD8S_BODY("__divmod8u_size"), 37, 50, &divmod8u_size,
+};
+
+#define NEGATE_16(high, low) \
+    "    xor a, a\n" \
+    "    sub a, " low "\n" \
+    "    ld " low ", a\n" \
+    "    sbc a, a\n" \
+    "    sub a, " high "\n" \
+    "    ld " high ", a\n"
+
+#define DIVMOD16S_BODY(divide) \
+    "    ld a, h\n" \
+    "    xor a, d\n" \
+    "    push af\n" \
+    "    ld a, h\n" \
+    "    push af\n" \
+    "    bit 7, d\n" \
+    "    jr z, :+\n" \
+    NEGATE_16("d", "e") \
+    ":   bit 7, h\n" \
+    "    jr z, :+\n" \
+    NEGATE_16("h", "l") \
+    ":   call " divide "\n" \
+    "    pop af\n" \
+    "    add a, a\n" \
+    "    jr nc, :+\n" \
+    NEGATE_16("d", "e") \
+    ":   pop af\n" \
+    "    add a, a\n" \
+    "    jr nc, :+\n" \
+    NEGATE_16("h", "l") \
+    ":\n"
+
+static RuntimeRoutine divmod16s_speed = {
+    "__divmod16s_speed", DIVMOD16S_BODY("__divmod16u_speed"), 48, 61, &divmod16u_speed,
+};
+
+static RuntimeRoutine divmod16s_size = {
+    "__divmod16s_size", DIVMOD16S_BODY("__divmod16u_size"), 48, 61, &divmod16u_size,
+};
+
+/*
+ * Values too wide for the registers
+ *
+ * Operands of 4 and 8 bytes are passed in `__runtime_operands`, which holds
+ * three values of the operation's width one after another: A, B and C. A and B
+ * are shifted together as a single value twice as wide. The block is shared,
+ * so an interrupt handler must not use these routines while they may be
+ * running.
+ *
+ * A = C * B
+ */
+
+#define OPERANDS "__runtime_operands"
+
+// Set once any operation calls or expands a routine in memory.
+static bool operands_referenced = false;
+
+// The product is kept in dehl, and the multiplier is taken a byte at a time,
+// from the most significant.
+#define MUL32_ADD \
+    "    ld a, [" OPERANDS " + 8]\n" \
+    "    add a, l\n" \
+    "    ld l, a\n" \
+    "    ld a, [" OPERANDS " + 9]\n" \
+    "    adc a, h\n" \
+    "    ld h, a\n" \
+    "    ld a, [" OPERANDS " + 10]\n" \
+    "    adc a, e\n" \
+    "    ld e, a\n" \
+    "    ld a, [" OPERANDS " + 11]\n" \
+    "    adc a, d\n" \
+    "    ld d, a\n"
+
+#define MUL32_BYTE(offset) \
+    "    ld a, [" OPERANDS " + " #offset "]\n" \
+    "    ld b, a\n" \
+    "    ld c, 8\n" \
+    ":   add hl, hl\n" \
+    "    rl e\n" \
+    "    rl d\n" \
+    "    sla b\n" \
+    "    jr nc, :+\n" \
+    MUL32_ADD \
+    ":   dec c\n" \
+    "    jr nz, :--\n"
+
+static RuntimeRoutine mul32_speed = {
+    "__mul32_speed",
+    "    ld hl, 0\n"
+    "    ld d, h\n"
+    "    ld e, l\n"
+    MUL32_BYTE(7)
+    MUL32_BYTE(6)
+    MUL32_BYTE(5)
+    MUL32_BYTE(4)
+    "    ld a, l\n"
+    "    ld [" OPERANDS "], a\n"
+    "    ld a, h\n"
+    "    ld [" OPERANDS " + 1], a\n"
+    "    ld a, e\n"
+    "    ld [" OPERANDS " + 2], a\n"
+    "    ld a, d\n"
+    "    ld [" OPERANDS " + 3], a\n",
+    173, 1265, NULL, true,
+};
+
+// Wider products are kept in A. Each step shifts the next bit of the
+// multiplier out of the top of B, and adds C if it is set.
+#define MUL_SPEED_BODY(bits, c, REPEAT_N, REPEAT_N_1, REPEAT_2N_1) \
+    "    xor a, a\n" \
+    "    ld hl, " OPERANDS "\n" \
+    REPEAT_N("    ld [hl+], a\n") \
+    "    ld c, " bits "\n" \
+    ":   ld hl, " OPERANDS "\n" \
+    "    sla [hl]\n" \
+    REPEAT_2N_1("    inc hl\n    rl [hl]\n") \
+    "    jr nc, :+\n" \
+    "    ld de, " OPERANDS "\n" \
+    "    ld hl, " c "\n" \
+    "    ld a, [de]\n" \
+    "    add a, [hl]\n" \
+    "    ld [de], a\n" \
+    REPEAT_N_1("    inc de\n    inc hl\n    ld a, [de]\n    adc a, [hl]\n    ld [de], a\n") \
+    ":   dec c\n" \
+    "    jr nz, :--\n"
+
+#define MUL_SIZE_BODY(width, double_width, bits, c) \
+    "    xor a, a\n" \
+    "    ld hl, " OPERANDS "\n" \
+    "    ld b, " width "\n" \
+    ":   ld [hl+], a\n" \
+    "    dec b\n" \
+    "    jr nz, :-\n" \
+    "    ld c, " bits "\n" \
+    ":   ld hl, " OPERANDS "\n" \
+    "    ld b, " double_width "\n" \
+    "    and a, a\n" \
+    ":   rl [hl]\n" \
+    "    inc hl\n" \
+    "    dec b\n" \
+    "    jr nz, :-\n" \
+    "    jr nc, :++\n" \
+    "    ld de, " OPERANDS "\n" \
+    "    ld hl, " c "\n" \
+    "    ld b, " width "\n" \
+    "    and a, a\n" \
+    ":   ld a, [de]\n" \
+    "    adc a, [hl]\n" \
+    "    ld [de], a\n" \
+    "    inc de\n" \
+    "    inc hl\n" \
+    "    dec b\n" \
+    "    jr nz, :-\n" \
+    ":   dec c\n" \
+    "    jr nz, :----\n"
+
+static RuntimeRoutine mul32_size = {
+    "__mul32_size", MUL_SIZE_BODY("4", "8", "32", OPERANDS " + 8"), 46, 4990, NULL, true,
+};
+
+static RuntimeRoutine mul64_speed = {
+    "__mul64_speed", MUL_SPEED_BODY("64", OPERANDS " + 16", REPEAT8, REPEAT7, REPEAT15), 113, 11861, NULL, true,
+};
+
+static RuntimeRoutine mul64_size = {
+    "__mul64_size", MUL_SIZE_BODY("8", "16", "64", OPERANDS " + 16"), 46, 18678, NULL, true,
+};
+
+/*
+ * A = A / C, B = A % C
+ */
+
+// The remainder is built in B as the dividend is shifted out of A, which
+// leaves room for the quotient. A carry out of the remainder means that the
+// divisor certainly fits. The loop of a 64-bit division is too long to close
+// with `jr`.
+#define DIVMOD_SPEED_BODY(bits, b, c, loop, REPEAT_N, REPEAT_N_1, REPEAT_2N_1) \
+    "    xor a, a\n" \
+    "    ld hl, " b "\n" \
+    REPEAT_N("    ld [hl+], a\n") \
+    "    ld c, " bits "\n" \
+    ":   ld hl, " OPERANDS "\n" \
+    "    sla [hl]\n" \
+    REPEAT_2N_1("    inc hl\n    rl [hl]\n") \
+    "    jr c, :+\n" \
+    "    ld de, " b "\n" \
+    "    ld hl, " c "\n" \
+    "    ld a, [de]\n" \
+    "    sub a, [hl]\n" \
+    REPEAT_N_1("    inc de\n    inc hl\n    ld a, [de]\n    sbc a, [hl]\n") \
+    "    jr c, :++\n" \
+    ":   ld de, " b "\n" \
+    "    ld hl, " c "\n" \
+    "    ld a, [de]\n" \
+    "    sub a, [hl]\n" \
+    "    ld [de], a\n" \
+    REPEAT_N_1("    inc de\n    inc hl\n    ld a, [de]\n    sbc a, [hl]\n    ld [de], a\n") \
+    "    ld hl, " OPERANDS "\n" \
+    "    inc [hl]\n" \
+    ":   dec c\n" \
+    "    " loop " nz, :---\n"
+
+#define DIVMOD_SIZE_BODY(width, double_width, bits, b, c) \
+    "    xor a, a\n" \
+    "    ld hl, " b "\n" \
+    "    ld b, " width "\n" \
+    ":   ld [hl+], a\n" \
+    "    dec b\n" \
+    "    jr nz, :-\n" \
+    "    ld c, " bits "\n" \
+    ":   ld hl, " OPERANDS "\n" \
+    "    ld b, " double_width "\n" \
+    "    and a, a\n" \
+    ":   rl [hl]\n" \
+    "    inc hl\n" \
+    "    dec b\n" \
+    "    jr nz, :-\n" \
+    "    jr c, :++\n" \
+    "    ld de, " b "\n" \
+    "    ld hl, " c "\n" \
+    "    ld b, " width "\n" \
+    "    and a, a\n" \
+    ":   ld a, [de]\n" \
+    "    sbc a, [hl]\n" \
+    "    inc de\n" \
+    "    inc hl\n" \
+    "    dec b\n" \
+    "    jr nz, :-\n" \
+    "    jr c, :+++\n" \
+    ":   ld de, " b "\n" \
+    "    ld hl, " c "\n" \
+    "    ld b, " width "\n" \
+    "    and a, a\n" \
+    ":   ld a, [de]\n" \
+    "    sbc a, [hl]\n" \
+    "    ld [de], a\n" \
+    "    inc de\n" \
+    "    inc hl\n" \
+    "    dec b\n" \
+    "    jr nz, :-\n" \
+    "    ld hl, " OPERANDS "\n" \
+    "    inc [hl]\n" \
+    ":   dec c\n" \
+    "    jr nz, :------\n"
+
+static RuntimeRoutine divmod32u_speed = {
+    "__divmod32u_speed",
+    DIVMOD_SPEED_BODY("32", OPERANDS " + 4", OPERANDS " + 8", "jr", REPEAT4, REPEAT3, REPEAT7),
+    91, 4461, NULL, true,
+};
+
+static RuntimeRoutine divmod32u_size = {
+    "__divmod32u_size", DIVMOD_SIZE_BODY("4", "8", "32", OPERANDS " + 4", OPERANDS " + 8"), 68, 7038, NULL, true,
+};
+
+static RuntimeRoutine divmod64u_speed = {
+    "__divmod64u_speed",
+    DIVMOD_SPEED_BODY("64", OPERANDS " + 8", OPERANDS " + 16", "jp", REPEAT8, REPEAT7, REPEAT15),
+    156, 16661, NULL, true,
+};
+
+static RuntimeRoutine divmod64u_size = {
+    "__divmod64u_size", DIVMOD_SIZE_BODY("8", "16", "64", OPERANDS " + 8", OPERANDS " + 16"), 68, 25846, NULL, true,
+};
+
+#define NEGATE_OPERAND(operand, REPEAT_N_1) \
+    "    ld hl, " operand "\n" \
+    "    xor a, a\n" \
+    "    sub a, [hl]\n" \
+    "    ld [hl+], a\n" \
+    REPEAT_N_1("    ld a, 0\n    sbc a, [hl]\n    ld [hl+], a\n")
+
+#define DIVMODS_WIDE_BODY(divide, a_top, b, c, c_top, REPEAT_N_1) \
+    "    ld a, [" a_top "]\n" \
+    "    ld b, a\n" \
+    "    ld a, [" c_top "]\n" \
+    "    xor a, b\n" \
+    "    push af\n" \
+    "    ld a, b\n" \
+    "    push af\n" \
+    "    ld a, [" c_top "]\n" \
+    "    bit 7, a\n" \
+    "    jr z, :+\n" \
+    NEGATE_OPERAND(c, REPEAT_N_1) \
+    ":   bit 7, b\n" \
+    "    jr z, :+\n" \
+    NEGATE_OPERAND(OPERANDS, REPEAT_N_1) \
+    ":   call " divide "\n" \
+    "    pop af\n" \
+    "    add a, a\n" \
+    "    jr nc, :+\n" \
+    NEGATE_OPERAND(b, REPEAT_N_1) \
+    ":   pop af\n" \
+    "    add a, a\n" \
+    "    jr nc, :+\n" \
+    NEGATE_OPERAND(OPERANDS, REPEAT_N_1) \
+    ":\n"
+
+#define DIVMOD32S_BODY(divide) \
+    DIVMODS_WIDE_BODY(divide, OPERANDS " + 3", OPERANDS " + 4", OPERANDS " + 8", OPERANDS " + 11", REPEAT3)
+#define DIVMOD64S_BODY(divide) \
+    DIVMODS_WIDE_BODY(divide, OPERANDS " + 7", OPERANDS " + 8", OPERANDS " + 16", OPERANDS " + 23", REPEAT7)
+
+static RuntimeRoutine divmod32s_speed = {
+    "__divmod32s_speed", DIVMOD32S_BODY("__divmod32u_speed"), 105, 153, &divmod32u_speed, true,
+};
+
+static RuntimeRoutine divmod32s_size = {
+    "__divmod32s_size", DIVMOD32S_BODY("__divmod32u_size"), 105, 153, &divmod32u_size, true,
+};
+
+static RuntimeRoutine divmod64s_speed = {
+    "__divmod64s_speed", DIVMOD64S_BODY("__divmod64u_speed"), 169, 249, &divmod64u_speed, true,
+};
+
+static RuntimeRoutine divmod64s_size = {
+    "__divmod64s_size", DIVMOD64S_BODY("__divmod64u_size"), 169, 249, &divmod64u_size, true,
+};
+
+// Every routine, in the order they are output.
+static RuntimeRoutine* routines[] = {
+    &mul8_speed, &mul8_size, &mul16_speed, &mul16_size,
+    &divmod8u_speed, &divmod8u_size, &divmod16u_speed, &divmod16u_size,
+    &divmod8s_speed, &divmod8s_size, &divmod16s_speed, &divmod16s_size,
+    &mul32_speed, &mul32_size, &mul64_speed, &mul64_size,
+    &divmod32u_speed, &divmod32u_size, &divmod64u_speed, &divmod64u_size,
+    &divmod32s_speed, &divmod32s_size, &divmod64s_speed, &divmod64s_size,
+    NULL
+};
+
+/*
+ * Operations
+ */
+
+// The registers each routine uses, which must be free while it runs. Flags
+// are always clobbered.
+static CPUReg* mul8_regs[] = {&a_reg, &b_reg, &c_reg, NULL};
+static CPUReg* mul16_speed_regs[] = {&hl_reg, &de_reg, &bc_reg, NULL};
+static CPUReg* mul16_size_regs[] = {&hl_reg, &de_reg, &bc_reg, &a_reg, NULL};
+static CPUReg* divmod8_speed_regs[] = {&a_reg, &b_reg, &c_reg, &d_reg, NULL};
+static CPUReg* divmod8_size_regs[] = {&a_reg, &b_reg, &c_reg, &d_reg, &e_reg, NULL};
+static CPUReg* divmod16_regs[] = {&hl_reg, &de_reg, &bc_reg, &a_reg, NULL};
+static CPUReg* wide_regs[] = {&hl_reg, &de_reg, &bc_reg, &a_reg, NULL};
+
+static const size_t no_additional_regs[] = {0};
+
+typedef struct RuntimeOperation {
+    uint8_t op_type;
+    uint8_t width;
+    bool is_signed;
+    RuntimeRoutine* routine;
+    CPUReg* lhs_reg;
+    CPUReg* rhs_reg;
+    CPUReg* result_reg;
+    CPUReg** regs;
+    // Where the operands and result of a routine in memory are, as offsets
+    // into `__runtime_operands`.
+    uint8_t lhs_offset;
+    uint8_t rhs_offset;
+    uint8_t result_offset;
+    // Filled in from the above by `init_operations()`.
+    CpuOp call;
+    CpuOp expand;
+} RuntimeOperation;
+
+static RuntimeOperation operations[] = {
+    {MUL, 1, false, &mul8_speed, &a_reg, &c_reg, &a_reg, mul8_regs},
+    {MUL, 1, false, &mul8_size, &a_reg, &c_reg, &a_reg, mul8_regs},
+    {MUL, 2, false, &mul16_speed, &hl_reg, &de_reg, &hl_reg, mul16_speed_regs},
+    {MUL, 2, false, &mul16_size, &hl_reg, &de_reg, &hl_reg, mul16_size_regs},
+    // The low bits of a product do not depend on signedness.
+    {MUL, 1, true, &mul8_speed, &a_reg, &c_reg, &a_reg, mul8_regs},
+    {MUL, 1, true, &mul8_size, &a_reg, &c_reg, &a_reg, mul8_regs},
+    {MUL, 2, true, &mul16_speed, &hl_reg, &de_reg, &hl_reg, mul16_speed_regs},
+    {MUL, 2, true, &mul16_size, &hl_reg, &de_reg, &hl_reg, mul16_size_regs},
+
+    {DIV, 1, false, &divmod8u_speed, &a_reg, &c_reg, &a_reg, divmod8_speed_regs},
+    {DIV, 1, false, &divmod8u_size, &a_reg, &c_reg, &a_reg, divmod8_size_regs},
+    {MOD, 1, false, &divmod8u_speed, &a_reg, &c_reg, &b_reg, divmod8_speed_regs},
+    {MOD, 1, false, &divmod8u_size, &a_reg, &c_reg, &b_reg, divmod8_size_regs},
+    {DIV, 2, false, &divmod16u_speed, &hl_reg, &de_reg, &hl_reg, divmod16_regs},
+    {DIV, 2, false, &divmod16u_size, &hl_reg, &de_reg, &hl_reg, divmod16_regs},
+    {MOD, 2, false, &divmod16u_speed, &hl_reg, &de_reg, &de_reg, divmod16_regs},
+    {MOD, 2, false, &divmod16u_size, &hl_reg, &de_reg, &de_reg, divmod16_regs},
+
+    {DIV, 1, true, &divmod8s_speed, &a_reg, &c_reg, &a_reg, divmod8_speed_regs},
+    {DIV, 1, true, &divmod8s_size, &a_reg, &c_reg, &a_reg, divmod8_size_regs},
+    {MOD, 1, true, &divmod8s_speed, &a_reg, &c_reg, &b_reg, divmod8_speed_regs},
+    {MOD, 1, true, &divmod8s_size, &a_reg, &c_reg, &b_reg, divmod8_size_regs},
+    {DIV, 2, true, &divmod16s_speed, &hl_reg, &de_reg, &hl_reg, divmod16_regs},
+    {DIV, 2, true, &divmod16s_size, &hl_reg, &de_reg, &hl_reg, divmod16_regs},
+    {MOD, 2, true, &divmod16s_speed, &hl_reg, &de_reg, &de_reg, divmod16_regs},
+    {MOD, 2, true, &divmod16s_size, &hl_reg, &de_reg, &de_reg, divmod16_regs},
+
+    {MUL, 4, false, &mul32_speed, NULL, NULL, NULL, wide_regs, 8, 4, 0},
+    {MUL, 4, false, &mul32_size, NULL, NULL, NULL, wide_regs, 8, 4, 0},
+    {MUL, 8, false, &mul64_speed, NULL, NULL, NULL, wide_regs, 16, 8, 0},
+    {MUL, 8, false, &mul64_size, NULL, NULL, NULL, wide_regs, 16, 8, 0},
+    {MUL, 4, true, &mul32_speed, NULL, NULL, NULL, wide_regs, 8, 4, 0},
+    {MUL, 4, true, &mul32_size, NULL, NULL, NULL, wide_regs, 8, 4, 0},
+    {MUL, 8, true, &mul64_speed, NULL, NULL, NULL, wide_regs, 16, 8, 0},
+    {MUL, 8, true, &mul64_size, NULL, NULL, NULL, wide_regs, 16, 8, 0},
+
+    {DIV, 4, false, &divmod32u_speed, NULL, NULL, NULL, wide_regs, 0, 8, 0},
+    {DIV, 4, false, &divmod32u_size, NULL, NULL, NULL, wide_regs, 0, 8, 0},
+    {MOD, 4, false, &divmod32u_speed, NULL, NULL, NULL, wide_regs, 0, 8, 4},
+    {MOD, 4, false, &divmod32u_size, NULL, NULL, NULL, wide_regs, 0, 8, 4},
+    {DIV, 8, false, &divmod64u_speed, NULL, NULL, NULL, wide_regs, 0, 16, 0},
+    {DIV, 8, false, &divmod64u_size, NULL, NULL, NULL, wide_regs, 0, 16, 0},
+    {MOD, 8, false, &divmod64u_speed, NULL, NULL, NULL, wide_regs, 0, 16, 8},
+    {MOD, 8, false, &divmod64u_size, NULL, NULL, NULL, wide_regs, 0, 16, 8},
+
+    {DIV, 4, true, &divmod32s_speed, NULL, NULL, NULL, wide_regs, 0, 8, 0},
+    {DIV, 4, true, &divmod32s_size, NULL, NULL, NULL, wide_regs, 0, 8, 0},
+    {MOD, 4, true, &divmod32s_speed, NULL, NULL, NULL, wide_regs, 0, 8, 4},
+    {MOD, 4, true, &divmod32s_size, NULL, NULL, NULL, wide_regs, 0, 8, 4},
+    {DIV, 8, true, &divmod64s_speed, NULL, NULL, NULL, wide_regs, 0, 16, 0},
+    {DIV, 8, true, &divmod64s_size, NULL, NULL, NULL, wide_regs, 0, 16, 0},
+    {MOD, 8, true, &divmod64s_speed, NULL, NULL, NULL, wide_regs, 0, 16, 8},
+    {MOD, 8, true, &divmod64s_size, NULL, NULL, NULL, wide_regs, 0, 16, 8},
+};
+
+#define OPERATION_COUNT (sizeof(operations) / sizeof(*operations))
+
+static RuntimeOperation* find_runtime_operation(const CpuOp* op) {
+    for (size_t i = 0; i < OPERATION_COUNT; i++) {
+        if (&operations[i].call == op || &operations[i].expand == op)
+            return &operations[i];
+    }
+    return NULL;
+}
+
+// Copy each operand of a routine in memory into `__runtime_operands`, through
+// `a`, before anything else is overwritten.
+static void pass_operands(FILE* out, CpuOpInfo* info) {
+    RuntimeOperation* rt_op = find_runtime_operation(info->operation);
+    const OperandBytes* bytes = info->bytes;
+
+    for (unsigned i = 0; i < bytes->width; i++) {
+        fputs("    ld a, ", out);
+        fprint_byte_operand(out, &bytes->lhs[i]);
+        fprintf(out, "\n    ld [" OPERANDS " + %u], a\n", rt_op->lhs_offset + i);
+    }
+    for (unsigned i = 0; i < bytes->width; i++) {
+        fputs("    ld a, ", out);
+        fprint_byte_operand(out, &bytes->rhs[i]);
+        fprintf(out, "\n    ld [" OPERANDS " + %u], a\n", rt_op->rhs_offset + i);
+    }
+}
+
+static void take_result(FILE* out, CpuOpInfo* info) {
+    RuntimeOperation* rt_op = find_runtime_operation(info->operation);
+    const OperandBytes* bytes = info->bytes;
+
+    for (unsigned i = 0; i < bytes->dest_width; i++) {
+        fprintf(out, "    ld a, [" OPERANDS " + %u]\n    ld ", rt_op->result_offset + i);
+        fprint_byte_operand(out, &bytes->dest[i]);
+        fputs(", a\n", out);
+    }
+}
+
+static void compile_call(FILE* out, CpuOpInfo* info) {
+    if (info->operation->in_place)
+        pass_operands(out, info);
+    fprintf(out, "    call %s\n", info->operation->routine->name);
+    if (info->operation->in_place)
+        take_result(out, info);
+}
+
+static void compile_expand(FILE* out, CpuOpInfo* info) {
+    if (info->operation->in_place)
+        pass_operands(out, info);
+    fputs(info->operation->routine->body, out);
+    if (info->operation->in_place)
+        take_result(out, info);
+}
+
+// The speed of a routine's body, including any routines it calls.
+static unsigned routine_cycles(RuntimeRoutine* routine) {
+    unsigned cycles = routine->cycles;
+    if (routine->calls)
+        cycles += routine_cycles(routine->calls) + CALL_CYCLES + RET_CYCLES;
+    return cycles;
+}
+
+// The size of a routine which has not yet been output, including any routines
+// it calls. Routines which are already referenced cost nothing more.
+static unsigned unreferenced_bytes(RuntimeRoutine* routine) {
+    if (routine == NULL || routine->referenced)
+        return 0;
+    return routine->bytes + RET_BYTES + unreferenced_bytes(routine->calls);
+}
+
+static void reference_routine(RuntimeRoutine* routine) {
+    for (; routine; routine = routine->calls)
+        routine->referenced = true;
+}
+
+static void init_operations() {
+    static bool initialized = false;
+    if (initialized)
+        return;
+    initialized = true;
+
+    for (size_t i = 0; i < OPERATION_COUNT; i++) {
+        RuntimeOperation* rt_op = &operations[i];
+        CpuOp op = {
+            .result_width = rt_op->width,
+            .lhs_width = rt_op->width,
+            .rhs_width = rt_op->width,
+            .result_reg = rt_op->result_reg,
+            .lhs_reg = rt_op->lhs_reg,
+            .rhs_reg = rt_op->rhs_reg,
+            .required_regs = rt_op->regs,
+            .additional_regs = no_additional_regs,
+            .routine = rt_op->routine,
+        };
+        // Each byte of the operands and result is copied through `a`, which
+        // takes about as long as a load and a store.
+        unsigned copy_bytes = 0, copy_cycles = 0;
+        if (rt_op->routine->in_memory) {
+            op.in_place = true;
+            op.lhs_in_memory = true;
+            op.rhs_in_memory = true;
+            op.reads_operands_first = true;
+            copy_bytes = rt_op->width * 3 * 4;
+            copy_cycles = rt_op->width * 3 * 5;
+        }
+
+        rt_op->call = op;
+        rt_op->call.bytes = CALL_BYTES + copy_bytes;
+        rt_op->call.cycles = routine_cycles(rt_op->routine) + CALL_CYCLES + RET_CYCLES + copy_cycles;
+        rt_op->call.compile = &compile_call;
+
+        rt_op->expand = op;
+        rt_op->expand.bytes = rt_op->routine->bytes + copy_bytes;
+        rt_op->expand.cycles = routine_cycles(rt_op->routine) + copy_cycles;
+        rt_op->expand.compile = &compile_expand;
+    }
+}
+
+// Weigh a number of bytes and cycles against each other under the current
+// objective, where the cycles are spent `weight` times.
+uint64_t weigh_cost(uint64_t bytes, uint64_t cycles, uint64_t weight) {
+    if (optimize_size)
+        return cycles * weight * SIZE_CYCLE_WEIGHT + bytes * SIZE_BYTE_WEIGHT;
+    return cycles * weight * SPEED_CYCLE_WEIGHT + bytes * SPEED_BYTE_WEIGHT;
+}
+
+// Weigh the cost of an operation under the current objective.
+static uint64_t operation_score(const CpuOp* op, unsigned extra_bytes, uint64_t weight) {
+    return weigh_cost(op->bytes + extra_bytes, op->cycles, weight);
+}
+
+// The operations which expand a routine that is not output, where each keeps
+// its chosen implementation.
+static const CpuOp*** expanded_sites = NULL;
+
+// Note an operation which expands a routine that is not output, in case it
+// would be cheaper to call instead once the routine is. When the sites which
+// expand the routine together cost more than its body and a call from each,
+// the routine is output and each of them calls it instead.
+static void share_expanded_routine(const CpuOp** site, uint64_t weight) {
+    RuntimeOperation* rt_op = find_runtime_operation(*site);
+    RuntimeRoutine* routine = rt_op->routine;
+    uint64_t call_score = operation_score(&rt_op->call, 0, weight);
+    uint64_t expand_score = operation_score(&rt_op->expand, 0, weight);
+
+    if (expand_score <= call_score)
+        return;
+    if (expanded_sites == NULL)
+        expanded_sites = va_new(0);
+    va_append(expanded_sites, site);
+    routine->expanded_excess += expand_score - call_score;
+    if (routine->expanded_excess <= weigh_cost(unreferenced_bytes(routine), 0, 0))
+        return;
+
+    reference_routine(routine);
+    for (size_t i = 0; i < va_len(expanded_sites); i++) {
+        const CpuOp** other = expanded_sites[i];
+        if (*other && (*other)->routine == routine && (*other)->compile == &compile_expand)
+            *other = &find_runtime_operation(*other)->call;
+    }
+}
+
+// Choose how to implement an operation with the runtime library, given the
+// weight of the block it is in, and store it at `site`. The first call to a
+// routine also pays for the routine's body, but once enough operations expand
+// it, it may be shared after all, which can switch earlier sites to calls.
+// Returns the operation at `site`, or NULL if no routine implements the
+// operation.
+const CpuOp* select_runtime_operation(const CpuOp** site, uint8_t op_type, uint8_t width, bool is_signed,
+                                      uint64_t weight) {
+    const CpuOp* best = NULL;
+    uint64_t best_score = UINT64_MAX;
+
+    init_operations();
+
+    for (size_t i = 0; i < OPERATION_COUNT; i++) {
+        RuntimeOperation* rt_op = &operations[i];
+        if (rt_op->op_type != op_type || rt_op->width != width || rt_op->is_signed != is_signed)
+            continue;
+
+        uint64_t call_score = operation_score(&rt_op->call, unreferenced_bytes(rt_op->routine), weight);
+        uint64_t expand_score = operation_score(&rt_op->expand, unreferenced_bytes(rt_op->routine->calls),
+                                                weight);
+        if (call_score < best_score) {
+            best = &rt_op->call;
+            best_score = call_score;
+        }
+        if (expand_score < best_score) {
+            best = &rt_op->expand;
+            best_score = expand_score;
+        }
+    }
+
+    if (best == NULL)
+        return NULL;
+
+    operands_referenced |= best->routine->in_memory;
+    *site = best;
+    if (best->compile == &compile_call) {
+        reference_routine(best->routine);
+    } else {
+        reference_routine(best->routine->calls);
+        if (!best->routine->referenced)
+            share_expanded_routine(site, weight);
+    }
+    return *site;
+}
+
+// Estimate the speed of the fastest runtime routine for an operation, including
+// the call. Returns 0 if there is no such routine.
+unsigned estimate_runtime_cycles(uint8_t op_type, uint8_t width, bool is_signed) {
+    unsigned best = 0;
+
+    init_operations();
+
+    for (size_t i = 0; i < OPERATION_COUNT; i++) {
+        RuntimeOperation* rt_op = &operations[i];
+        if (rt_op->op_type == op_type && rt_op->width == width && rt_op->is_signed == is_signed
+            && (best == 0 || rt_op->call.cycles < best))
+            best = rt_op->call.cycles;
+    }
+    return best;
+}
+
+// Find the speed of a call to a routine, other than the `call` itself, given its
+// name. Returns 0 if there is no such routine.
+unsigned runtime_routine_cycles(const char* name, size_t length) {
+    for (size_t i = 0; routines[i]; i++) {
+        if (strlen(routines[i]->name) == length && strncmp(routines[i]->name, name, length) == 0)
+            return routine_cycles(routines[i]) + RET_CYCLES;
+    }
+    return 0;
+}
+
+// Find the size of the routines which are output, in bytes.
+size_t runtime_bytes(void) {
+    size_t bytes = 0;
+
+    for (size_t i = 0; routines[i]; i++) {
+        if (routines[i]->referenced)
+            bytes += routines[i]->bytes + RET_BYTES;
+    }
+    return bytes;
+}
+
+// Output every routine which has been referenced, exported if other files call
+// them too, along with the memory which routines take their operands in.
+void fprint_runtime(FILE* out, bool exported) {
+    bool any = false;
+
+    for (size_t i = 0; routines[i]; i++) {
+        if (!routines[i]->referenced)
+            continue;
+        if (!any)
+            fputs("\nSECTION FRAGMENT \"DCC Runtime\", ROM0\n", out);
+        any = true;
+        fprintf(out, "\n%s:%s\n%s    ret\n", routines[i]->name, exported ? ":" : "", routines[i]->body);
+    }
+    // Room for three 8-byte operands.
+    if (operands_referenced)
+        fprintf(out, "\nSECTION \"DCC Runtime Operands\", WRAM0\n" OPERANDS ":%s ds 24\n", exported ? ":" : "");
+
+    if (expanded_sites)
+        va_free(expanded_sites);
+    expanded_sites = NULL;
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "gb/operations.h"
+
+// The cost of `call` and `ret`, which expanding a routine inline avoids.
+#define CALL_BYTES 3
+#define CALL_CYCLES 6
+#define RET_BYTES 1
+#define RET_CYCLES 4
+
+// How heavily cycles and bytes are weighed against each other under each
+// objective. Cycles are also scaled by the weight of the block.
+#define SPEED_CYCLE_WEIGHT 4
+#define SPEED_BYTE_WEIGHT 1
+#define SIZE_CYCLE_WEIGHT 1
+#define SIZE_BYTE_WEIGHT 16
+
+// A routine in the runtime library, for operations which the SM83 has no
+// instructions for.
+typedef struct RuntimeRoutine {
+    const char* name;
+    // The routine's assembly, excluding the final `ret`. Only anonymous labels
+    // are used, so that it can be expanded inline any number of times.
+    const char* body;
+    // The size and worst-case speed of the body, in bytes and M-cycles.
+    uint16_t bytes;
+    uint16_t cycles;
+    // Another routine which the body calls, or NULL.
+    struct RuntimeRoutine* calls;
+    // Whether the routine takes its operands in `__runtime_operands`, rather
+    // than in registers, and leaves its results there.
+    bool in_memory;
+    // Set once any operation calls this routine, or a routine which calls it,
+    // so that only routines which are needed are output.
+    bool referenced;
+    // How much more the operations which expand the routine cost than calls
+    // would, while it is not output. Once this outweighs the body, they share
+    // one copy of it instead.
+    uint64_t expanded_excess;
+} RuntimeRoutine;
+
+const CpuOp* select_runtime_operation(const CpuOp** site, uint8_t op_type, uint8_t width, bool is_signed,
+                                      uint64_t weight);
+uint64_t weigh_cost(uint64_t bytes, uint64_t cycles, uint64_t weight);
+unsigned estimate_runtime_cycles(uint8_t op_type, uint8_t width, bool is_signed);
+unsigned runtime_routine_cycles(const char* name, size_t length);
+size_t runtime_bytes(void);
+void fprint_runtime(FILE* out, bool exported);
@@ -0,0 +1,173 @@
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "cfg.h"
+#include "optimizer.h"
+#include "statements.h"
+#include "varray.h"
+
+// Dominator-based global value numbering. The dominator tree is walked from the
+// entry while keeping a scoped table of every operation computed along the
+// way. Since each local is only assigned once, an operation which matches an
+// entry in the table computes the same value as a dominating local, and every
+// use of it can be redirected there.
+
+typedef struct ValueEntry {
+    uint64_t hash;
+    Operation* op;
+} ValueEntry;
+
+typedef struct GVNState {
+    Function* func;
+    // VArray of each block's children in the dominator tree.
+    size_t** children;
+    // VArray of operations available in the current block, innermost last.
+    ValueEntry* table;
+    size_t removed;
+} GVNState;
+
+// Check if an operation always produces the same result from the same
+// operands. Dereferences read memory, which may change between two of them.
+static bool is_numberable(Operation* op) {
+    return op->type != DEREFERENCE;
+}
+
+// Point one of a local's references at a different operand field.
+static void move_reference(LocalVar* local, uint64_t* from, uint64_t* to) {
+    for (size_t i = 0; i < va_len(local->references); i++) {
+        if (local->references[i] == from) {
+            local->references[i] = to;
+            return;
+        }
+    }
+}
+
+// Put an operation's operands into a canonical order, so that `%1 + %0` and
+// `%0 + %1` are numbered identically.
+static void canonicalize_operation(Function* func, Operation* op) {
+    switch (op->type) {
+    case ASSIGN: case NOT: case NEGATE: case COMPLEMENT: case ADDRESS: case DEREFERENCE:
+        return;
+    }
+
+    if (op->rhs.is_const || op->lhs <= op->rhs.local_id)
+        return;
+
+    uint8_t mirrored = mirror_comparison(op->type);
+    if (!is_commutative(op->type) && mirrored == op->type)
+        return;
+
+    move_reference(func->locals[op->lhs], &op->lhs, &op->rhs.local_id);
+    move_reference(func->locals[op->rhs.local_id], &op->rhs.local_id, &op->lhs);
+
+    uint64_t temp = op->lhs;
+    op->lhs = op->rhs.local_id;
+    op->rhs.local_id = temp;
+    op->type = mirrored;
+}
+
+static uint64_t hash_operation(Operation* op) {
+    // FNV-1a over each field which contributes to the result.
+    uint64_t fields[] = {op->type, op->var_type, op->lhs, op->rhs.is_const, op->rhs.const_unsigned};
+    uint64_t hash = 0xCBF29CE484222325;
+
+    switch (op->type) {
+    case ASSIGN:
+        fields[2] = 0; // `lhs` is unused by assignments.
+        break;
+    case NOT: case NEGATE: case COMPLEMENT: case ADDRESS: case DEREFERENCE:
+        fields[3] = fields[4] = 0; // `rhs` is unused by unops.
+        break;
+    }
+
+    for (size_t i = 0; i < sizeof(fields) / sizeof(*fields); i++) {
+        hash ^= fields[i];
+        hash *= 0x100000001B3;
+    }
+    return hash;
+}
+
+static bool operations_match(Operation* a, Operation* b) {
+    if (a->type != b->type || a->var_type != b->var_type)
+        return false;
+    if (a->type != ASSIGN && a->lhs != b->lhs)
+        return false;
+
+    switch (a->type) {
+    case NOT: case NEGATE: case COMPLEMENT: case ADDRESS: case DEREFERENCE:
+        return true;
+    }
+    return a->rhs.is_const == b->rhs.is_const && a->rhs.const_unsigned == b->rhs.const_unsigned;
+}
+
+static Operation* find_available(GVNState* st, Operation* op, uint64_t hash) {
+    for (size_t i = va_len(st->table); i > 0; i--) {
+        ValueEntry* entry = &st->table[i - 1];
+        if (entry->hash == hash && operations_match(entry->op, op))
+            return entry->op;
+    }
+    return NULL;
+}
+
+static void number_block(GVNState* st, size_t block) {
+    Function* func = st->func;
+    size_t scope = va_len(st->table);
+
+    for (Statement* state = func->basic_blocks[block].first; state;) {
+        Statement* this_state = state;
+        state = state->next;
+
+        if (this_state->type != OPERATION || !is_numberable((Operation*) this_state))
+            continue;
+
+        Operation* op = (Operation*) this_state;
+        canonicalize_operation(func, op);
+
+        uint64_t hash = hash_operation(op);
+        Operation* available = find_available(st, op, hash);
+
+        if (available) {
+            replace_local_uses(func, op->dest, available->dest);
+            delete_local(func, op->dest);
+            st->removed += 1;
+        } else {
+            ValueEntry entry = {hash, op};
+            va_append(st->table, entry);
+        }
+    }
+
+    for (size_t i = 0; i < va_len(st->children[block]); i++)
+        number_block(st, st->children[block][i]);
+
+    // Leaving this block's subtree; its operations no longer dominate.
+    va_header(st->table)->size = scope * sizeof(ValueEntry);
+}
+
+// Replace operations which recompute a value already available in a
+// dominating local. Returns the number of operations removed.
+size_t number_values(Function* func) {
+    GVNState st;
+    size_t block_count = va_len(func->basic_blocks);
+
+    compute_dominators(func);
+
+    st.func = func;
+    st.table = va_new(0);
+    st.removed = 0;
+    st.children = malloc(block_count * sizeof(size_t*));
+    for (size_t i = 0; i < block_count; i++)
+        st.children[i] = va_new(0);
+    for (size_t i = 1; i < block_count; i++) {
+        if (func->basic_blocks[i].idom != NO_BLOCK)
+            va_append(st.children[func->basic_blocks[i].idom], i);
+    }
+
+    number_block(&st, 0);
+
+    for (size_t i = 0; i < block_count; i++)
+        va_free(st.children[i]);
+    free(st.children);
+    va_free(st.table);
+
+    return st.removed;
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "statements.h"
+
+// Returned by block lookups which fail to find a block.
+#define NO_BLOCK SIZE_MAX
+
+size_t find_block(Function* func, const char* label);
+size_t block_successors(Function* func, size_t block, size_t successors[2]);
+size_t* reverse_postorder(Function* func);
+size_t** collect_predecessors(Function* func);
+void free_predecessors(Function* func, size_t** predecessors);
+void compute_dominators(Function* func);
+bool dominates(Function* func, size_t a, size_t b);
+bool loop_contains(Loop* loop, size_t block);
+void free_loops(Function* func);
+void find_loops(Function* func);
+void compute_loop_depths(Function* func);
+uint64_t block_weight(BasicBlock* bb);
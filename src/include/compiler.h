@@ -0,0 +1,7 @@
+#pragma once
+
+#include <stdio.h>
+
+#include "statements.h"
+
+void compile_ir(FILE** outs, Declaration** declarations);
@@ -0,0 +1,10 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include "statements.h"
+
+Declaration** link_modules(Declaration*** modules, const char** paths);
+void remove_unreachable(Declaration** decls, const char** entries);
+size_t remove_unread_globals(Declaration** decls);
+bool is_exported(Declaration** decls, Declaration* decl);
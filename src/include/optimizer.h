@@ -1,8 +1,70 @@
+#pragma once
+
+#include <stdio.h>
+
 #include "statements.h"
 
+// Weigh code size more heavily than speed when choosing how to compile
+// operations.
+extern bool optimize_size;
+// Choose where static functions take their parameters and return their results
+// to suit their callers.
+extern bool custom_conventions;
+// Turn calls whose result is returned straight away into jumps.
+extern bool tail_calls;
+// Use `jr` for jumps within its reach.
+extern bool relax_jumps;
+// Count each run of every block.
+extern bool instrument_blocks;
+// Place globals in pages and HRAM by how they are accessed.
+extern bool data_layout;
+// The HRAM budget given by -fhram-size, or NULL.
+extern const char* hram_size;
+// The ROM0 budget given by -fbank0-size, or NULL.
+extern const char* bank0_size;
+// The interrupt handler budget given by -finterrupt-cycles, or NULL.
+extern const char* interrupt_cycles;
+// Where the savings of block layout, and the data layout, are reported, or
+// NULL.
+extern FILE* layout_report;
+// The path of the profile given by -fprofile-use, or NULL.
+extern const char* profile_path;
+// The path of the symbol file given by -fprofile-symbols, or NULL.
+extern const char* profile_symbols_path;
+// Where the symbol of each block is listed, or NULL.
+extern FILE* symbol_map;
+
 void print_opt_help();
 void parse_opt_flag(const char* arg);
+void count_block_references(Function* func);
+void count_local_references(Function* func);
 void generate_local_vars(Function* func);
 void generate_basic_blocks(Function* func);
 void remove_unused_blocks(Function* func);
+void remove_unused_casts(Function* func);
+void propagate_constants(Function* func);
+void thread_jumps(Function* func);
+size_t narrow_types(Function* func);
+size_t reduce_strength(Function* func);
+size_t number_values(Function* func);
+size_t forward_memory_values(Function* func);
+void summarize_global_writes(Declaration** decls);
+size_t hoist_invariants(Function* func);
+size_t lower_counted_loops(Function* func);
+size_t unroll_loops(Function* func, size_t* budget);
+size_t unroll_hot_loops(Function* func, size_t* budget);
+void remove_dead_code(Function* func);
+size_t merge_block_tails(Function* func);
+size_t fold_identical_functions(Declaration** decls);
+size_t layout_blocks(Function* func);
+char* block_symbol(Function* func, size_t block);
+void load_profile(const char* path);
+void free_profile();
+void apply_profile(Function* func);
+void write_symbol_map(FILE* out, Function* func);
+Function** order_call_graph(Declaration** decls);
+Function** find_called_functions(Declaration** decls);
+size_t remove_uncalled_functions(Declaration** decls, Function** called);
+size_t inline_calls(Function* func, Declaration** decls);
+void convert_counter_dump(FILE* out, FILE* map, FILE* dump);
 void optimize_ir(Declaration** decls);
@@ -26,6 +26,15 @@ typedef struct RegRealloc {
     CPUReg* reg;
 } RegRealloc;
 
+// A single read of a local variable.
+typedef struct LocalUse {
+    // The index of the statement which reads the local.
+    size_t when;
+    // How often the reading block is expected to run. Heavier uses are more
+    // costly to reload after a spill.
+    uint64_t weight;
+} LocalUse;
+
 typedef struct LocalVar {
     uint8_t type;
     // VArray of pointers to any occarance in which this local is referenced.
@@ -38,9 +47,21 @@ typedef struct LocalVar {
     size_t lifetime_end;
     // The index of the last register in `registers` that this variable was placed into.
     size_t active_reg;
+    // VArray of each register the variable is placed in, in order. A NULL
+    // register means the variable has been spilled to memory.
     RegRealloc* reg_reallocs;
+    // VArray of every statement which reads this variable, in order. This is
+    // the next-use table used to choose which variable to spill.
+    LocalUse* uses;
 } LocalVar;
 
+// A set of 8-bit registers, with one bit for each.
+typedef uint8_t RegisterSet;
+#define ALL_REGISTERS 0x7F
+
+// The width of each `VariableType` in bytes.
+extern const uint8_t type_widths[];
+
 extern CPUReg a_reg;
 extern CPUReg c_reg;
 extern CPUReg b_reg;
@@ -51,7 +72,16 @@ extern CPUReg h_reg;
 extern CPUReg bc_reg;
 extern CPUReg de_reg;
 extern CPUReg hl_reg;
+extern CPUReg bcde_reg;
+extern CPUReg dehl_reg;
+extern CPUReg hlbc_reg;
 
+bool match_registers(CPUReg* reg1, CPUReg* reg2);
+RegisterSet register_set(CPUReg* reg);
+CPUReg* local_location(LocalVar* local, size_t when);
+CPUReg* local_location_before(LocalVar* local, size_t when);
+CPUReg* return_reg(uint8_t type);
+CPUReg** parameter_registers(const uint8_t* types, size_t count);
 void analyze_var_usage(struct Function* func);
 void fprint_var_usage(FILE* out, struct Function* func);
 void assign_registers(struct Function* func);
@@ -4,9 +4,14 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "gb/operations.h"
 #include "registers.h"
+#include "varray.h"
+
+// Marks a block which has no profile data.
+#define UNPROFILED UINT64_MAX
 
 enum VariableType {
     VOID,
@@ -16,6 +21,10 @@ enum VariableType {
     PTR,
 };
 
+static inline bool is_signed_type(uint8_t type) {
+    return type >= I8 && type <= I64;
+}
+
 /*
     {  "u8", 1},
     { "u16", 2},
@@ -36,7 +45,9 @@ enum StatementType {
     READ,
     WRITE,
     JUMP,
+    BRANCH,
     RETURN,
+    CALL,
     LABEL,
     END_BLOCK = -1
 };
@@ -78,6 +89,8 @@ typedef struct Declaration {
     char** traits;
     uint8_t type;
     bool is_fn; // True if this structure is part of a `Function`
+    // The input file which the declaration was read from, counted from 0.
+    unsigned module;
 } Declaration;
 
 // Five statement types.
@@ -96,12 +109,14 @@ typedef struct Read {
     uint8_t var_type;
     uint64_t dest; // Destination local variable.
     char* src;
+    Declaration* global; // NULL if the global is not declared in this file.
 } Read;
 
 typedef struct Write {
     Statement statement;
     char* dest;
     uint64_t src;
+    Declaration* global; // NULL if the global is not declared in this file.
 } Write;
 
 typedef struct Jump {
@@ -109,11 +124,35 @@ typedef struct Jump {
     char* label; // Could also be an ID or something.
 } Jump;
 
+// Jumps to `true_label` if a local is nonzero, or to `false_label` otherwise.
+// A countdown branch decrements its local in place first, which is only done
+// to a loop's private counter once every other pass is done with it.
+typedef struct Branch {
+    Statement statement;
+    uint64_t cond;
+    char* true_label;
+    char* false_label;
+    bool countdown;
+} Branch;
+
 typedef struct Return {
     Statement statement;
     Value val;
 } Return;
 
+// Calls a function, passing each argument where the ABI places the matching
+// parameter. A call whose result is discarded has a `var_type` of VOID, and
+// declares no local.
+typedef struct Call {
+    Statement statement;
+    uint8_t var_type;
+    uint64_t dest;
+    char* function;
+    // The function being called. Set once every declaration has been parsed.
+    struct Function* callee;
+    Value* args; // VArray
+} Call;
+
 typedef struct Label {
     Statement statement;
     char* identifier;
@@ -127,8 +166,30 @@ typedef struct BasicBlock {
     Statement* first;
     Statement* final;
     uint64_t ref_count;
+    // How many loops this block is nested within.
+    uint32_t loop_depth;
+    // Index of this block's immediate dominator. Only valid after calling
+    // `compute_dominators()`.
+    size_t idom;
+    // How many times the block ran according to the profile, and how many
+    // times that is per call of its function. Both are UNPROFILED when no
+    // profile is in use.
+    uint64_t profile_count;
+    uint64_t profile_weight;
 } BasicBlock;
 
+// A natural loop: a header, and every block which reaches a back edge to the
+// header without passing through it.
+typedef struct Loop {
+    size_t header;
+    // VArray of the indices of the loop's blocks, including its header.
+    size_t* blocks;
+    // The innermost loop containing this one, or NULL.
+    struct Loop* parent;
+    // VArray of the loops directly nested within this one.
+    struct Loop** children;
+} Loop;
+
 // Functions can simply be treated as read-only global variables.
 typedef struct Function {
     Declaration declaration;
@@ -138,12 +199,88 @@ typedef struct Function {
     uint8_t* parameter_types;
     BasicBlock* basic_blocks;
     LocalVar** locals;
+    // VArray of the function's loops, each listed before any loop containing
+    // it. Only valid after calling `find_loops()`.
+    Loop** loops;
+    // Whether the function may end up calling itself, directly or otherwise.
+    bool is_recursive;
+    // The registers each parameter is passed in (a VArray), and the register
+    // the result is returned in. Both are NULL until the function's calling
+    // convention is chosen. A parameter which fits in no register left over
+    // has NULL in place of one, and is written straight to the function's
+    // memory slot for it. A result too wide for any register is returned in
+    // memory, at `<function>.result`.
+    CPUReg** parameter_regs;
+    CPUReg* result_reg;
+    // The registers which a call to the function may overwrite. This is every
+    // register until the function has been compiled.
+    RegisterSet clobbers;
+    // An estimate of the most M-cycles which a call to the function takes,
+    // counting each of its loops once. Zero until the function is compiled.
+    unsigned cycles;
+    // The ROM bank which the function is placed in, where bank 0 is ROM0.
+    // Chosen once every function has been compiled.
+    unsigned bank;
+    // VArray of the globals which a call to the function may write, directly
+    // or through its callees, or NULL if it may write any of them.
+    Declaration** writes;
+    // VArray of the names of exported functions which were folded into this
+    // one, and which label the same code, or NULL if there are none.
+    char** aliases;
 } Function;
 
+// Check if a function is defined here, rather than only declared.
+static inline bool has_body(Declaration* decl) {
+    return decl->is_fn && decl->storage_class != EXTERN;
+}
+
+// Check if a declaration lists a trait, such as `inline` or `pure`.
+static inline bool has_trait(Declaration* decl, const char* trait) {
+    for (size_t i = 0; i < va_len(decl->traits); i++) {
+        if (strcmp(decl->traits[i], trait) == 0)
+            return true;
+    }
+    return false;
+}
+
+// Check if a function is an interrupt handler, which the CPU enters rather than
+// any call, and which must leave every register as it found it.
+static inline bool is_interrupt_handler(Declaration* decl) {
+    return decl->is_fn && has_trait(decl, "interrupt");
+}
+
+// Check if a global may be read or changed behind the program's back, as a
+// hardware register may. Globals which are not declared in this file are
+// assumed to be.
+static inline bool is_volatile(Declaration* global) {
+    return global == NULL || has_trait(global, "volatile");
+}
+
 Statement* iterate_statements(Function* func, Statement* statement, size_t* i, size_t* block_no);
 LocalVar* iterate_locals(Function* func, size_t* i);
 LocalVar* get_local(Function* func, size_t i);
-void fprint_statement(FILE* out, Statement* statement);
+void append_to_block(BasicBlock* bb, Statement* st);
+void remove_from_block(BasicBlock* bb, Statement* st);
+void insert_before(Statement* position, Statement* st);
+void init_block(BasicBlock* bb, char* label);
+char* new_label(Function* func, const char* prefix, const char* suffix);
+char* unique_label(Function* func, const char* base, const char* suffix);
+void update_block_parents(Function* func);
+void init_local(LocalVar** local, Statement* origin, uint8_t type);
+Operation* new_operation(Function* func, uint8_t op_type, uint8_t var_type, uint64_t lhs, Value rhs);
+uint64_t** statement_operands(Statement* statement);
+bool statement_dest(Statement* statement, uint64_t* dest);
+bool is_tail_call(Function* func, Call* call);
+Statement* copy_statement(Statement* statement);
+void replace_local_uses(Function* func, uint64_t old_id, uint64_t new_id);
+void delete_statement(Function* func, Statement* statement);
+void replace_with_jump(Function* func, Statement* statement, const char* label);
+void delete_local(Function* func, uint64_t id);
+bool is_commutative(uint8_t op_type);
+uint8_t mirror_comparison(uint8_t op_type);
+uint64_t truncate_to_type(uint8_t type, uint64_t value);
+void set_const_value(Value* val, uint8_t type, uint64_t value);
+void fprint_statement(FILE* out, uint8_t return_type, Statement* statement);
 void fprint_declaration(FILE* out, Declaration* declaration);
 void free_local_var(LocalVar* local);
 void free_statement(Statement* statement);
@@ -0,0 +1,380 @@
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "cfg.h"
+#include "optimizer.h"
+#include "gb/runtime.h"
+#include "statements.h"
+#include "varray.h"
+
+// Inlining. Every call pays for its `call` and `ret`, so calls to small
+// functions, and calls which run often, are replaced by a copy of the callee's
+// body. Functions are optimized bottom-up over the call graph, so a callee has
+// already inlined its own callees and been simplified by the time its callers
+// are considered.
+
+// A rough size of each statement, in bytes.
+#define STATEMENT_BYTES 3
+// Static functions without calls of their own, and with no more statements than
+// this, are always inlined.
+#define SMALL_FUNCTION_STATEMENTS 4
+// How many statements inlining may add to a single function.
+#define GROWTH_LIMIT 64
+
+static size_t declaration_index(Declaration** decls, Function* func) {
+    for (size_t i = 0; i < va_len(decls); i++) {
+        if (decls[i] == &func->declaration)
+            return i;
+    }
+    return SIZE_MAX;
+}
+
+static void visit_callees(Declaration** decls, bool* calls, bool* visited, size_t i, Function*** order) {
+    size_t count = va_len(decls);
+
+    visited[i] = true;
+    for (size_t j = 0; j < count; j++) {
+        if (calls[i * count + j] && !visited[j])
+            visit_callees(decls, calls, visited, j, order);
+    }
+    va_append(*order, (Function*) decls[i]);
+}
+
+// Order the functions defined in a file so that each comes after the functions
+// it calls, other than those which may call it back. Each function's
+// `is_recursive` is set along the way. Returns a new VArray.
+Function** order_call_graph(Declaration** decls) {
+    size_t count = va_len(decls);
+    bool* calls = calloc(count * count, sizeof(bool));
+    bool* reaches = malloc(count * count * sizeof(bool));
+    bool* visited = calloc(count, sizeof(bool));
+    Function** order = va_new(0);
+
+    for (size_t i = 0; i < count; i++) {
+        if (!has_body(decls[i]))
+            continue;
+        Function* func = (Function*) decls[i];
+        for (size_t j = 0; j < va_len(func->basic_blocks); j++) {
+            for (Statement* state = func->basic_blocks[j].first; state; state = state->next) {
+                if (state->type == CALL && has_body(&((Call*) state)->callee->declaration))
+                    calls[i * count + declaration_index(decls, ((Call*) state)->callee)] = true;
+            }
+        }
+    }
+
+    // Warshall's algorithm finds every function which each one may reach.
+    memcpy(reaches, calls, count * count * sizeof(bool));
+    for (size_t k = 0; k < count; k++) {
+        for (size_t i = 0; i < count; i++) {
+            if (!reaches[i * count + k])
+                continue;
+            for (size_t j = 0; j < count; j++)
+                reaches[i * count + j] |= reaches[k * count + j];
+        }
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        if (!has_body(decls[i]))
+            continue;
+        ((Function*) decls[i])->is_recursive = reaches[i * count + i];
+        if (!visited[i])
+            visit_callees(decls, calls, visited, i, &order);
+    }
+
+    free(calls);
+    free(reaches);
+    free(visited);
+    return order;
+}
+
+// Count the calls to a function throughout the file.
+static size_t count_calls(Declaration** decls, Function* callee) {
+    size_t calls = 0;
+
+    for (size_t i = 0; i < va_len(decls); i++) {
+        if (!has_body(decls[i]))
+            continue;
+        Function* func = (Function*) decls[i];
+        for (size_t j = 0; j < va_len(func->basic_blocks); j++) {
+            for (Statement* state = func->basic_blocks[j].first; state; state = state->next)
+                calls += state->type == CALL && ((Call*) state)->callee == callee;
+        }
+    }
+    return calls;
+}
+
+// Collect each function which is called from somewhere in the file.
+Function** find_called_functions(Declaration** decls) {
+    Function** called = va_new(0);
+
+    for (size_t i = 0; i < va_len(decls); i++) {
+        if (has_body(decls[i]) && count_calls(decls, (Function*) decls[i]))
+            va_append(called, (Function*) decls[i]);
+    }
+    return called;
+}
+
+// Remove static functions which were called before inlining but no longer are.
+// Functions which were never called are left alone, since they may be entry
+// points. Returns the number of functions removed.
+size_t remove_uncalled_functions(Declaration** decls, Function** called) {
+    size_t removed = 0;
+
+    for (size_t i = 0; i < va_len(called); i++) {
+        Function* func = called[i];
+        if (func->declaration.storage_class != STATIC || count_calls(decls, func))
+            continue;
+
+        va_remove(decls, declaration_index(decls, func));
+        va_remove(called, i);
+        free_declaration(&func->declaration);
+        removed++;
+        // Removing a function may leave its own callees uncalled.
+        i = SIZE_MAX;
+    }
+    return removed;
+}
+
+static size_t count_statements(Function* func, size_t* returns, bool* is_leaf) {
+    size_t statements = 0;
+
+    *returns = 0;
+    *is_leaf = true;
+    for (size_t i = 0; i < va_len(func->basic_blocks); i++) {
+        for (Statement* state = func->basic_blocks[i].first; state; state = state->next) {
+            statements++;
+            *returns += state->type == RETURN;
+            *is_leaf &= state->type != CALL;
+        }
+    }
+    return statements;
+}
+
+// Decide whether to inline a call, given how many statements inlining has
+// already added to the caller. Callees which may call back into the caller are
+// never inlined. Otherwise, the call and return which inlining saves each time
+// the call runs are weighed against the bytes of the copied body.
+static bool should_inline(Declaration** decls, Call* call, size_t growth) {
+    Function* callee = call->callee;
+    Declaration* decl = &callee->declaration;
+    size_t returns;
+    bool is_leaf;
+
+    if (!has_body(decl) || callee->is_recursive || has_trait(decl, "noninline"))
+        return false;
+    size_t size = count_statements(callee, &returns, &is_leaf);
+    // Without phis, a result can only be passed on from a single return.
+    if (call->var_type != VOID && returns != 1)
+        return false;
+
+    if (has_trait(decl, "inline"))
+        return true;
+    if (decl->storage_class == STATIC && is_leaf && size <= SMALL_FUNCTION_STATEMENTS)
+        return true;
+    // The only call to a static function takes its body along with it.
+    if (decl->storage_class == STATIC && count_calls(decls, callee) == 1)
+        return true;
+    if (growth + size > GROWTH_LIMIT)
+        return false;
+
+    uint64_t weight = block_weight(call->statement.parent);
+    return weigh_cost(size * STATEMENT_BYTES, 0, weight)
+           <= weigh_cost(CALL_BYTES, CALL_CYCLES + RET_CYCLES, weight);
+}
+
+static char* concat(const char* prefix, const char* suffix) {
+    size_t length = strlen(prefix) + strlen(suffix) + 1;
+    char* str = malloc(length);
+    snprintf(str, length, "%s%s", prefix, suffix);
+    return str;
+}
+
+// Check if any of a function's labels begin with a prefix.
+static bool uses_prefix(Function* func, const char* prefix) {
+    for (size_t i = 0; i < va_len(func->basic_blocks); i++) {
+        const char* label = func->basic_blocks[i].label;
+        if (label && strncmp(label, prefix, strlen(prefix)) == 0)
+            return true;
+    }
+    return false;
+}
+
+// Point a copied statement's locals and labels at their copies in the caller.
+static void rename_statement(Statement* statement, uint64_t* local_map, const char* prefix) {
+    uint64_t** operands = statement_operands(statement);
+    for (size_t i = 0; i < va_len(operands); i++)
+        *operands[i] = local_map[*operands[i]];
+    va_free(operands);
+
+    switch (statement->type) {
+    case OPERATION: ((Operation*) statement)->dest = local_map[((Operation*) statement)->dest]; break;
+    case READ: ((Read*) statement)->dest = local_map[((Read*) statement)->dest]; break;
+    case CALL:
+        if (((Call*) statement)->var_type != VOID)
+            ((Call*) statement)->dest = local_map[((Call*) statement)->dest];
+        break;
+    case JUMP: {
+        Jump* jmp = (Jump*) statement;
+        char* label = concat(prefix, jmp->label);
+        free(jmp->label);
+        jmp->label = label;
+    } break;
+    case BRANCH: {
+        Branch* br = (Branch*) statement;
+        char* true_label = concat(prefix, br->true_label);
+        char* false_label = concat(prefix, br->false_label);
+        free(br->true_label);
+        free(br->false_label);
+        br->true_label = true_label;
+        br->false_label = false_label;
+    } break;
+    }
+}
+
+// Replace a call with a copy of its callee's blocks, placed directly after the
+// block containing the call. The rest of that block moves to a new block, which
+// each copied return jumps to. Parameters become copies of the arguments, and
+// the result becomes a copy of the returned value. Returns the index of the
+// block which the call's block continues into.
+static size_t inline_call(Function* caller, Call* call, size_t* inline_count) {
+    Function* callee = call->callee;
+    size_t block = call->statement.parent - caller->basic_blocks;
+    size_t callee_blocks = va_len(callee->basic_blocks);
+    size_t old_count = va_len(caller->basic_blocks);
+
+    // Copied labels are prefixed with the callee's name and a number which no
+    // other label in the caller begins with.
+    char prefix[256];
+    do {
+        *inline_count += 1;
+        snprintf(prefix, sizeof(prefix), "%s_%zu_", callee->declaration.identifier, *inline_count);
+    } while (uses_prefix(caller, prefix));
+
+    // The continuation is named `return`, unless the callee uses that label.
+    char suffix[256] = "return";
+    while (find_block(callee, suffix) != NO_BLOCK && strlen(suffix) < sizeof(suffix) - 2) {
+        memmove(suffix + 1, suffix, strlen(suffix) + 1);
+        suffix[0] = '_';
+    }
+
+    uint64_t* local_map = malloc(va_len(callee->locals) * sizeof(uint64_t));
+    for (size_t i = 0; i < callee->parameter_count; i++) {
+        Value arg = call->args[i];
+        Operation* param = new_operation(caller, ASSIGN, callee->parameter_types[i], arg.is_const ? 0 : arg.local_id,
+                                         arg);
+        insert_before(&call->statement, &param->statement);
+        local_map[i] = param->dest;
+    }
+    for (size_t i = callee->parameter_count; i < va_len(callee->locals); i++) {
+        local_map[i] = va_len(caller->locals);
+        va_append(caller->locals, (LocalVar*) NULL);
+    }
+
+    BasicBlock* blocks = va_new((old_count + callee_blocks + 1) * sizeof(BasicBlock));
+    for (size_t i = 0; i <= block; i++)
+        blocks[i] = caller->basic_blocks[i];
+    for (size_t i = block + 1; i < old_count; i++)
+        blocks[i + callee_blocks + 1] = caller->basic_blocks[i];
+
+    BasicBlock* split = &blocks[block];
+    BasicBlock* rest = &blocks[block + callee_blocks + 1];
+    init_block(rest, new_label(caller, prefix, suffix));
+    rest->profile_count = split->profile_count;
+    rest->profile_weight = split->profile_weight;
+    while (call->statement.next) {
+        Statement* state = call->statement.next;
+        remove_from_block(split, state);
+        append_to_block(rest, state);
+    }
+
+    for (size_t i = 0; i < callee_blocks; i++) {
+        BasicBlock* source = &callee->basic_blocks[i];
+        BasicBlock* copy = &blocks[block + 1 + i];
+
+        init_block(copy, new_label(caller, prefix, source->label ? source->label : ""));
+        for (Statement* state = source->first; state; state = state->next) {
+            Statement* new_state;
+
+            if (state->type == RETURN) {
+                Return* ret = (Return*) state;
+                if (call->var_type != VOID) {
+                    Value val = ret->val;
+                    if (!val.is_const)
+                        val.local_id = local_map[val.local_id];
+                    Operation* result = calloc(1, sizeof(Operation));
+                    result->statement.type = OPERATION;
+                    result->type = ASSIGN;
+                    result->var_type = call->var_type;
+                    result->dest = call->dest;
+                    result->lhs = val.is_const ? 0 : val.local_id;
+                    result->rhs = val;
+                    va_append(caller->statements, &result->statement);
+                    append_to_block(copy, &result->statement);
+                    caller->locals[call->dest]->origin = &result->statement;
+                }
+                Jump* jmp = malloc(sizeof(Jump));
+                jmp->statement.type = JUMP;
+                jmp->label = concat(prefix, suffix);
+                new_state = &jmp->statement;
+            } else {
+                uint64_t dest;
+                bool has_dest = statement_dest(state, &dest);
+                new_state = copy_statement(state);
+                rename_statement(new_state, local_map, prefix);
+                if (has_dest)
+                    init_local(&caller->locals[local_map[dest]], new_state, get_local(callee, dest)->type);
+            }
+            va_append(caller->statements, new_state);
+            append_to_block(copy, new_state);
+        }
+    }
+
+    // The call itself is left to be freed with the caller's other statements.
+    remove_from_block(split, &call->statement);
+    Jump* enter = malloc(sizeof(Jump));
+    enter->statement.type = JUMP;
+    enter->label = concat(prefix, callee->basic_blocks[0].label ? callee->basic_blocks[0].label : "");
+    va_append(caller->statements, &enter->statement);
+    append_to_block(split, &enter->statement);
+
+    va_free(caller->basic_blocks);
+    caller->basic_blocks = blocks;
+    update_block_parents(caller);
+    free(local_map);
+    return block + callee_blocks + 1;
+}
+
+// Inline the calls in a function which are worth inlining. The blocks copied
+// in by each call are not searched again, since their calls were already
+// passed over when the callee was optimized. Returns the number of calls
+// inlined.
+size_t inline_calls(Function* func, Declaration** decls) {
+    size_t inlined = 0;
+    size_t growth = 0;
+    size_t inline_count = 0;
+
+    compute_loop_depths(func);
+    apply_profile(func);
+    for (size_t i = 0; i < va_len(func->basic_blocks); i++) {
+        for (Statement* state = func->basic_blocks[i].first; state; state = state->next) {
+            if (state->type != CALL || !should_inline(decls, (Call*) state, growth))
+                continue;
+
+            size_t returns;
+            bool is_leaf;
+            growth += count_statements(((Call*) state)->callee, &returns, &is_leaf);
+            // Continue with the rest of the block, in its new home.
+            i = inline_call(func, (Call*) state, &inline_count) - 1;
+            inlined++;
+            break;
+        }
+    }
+
+    if (inlined) {
+        count_block_references(func);
+        count_local_references(func);
+    }
+    return inlined;
+}
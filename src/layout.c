@@ -0,0 +1,317 @@
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "cfg.h"
+#include "optimizer.h"
+#include "statements.h"
+#include "varray.h"
+
+// Block layout. Blocks are emitted in order, and a jump to the very next block
+// is left out, so placing each block's likeliest successor directly after it
+// saves both the jump's bytes and its cycles. Blocks are first joined into
+// chains along their heaviest edges, following Pettis and Hansen, and the
+// chains are then placed one after another.
+
+// The speed of `jp` and `jp cc`, in M-cycles.
+#define JUMP_CYCLES 4
+#define BRANCH_TAKEN_CYCLES 4
+#define BRANCH_NOT_TAKEN_CYCLES 3
+
+// Branch probabilities are estimated in eighths.
+#define PROBABILITY_SCALE 8
+#define LIKELY_PROBABILITY 7
+
+// Where the layout report is written, or NULL.
+FILE* layout_report = NULL;
+
+typedef struct Edge {
+    size_t from;
+    size_t to;
+    // How often the edge is taken per call, in eighths.
+    uint64_t weight;
+} Edge;
+
+// Estimate how likely each side of a block's exit is to be taken, in eighths.
+// With a profile, each side is as likely as it was to run. Otherwise, staying
+// within a loop is assumed to be likely.
+static void estimate_probabilities(Function* func, size_t block, size_t successors[2], size_t count,
+                                   unsigned probabilities[2]) {
+    if (count < 2) {
+        probabilities[0] = PROBABILITY_SCALE;
+        return;
+    }
+
+    uint64_t count0 = func->basic_blocks[successors[0]].profile_count;
+    uint64_t count1 = func->basic_blocks[successors[1]].profile_count;
+    if (count0 != UNPROFILED && count1 != UNPROFILED && count0 + count1 > 0) {
+        probabilities[0] = (count0 * PROBABILITY_SCALE + (count0 + count1) / 2) / (count0 + count1);
+        probabilities[1] = PROBABILITY_SCALE - probabilities[0];
+        return;
+    }
+
+    uint32_t depth0 = func->basic_blocks[successors[0]].loop_depth;
+    uint32_t depth1 = func->basic_blocks[successors[1]].loop_depth;
+    size_t likely = SIZE_MAX;
+
+    if (depth0 != depth1)
+        likely = depth0 > depth1 ? 0 : 1;
+    else if (dominates(func, successors[0], block))
+        likely = 0;
+    else if (dominates(func, successors[1], block))
+        likely = 1;
+
+    if (likely == SIZE_MAX) {
+        probabilities[0] = probabilities[1] = PROBABILITY_SCALE / 2;
+    } else {
+        probabilities[likely] = LIKELY_PROBABILITY;
+        probabilities[!likely] = PROBABILITY_SCALE - LIKELY_PROBABILITY;
+    }
+}
+
+// Collect every edge in the function, with its estimated weight.
+static Edge* collect_edges(Function* func) {
+    Edge* edges = va_new(0);
+
+    for (size_t i = 0; i < va_len(func->basic_blocks); i++) {
+        size_t successors[2];
+        unsigned probabilities[2];
+        size_t count = block_successors(func, i, successors);
+
+        estimate_probabilities(func, i, successors, count, probabilities);
+        for (size_t j = 0; j < count; j++) {
+            Edge edge = {i, successors[j], block_weight(&func->basic_blocks[i]) * probabilities[j]};
+            va_append(edges, edge);
+        }
+    }
+    return edges;
+}
+
+static uint64_t edge_weight(Edge* edges, size_t from, size_t to) {
+    for (size_t i = 0; i < va_len(edges); i++) {
+        if (edges[i].from == from && edges[i].to == to)
+            return edges[i].weight;
+    }
+    return 0;
+}
+
+// Estimate the cycles spent jumping between blocks if they were placed in a
+// given order, in eighths per call, and count the jumps which would be emitted.
+// This mirrors how the compiler emits jumps and branches.
+static uint64_t layout_cost(Function* func, Edge* edges, size_t* order, size_t* jumps) {
+    size_t block_count = va_len(func->basic_blocks);
+    uint64_t cost = 0;
+
+    *jumps = 0;
+    for (size_t i = 0; i < block_count; i++) {
+        size_t block = order[i];
+        size_t next = i + 1 < block_count ? order[i + 1] : NO_BLOCK;
+        size_t successors[2];
+        size_t count = block_successors(func, block, successors);
+
+        if (count == 1 && successors[0] != next) {
+            *jumps += 1;
+            cost += edge_weight(edges, block, successors[0]) * JUMP_CYCLES;
+        } else if (count == 2) {
+            uint64_t first = edge_weight(edges, block, successors[0]);
+            uint64_t second = edge_weight(edges, block, successors[1]);
+
+            if (successors[0] == next || successors[1] == next) {
+                uint64_t fallen = successors[0] == next ? first : second;
+                uint64_t taken = successors[0] == next ? second : first;
+                *jumps += 1;
+                cost += taken * BRANCH_TAKEN_CYCLES + fallen * BRANCH_NOT_TAKEN_CYCLES;
+            } else {
+                // The false side is reached by a `jp` after the `jp cc`.
+                *jumps += 2;
+                cost += first * BRANCH_TAKEN_CYCLES + second * (BRANCH_NOT_TAKEN_CYCLES + JUMP_CYCLES);
+            }
+        }
+    }
+    return cost;
+}
+
+static int compare_edges(const void* a, const void* b) {
+    const Edge* x = a;
+    const Edge* y = b;
+
+    if (x->weight != y->weight)
+        return x->weight > y->weight ? -1 : 1;
+    // Prefer keeping the source order between equally weighted edges.
+    if (x->from != y->from)
+        return x->from < y->from ? -1 : 1;
+    return x->to < y->to ? -1 : x->to > y->to;
+}
+
+static size_t chain_head(size_t* prev, size_t block) {
+    while (prev[block] != NO_BLOCK)
+        block = prev[block];
+    return block;
+}
+
+// Check if every block in a chain may be placed, which is when its immediate
+// dominator has been placed already or comes earlier in the same chain.
+static bool is_chain_ready(Function* func, size_t* next, bool* placed, size_t head) {
+    for (size_t block = head; block != NO_BLOCK; block = next[block]) {
+        size_t idom = func->basic_blocks[block].idom;
+        if (idom == NO_BLOCK || idom == block || placed[idom])
+            continue;
+
+        bool earlier = false;
+        for (size_t other = head; other != block; other = next[other])
+            earlier |= other == idom;
+        if (!earlier)
+            return false;
+    }
+    return true;
+}
+
+// Choose an order for the blocks, returned as a new VArray of block indices.
+static size_t* choose_layout(Function* func, Edge* edges) {
+    size_t block_count = va_len(func->basic_blocks);
+    size_t* next = malloc(block_count * sizeof(size_t));
+    size_t* prev = malloc(block_count * sizeof(size_t));
+    bool* placed = calloc(block_count, sizeof(bool));
+    Edge* sorted = va_new(va_size(edges));
+    size_t* order = va_new(0);
+
+    for (size_t i = 0; i < block_count; i++)
+        next[i] = prev[i] = NO_BLOCK;
+    memcpy(sorted, edges, va_size(edges));
+    qsort(sorted, va_len(sorted), sizeof(Edge), compare_edges);
+
+    // Join blocks into chains along their heaviest edges. The entry must begin
+    // its chain, and back edges are never joined, so that every loop's header
+    // stays ahead of its body.
+    for (size_t i = 0; i < va_len(sorted); i++) {
+        size_t from = sorted[i].from;
+        size_t to = sorted[i].to;
+
+        if (to == 0 || next[from] != NO_BLOCK || prev[to] != NO_BLOCK
+            || chain_head(prev, from) == to || dominates(func, to, from))
+            continue;
+        next[from] = to;
+        prev[to] = from;
+    }
+
+    // Place the entry's chain first, followed by whichever chain is most
+    // heavily jumped to from the blocks placed so far.
+    for (size_t head = 0; head != NO_BLOCK;) {
+        for (size_t block = head; block != NO_BLOCK; block = next[block]) {
+            va_append(order, block);
+            placed[block] = true;
+        }
+
+        size_t best = NO_BLOCK;
+        uint64_t best_weight = 0;
+        for (size_t i = 0; i < block_count; i++) {
+            if (placed[i] || prev[i] != NO_BLOCK || !is_chain_ready(func, next, placed, i))
+                continue;
+
+            uint64_t weight = 0;
+            for (size_t j = 0; j < va_len(edges); j++) {
+                if (edges[j].to == i && placed[edges[j].from])
+                    weight += edges[j].weight;
+            }
+            if (best == NO_BLOCK || weight > best_weight) {
+                best = i;
+                best_weight = weight;
+            }
+        }
+        // Any remaining chains are unreachable, and their order is unimportant.
+        for (size_t i = 0; best == NO_BLOCK && i < block_count; i++) {
+            if (!placed[i] && prev[i] == NO_BLOCK)
+                best = i;
+        }
+        head = best;
+    }
+
+    free(next);
+    free(prev);
+    free(placed);
+    va_free(sorted);
+    return order;
+}
+
+// Check that each reachable block is placed after its immediate dominator,
+// which the register allocator relies on.
+static bool respects_dominators(Function* func, size_t* order) {
+    size_t block_count = va_len(func->basic_blocks);
+    size_t* position = malloc(block_count * sizeof(size_t));
+    bool valid = true;
+
+    for (size_t i = 0; i < block_count; i++)
+        position[order[i]] = i;
+    for (size_t i = 1; valid && i < block_count; i++) {
+        size_t idom = func->basic_blocks[i].idom;
+        if (idom != NO_BLOCK && position[idom] >= position[i])
+            valid = false;
+    }
+
+    free(position);
+    return valid;
+}
+
+// Reorder a function's blocks so that jumps become fallthroughs, inverting
+// branches where that lets the likelier side fall through. The new order is only
+// kept if it needs no more jumps and is estimated to be no slower, unless the
+// source order places a block before its dominator. Returns the number of jumps
+// removed.
+size_t layout_blocks(Function* func) {
+    size_t block_count = va_len(func->basic_blocks);
+    if (block_count < 2)
+        return 0;
+
+    compute_loop_depths(func);
+    Edge* edges = collect_edges(func);
+    size_t* source_order = malloc(block_count * sizeof(size_t));
+    for (size_t i = 0; i < block_count; i++)
+        source_order[i] = i;
+    size_t* order = choose_layout(func, edges);
+
+    size_t old_jumps, new_jumps;
+    uint64_t old_cost = layout_cost(func, edges, source_order, &old_jumps);
+    uint64_t new_cost = 0;
+    bool improved = respects_dominators(func, order);
+    if (improved) {
+        // A source order which the register allocator can not handle is
+        // replaced regardless of cost.
+        new_cost = layout_cost(func, edges, order, &new_jumps);
+        improved = !respects_dominators(func, source_order)
+                   || (new_jumps <= old_jumps && new_cost <= old_cost
+                       && (new_jumps < old_jumps || new_cost < old_cost));
+    }
+
+    if (improved) {
+        BasicBlock* blocks = va_new(va_size(func->basic_blocks));
+        size_t* position = malloc(block_count * sizeof(size_t));
+        for (size_t i = 0; i < block_count; i++) {
+            blocks[i] = func->basic_blocks[order[i]];
+            position[order[i]] = i;
+        }
+        for (size_t i = 0; i < block_count; i++) {
+            if (blocks[i].idom != NO_BLOCK)
+                blocks[i].idom = position[blocks[i].idom];
+        }
+        va_free(func->basic_blocks);
+        func->basic_blocks = blocks;
+        update_block_parents(func);
+        free(position);
+    } else {
+        new_jumps = old_jumps;
+        new_cost = old_cost;
+    }
+
+    size_t removed = new_jumps < old_jumps ? old_jumps - new_jumps : 0;
+    if (layout_report) {
+        fprintf(layout_report, "%s: %zu of %zu jumps removed, saving an estimated %" PRId64 " cycles per call\n",
+                func->declaration.identifier, removed, old_jumps,
+                ((int64_t) old_cost - (int64_t) new_cost) / PROBABILITY_SCALE);
+    }
+
+    free(source_order);
+    va_free(order);
+    va_free(edges);
+    return removed;
+}
@@ -0,0 +1,364 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "exception.h"
+#include "link.h"
+#include "parser.h"
+#include "statements.h"
+#include "varray.h"
+
+// Whole-program linking. Each input file is parsed on its own, and their
+// declarations are then merged into one program, as though every input had
+// been a single file. An extern declaration of a symbol which another input
+// exports is replaced by that definition, so calls and globals reach across
+// files, and every pass sees the callee's body and the global's accesses.
+//
+// Static symbols may share a name with those of another input. Since passes
+// and the backend look symbols up by name, such statics are renamed apart.
+//
+// Given the entry points which code outside the program uses, anything they
+// can not reach is removed, and exported symbols which they do not name are
+// made static. Each input still has its own output, which exports anything
+// another output uses.
+
+// Returned by lookups of declarations which are not found.
+#define NO_DECLARATION SIZE_MAX
+
+// The path of each input file, by module.
+static const char** module_paths = NULL;
+
+// Find the declaration which a statement calls, reads or writes, if any.
+static Declaration* referenced_declaration(Statement* statement) {
+    switch (statement->type) {
+    case CALL: return &((Call*) statement)->callee->declaration;
+    case READ: return ((Read*) statement)->global;
+    case WRITE: return ((Write*) statement)->global;
+    }
+    return NULL;
+}
+
+// Find the name by which a statement calls, reads or writes a symbol, if any.
+static char** referenced_name(Statement* statement) {
+    switch (statement->type) {
+    case CALL: return &((Call*) statement)->function;
+    case READ: return &((Read*) statement)->src;
+    case WRITE: return &((Write*) statement)->dest;
+    }
+    return NULL;
+}
+
+static size_t find_declaration(Declaration** decls, const char* identifier) {
+    for (size_t i = 0; i < va_len(decls); i++) {
+        if (strequ(decls[i]->identifier, identifier))
+            return i;
+    }
+    return NO_DECLARATION;
+}
+
+// Send every call, read and write of one declaration to another.
+static void redirect_references(Declaration** decls, Declaration* from, Declaration* to) {
+    for (size_t i = 0; i < va_len(decls); i++) {
+        if (!has_body(decls[i]))
+            continue;
+        Function* func = (Function*) decls[i];
+        for (size_t j = 0; j < va_len(func->basic_blocks); j++) {
+            for (Statement* state = func->basic_blocks[j].first; state; state = state->next) {
+                if (referenced_declaration(state) != from)
+                    continue;
+                if (state->type == CALL)
+                    ((Call*) state)->callee = (Function*) to;
+                else if (state->type == READ)
+                    ((Read*) state)->global = to;
+                else
+                    ((Write*) state)->global = to;
+            }
+        }
+    }
+}
+
+// Give a declaration a new name, along with every statement which refers to it.
+static void rename_declaration(Declaration** decls, Declaration* decl, const char* identifier) {
+    for (size_t i = 0; i < va_len(decls); i++) {
+        if (!has_body(decls[i]))
+            continue;
+        Function* func = (Function*) decls[i];
+        for (size_t j = 0; j < va_len(func->basic_blocks); j++) {
+            for (Statement* state = func->basic_blocks[j].first; state; state = state->next) {
+                if (referenced_declaration(state) != decl)
+                    continue;
+                char** name = referenced_name(state);
+                free(*name);
+                *name = strdup(identifier);
+            }
+        }
+    }
+    free(decl->identifier);
+    decl->identifier = strdup(identifier);
+}
+
+// Check that an extern declaration matches the symbol which it is resolved to.
+static void check_signature(Declaration* decl, Declaration* target) {
+    if (decl->is_fn != target->is_fn) {
+        error("\"%s\" is declared as a %s in %s, but as a %s in %s.", decl->identifier,
+              decl->is_fn ? "function" : "variable", module_paths[decl->module],
+              target->is_fn ? "function" : "variable", module_paths[target->module]);
+        return;
+    }
+
+    if (is_interrupt_handler(target) && !is_interrupt_handler(decl)) {
+        error("\"%s\" is declared as a function in %s, but is an interrupt handler in %s.", decl->identifier,
+              module_paths[decl->module], module_paths[target->module]);
+        return;
+    }
+
+    bool matches = type_widths[decl->type] == type_widths[target->type];
+    if (decl->is_fn) {
+        Function* func = (Function*) decl;
+        Function* other = (Function*) target;
+        matches &= func->parameter_count == other->parameter_count;
+        for (size_t i = 0; matches && i < func->parameter_count; i++)
+            matches &= type_widths[func->parameter_types[i]] == type_widths[other->parameter_types[i]];
+    }
+    if (!matches)
+        error("\"%s\" is declared with a different type in %s than in %s.", decl->identifier,
+              module_paths[decl->module], module_paths[target->module]);
+}
+
+// Find what an extern declaration refers to: the definition which another input
+// exports, or else the first extern declaration of the same symbol.
+static Declaration* resolve_extern(Declaration** decls, size_t index) {
+    Declaration* decl = decls[index];
+    Declaration* first = NULL;
+
+    for (size_t i = 0; i < va_len(decls); i++) {
+        if (i == index || !strequ(decls[i]->identifier, decl->identifier))
+            continue;
+        if (decls[i]->storage_class == EXPORT)
+            return decls[i];
+        if (decls[i]->storage_class == EXTERN && i < index && first == NULL)
+            first = decls[i];
+    }
+    return first;
+}
+
+// Check if a static declaration must be renamed, because a symbol of another
+// input is already known by its name.
+static bool is_name_taken(Declaration** decls, size_t index) {
+    Declaration* decl = decls[index];
+
+    for (size_t i = 0; i < va_len(decls); i++) {
+        if (decls[i]->module != decl->module && strequ(decls[i]->identifier, decl->identifier)
+            && (decls[i]->storage_class != STATIC || i < index))
+            return true;
+    }
+    return false;
+}
+
+// Merge the declarations of each input file into one program, given a VArray
+// of each file's declarations, which are consumed, and each file's path.
+// Returns a new VArray.
+Declaration** link_modules(Declaration*** modules, const char** paths) {
+    Declaration** decls = va_new(0);
+
+    module_paths = paths;
+    for (size_t i = 0; i < va_len(modules); i++) {
+        for (size_t j = 0; j < va_len(modules[i]); j++) {
+            modules[i][j]->module = i;
+            va_append(decls, modules[i][j]);
+        }
+        va_free(modules[i]);
+    }
+
+    for (size_t i = 0; i < va_len(decls); i++) {
+        if (decls[i]->storage_class != EXPORT)
+            continue;
+        for (size_t j = 0; j < i; j++) {
+            if (decls[j]->storage_class == EXPORT && strequ(decls[i]->identifier, decls[j]->identifier))
+                error("\"%s\" is exported by both %s and %s.", decls[i]->identifier,
+                      module_paths[decls[j]->module], module_paths[decls[i]->module]);
+        }
+    }
+
+    for (size_t i = 0; i < va_len(decls); i++) {
+        if (decls[i]->storage_class != EXTERN)
+            continue;
+        Declaration* target = resolve_extern(decls, i);
+        if (target == NULL)
+            continue;
+        Declaration* decl = decls[i];
+        check_signature(decl, target);
+        redirect_references(decls, decl, target);
+        va_remove(decls, i);
+        free_declaration(decl);
+        i -= 1; // Handle the change in size by offsetting i.
+    }
+
+    for (size_t i = 0; i < va_len(decls); i++) {
+        if (decls[i]->storage_class != STATIC || !is_name_taken(decls, i))
+            continue;
+        char identifier[256];
+        for (unsigned n = decls[i]->module;; n++) {
+            snprintf(identifier, sizeof(identifier), "%s_%u", decls[i]->identifier, n);
+            if (find_declaration(decls, identifier) == NO_DECLARATION)
+                break;
+        }
+        rename_declaration(decls, decls[i], identifier);
+    }
+    return decls;
+}
+
+// Remove the declarations which are not marked, keeping the order of the rest.
+static void remove_unmarked(Declaration** decls, bool* marked) {
+    size_t kept = 0;
+
+    for (size_t i = 0; i < va_len(decls); i++) {
+        if (marked[i])
+            decls[kept++] = decls[i];
+        else
+            free_declaration(decls[i]);
+    }
+    va_header(decls)->size = kept * sizeof(Declaration*);
+}
+
+// Remove everything which the entry points do not reach through calls, reads
+// and writes, and make static any export which is not an entry point. Volatile
+// globals are always kept, since they may be used behind the program's back,
+// and interrupt handlers are entry points of their own, since the vectors
+// which jump to them are written elsewhere. Without any entry points, nothing
+// is known to be unreachable.
+void remove_unreachable(Declaration** decls, const char** entries) {
+    if (va_len(entries) == 0)
+        return;
+
+    size_t count = va_len(decls);
+    bool* reached = calloc(count + 1, sizeof(bool));
+    bool* entry = calloc(count + 1, sizeof(bool));
+    size_t* worklist = va_new(0);
+
+    for (size_t i = 0; i < va_len(entries); i++) {
+        size_t index = find_declaration(decls, entries[i]);
+        if (index == NO_DECLARATION || decls[index]->storage_class == EXTERN) {
+            error("Entry point \"%s\" is not defined by any input.", entries[i]);
+            continue;
+        }
+        entry[index] = true;
+        va_append(worklist, index);
+    }
+    for (size_t i = 0; i < count; i++) {
+        if (decls[i]->storage_class == EXTERN)
+            continue;
+        if (is_interrupt_handler(decls[i]) && !entry[i]) {
+            entry[i] = true;
+            va_append(worklist, i);
+        } else if (!decls[i]->is_fn && has_trait(decls[i], "volatile")) {
+            va_append(worklist, i);
+        }
+    }
+
+    while (va_len(worklist)) {
+        size_t index = va_last(worklist);
+        va_remove(worklist, va_len(worklist) - 1);
+        if (reached[index])
+            continue;
+        reached[index] = true;
+        if (!has_body(decls[index]))
+            continue;
+
+        Function* func = (Function*) decls[index];
+        for (size_t j = 0; j < va_len(func->basic_blocks); j++) {
+            for (Statement* state = func->basic_blocks[j].first; state; state = state->next) {
+                Declaration* decl = referenced_declaration(state);
+                for (size_t k = 0; decl && k < count; k++) {
+                    if (decls[k] == decl && !reached[k])
+                        va_append(worklist, k);
+                }
+            }
+        }
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        if (reached[i] && !entry[i] && decls[i]->storage_class == EXPORT)
+            decls[i]->storage_class = STATIC;
+    }
+    remove_unmarked(decls, reached);
+
+    free(reached);
+    free(entry);
+    va_free(worklist);
+}
+
+// Remove static globals which are never read, along with every write to them.
+// Returns the number of globals removed.
+size_t remove_unread_globals(Declaration** decls) {
+    size_t count = va_len(decls);
+    bool* read = calloc(count + 1, sizeof(bool));
+    size_t removed = 0;
+
+    for (size_t i = 0; i < count; i++)
+        read[i] = decls[i]->is_fn || decls[i]->storage_class != STATIC || has_trait(decls[i], "volatile");
+    for (size_t i = 0; i < count; i++) {
+        if (!has_body(decls[i]))
+            continue;
+        Function* func = (Function*) decls[i];
+        for (size_t j = 0; j < va_len(func->basic_blocks); j++) {
+            for (Statement* state = func->basic_blocks[j].first; state; state = state->next) {
+                for (size_t k = 0; state->type == READ && k < count; k++)
+                    read[k] |= decls[k] == ((Read*) state)->global;
+            }
+        }
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        if (!has_body(decls[i]))
+            continue;
+        Function* func = (Function*) decls[i];
+        for (size_t j = 0; j < va_len(func->basic_blocks); j++) {
+            for (Statement* state = func->basic_blocks[j].first; state;) {
+                Statement* this_state = state;
+                state = state->next;
+                if (this_state->type != WRITE || ((Write*) this_state)->global == NULL)
+                    continue;
+                for (size_t k = 0; k < count; k++) {
+                    if (!read[k] && decls[k] == ((Write*) this_state)->global) {
+                        delete_statement(func, this_state);
+                        break;
+                    }
+                }
+            }
+        }
+    }
+
+    for (size_t i = 0; i < count; i++)
+        removed += !read[i];
+    remove_unmarked(decls, read);
+    free(read);
+    return removed;
+}
+
+// Check if a declaration is called, read or written by a function of another
+// input.
+static bool is_used_across_modules(Declaration** decls, Declaration* decl) {
+    for (size_t i = 0; i < va_len(decls); i++) {
+        if (!has_body(decls[i]) || decls[i]->module == decl->module)
+            continue;
+        Function* func = (Function*) decls[i];
+        for (size_t j = 0; j < va_len(func->basic_blocks); j++) {
+            for (Statement* state = func->basic_blocks[j].first; state; state = state->next) {
+                if (referenced_declaration(state) == decl)
+                    return true;
+            }
+        }
+    }
+    return false;
+}
+
+// Check if a symbol must be exported from the output of its input, because the
+// program exports it, or because another input's output uses it.
+bool is_exported(Declaration** decls, Declaration* decl) {
+    return decl->storage_class == EXPORT || (decl->storage_class == STATIC && is_used_across_modules(decls, decl));
+}
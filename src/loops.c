@@ -0,0 +1,1073 @@
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "cfg.h"
+#include "gb/runtime.h"
+#include "optimizer.h"
+#include "parser.h"
+#include "statements.h"
+#include "varray.h"
+
+// Loop optimizations. Every loop is first given a preheader: a block which
+// runs once before the loop is entered, through which every entering edge
+// passes. Work which gives the same result on each iteration is moved there,
+// and so is the setup of a counter for loops whose trip count is known on
+// entry. Short loops are copied out, within a budget of bytes for each
+// function. Inner loops are always handled before the loops containing them,
+// so that whatever leaves an inner loop may leave the outer one as well.
+
+// Locals hold their values across iterations only through globals. A global
+// which is read at the top of a loop and written back once per iteration, one
+// step away from what was read, is an induction variable.
+typedef struct InductionVar {
+    Read* read;
+    Write* write;
+    // Either 1 or -1.
+    int step;
+} InductionVar;
+
+// A branch at the top of a loop which stays in the loop while an induction
+// variable compares a certain way against a bound.
+typedef struct ExitTest {
+    Branch* branch;
+    bool stay_on_true;
+    InductionVar iv;
+    uint8_t test;
+    // Either a constant, or a local set before the loop.
+    Value bound;
+} ExitTest;
+
+static size_t block_index(Function* func, Statement* statement) {
+    return statement->parent - func->basic_blocks;
+}
+
+// Check if a local's value is set outside of a loop. Parameters are set before
+// any block.
+static bool is_defined_outside(Function* func, Loop* loop, uint64_t id) {
+    Statement* origin = func->locals[id]->origin;
+    return origin == NULL || !loop_contains(loop, block_index(func, origin));
+}
+
+// Find a loop's preheader. Returns NO_BLOCK if it has none.
+static size_t find_preheader(Function* func, Loop* loop, size_t** predecessors) {
+    size_t* preds = predecessors[loop->header];
+    size_t preheader = NO_BLOCK;
+
+    for (size_t i = 0; i < va_len(preds); i++) {
+        if (loop_contains(loop, preds[i]))
+            continue;
+        if (preheader != NO_BLOCK)
+            return NO_BLOCK;
+        preheader = preds[i];
+    }
+
+    size_t successors[2];
+    if (preheader == NO_BLOCK || block_successors(func, preheader, successors) != 1)
+        return NO_BLOCK;
+    return preheader;
+}
+
+static void replace_label(char** label, const char* to) {
+    char* copy = malloc(strlen(to) + 1);
+    strcpy(copy, to);
+    free(*label);
+    *label = copy;
+}
+
+// Send a block's jumps to one label to another instead.
+static void retarget_block(BasicBlock* block, const char* from, const char* to) {
+    Statement* final = block->final;
+    if (final == NULL)
+        return;
+    if (final->type == JUMP && strequ(((Jump*) final)->label, from)) {
+        replace_label(&((Jump*) final)->label, to);
+    } else if (final->type == BRANCH) {
+        if (strequ(((Branch*) final)->true_label, from))
+            replace_label(&((Branch*) final)->true_label, to);
+        if (strequ(((Branch*) final)->false_label, from))
+            replace_label(&((Branch*) final)->false_label, to);
+    }
+}
+
+// Add a block before a loop's header which jumps to it, and send every edge
+// entering the loop there instead.
+static void insert_preheader(Function* func, Loop* loop) {
+    size_t header = loop->header;
+    char* header_label = func->basic_blocks[header].label;
+    char* label = unique_label(func, header_label, "_preheader");
+
+    for (size_t i = 0; i < va_len(func->basic_blocks); i++) {
+        if (!loop_contains(loop, i))
+            retarget_block(&func->basic_blocks[i], header_label, label);
+    }
+
+    Jump* jmp = malloc(sizeof(Jump));
+    jmp->statement.type = JUMP;
+    jmp->label = malloc(strlen(header_label) + 1);
+    strcpy(jmp->label, header_label);
+    va_append(func->statements, &jmp->statement);
+
+    // The preheader is placed directly before the header, so that it falls
+    // through even if blocks are never reordered.
+    va_expand(&func->basic_blocks, sizeof(BasicBlock));
+    memmove(&func->basic_blocks[header + 1], &func->basic_blocks[header],
+            (va_len(func->basic_blocks) - 1 - header) * sizeof(BasicBlock));
+    init_block(&func->basic_blocks[header], label);
+    append_to_block(&func->basic_blocks[header], &jmp->statement);
+    update_block_parents(func);
+}
+
+// Give every loop a preheader, and find the loops again afterwards. A loop
+// headed by the function's entry is left without one, since nothing enters it
+// through an edge.
+static void insert_preheaders(Function* func) {
+    for (bool changed = true; changed;) {
+        changed = false;
+        find_loops(func);
+        size_t** predecessors = collect_predecessors(func);
+        Loop* loop = NULL;
+
+        for (size_t i = 0; i < va_len(func->loops) && loop == NULL; i++) {
+            if (func->loops[i]->header != 0 && find_preheader(func, func->loops[i], predecessors) == NO_BLOCK)
+                loop = func->loops[i];
+        }
+        free_predecessors(func, predecessors);
+
+        // Adding a block moves the others, so the loops are found again.
+        if (loop) {
+            insert_preheader(func, loop);
+            changed = true;
+        }
+    }
+    count_block_references(func);
+}
+
+/*
+ * Loop-invariant code motion
+ */
+
+// Check if an operation's result depends on nothing but its operands.
+// Dereferences read memory, which the loop may change.
+static bool is_pure(Operation* op) {
+    return op->type != DEREFERENCE;
+}
+
+// Constants cost as much to load as they would to keep, so they are only moved
+// along with an operation which reads them.
+static bool is_constant_assignment(Operation* op) {
+    return op->type == ASSIGN && op->rhs.is_const;
+}
+
+static void hoist(Function* func, Statement* statement, BasicBlock* preheader) {
+    remove_from_block(statement->parent, statement);
+    insert_before(preheader->final, statement);
+}
+
+// Move the invariant operations of a loop to its preheader, along with any
+// constants they read. Returns the number of operations moved.
+static size_t hoist_loop_invariants(Function* func, Loop* loop, size_t preheader, size_t* order) {
+    BasicBlock* pre = &func->basic_blocks[preheader];
+    bool* invariant = calloc(va_len(func->locals), sizeof(bool));
+    size_t hoisted = 0;
+
+    for (size_t i = 0; i < va_len(func->locals); i++)
+        invariant[i] = func->locals[i] && is_defined_outside(func, loop, i);
+
+    // Reverse postorder visits each definition before its uses.
+    for (size_t i = 0; i < va_len(order); i++) {
+        if (!loop_contains(loop, order[i]))
+            continue;
+
+        for (Statement* state = func->basic_blocks[order[i]].first; state;) {
+            Statement* this_state = state;
+            state = state->next;
+            if (this_state->type != OPERATION || !is_pure((Operation*) this_state))
+                continue;
+
+            Operation* op = (Operation*) this_state;
+            uint64_t** operands = statement_operands(this_state);
+            bool is_invariant = true;
+            for (size_t j = 0; j < va_len(operands); j++)
+                is_invariant &= invariant[*operands[j]];
+
+            if (is_invariant) {
+                invariant[op->dest] = true;
+                if (!is_constant_assignment(op)) {
+                    for (size_t j = 0; j < va_len(operands); j++) {
+                        if (!is_defined_outside(func, loop, *operands[j]))
+                            hoist(func, func->locals[*operands[j]]->origin, pre);
+                    }
+                    hoist(func, this_state, pre);
+                    hoisted++;
+                }
+            }
+            va_free(operands);
+        }
+    }
+
+    free(invariant);
+    return hoisted;
+}
+
+// Move operations which give the same result on every iteration of a loop to
+// before the loop. Returns the number of operations moved.
+size_t hoist_invariants(Function* func) {
+    size_t hoisted = 0;
+
+    insert_preheaders(func);
+    size_t** predecessors = collect_predecessors(func);
+    size_t* order = reverse_postorder(func);
+
+    for (size_t i = 0; i < va_len(func->loops); i++) {
+        size_t preheader = find_preheader(func, func->loops[i], predecessors);
+        if (preheader != NO_BLOCK)
+            hoisted += hoist_loop_invariants(func, func->loops[i], preheader, order);
+    }
+
+    va_free(order);
+    free_predecessors(func, predecessors);
+    return hoisted;
+}
+
+/*
+ * Counted loops
+ */
+
+// Check if a local is read from a global at the top of a loop, which the loop
+// then steps by one exactly once per iteration.
+static bool find_induction_variable(Function* func, Loop* loop, uint64_t id, size_t** predecessors,
+                                    InductionVar* iv) {
+    Statement* origin = func->locals[id]->origin;
+    if (origin == NULL || origin->type != READ || block_index(func, origin) != loop->header)
+        return false;
+
+    Read* read = (Read*) origin;
+    if ((read->var_type != U8 && read->var_type != U16) || is_volatile(read->global))
+        return false;
+
+    // A call could change the global behind the loop's back.
+    Write* write = NULL;
+    for (size_t i = 0; i < va_len(loop->blocks); i++) {
+        for (Statement* state = func->basic_blocks[loop->blocks[i]].first; state; state = state->next) {
+            if (state->type == CALL)
+                return false;
+            if (state->type == WRITE && strequ(((Write*) state)->dest, read->src)) {
+                if (write)
+                    return false;
+                write = (Write*) state;
+            }
+        }
+    }
+    if (write == NULL)
+        return false;
+
+    Statement* step_origin = func->locals[write->src]->origin;
+    if (step_origin == NULL || step_origin->type != OPERATION)
+        return false;
+    Operation* step = (Operation*) step_origin;
+    if ((step->type != ADD && step->type != SUB) || step->lhs != id || !step->rhs.is_const
+        || step->var_type != read->var_type)
+        return false;
+
+    uint64_t amount = step->type == ADD ? step->rhs.const_unsigned : -step->rhs.const_unsigned;
+    amount = truncate_to_type(read->var_type, amount);
+    if (amount == 1)
+        iv->step = 1;
+    else if (amount == truncate_to_type(read->var_type, -1))
+        iv->step = -1;
+    else
+        return false;
+
+    // The write must happen once on every path around the loop, after the
+    // read, and outside of any inner loop.
+    size_t write_block = block_index(func, &write->statement);
+    for (size_t i = 0; i < va_len(loop->children); i++) {
+        if (loop_contains(loop->children[i], write_block))
+            return false;
+    }
+    for (size_t i = 0; i < va_len(predecessors[loop->header]); i++) {
+        size_t latch = predecessors[loop->header][i];
+        if (loop_contains(loop, latch) && !dominates(func, write_block, latch))
+            return false;
+    }
+    if (write_block == loop->header) {
+        Statement* state = &read->statement;
+        while (state && state != &write->statement)
+            state = state->next;
+        if (state == NULL)
+            return false;
+    }
+
+    iv->read = read;
+    iv->write = write;
+    return true;
+}
+
+static Value const_value(uint64_t value) {
+    return (Value) {.is_const = true, .const_unsigned = value};
+}
+
+static Value local_value(uint64_t id) {
+    return (Value) {.is_const = false, .local_id = id};
+}
+
+// Get a local as a constant if it is assigned one.
+static Value known_value(Function* func, uint64_t id) {
+    Statement* origin = func->locals[id]->origin;
+    if (origin && origin->type == OPERATION && is_constant_assignment((Operation*) origin))
+        return ((Operation*) origin)->rhs;
+    return local_value(id);
+}
+
+// Find the value of a global as a loop is entered, from its last write in the
+// preheader if there is one. Otherwise, if `may_read` is set, it is read at the
+// end of the preheader. Returns false if the value was not found.
+static bool entry_value(Function* func, BasicBlock* preheader, Read* read, bool may_read, Value* value) {
+    for (Statement* state = preheader->final; state; state = state->last) {
+        if (state->type == CALL)
+            break;
+        if (state->type == WRITE && strequ(((Write*) state)->dest, read->src)) {
+            *value = known_value(func, ((Write*) state)->src);
+            return true;
+        }
+    }
+    if (!may_read)
+        return false;
+
+    Read* entry = malloc(sizeof(Read));
+    entry->statement.type = READ;
+    entry->var_type = read->var_type;
+    entry->dest = va_len(func->locals);
+    entry->src = malloc(strlen(read->src) + 1);
+    strcpy(entry->src, read->src);
+    entry->global = read->global;
+    va_append(func->statements, &entry->statement);
+    va_append(func->locals, (LocalVar*) NULL);
+    init_local(&func->locals[entry->dest], &entry->statement, read->var_type);
+    insert_before(preheader->final, &entry->statement);
+    *value = local_value(entry->dest);
+    return true;
+}
+
+// Add an operation to the end of a preheader, unless both of its operands are
+// constant, in which case its result is returned directly. Only the handful of
+// operations which trip counts are made of are supported.
+static Value emit_operation(Function* func, BasicBlock* preheader, uint8_t op_type, uint8_t type, Value lhs,
+                            Value rhs) {
+    if (lhs.is_const && (rhs.is_const || op_type == NEGATE)) {
+        uint64_t result = 0;
+        switch (op_type) {
+        case ADD: result = lhs.const_unsigned + rhs.const_unsigned; break;
+        case SUB: result = lhs.const_unsigned - rhs.const_unsigned; break;
+        case B_AND: result = lhs.const_unsigned & rhs.const_unsigned; break;
+        case RSH: result = lhs.const_unsigned >> rhs.const_unsigned; break;
+        case GREATER: result = lhs.const_unsigned > rhs.const_unsigned; break;
+        case NEGATE: result = -lhs.const_unsigned; break;
+        }
+        return const_value(truncate_to_type(op_type == GREATER ? U8 : type, result));
+    }
+    if ((op_type == ADD || op_type == SUB) && rhs.is_const && rhs.const_unsigned == 0)
+        return lhs;
+
+    // Only the right operand may be constant.
+    if (lhs.is_const && is_commutative(op_type)) {
+        Value temp = lhs;
+        lhs = rhs;
+        rhs = temp;
+    } else if (lhs.is_const && op_type == GREATER) {
+        Value temp = lhs;
+        lhs = rhs;
+        rhs = temp;
+        op_type = LESS;
+    } else if (lhs.is_const) {
+        Operation* load = new_operation(func, ASSIGN, type, 0, lhs);
+        insert_before(preheader->final, &load->statement);
+        lhs = local_value(load->dest);
+    }
+
+    Operation* op = new_operation(func, op_type, op_type == GREATER || op_type == LESS ? U8 : type, lhs.local_id,
+                                  rhs);
+    insert_before(preheader->final, &op->statement);
+    return local_value(op->dest);
+}
+
+// Set up a countdown counter for a number of trips at the end of a preheader.
+// The counter is always a new local, since it is changed in place.
+static uint64_t emit_counter(Function* func, BasicBlock* preheader, Value trips) {
+    if (!trips.is_const)
+        return emit_operation(func, preheader, ADD, U8, trips, const_value(1)).local_id;
+
+    Operation* load = new_operation(func, ASSIGN, U8, 0, const_value(truncate_to_type(U8, trips.const_unsigned + 1)));
+    insert_before(preheader->final, &load->statement);
+    return load->dest;
+}
+
+// Flip a comparison, so that it holds exactly when the original does not.
+static uint8_t invert_comparison(uint8_t op_type) {
+    switch (op_type) {
+    case LESS: return GREATER_EQU;
+    case GREATER: return LESS_EQU;
+    case LESS_EQU: return GREATER;
+    case GREATER_EQU: return LESS;
+    case NOT_EQU: return EQU;
+    case EQU: return NOT_EQU;
+    }
+    return op_type;
+}
+
+// Find the test at the top of a loop which decides whether to leave it, if the
+// test compares an induction variable against a bound which the loop does not
+// change. The test is given as the comparison under which the loop continues.
+static bool find_exit_test(Function* func, Loop* loop, size_t** predecessors, ExitTest* exit_test) {
+    BasicBlock* header = &func->basic_blocks[loop->header];
+    if (header->final->type != BRANCH || ((Branch*) header->final)->countdown)
+        return false;
+
+    Branch* br = (Branch*) header->final;
+    bool stay_on_true = loop_contains(loop, find_block(func, br->true_label));
+    if (stay_on_true == loop_contains(loop, find_block(func, br->false_label)))
+        return false;
+
+    Statement* origin = func->locals[br->cond]->origin;
+    if (origin == NULL || origin->type != OPERATION)
+        return false;
+    Operation* cmp = (Operation*) origin;
+    if (cmp->type < LESS || cmp->type > EQU)
+        return false;
+
+    exit_test->test = cmp->type;
+    if (find_induction_variable(func, loop, cmp->lhs, predecessors, &exit_test->iv)) {
+        exit_test->bound = cmp->rhs;
+    } else if (!cmp->rhs.is_const
+               && find_induction_variable(func, loop, cmp->rhs.local_id, predecessors, &exit_test->iv)) {
+        exit_test->bound = local_value(cmp->lhs);
+        exit_test->test = mirror_comparison(exit_test->test);
+    } else {
+        return false;
+    }
+    if (!stay_on_true)
+        exit_test->test = invert_comparison(exit_test->test);
+
+    // A negative constant would make the comparison signed.
+    Value* bound = &exit_test->bound;
+    if (bound->is_const && bound->is_signed)
+        return false;
+    if (!bound->is_const) {
+        if (!is_defined_outside(func, loop, bound->local_id)
+            || func->locals[bound->local_id]->type != exit_test->iv.read->var_type)
+            return false;
+        *bound = known_value(func, bound->local_id);
+    }
+
+    exit_test->branch = br;
+    exit_test->stay_on_true = stay_on_true;
+    return true;
+}
+
+// Replace the exit test at the top of a loop with a countdown. The counter
+// starts at one more than the trip count, and is
+// decremented before each iteration, so that it reaches zero as the test would
+// have failed. An 8-bit counter covers up to 255 iterations, since a starting
+// value of 256 wraps to zero.
+static bool lower_counted_loop(Function* func, Loop* loop, size_t** predecessors) {
+    ExitTest exit_test;
+    if (!find_exit_test(func, loop, predecessors, &exit_test))
+        return false;
+
+    // Without an exact step, only tests which stop as the variable passes the
+    // bound can be counted.
+    InductionVar iv = exit_test.iv;
+    uint8_t test = exit_test.test;
+    Value bound = exit_test.bound;
+    if (test != NOT_EQU && !(test == LESS && iv.step == 1) && !(test == GREATER && iv.step == -1))
+        return false;
+
+    uint8_t type = iv.read->var_type;
+    size_t preheader_index = find_preheader(func, loop, predecessors);
+    if (preheader_index == NO_BLOCK)
+        return false;
+    BasicBlock* preheader = &func->basic_blocks[preheader_index];
+
+    // A 16-bit variable may need more iterations than the counter can hold,
+    // so its trip count must be known here.
+    Value entry;
+    if (type != U8 && !bound.is_const)
+        return false;
+    if (!entry_value(func, preheader, iv.read, type == U8, &entry) || (type != U8 && !entry.is_const))
+        return false;
+
+    Value high = iv.step == 1 ? bound : entry;
+    Value low = iv.step == 1 ? entry : bound;
+    Value trips = emit_operation(func, preheader, SUB, type, high, low);
+    if (test != NOT_EQU && !(low.is_const && low.const_unsigned == 0)) {
+        // The test fails straight away if the variable starts past the bound.
+        Value enters = emit_operation(func, preheader, GREATER, type, high, low);
+        Value mask = emit_operation(func, preheader, NEGATE, type, enters, const_value(0));
+        trips = emit_operation(func, preheader, B_AND, type, trips, mask);
+    }
+    if (trips.is_const && trips.const_unsigned > UINT8_MAX)
+        return false;
+
+    Branch* br = exit_test.branch;
+    br->cond = emit_counter(func, preheader, trips);
+    br->countdown = true;
+    if (!exit_test.stay_on_true) {
+        char* temp = br->true_label;
+        br->true_label = br->false_label;
+        br->false_label = temp;
+    }
+    return true;
+}
+
+// Count down loops whose trip count is known on entry in a register, instead
+// of testing the loop's condition on each iteration. The counter is changed in
+// place, so this must follow every pass which may copy or reuse a local.
+// Returns the number of loops changed.
+size_t lower_counted_loops(Function* func) {
+    size_t lowered = 0;
+
+    insert_preheaders(func);
+    size_t** predecessors = collect_predecessors(func);
+    for (size_t i = 0; i < va_len(func->loops); i++)
+        lowered += lower_counted_loop(func, func->loops[i], predecessors);
+    free_predecessors(func, predecessors);
+
+    count_local_references(func);
+    return lowered;
+}
+
+/*
+ * Unrolling
+ */
+
+// The most iterations a loop may have to be unrolled completely.
+#define MAX_UNROLLED_TRIPS 16
+// How many times a loop's header must run per call of its function, according
+// to the profile, for the loop to be unrolled partially.
+#define HOT_LOOP_WEIGHT 16
+// Rough sizes of the statements which are not compiled to a single CpuOp. Reads
+// and writes move each byte through `a`.
+#define LOAD_BYTES 3
+#define ASSIGN_BYTES 2
+#define JUMP_BYTES 3
+#define BRANCH_BYTES 5
+// The code which divides a counter between a partially unrolled loop and the
+// loop which runs the remaining iterations.
+#define SPLIT_BYTES 12
+
+// One copy of a loop's blocks.
+typedef struct LoopCopy {
+    // The index of each block which is copied, and the label of its copy.
+    size_t* members;
+    char** labels;
+    size_t count;
+    // Where jumps back to the header go instead.
+    const char* next;
+} LoopCopy;
+
+// Estimate the size of a statement once compiled, from the smallest CpuOp
+// which may implement it.
+static size_t statement_bytes(Function* func, Statement* statement) {
+    switch (statement->type) {
+    case OPERATION: {
+        Operation* op = (Operation*) statement;
+        uint8_t width = type_widths[op->var_type];
+        if ((op->type >= LESS && op->type <= EQU) || op->type == NOT)
+            width = type_widths[func->locals[op->lhs]->type];
+
+        size_t bytes = estimate_operation_bytes(op->type, width, op->rhs.is_const, op->rhs.const_unsigned);
+        if (bytes)
+            return bytes;
+        if (op->type == MUL || op->type == DIV || op->type == MOD)
+            return CALL_BYTES;
+        return width * ASSIGN_BYTES;
+    }
+    case READ: return type_widths[((Read*) statement)->var_type] * LOAD_BYTES;
+    case WRITE: return type_widths[func->locals[((Write*) statement)->src]->type] * LOAD_BYTES;
+    case JUMP: return JUMP_BYTES;
+    case BRANCH: return BRANCH_BYTES;
+    case CALL: return CALL_BYTES;
+    }
+    return 0;
+}
+
+// Estimate the size of one iteration of a loop, without the header's test,
+// which unrolling removes.
+static size_t iteration_bytes(Function* func, Loop* loop) {
+    size_t bytes = 0;
+
+    for (size_t i = 0; i < va_len(loop->blocks); i++) {
+        BasicBlock* block = &func->basic_blocks[loop->blocks[i]];
+        for (Statement* state = block->first; state; state = state->next) {
+            if (loop->blocks[i] != loop->header || state != block->final)
+                bytes += statement_bytes(func, state);
+        }
+    }
+    return bytes;
+}
+
+// Check if a loop can be copied whole: it contains no other loop, and is only
+// left from its header, so that the code after it only sees locals from the
+// header's final run.
+static bool is_unrollable(Function* func, Loop* loop) {
+    if (va_len(loop->children) || loop->header == 0)
+        return false;
+
+    for (size_t i = 0; i < va_len(loop->blocks); i++) {
+        size_t successors[2];
+        size_t count = block_successors(func, loop->blocks[i], successors);
+        for (size_t j = 0; j < count && loop->blocks[i] != loop->header; j++) {
+            if (!loop_contains(loop, successors[j]))
+                return false;
+        }
+    }
+
+    for (size_t i = 0; i < va_len(func->basic_blocks); i++) {
+        if (loop_contains(loop, i))
+            continue;
+        for (Statement* state = func->basic_blocks[i].first; state; state = state->next) {
+            uint64_t** operands = statement_operands(state);
+            bool is_outside = true;
+            for (size_t j = 0; j < va_len(operands); j++) {
+                Statement* origin = func->locals[*operands[j]]->origin;
+                is_outside &= origin == NULL || !loop_contains(loop, block_index(func, origin))
+                              || block_index(func, origin) == loop->header;
+            }
+            va_free(operands);
+            if (!is_outside)
+                return false;
+        }
+    }
+    return true;
+}
+
+// List a loop's blocks in the order they are placed.
+static size_t* ordered_blocks(Function* func, Loop* loop) {
+    size_t* members = va_new(0);
+
+    for (size_t i = 0; i < va_len(func->basic_blocks); i++) {
+        if (loop_contains(loop, i))
+            va_append(members, i);
+    }
+    return members;
+}
+
+// Label each block of one copy of a loop, given the label of the header's copy.
+static LoopCopy name_copy(Function* func, Loop* loop, size_t* members, size_t copy, char* header_label) {
+    LoopCopy result = {.members = members, .labels = malloc(va_len(members) * sizeof(char*)),
+                       .count = va_len(members)};
+    char suffix[32];
+    snprintf(suffix, sizeof(suffix), "_%zu", copy);
+
+    for (size_t i = 0; i < result.count; i++) {
+        if (members[i] == loop->header)
+            result.labels[i] = header_label;
+        else
+            result.labels[i] = unique_label(func, func->basic_blocks[members[i]].label, suffix);
+    }
+    return result;
+}
+
+// Find where a jump in a copy of a loop goes. Jumps within the loop stay in the
+// same copy, except those to the header.
+static const char* copied_target(Function* func, Loop* loop, LoopCopy* copy, const char* label) {
+    size_t block = find_block(func, label);
+
+    if (block == loop->header)
+        return copy->next;
+    for (size_t i = 0; i < copy->count; i++) {
+        if (copy->members[i] == block)
+            return copy->labels[i];
+    }
+    return label;
+}
+
+// Append a copy of a loop's blocks to a VArray of blocks. The copy of the
+// header's test jumps straight to where the loop continues, or if `leave` is
+// set, to where it is left. Every local set within the loop is given a new one,
+// recorded in `local_map`. If `constant_read` is set, its copy loads `constant`
+// instead of reading memory.
+static void copy_loop(Function* func, Loop* loop, LoopCopy* copy, bool leave, Read* constant_read, uint64_t constant,
+                      uint64_t* local_map, BasicBlock** blocks) {
+    for (size_t i = 0; i < copy->count; i++) {
+        for (Statement* state = func->basic_blocks[copy->members[i]].first; state; state = state->next) {
+            uint64_t dest;
+            if (statement_dest(state, &dest)) {
+                local_map[dest] = va_len(func->locals);
+                va_append(func->locals, (LocalVar*) NULL);
+            }
+        }
+    }
+
+    for (size_t i = 0; i < copy->count; i++) {
+        BasicBlock* source = &func->basic_blocks[copy->members[i]];
+        va_expand(blocks, sizeof(BasicBlock));
+        BasicBlock* bb = &va_last(*blocks);
+        init_block(bb, copy->labels[i]);
+        bb->profile_count = source->profile_count;
+        bb->profile_weight = source->profile_weight;
+
+        for (Statement* state = source->first; state; state = state->next) {
+            Statement* new_state;
+            uint64_t dest;
+
+            if (copy->members[i] == loop->header && state == source->final) {
+                Branch* br = (Branch*) state;
+                bool stay_on_true = loop_contains(loop, find_block(func, br->true_label));
+                Jump* jmp = malloc(sizeof(Jump));
+                jmp->statement.type = JUMP;
+                jmp->label = NULL;
+                replace_label(&jmp->label,
+                              copied_target(func, loop, copy, stay_on_true != leave ? br->true_label : br->false_label));
+                new_state = &jmp->statement;
+            } else if (constant_read && state == &constant_read->statement) {
+                Operation* load = calloc(1, sizeof(Operation));
+                load->statement.type = OPERATION;
+                load->type = ASSIGN;
+                load->var_type = constant_read->var_type;
+                load->dest = local_map[constant_read->dest];
+                load->rhs = const_value(constant);
+                new_state = &load->statement;
+                init_local(&func->locals[load->dest], new_state, load->var_type);
+            } else {
+                new_state = copy_statement(state);
+                uint64_t** operands = statement_operands(new_state);
+                for (size_t j = 0; j < va_len(operands); j++)
+                    *operands[j] = local_map[*operands[j]];
+                va_free(operands);
+
+                switch (new_state->type) {
+                case OPERATION: ((Operation*) new_state)->dest = local_map[((Operation*) new_state)->dest]; break;
+                case READ: ((Read*) new_state)->dest = local_map[((Read*) new_state)->dest]; break;
+                case JUMP:
+                    replace_label(&((Jump*) new_state)->label,
+                                  copied_target(func, loop, copy, ((Jump*) new_state)->label));
+                    break;
+                case BRANCH: {
+                    Branch* br = (Branch*) new_state;
+                    replace_label(&br->true_label, copied_target(func, loop, copy, br->true_label));
+                    replace_label(&br->false_label, copied_target(func, loop, copy, br->false_label));
+                } break;
+                }
+                if (statement_dest(state, &dest))
+                    init_local(&func->locals[local_map[dest]], new_state, func->locals[dest]->type);
+            }
+            va_append(func->statements, new_state);
+            append_to_block(bb, new_state);
+        }
+    }
+}
+
+// Drop the locals set within a loop which is about to be replaced.
+static void free_loop_locals(Function* func, Loop* loop) {
+    for (size_t i = 0; i < va_len(loop->blocks); i++) {
+        for (Statement* state = func->basic_blocks[loop->blocks[i]].first; state; state = state->next) {
+            uint64_t dest;
+            if (!statement_dest(state, &dest))
+                continue;
+            free_local_var(func->locals[dest]);
+            func->locals[dest] = NULL;
+        }
+    }
+}
+
+// Replace a loop's blocks with new ones, placed where the loop began.
+static void replace_loop(Function* func, Loop* loop, BasicBlock* replacement) {
+    size_t* members = ordered_blocks(func, loop);
+    BasicBlock* blocks = va_new(0);
+
+    for (size_t i = 0; i < va_len(func->basic_blocks); i++) {
+        if (i == members[0]) {
+            for (size_t j = 0; j < va_len(replacement); j++)
+                va_append(blocks, replacement[j]);
+        }
+        if (!loop_contains(loop, i))
+            va_append(blocks, func->basic_blocks[i]);
+    }
+
+    va_free(func->basic_blocks);
+    func->basic_blocks = blocks;
+    update_block_parents(func);
+    va_free(members);
+}
+
+// Check if a comparison holds between two unsigned values.
+static bool compare(uint8_t op_type, uint64_t lhs, uint64_t rhs) {
+    switch (op_type) {
+    case LESS: return lhs < rhs;
+    case GREATER: return lhs > rhs;
+    case LESS_EQU: return lhs <= rhs;
+    case GREATER_EQU: return lhs >= rhs;
+    case NOT_EQU: return lhs != rhs;
+    case EQU: return lhs == rhs;
+    }
+    return false;
+}
+
+// Find the value of a loop's induction variable at the top of each iteration,
+// if the loop runs a constant number of times which is small enough to unroll
+// completely. Returns the number of iterations, or SIZE_MAX if there are too
+// many or they are not known.
+static size_t count_trips(Function* func, Loop* loop, size_t preheader, ExitTest* exit_test, uint64_t* values) {
+    Value entry;
+    if (!exit_test->bound.is_const
+        || !entry_value(func, &func->basic_blocks[preheader], exit_test->iv.read, false, &entry) || !entry.is_const)
+        return SIZE_MAX;
+
+    uint8_t type = exit_test->iv.read->var_type;
+    size_t trips = 0;
+    values[0] = truncate_to_type(type, entry.const_unsigned);
+    while (compare(exit_test->test, values[trips], exit_test->bound.const_unsigned)) {
+        if (trips == MAX_UNROLLED_TRIPS)
+            return SIZE_MAX;
+        values[trips + 1] = truncate_to_type(type, values[trips] + exit_test->iv.step);
+        trips++;
+    }
+    return trips;
+}
+
+// Replace a loop with a copy of its blocks for each iteration, followed by a
+// copy of its header which leaves. The induction variable is known in each
+// copy, so constant propagation can simplify them afterwards.
+static void unroll_completely(Function* func, Loop* loop, size_t preheader, Read* iv_read, uint64_t* values,
+                              size_t trips) {
+    size_t* members = ordered_blocks(func, loop);
+    size_t local_count = va_len(func->locals);
+    uint64_t* local_map = malloc(local_count * sizeof(uint64_t));
+    char** header_labels = malloc((trips + 1) * sizeof(char*));
+    const char* header_label = func->basic_blocks[loop->header].label;
+    BasicBlock* copies = va_new(0);
+
+    for (size_t i = 0; i < local_count; i++)
+        local_map[i] = i;
+    for (size_t i = 0; i <= trips; i++) {
+        char suffix[32];
+        snprintf(suffix, sizeof(suffix), "_%zu", i);
+        header_labels[i] = unique_label(func, header_label, suffix);
+    }
+
+    for (size_t i = 0; i < trips; i++) {
+        LoopCopy copy = name_copy(func, loop, members, i, header_labels[i]);
+        copy.next = header_labels[i + 1];
+        copy_loop(func, loop, &copy, false, iv_read, values[i], local_map, &copies);
+        free(copy.labels);
+    }
+    LoopCopy last = {.members = &loop->header, .labels = &header_labels[trips], .count = 1};
+    copy_loop(func, loop, &last, true, iv_read, values[trips], local_map, &copies);
+
+    // The code after the loop uses the header's locals from the last copy.
+    for (size_t i = 0; i < va_len(func->basic_blocks); i++) {
+        if (loop_contains(loop, i))
+            continue;
+        for (Statement* state = func->basic_blocks[i].first; state; state = state->next) {
+            uint64_t** operands = statement_operands(state);
+            for (size_t j = 0; j < va_len(operands); j++) {
+                if (*operands[j] < local_count)
+                    *operands[j] = local_map[*operands[j]];
+            }
+            va_free(operands);
+        }
+    }
+
+    retarget_block(&func->basic_blocks[preheader], header_label, header_labels[0]);
+    free_loop_locals(func, loop);
+    replace_loop(func, loop, copies);
+
+    va_free(copies);
+    va_free(members);
+    free(header_labels);
+    free(local_map);
+}
+
+// Completely unroll loops which run a small, constant number of times, as long
+// as the function grows by no more than `budget` bytes. The budget is reduced
+// by the estimated growth. Returns the number of loops unrolled.
+size_t unroll_loops(Function* func, size_t* budget) {
+    size_t unrolled = 0;
+
+    for (bool changed = true; changed;) {
+        changed = false;
+        insert_preheaders(func);
+        size_t** predecessors = collect_predecessors(func);
+
+        Loop* loop = NULL;
+        size_t preheader = NO_BLOCK;
+        ExitTest exit_test;
+        uint64_t values[MAX_UNROLLED_TRIPS + 1];
+        size_t trips = 0;
+        for (size_t i = 0; i < va_len(func->loops) && loop == NULL; i++) {
+            Loop* candidate = func->loops[i];
+            if (!is_unrollable(func, candidate) || !find_exit_test(func, candidate, predecessors, &exit_test))
+                continue;
+            preheader = find_preheader(func, candidate, predecessors);
+            if (preheader == NO_BLOCK)
+                continue;
+            trips = count_trips(func, candidate, preheader, &exit_test, values);
+            if (trips == SIZE_MAX)
+                continue;
+
+            // Each copy of the header's test and jump folds away.
+            size_t iteration = iteration_bytes(func, candidate);
+            size_t header = 0;
+            BasicBlock* header_block = &func->basic_blocks[candidate->header];
+            for (Statement* state = header_block->first; state != header_block->final; state = state->next)
+                header += statement_bytes(func, state);
+            size_t size = trips * iteration + header;
+            size_t growth = size > iteration + BRANCH_BYTES ? size - (iteration + BRANCH_BYTES) : 0;
+            if (growth > *budget)
+                continue;
+
+            *budget -= growth;
+            loop = candidate;
+        }
+        free_predecessors(func, predecessors);
+
+        if (loop) {
+            unroll_completely(func, loop, preheader, exit_test.iv.read, values, trips);
+            count_block_references(func);
+            count_local_references(func);
+            unrolled++;
+            changed = true;
+        }
+    }
+    return unrolled;
+}
+
+// Check if a loop has been marked as hot, either by the profile or by its
+// function's `hot` trait.
+static bool is_hot(Function* func, Loop* loop) {
+    uint64_t weight = func->basic_blocks[loop->header].profile_weight;
+    return has_trait(&func->declaration, "hot") || (weight != UNPROFILED && weight >= HOT_LOOP_WEIGHT);
+}
+
+// Unroll a counted loop by a factor of 2, 4 or 8. The counter is divided
+// between a new loop which runs `factor` iterations for each countdown, and the
+// original loop, which runs whatever remains. The new loop runs the header's
+// statements before each of its copies of the body, and the original loop runs
+// them one final time as it leaves.
+static void unroll_partially(Function* func, Loop* loop, size_t preheader, size_t factor) {
+    BasicBlock* pre = &func->basic_blocks[preheader];
+    Branch* br = (Branch*) func->basic_blocks[loop->header].final;
+    const char* header_label = func->basic_blocks[loop->header].label;
+
+    size_t shift = factor == 8 ? 3 : factor == 4 ? 2 : 1;
+    // The counter was set to one more than the trip count, which is reused if
+    // it is still around.
+    Value trips;
+    Statement* origin = func->locals[br->cond]->origin;
+    Operation* add = origin && origin->type == OPERATION ? (Operation*) origin : NULL;
+    if (add && add->type == ADD && add->rhs.is_const && add->rhs.const_unsigned == 1
+        && func->locals[add->lhs]->type == U8)
+        trips = local_value(add->lhs);
+    else
+        trips = emit_operation(func, pre, SUB, U8, known_value(func, br->cond), const_value(1));
+    Value quotient = emit_operation(func, pre, RSH, U8, trips, const_value(shift));
+    Value remainder = emit_operation(func, pre, B_AND, U8, trips, const_value(factor - 1));
+    uint64_t counter = emit_counter(func, pre, quotient);
+    br->cond = emit_counter(func, pre, remainder);
+
+    size_t* members = ordered_blocks(func, loop);
+    size_t local_count = va_len(func->locals);
+    uint64_t* local_map = malloc(local_count * sizeof(uint64_t));
+    char** header_labels = malloc(factor * sizeof(char*));
+    BasicBlock* copies = va_new(0);
+
+    for (size_t i = 0; i < local_count; i++)
+        local_map[i] = i;
+    for (size_t i = 0; i < factor; i++) {
+        char suffix[32];
+        snprintf(suffix, sizeof(suffix), "_%zu", i);
+        header_labels[i] = unique_label(func, header_label, suffix);
+    }
+
+    Branch* countdown = malloc(sizeof(Branch));
+    countdown->statement.type = BRANCH;
+    countdown->cond = counter;
+    countdown->true_label = NULL;
+    countdown->false_label = NULL;
+    countdown->countdown = true;
+    replace_label(&countdown->true_label, header_labels[0]);
+    replace_label(&countdown->false_label, header_label);
+    va_append(func->statements, &countdown->statement);
+
+    va_expand(&copies, sizeof(BasicBlock));
+    char* top_label = unique_label(func, header_label, "_unrolled");
+    init_block(&copies[0], top_label);
+    copies[0].profile_count = func->basic_blocks[loop->header].profile_count;
+    copies[0].profile_weight = func->basic_blocks[loop->header].profile_weight;
+    append_to_block(&copies[0], &countdown->statement);
+
+    for (size_t i = 0; i < factor; i++) {
+        LoopCopy copy = name_copy(func, loop, members, i, header_labels[i]);
+        copy.next = i + 1 < factor ? header_labels[i + 1] : top_label;
+        copy_loop(func, loop, &copy, false, NULL, 0, local_map, &copies);
+        free(copy.labels);
+    }
+
+    // The original loop follows the new one, and keeps its blocks.
+    for (size_t i = 0; i < va_len(members); i++)
+        va_append(copies, func->basic_blocks[members[i]]);
+    retarget_block(pre, header_label, top_label);
+    replace_loop(func, loop, copies);
+
+    va_free(copies);
+    va_free(members);
+    free(header_labels);
+    free(local_map);
+}
+
+// Partially unroll the counted loops which are hot, as long as the function
+// grows by no more than `budget` bytes. The budget is reduced by the estimated
+// growth. This must follow `lower_counted_loops()`. Returns the number of loops
+// unrolled.
+size_t unroll_hot_loops(Function* func, size_t* budget) {
+    size_t unrolled = 0;
+
+    // The loops are found again after each is unrolled, so they are first
+    // picked out by their headers' labels. The new loops are never picked.
+    find_loops(func);
+    const char** headers = va_new(0);
+    for (size_t i = 0; i < va_len(func->loops); i++) {
+        Loop* loop = func->loops[i];
+        Statement* final = func->basic_blocks[loop->header].final;
+        if (final->type == BRANCH && ((Branch*) final)->countdown && is_hot(func, loop)
+            && is_unrollable(func, loop))
+            va_append(headers, func->basic_blocks[loop->header].label);
+    }
+
+    for (size_t i = 0; i < va_len(headers); i++) {
+        find_loops(func);
+        size_t** predecessors = collect_predecessors(func);
+        size_t header = find_block(func, headers[i]);
+        Loop* loop = NULL;
+        for (size_t j = 0; j < va_len(func->loops); j++) {
+            if (func->loops[j]->header == header)
+                loop = func->loops[j];
+        }
+        size_t preheader = loop ? find_preheader(func, loop, predecessors) : NO_BLOCK;
+        free_predecessors(func, predecessors);
+        if (preheader == NO_BLOCK)
+            continue;
+
+        // A counter known here leaves fewer iterations than a larger factor.
+        Value count = known_value(func, ((Branch*) func->basic_blocks[header].final)->cond);
+        uint64_t trips = count.is_const ? truncate_to_type(U8, count.const_unsigned - 1) : UINT8_MAX;
+        size_t iteration = iteration_bytes(func, loop);
+        size_t factor = 8;
+        while (factor > 1 && (factor > trips || factor * iteration + BRANCH_BYTES + SPLIT_BYTES > *budget))
+            factor /= 2;
+        if (factor == 1)
+            continue;
+
+        *budget -= factor * iteration + BRANCH_BYTES + SPLIT_BYTES;
+        unroll_partially(func, loop, preheader, factor);
+        unrolled++;
+    }
+
+    va_free(headers);
+    if (unrolled) {
+        count_block_references(func);
+        count_local_references(func);
+    }
+    return unrolled;
+}
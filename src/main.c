@@ -6,6 +6,7 @@
 
 #include "compiler.h"
 #include "exception.h"
+#include "link.h"
 #include "optimizer.h"
 #include "parser.h"
 #include "registers.h"
@@ -14,24 +15,36 @@
 
 static struct option const longopts[] = {
     {"ansi",     no_argument,       NULL, 'a'},
+    {"dump",     required_argument, NULL, 'd'},
+    {"entry",    required_argument, NULL, 'e'},
     {"optimize", required_argument, NULL, 'f'},
     {"help",     no_argument,       NULL, 'h'},
     {"input",    required_argument, NULL, 'i'},
+    {"layout",   required_argument, NULL, 'l'},
+    {"map",      required_argument, NULL, 'm'},
     {"output",   required_argument, NULL, 'o'},
     {"ir",       required_argument, NULL, 'r'},
     {NULL}
 };
-static const char shortopts[] = "af:hi:o:r:";
+static const char shortopts[] = "ad:e:f:hi:l:m:o:r:";
 
 void print_help(char* name) {
-    printf("usage:\n  %s -i <infile> -o <outfile>\n", name);
+    printf("usage:\n  %s -i <infile> -o <outfile> [-i <infile> -o <outfile>]...\n", name);
     puts("options:\n"
          "  -a --ansi     Toggle ANSI terminal support.\n"
+         "  -d --dump     Path to a dump of the block counters to convert to a profile. The\n"
+         "                counter table is read from --map, and the profile written to --output.\n"
+         "  -e --entry    Name a symbol which code outside of the inputs uses, such as the\n"
+         "                entry point. Once any are named, everything which they do not reach\n"
+         "                is removed, and every other export is made static.\n"
          "  -f --optimize Enable or disable certain optimizations. Enter -fhelp for help.\n"
          "  -h --help     Show this message.\n"
-         "  -i --input    Path to the input IR file.\n"
-         "  -o --output   Path to the output assembly file.\n"
-         "  -r --ir       Path to the output optimized IR file.");
+         "  -i --input    Path to an input IR file. Several are linked into one program, and\n"
+         "                each is output to the --output given in the same position.\n"
+         "  -l --layout   Path to the output report of the block and data layouts.\n"
+         "  -m --map      Path to the output symbol map, which names each block for profiling.\n"
+         "  -o --output   Path to an output assembly file.\n"
+         "  -r --ir       Path to the output optimized IR file, which holds every input.");
 }
 
 // Attempt to open an optional output file and return it. If the file's path is
@@ -45,16 +58,47 @@ FILE * open_optional_output(const char * path) {
             file = fopen(path, "w");
         if (file == NULL)
             error("Failed to open %s.", path);
+        return file;
     }
+    return NULL;
+}
+
+// Convert a dump of the block counters into a profile.
+static void convert_dump(const char* dump_path, const char* map_path, const char* out_path) {
+    if (map_path == NULL)
+        error("Converting a counter dump requires the symbol map it was compiled with.");
+    if (out_path == NULL)
+        error("Missing output profile path.");
+    errcheck();
+
+    FILE* dump = fopen(dump_path, "rb");
+    FILE* map = fopen(map_path, "r");
+    if (dump == NULL)
+        error("Failed to open %s.", dump_path);
+    if (map == NULL)
+        error("Failed to open %s.", map_path);
+    FILE* out = open_optional_output(out_path);
+    errcheck();
+
+    convert_counter_dump(out, map, dump);
+    errcheck();
+
+    fclose(dump);
+    fclose(map);
+    if (out != stdout)
+        fclose(out);
 }
 
 int main(int argc, char* argv[]) {
-    FILE* ir_in = NULL;
     FILE* ir_out = NULL;
-    FILE* asm_out = NULL;
-    const char* ir_in_path = NULL;
+    FILE** asm_outs = va_new(0);
+    const char** ir_in_paths = va_new(0);
     const char* ir_out_path = NULL;
-    const char* asm_out_path = NULL;
+    const char* layout_path = NULL;
+    const char* map_path = NULL;
+    const char* dump_path = NULL;
+    const char** asm_out_paths = va_new(0);
+    const char** entries = va_new(0);
 
     // Check if stderr is a tty.
     ansi_exceptions = isatty(fileno(stderr));
@@ -75,6 +119,12 @@ int main(int argc, char* argv[]) {
         case 'a':
             ansi_exceptions ^= true;
             break;
+        case 'd':
+            dump_path = optarg;
+            break;
+        case 'e':
+            va_append(entries, (const char*) optarg);
+            break;
         case 'f':
             if (strequ(optarg, "help")) {
                 print_opt_help();
@@ -94,10 +144,16 @@ int main(int argc, char* argv[]) {
                 exit(0);
             break;
         case 'i':
-            ir_in_path = optarg;
+            va_append(ir_in_paths, (const char*) optarg);
+            break;
+        case 'l':
+            layout_path = optarg;
+            break;
+        case 'm':
+            map_path = optarg;
             break;
         case 'o':
-            asm_out_path = optarg;
+            va_append(asm_out_paths, (const char*) optarg);
             break;
         case 'r':
             ir_out_path = optarg;
@@ -105,34 +161,65 @@ int main(int argc, char* argv[]) {
         }
     }
 
-    // An input IR file is required.
-    if (ir_in_path == NULL) {
+    // Converting a counter dump needs no IR.
+    if (dump_path) {
+        convert_dump(dump_path, map_path, va_len(asm_out_paths) ? asm_out_paths[0] : NULL);
+        exit(0);
+    }
+
+    // At least one input IR file is required, and each needs its own output.
+    FILE** ir_ins = va_new(0);
+    if (va_len(ir_in_paths) == 0)
         error("Missing input file path.");
-    } else {
-        ir_in = fopen(ir_in_path, "r");
+    for (size_t i = 0; i < va_len(ir_in_paths); i++) {
+        FILE* ir_in = fopen(ir_in_paths[i], "r");
         if (ir_in == NULL)
-            error("Failed to open %s.", ir_in_path);
+            error("Failed to open %s.", ir_in_paths[i]);
+        va_append(ir_ins, ir_in);
     }
+    if (va_len(asm_out_paths) && va_len(asm_out_paths) != va_len(ir_in_paths))
+        error("Expected an output file for each of the %zu input files, but got %zu.", va_len(ir_in_paths),
+              va_len(asm_out_paths));
 
     ir_out = open_optional_output(ir_out_path);
-    asm_out = open_optional_output(asm_out_path);
+    for (size_t i = 0; i < va_len(asm_out_paths); i++) {
+        FILE* asm_out = open_optional_output(asm_out_paths[i]);
+        va_append(asm_outs, asm_out);
+    }
+    layout_report = open_optional_output(layout_path);
+    symbol_map = open_optional_output(map_path);
 
-    if (asm_out == NULL && ir_out == NULL)
+    if (va_len(asm_outs) == 0 && ir_out == NULL)
         warn("No output files were provided. Performing a dry run.");
 
     // Check for CLI errors before processing.
     errcheck();
 
-    // Parse the input IR file.
-    Declaration** declaration_list = fparse_textual_ir(ir_in);
+    // Parse each input IR file, and link them into one program.
+    Declaration*** modules = va_new(0);
+    for (size_t i = 0; i < va_len(ir_ins); i++) {
+        Declaration** module = fparse_textual_ir(ir_ins[i]);
+        va_append(modules, module);
+    }
+    Declaration** declaration_list = link_modules(modules, ir_in_paths);
+    remove_unreachable(declaration_list, entries);
+    remove_unread_globals(declaration_list);
+    va_free(modules);
+    errcheck();
+
     optimize_ir(declaration_list);
-    for (size_t i = 0; i < va_len(declaration_list); i++) {
-        if (declaration_list[i]->is_fn) {
-            Function* func = (Function*) declaration_list[i];
-            analyze_var_usage(func);
-            assign_registers(func);
-        }
+
+    // Functions are allocated before those they call, so that a static
+    // function can take its parameters where its callers already hold them.
+    Function** call_order = order_call_graph(declaration_list);
+    for (size_t i = va_len(call_order); i-- > 0;) {
+        Function* func = call_order[i];
+        analyze_var_usage(func);
+        assign_registers(func);
+        if (symbol_map)
+            write_symbol_map(symbol_map, func);
     }
+    va_free(call_order);
 
     // Check for errors before writing to output files.
     errcheck();
@@ -147,14 +234,32 @@ int main(int argc, char* argv[]) {
         }
     }
 
+    // Compile the IR to assembly.
+    if (va_len(asm_outs)) {
+        compile_ir(asm_outs, declaration_list);
+        errcheck();
+    }
+
     // Final clean up before exit.
     for (size_t i = 0; i < va_len(declaration_list); i++)
         free_declaration(declaration_list[i]);
     va_free(declaration_list);
 
-    fclose(ir_in);
+    for (size_t i = 0; i < va_len(ir_ins); i++)
+        fclose(ir_ins[i]);
     if (ir_out)
         fclose(ir_out);
-    if (asm_out)
-        fclose(asm_out);
+    for (size_t i = 0; i < va_len(asm_outs); i++) {
+        if (asm_outs[i] != stdout)
+            fclose(asm_outs[i]);
+    }
+    if (layout_report && layout_report != stdout)
+        fclose(layout_report);
+    if (symbol_map && symbol_map != stdout)
+        fclose(symbol_map);
+    va_free(ir_ins);
+    va_free(asm_outs);
+    va_free(ir_in_paths);
+    va_free(asm_out_paths);
+    va_free(entries);
 }
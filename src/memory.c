@@ -0,0 +1,388 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cfg.h"
+#include "optimizer.h"
+#include "statements.h"
+#include "varray.h"
+
+// Redundant load and store elimination for globals. Each global declared in
+// this file is given a slot, and two dataflow problems are solved over them.
+//
+// Going forwards, each slot holds the local which its global's value is known
+// to be in, from the last read or write of it. A read of a global which is
+// already in a local is replaced by that local. Where paths meet, a value is
+// only kept if every path agrees on the same local, whose declaration must
+// then dominate the meeting point.
+//
+// Going backwards, a slot is live if its global may be read before it is next
+// written. A write to a global which is not live is never seen, and is removed.
+//
+// Dereferences are treated as touching every global, since they may reach any
+// of them. So are calls, except that a call only changes the globals which the
+// callee's summary says it may write. Volatile globals, and those declared
+// elsewhere, are left alone entirely.
+
+// A global whose value is in no known local.
+#define UNKNOWN UINT64_MAX
+// A global on a path which has not been visited yet, which agrees with
+// anything.
+#define UNVISITED (UINT64_MAX - 1)
+// Returned by slot lookups for globals which are not tracked.
+#define NO_SLOT SIZE_MAX
+
+typedef struct MemoryState {
+    Function* func;
+    // VArray of the declaration of each tracked global.
+    Declaration** slots;
+    // The value of each slot at the end of each block, `slot_count` per block.
+    uint64_t* values_out;
+    // The local which replaces each read, or UNKNOWN for those which are kept.
+    uint64_t* replacements;
+    // Whether each slot is live at the start of each block.
+    bool* live_in;
+    size_t slot_count;
+    size_t removed;
+} MemoryState;
+
+static size_t find_slot(MemoryState* st, Declaration* global) {
+    for (size_t i = 0; i < va_len(st->slots); i++) {
+        if (st->slots[i] == global)
+            return i;
+    }
+    return NO_SLOT;
+}
+
+// Find the global which a statement reads or writes, if any.
+static Declaration* statement_global(Statement* statement) {
+    switch (statement->type) {
+    case READ: return ((Read*) statement)->global;
+    case WRITE: return ((Write*) statement)->global;
+    }
+    return NULL;
+}
+
+// Give each global which the function reads or writes a slot, unless it is
+// volatile.
+static void collect_slots(MemoryState* st) {
+    Function* func = st->func;
+
+    st->slots = va_new(0);
+    for (size_t i = 0; i < va_len(func->basic_blocks); i++) {
+        for (Statement* state = func->basic_blocks[i].first; state; state = state->next) {
+            Declaration* global = statement_global(state);
+            if ((state->type == READ || state->type == WRITE) && !is_volatile(global)
+                && find_slot(st, global) == NO_SLOT)
+                va_append(st->slots, global);
+        }
+    }
+    st->slot_count = va_len(st->slots);
+}
+
+// Check if a statement may read or write any global behind the slots' backs.
+// A `pure` function may still read globals, but never writes them.
+static bool touches_memory(Statement* statement, bool writes) {
+    switch (statement->type) {
+    case OPERATION: return ((Operation*) statement)->type == DEREFERENCE;
+    case CALL: return !writes || !has_trait(&((Call*) statement)->callee->declaration, "pure");
+    case RETURN: return !writes;
+    }
+    return false;
+}
+
+// Check if a statement which touches memory may change a global.
+static bool may_write(Statement* statement, Declaration* global) {
+    if (statement->type != CALL || ((Call*) statement)->callee->writes == NULL)
+        return true;
+
+    Declaration** writes = ((Call*) statement)->callee->writes;
+    for (size_t i = 0; i < va_len(writes); i++) {
+        if (writes[i] == global)
+            return true;
+    }
+    return false;
+}
+
+/*
+ * Forwarding values to reads
+ */
+
+// Find the values of each slot at the start of a block, from those at the end
+// of each of its predecessors.
+static void meet_values(MemoryState* st, size_t block, size_t** predecessors, uint64_t* values) {
+    for (size_t s = 0; s < st->slot_count; s++)
+        values[s] = block == 0 ? UNKNOWN : UNVISITED;
+
+    for (size_t i = 0; i < va_len(predecessors[block]); i++) {
+        uint64_t* out = &st->values_out[predecessors[block][i] * st->slot_count];
+        for (size_t s = 0; s < st->slot_count; s++) {
+            if (out[s] == UNVISITED || out[s] == values[s])
+                continue;
+            values[s] = values[s] == UNVISITED ? out[s] : UNKNOWN;
+        }
+    }
+}
+
+// Carry the value of each slot through a block. If `apply` is set, a read of a
+// global whose value is already in a local of the same type is replaced by
+// that local, and a write of that local is removed. The read is treated as
+// replaced either way, so that the values found before applying never name a
+// removed local.
+static void forward_block(MemoryState* st, size_t block, uint64_t* values, bool apply) {
+    Function* func = st->func;
+
+    for (Statement* state = func->basic_blocks[block].first; state;) {
+        Statement* this_state = state;
+        state = state->next;
+
+        if (touches_memory(this_state, true)) {
+            for (size_t s = 0; s < st->slot_count; s++) {
+                if (may_write(this_state, st->slots[s]))
+                    values[s] = UNKNOWN;
+            }
+            continue;
+        }
+
+        size_t slot = find_slot(st, statement_global(this_state));
+        if (slot == NO_SLOT)
+            continue;
+
+        // A write of a read which is to be replaced writes its replacement.
+        // Writing the value which a global already holds changes nothing.
+        if (this_state->type == WRITE) {
+            uint64_t src = ((Write*) this_state)->src;
+            if (st->replacements[src] != UNKNOWN)
+                src = st->replacements[src];
+            if (values[slot] == src && apply) {
+                delete_statement(func, this_state);
+                st->removed += 1;
+            }
+            values[slot] = src;
+            continue;
+        }
+
+        Read* read = (Read*) this_state;
+        uint64_t known = values[slot];
+        st->replacements[read->dest] = UNKNOWN;
+        if (known == UNKNOWN || func->locals[known]->type != read->var_type) {
+            values[slot] = read->dest;
+        } else if (!apply) {
+            st->replacements[read->dest] = known;
+        } else {
+            replace_local_uses(func, read->dest, known);
+            delete_local(func, read->dest);
+            st->removed += 1;
+        }
+    }
+}
+
+static void forward_values(MemoryState* st, size_t* order, size_t** predecessors) {
+    size_t block_count = va_len(st->func->basic_blocks);
+    uint64_t* values = malloc((st->slot_count + 1) * sizeof(uint64_t));
+
+    st->replacements = malloc(va_len(st->func->locals) * sizeof(uint64_t));
+    for (size_t i = 0; i < va_len(st->func->locals); i++)
+        st->replacements[i] = UNKNOWN;
+
+    // Blocks which are never reached know nothing, and the rest start out
+    // agreeing with anything.
+    st->values_out = malloc((block_count * st->slot_count + 1) * sizeof(uint64_t));
+    for (size_t i = 0; i < block_count * st->slot_count; i++)
+        st->values_out[i] = UNKNOWN;
+    for (size_t i = 0; i < va_len(order); i++) {
+        for (size_t s = 0; s < st->slot_count; s++)
+            st->values_out[order[i] * st->slot_count + s] = UNVISITED;
+    }
+
+    for (bool changed = true; changed;) {
+        changed = false;
+        for (size_t i = 0; i < va_len(order); i++) {
+            uint64_t* out = &st->values_out[order[i] * st->slot_count];
+            meet_values(st, order[i], predecessors, values);
+            forward_block(st, order[i], values, false);
+            if (memcmp(out, values, st->slot_count * sizeof(uint64_t))) {
+                memcpy(out, values, st->slot_count * sizeof(uint64_t));
+                changed = true;
+            }
+        }
+    }
+
+    for (size_t i = 0; i < va_len(order); i++) {
+        meet_values(st, order[i], predecessors, values);
+        forward_block(st, order[i], values, true);
+    }
+
+    free(values);
+    free(st->values_out);
+    free(st->replacements);
+}
+
+/*
+ * Removing dead stores
+ */
+
+// Find which slots are live at the start of a block, from those which are live
+// at its end. If `apply` is set, writes to globals which are not live are
+// removed.
+static void kill_block(MemoryState* st, size_t block, bool* live, bool apply) {
+    Function* func = st->func;
+
+    for (Statement* state = func->basic_blocks[block].final; state;) {
+        Statement* this_state = state;
+        state = state->last;
+
+        if (touches_memory(this_state, false)) {
+            for (size_t s = 0; s < st->slot_count; s++)
+                live[s] = true;
+            continue;
+        }
+
+        size_t slot = find_slot(st, statement_global(this_state));
+        if (slot == NO_SLOT)
+            continue;
+
+        if (this_state->type == READ) {
+            live[slot] = true;
+            continue;
+        }
+
+        if (!live[slot] && apply) {
+            delete_statement(func, this_state);
+            st->removed += 1;
+        }
+        live[slot] = false;
+    }
+}
+
+// Find which slots are live at the end of a block.
+static void live_out(MemoryState* st, size_t block, bool* live) {
+    size_t successors[2];
+    size_t count = block_successors(st->func, block, successors);
+
+    memset(live, 0, st->slot_count * sizeof(bool));
+    for (size_t i = 0; i < count; i++) {
+        for (size_t s = 0; s < st->slot_count; s++)
+            live[s] |= st->live_in[successors[i] * st->slot_count + s];
+    }
+}
+
+static void remove_dead_stores(MemoryState* st, size_t* order) {
+    size_t block_count = va_len(st->func->basic_blocks);
+    bool* live = malloc(st->slot_count + 1);
+
+    st->live_in = calloc(block_count * st->slot_count + 1, sizeof(bool));
+
+    for (bool changed = true; changed;) {
+        changed = false;
+        for (size_t i = va_len(order); i-- > 0;) {
+            bool* in = &st->live_in[order[i] * st->slot_count];
+            live_out(st, order[i], live);
+            kill_block(st, order[i], live, false);
+            if (memcmp(in, live, st->slot_count)) {
+                memcpy(in, live, st->slot_count);
+                changed = true;
+            }
+        }
+    }
+
+    for (size_t i = 0; i < va_len(order); i++) {
+        live_out(st, order[i], live);
+        kill_block(st, order[i], live, true);
+    }
+
+    free(live);
+    free(st->live_in);
+}
+
+// Replace reads of globals whose value is already in a local, and remove
+// writes to globals which are overwritten before anything can read them.
+// Returns the number of reads and writes removed.
+size_t forward_memory_values(Function* func) {
+    MemoryState st = {.func = func};
+
+    collect_slots(&st);
+    if (st.slot_count == 0) {
+        va_free(st.slots);
+        return 0;
+    }
+
+    size_t* order = reverse_postorder(func);
+    size_t** predecessors = collect_predecessors(func);
+
+    forward_values(&st, order, predecessors);
+    remove_dead_stores(&st, order);
+
+    free_predecessors(func, predecessors);
+    va_free(order);
+    va_free(st.slots);
+    return st.removed;
+}
+
+/*
+ * Summarizing writes
+ */
+
+static bool add_write(Declaration*** writes, Declaration* global) {
+    for (size_t i = 0; i < va_len(*writes); i++) {
+        if ((*writes)[i] == global)
+            return false;
+    }
+    va_append(*writes, global);
+    return true;
+}
+
+// Add the globals which a function's calls may write to its summary. Returns
+// true if the summary changed.
+static bool summarize_calls(Function* func) {
+    bool changed = false;
+
+    for (size_t i = 0; func->writes && i < va_len(func->basic_blocks); i++) {
+        for (Statement* state = func->basic_blocks[i].first; state; state = state->next) {
+            if (state->type != CALL)
+                continue;
+            Function* callee = ((Call*) state)->callee;
+            if (!has_body(&callee->declaration) && has_trait(&callee->declaration, "pure"))
+                continue;
+            if (callee->writes == NULL) {
+                va_free(func->writes);
+                func->writes = NULL;
+                return true;
+            }
+            for (size_t j = 0; j < va_len(callee->writes); j++)
+                changed |= add_write(&func->writes, callee->writes[j]);
+        }
+    }
+    return changed;
+}
+
+// Summarize which globals each function may write, whether itself or through
+// the functions it calls. A function which calls one declared elsewhere may
+// write anything, unless the callee is `pure`. Passes only ever remove writes,
+// so the summaries hold however the functions are changed afterwards.
+void summarize_global_writes(Declaration** decls) {
+    for (size_t i = 0; i < va_len(decls); i++) {
+        if (!has_body(decls[i]))
+            continue;
+        Function* func = (Function*) decls[i];
+        if (func->writes)
+            va_free(func->writes);
+        func->writes = va_new(0);
+        for (size_t j = 0; j < va_len(func->basic_blocks); j++) {
+            for (Statement* state = func->basic_blocks[j].first; state; state = state->next) {
+                if (state->type == WRITE && ((Write*) state)->global)
+                    add_write(&func->writes, ((Write*) state)->global);
+            }
+        }
+    }
+
+    // Writes pass from each callee to its callers until every summary settles.
+    for (bool changed = true; changed;) {
+        changed = false;
+        for (size_t i = 0; i < va_len(decls); i++) {
+            if (has_body(decls[i]))
+                changed |= summarize_calls((Function*) decls[i]);
+        }
+    }
+}
@@ -0,0 +1,528 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cfg.h"
+#include "optimizer.h"
+#include "parser.h"
+#include "statements.h"
+#include "varray.h"
+
+// Merging identical code. Every copy of the same code takes its own ROM, and
+// optimized programs are full of them: functions which only differed in types
+// which narrowing has since made the same, and blocks which end the same way
+// before returning.
+//
+// Functions whose bodies match, up to how their locals are numbered, are folded
+// into one. Calls to the others are sent to it, and the names of those which
+// are exported become aliases of its code. Each function is first hashed on
+// its shape, so that only those with the same hash are compared in full.
+//
+// Within a function, blocks which end in the same statements, before the same
+// return or jump, keep one copy of those statements, which the others jump to.
+// This costs a jump each time one of the others runs, so blocks within loops
+// are left alone.
+
+// Marks a local which has not been matched yet.
+#define NO_LOCAL UINT64_MAX
+// The fewest statements worth sharing, including the return or jump ending
+// them. A lone return or jump is no larger than the jump which would replace it.
+#define MIN_TAIL_STATEMENTS 2
+
+#define FNV_OFFSET 0xCBF29CE484222325
+#define FNV_PRIME 0x100000001B3
+// Stands in for the callee of a call from a function to itself.
+#define SELF_CALL UINT64_MAX
+
+// A matching between the locals of code being compared with other code. Within
+// a single function, the locals of both must be the same unless the compared
+// statements declare them.
+typedef struct Match {
+    Function* func;
+    Function* other;
+    // The local of `func` which each local of `other` matches, and the other
+    // way around.
+    uint64_t* map;
+    uint64_t* reverse;
+    bool in_place;
+} Match;
+
+static void reset_match(Match* m) {
+    for (size_t i = 0; i < va_len(m->other->locals); i++)
+        m->map[i] = NO_LOCAL;
+    for (size_t i = 0; i < va_len(m->func->locals); i++)
+        m->reverse[i] = NO_LOCAL;
+}
+
+static void init_match(Match* m, Function* func, Function* other) {
+    m->func = func;
+    m->other = other;
+    m->map = malloc((va_len(other->locals) + 1) * sizeof(uint64_t));
+    m->reverse = malloc((va_len(func->locals) + 1) * sizeof(uint64_t));
+    m->in_place = func == other;
+    reset_match(m);
+}
+
+static void free_match(Match* m) {
+    free(m->map);
+    free(m->reverse);
+}
+
+// Match a local of one piece of code to a local of the other, where either
+// declares or reads it. Returns false if either is already matched to another.
+static bool match_locals(Match* m, uint64_t local, uint64_t other, bool declares) {
+    if (m->map[other] != NO_LOCAL || m->reverse[local] != NO_LOCAL)
+        return !(m->in_place && declares) && m->map[other] == local;
+    // Locals declared before the compared statements are shared.
+    if (m->in_place && !declares)
+        return local == other;
+    if (get_local(m->func, local)->type != get_local(m->other, other)->type)
+        return false;
+    m->map[other] = local;
+    m->reverse[local] = other;
+    return true;
+}
+
+// Check if an operation reads its `rhs`.
+static bool has_rhs(Operation* op) {
+    switch (op->type) {
+    case NOT: case NEGATE: case COMPLEMENT: case ADDRESS: case DEREFERENCE:
+        return false;
+    }
+    return true;
+}
+
+static bool same_constant(Value a, Value b) {
+    if (a.is_const != b.is_const)
+        return false;
+    return !a.is_const || (a.const_unsigned == b.const_unsigned && a.is_signed == b.is_signed);
+}
+
+static bool same_global(Declaration* a, Declaration* b, const char* a_name, const char* b_name) {
+    return a == b && (a || strequ(a_name, b_name));
+}
+
+static bool same_label(Match* m, const char* a, const char* b) {
+    if (m->in_place)
+        return strequ(a, b);
+    return find_block(m->func, a) == find_block(m->other, b);
+}
+
+// A call from either function being compared must be a call to itself in both.
+static bool same_callee(Match* m, Function* a, Function* b) {
+    bool a_self = a == m->func || a == m->other;
+    bool b_self = b == m->func || b == m->other;
+    if (m->in_place || !(a_self || b_self))
+        return a == b;
+    return a == m->func && b == m->other;
+}
+
+// Compare everything about two statements other than their locals.
+static bool same_fields(Match* m, Statement* a, Statement* b) {
+    if (a->type != b->type)
+        return false;
+
+    switch (a->type) {
+    case OPERATION: {
+        Operation* x = (Operation*) a;
+        Operation* y = (Operation*) b;
+        return x->type == y->type && x->var_type == y->var_type && (!has_rhs(x) || same_constant(x->rhs, y->rhs));
+    }
+    case READ: {
+        Read* x = (Read*) a;
+        Read* y = (Read*) b;
+        return x->var_type == y->var_type && same_global(x->global, y->global, x->src, y->src);
+    }
+    case WRITE:
+        return same_global(((Write*) a)->global, ((Write*) b)->global, ((Write*) a)->dest, ((Write*) b)->dest);
+    case JUMP:
+        return same_label(m, ((Jump*) a)->label, ((Jump*) b)->label);
+    case BRANCH: {
+        Branch* x = (Branch*) a;
+        Branch* y = (Branch*) b;
+        return x->countdown == y->countdown && same_label(m, x->true_label, y->true_label)
+               && same_label(m, x->false_label, y->false_label);
+    }
+    case RETURN:
+        return same_constant(((Return*) a)->val, ((Return*) b)->val);
+    case CALL: {
+        Call* x = (Call*) a;
+        Call* y = (Call*) b;
+        if (x->var_type != y->var_type || !same_callee(m, x->callee, y->callee) || va_len(x->args) != va_len(y->args))
+            return false;
+        for (size_t i = 0; i < va_len(x->args); i++) {
+            if (!same_constant(x->args[i], y->args[i]))
+                return false;
+        }
+        return true;
+    }
+    }
+    return false;
+}
+
+// Compare two statements, matching the locals they read and declare.
+static bool same_statement(Match* m, Statement* a, Statement* b) {
+    if (!same_fields(m, a, b))
+        return false;
+
+    uint64_t** a_operands = statement_operands(a);
+    uint64_t** b_operands = statement_operands(b);
+    bool same = va_len(a_operands) == va_len(b_operands);
+    for (size_t i = 0; same && i < va_len(a_operands); i++)
+        same = match_locals(m, *a_operands[i], *b_operands[i], false);
+    va_free(a_operands);
+    va_free(b_operands);
+
+    uint64_t a_dest, b_dest;
+    if (same && statement_dest(a, &a_dest) && statement_dest(b, &b_dest))
+        same = match_locals(m, a_dest, b_dest, true);
+    return same;
+}
+
+/*
+ * Folding functions
+ */
+
+// Mix a value into a hash, one byte at a time.
+static uint64_t mix(uint64_t hash, uint64_t value) {
+    for (size_t i = 0; i < sizeof(value); i++) {
+        hash ^= (value >> (8 * i)) & 0xFF;
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+static uint64_t mix_string(uint64_t hash, const char* str) {
+    for (; *str; str++) {
+        hash ^= (uint8_t) *str;
+        hash *= FNV_PRIME;
+    }
+    return mix(hash, 0);
+}
+
+static uint64_t mix_constant(uint64_t hash, Value val) {
+    hash = mix(hash, val.is_const);
+    return val.is_const ? mix(hash, val.const_unsigned) : hash;
+}
+
+// Hash a statement on everything but its locals, as `same_fields` compares it.
+static uint64_t hash_statement(Function* func, uint64_t hash, Statement* statement) {
+    hash = mix(hash, statement->type);
+
+    switch (statement->type) {
+    case OPERATION: {
+        Operation* op = (Operation*) statement;
+        hash = mix(mix(hash, op->type), op->var_type);
+        if (has_rhs(op))
+            hash = mix_constant(hash, op->rhs);
+    } break;
+    case READ:
+        hash = mix_string(mix(hash, ((Read*) statement)->var_type), ((Read*) statement)->src);
+        break;
+    case WRITE:
+        hash = mix_string(hash, ((Write*) statement)->dest);
+        break;
+    case JUMP:
+        hash = mix(hash, find_block(func, ((Jump*) statement)->label));
+        break;
+    case BRANCH: {
+        Branch* br = (Branch*) statement;
+        hash = mix(hash, find_block(func, br->true_label));
+        hash = mix(hash, find_block(func, br->false_label));
+        hash = mix(hash, br->countdown);
+    } break;
+    case RETURN:
+        hash = mix_constant(hash, ((Return*) statement)->val);
+        break;
+    case CALL: {
+        Call* call = (Call*) statement;
+        hash = mix(hash, call->var_type);
+        hash = call->callee == func ? mix(hash, SELF_CALL) : mix_string(hash, call->function);
+        for (size_t i = 0; i < va_len(call->args); i++)
+            hash = mix_constant(hash, call->args[i]);
+    } break;
+    }
+    return hash;
+}
+
+static uint64_t hash_function(Function* func) {
+    uint64_t hash = mix(FNV_OFFSET, func->declaration.type);
+
+    for (size_t i = 0; i < func->parameter_count; i++)
+        hash = mix(hash, func->parameter_types[i]);
+    for (size_t i = 0; i < va_len(func->basic_blocks); i++) {
+        for (Statement* state = func->basic_blocks[i].first; state; state = state->next)
+            hash = hash_statement(func, hash, state);
+        hash = mix(hash, END_BLOCK);
+    }
+    return hash;
+}
+
+static bool same_traits(Declaration* a, Declaration* b) {
+    if (va_len(a->traits) != va_len(b->traits))
+        return false;
+    for (size_t i = 0; i < va_len(a->traits); i++) {
+        if (!has_trait(b, a->traits[i]))
+            return false;
+    }
+    return true;
+}
+
+// Check if two functions do the same thing in the same way: each block matches
+// the block in the same place in the other, statement for statement.
+static bool same_function(Function* a, Function* b) {
+    if (a->declaration.type != b->declaration.type || a->parameter_count != b->parameter_count
+        || va_len(a->basic_blocks) != va_len(b->basic_blocks) || !same_traits(&a->declaration, &b->declaration))
+        return false;
+    for (size_t i = 0; i < a->parameter_count; i++) {
+        if (a->parameter_types[i] != b->parameter_types[i])
+            return false;
+    }
+
+    Match m;
+    bool same = true;
+    init_match(&m, a, b);
+    for (size_t i = 0; i < a->parameter_count; i++)
+        match_locals(&m, i, i, true);
+    for (size_t i = 0; same && i < va_len(a->basic_blocks); i++) {
+        Statement* x = a->basic_blocks[i].first;
+        Statement* y = b->basic_blocks[i].first;
+        for (; same && x && y; x = x->next, y = y->next)
+            same = same_statement(&m, x, y);
+        same &= x == NULL && y == NULL;
+    }
+    free_match(&m);
+    return same;
+}
+
+static char* copy_string(const char* str) {
+    char* copy = malloc(strlen(str) + 1);
+    strcpy(copy, str);
+    return copy;
+}
+
+// Send every call to one function to another which does the same, and remove
+// it. An exported function's name is kept as an alias of the other's code.
+static void fold_function(Declaration** decls, size_t keep, size_t drop) {
+    Function* kept = (Function*) decls[keep];
+    Function* dropped = (Function*) decls[drop];
+
+    for (size_t i = 0; i < va_len(decls); i++) {
+        if (!has_body(decls[i]))
+            continue;
+        Function* func = (Function*) decls[i];
+        for (size_t j = 0; j < va_len(func->basic_blocks); j++) {
+            for (Statement* state = func->basic_blocks[j].first; state; state = state->next) {
+                if (state->type != CALL || ((Call*) state)->callee != dropped)
+                    continue;
+                ((Call*) state)->callee = kept;
+                free(((Call*) state)->function);
+                ((Call*) state)->function = copy_string(kept->declaration.identifier);
+            }
+        }
+    }
+
+    if (dropped->declaration.storage_class == EXPORT) {
+        if (kept->aliases == NULL)
+            kept->aliases = va_new(0);
+        va_append(kept->aliases, copy_string(dropped->declaration.identifier));
+    }
+    for (size_t i = 0; dropped->aliases && i < va_len(dropped->aliases); i++)
+        va_append(kept->aliases, copy_string(dropped->aliases[i]));
+
+    va_remove(decls, drop);
+    free_declaration(&dropped->declaration);
+}
+
+// Fold each set of functions which do the same thing into the first of them.
+// An exported function is kept over a static one, since code outside the
+// program may call it, and so it must stay in ROM0. Returns the number of
+// functions removed.
+size_t fold_identical_functions(Declaration** decls) {
+    size_t folded = 0;
+    uint64_t* hashes = va_new(0);
+
+    for (size_t i = 0; i < va_len(decls); i++) {
+        uint64_t hash = has_body(decls[i]) ? hash_function((Function*) decls[i]) : 0;
+        va_append(hashes, hash);
+    }
+
+    for (size_t i = 0; i < va_len(decls); i++) {
+        if (!has_body(decls[i]))
+            continue;
+        for (size_t j = i + 1; j < va_len(decls); j++) {
+            if (!has_body(decls[j]) || hashes[i] != hashes[j]
+                || !same_function((Function*) decls[i], (Function*) decls[j]))
+                continue;
+            folded++;
+            if (decls[i]->storage_class == STATIC && decls[j]->storage_class == EXPORT) {
+                // The exported function takes in the rest of the set once the
+                // search reaches it.
+                fold_function(decls, j, i);
+                va_remove(hashes, i);
+                i -= 1; // Handle the change in size by offsetting i.
+                break;
+            }
+            fold_function(decls, i, j);
+            va_remove(hashes, j);
+            j -= 1; // Handle the change in size by offsetting j.
+        }
+    }
+
+    va_free(hashes);
+    return folded;
+}
+
+/*
+ * Merging block tails
+ */
+
+static Statement* tail_start(BasicBlock* bb, size_t count) {
+    Statement* state = bb->final;
+    for (size_t i = 1; i < count; i++)
+        state = state->last;
+    return state;
+}
+
+static size_t count_statements(BasicBlock* bb) {
+    size_t count = 0;
+    for (Statement* state = bb->first; state; state = state->next)
+        count++;
+    return count;
+}
+
+// Check that every local declared from `first` to the end of its block is only
+// read there, so that the statements may move to a block of their own.
+static bool is_self_contained(Function* func, Statement* first) {
+    for (Statement* state = first; state; state = state->next) {
+        uint64_t dest;
+        if (!statement_dest(state, &dest))
+            continue;
+        size_t reads = 0;
+        for (Statement* later = state->next; later; later = later->next) {
+            uint64_t** operands = statement_operands(later);
+            for (size_t i = 0; i < va_len(operands); i++)
+                reads += *operands[i] == dest;
+            va_free(operands);
+        }
+        if (reads != va_len(get_local(func, dest)->references))
+            return false;
+    }
+    return true;
+}
+
+// Find how many statements two blocks end with in common, or 0 if too few are
+// to be worth sharing.
+static size_t common_tail(Function* func, Match* m, size_t a, size_t b) {
+    BasicBlock* x = &func->basic_blocks[a];
+    BasicBlock* y = &func->basic_blocks[b];
+
+    // Sharing can go no further back than the statements agree without their
+    // locals.
+    size_t longest = 0;
+    for (Statement* s = x->final, * t = y->final; s && t && same_fields(m, s, t); s = s->last, t = t->last)
+        longest++;
+
+    for (size_t count = longest; count >= MIN_TAIL_STATEMENTS; count--) {
+        Statement* first = tail_start(x, count);
+        Statement* other_first = tail_start(y, count);
+        bool same = true;
+
+        reset_match(m);
+        for (Statement* s = first, * t = other_first; same && s; s = s->next, t = t->next)
+            same = same_statement(m, s, t);
+        if (same && is_self_contained(func, first) && is_self_contained(func, other_first))
+            return count;
+    }
+    return 0;
+}
+
+// Check if a tail is the whole of a block which may be jumped to.
+static bool is_whole_block(Function* func, size_t block, size_t count) {
+    BasicBlock* bb = &func->basic_blocks[block];
+    return block != 0 && bb->label && count_statements(bb) == count;
+}
+
+static void append_jump(Function* func, BasicBlock* bb, const char* label) {
+    Jump* jmp = malloc(sizeof(Jump));
+    jmp->statement.type = JUMP;
+    jmp->label = copy_string(label);
+    va_append(func->statements, &jmp->statement);
+    append_to_block(bb, &jmp->statement);
+}
+
+// Replace the last `count` statements of one block with a jump to the same
+// statements ending another. Unless they are the whole of the other block,
+// they first move to a new block of their own, which it jumps to as well.
+static void share_tail(Function* func, size_t keep, size_t drop, size_t count) {
+    BasicBlock* bb = &func->basic_blocks[drop];
+    for (size_t i = 0; i < count; i++) {
+        uint64_t dest;
+        if (statement_dest(bb->final, &dest))
+            delete_local(func, dest);
+        else
+            delete_statement(func, bb->final);
+    }
+
+    char* label = func->basic_blocks[keep].label;
+    if (!is_whole_block(func, keep, count)) {
+        label = unique_label(func, label ? label : "entry", "_tail");
+        va_expand(&func->basic_blocks, sizeof(BasicBlock));
+        BasicBlock* tail = &va_last(func->basic_blocks);
+        BasicBlock* kept = &func->basic_blocks[keep];
+        init_block(tail, label);
+        for (Statement* state = tail_start(kept, count); state;) {
+            Statement* this_state = state;
+            state = state->next;
+            remove_from_block(kept, this_state);
+            append_to_block(tail, this_state);
+        }
+        append_jump(func, kept, label);
+    }
+    append_jump(func, &func->basic_blocks[drop], label);
+    update_block_parents(func);
+}
+
+// Check if a block's tail may be shared: it must end in a return or jump, and
+// not run often enough for the added jump to matter.
+static bool may_share(BasicBlock* bb) {
+    return bb->final && (bb->final->type == RETURN || bb->final->type == JUMP) && bb->loop_depth == 0;
+}
+
+// Share the statements which blocks outside of loops end with in common.
+// Returns the number of blocks which gave up their copy.
+size_t merge_block_tails(Function* func) {
+    size_t merged = 0;
+    Match m;
+
+    compute_loop_depths(func);
+    count_local_references(func);
+    init_match(&m, func, func);
+    for (bool changed = true; changed;) {
+        changed = false;
+        for (size_t a = 0; a < va_len(func->basic_blocks) && !changed; a++) {
+            if (!may_share(&func->basic_blocks[a]))
+                continue;
+            for (size_t b = a + 1; b < va_len(func->basic_blocks) && !changed; b++) {
+                if (!may_share(&func->basic_blocks[b]))
+                    continue;
+                size_t count = common_tail(func, &m, a, b);
+                if (count == 0)
+                    continue;
+                // A block which is nothing but the tail is kept as it is.
+                if (!is_whole_block(func, a, count) && is_whole_block(func, b, count))
+                    share_tail(func, b, a, count);
+                else
+                    share_tail(func, a, b, count);
+                merged++;
+                changed = true;
+            }
+        }
+    }
+    free_match(&m);
+
+    if (merged)
+        count_block_references(func);
+    return merged;
+}
@@ -1,6 +1,9 @@
+#include "cfg.h"
 #include "exception.h"
+#include "link.h"
 #include "optimizer.h"
 #include "parser.h"
+#include "registers.h"
 #include "statements.h"
 #include "varray.h"
 
@@ -12,10 +15,74 @@ struct OptimizeOption {
 
 bool remove_unused = true;
 bool fold_constants = true;
+bool thread = true;
+bool narrow = true;
+bool strength_reduce = true;
+bool global_value_numbering = true;
+bool forward_memory = true;
+bool dead_code = true;
+bool block_layout = true;
+bool data_layout = true;
+bool optimize_size = false;
+bool relax_jumps = true;
+bool instrument_blocks = false;
+bool inline_functions = true;
+bool custom_conventions = true;
+bool tail_calls = true;
+bool loop_invariants = true;
+bool counted_loops = true;
+bool unroll = true;
+bool merge_tails = true;
+bool merge_functions = true;
+// How many bytes unrolling may add to each function, given by -funroll-limit.
+static const char* unroll_limit = NULL;
+#define DEFAULT_UNROLL_LIMIT 64
+// How many bytes of HRAM globals may take, given by -fhram-size.
+const char* hram_size = NULL;
+// How many bytes of ROM0 code may take, given by -fbank0-size.
+const char* bank0_size = NULL;
+// How many M-cycles an interrupt handler may take, given by -finterrupt-cycles.
+const char* interrupt_cycles = NULL;
 
 const struct OptimizeOption optimization_options[] = {
+    {"inline",         &inline_functions, "Replace calls to small or frequently called functions with their bodies."},
     {"remove-unused",  &remove_unused,  "Remove unused blocks and fallthroughs."},
-    {"fold-constants", &fold_constants, "Evaluate constant operations and replace them with assignments."},
+    {"fold-constants", &fold_constants, "Propagate constants across blocks, fold constant operations, and remove unreachable blocks."},
+    {"thread-jumps",   &thread,         "Send jumps to blocks which only jump straight to their final target."},
+    {"narrow-types",   &narrow,         "Narrow locals whose range of values fits in a smaller type."},
+    {"strength-reduce", &strength_reduce, "Replace multiplication and division by constants with shifts and adds."},
+    {"gvn",            &global_value_numbering, "Replace operations which recompute a dominating result."},
+    {"forward-memory", &forward_memory, "Reuse the value last read from or written to a global instead of reading it again, and remove writes which are overwritten before they are read."},
+    {"licm",           &loop_invariants, "Move operations whose operands do not change within a loop to before the loop."},
+    {"counted-loops",  &counted_loops,  "Count down loops whose trip count is known on entry in a register, instead of testing their condition."},
+    {"unroll",         &unroll,         "Copy the body of loops with a small constant trip count once per iteration, and of hot counted loops several times over."},
+    {"dead-code",      &dead_code,      "Remove statements whose results are never used."},
+    {"merge-tails",    &merge_tails,    "Keep one copy of the statements which blocks outside of loops end with in common, and jump to it from the others."},
+    {"merge-functions", &merge_functions, "Fold functions which are identical once optimized into one, keeping the names of exported ones as aliases."},
+    {"custom-conventions", &custom_conventions, "Pass the arguments and results of static functions in registers which suit their callers."},
+    {"tail-calls",     &tail_calls,     "Jump to functions whose result is returned straight away, and loop back for calls to the function itself."},
+    {"relax-jumps",    &relax_jumps,    "Shorten jumps to nearby labels, and send jumps to a jump straight to its target."},
+    {"block-layout",   &block_layout,   "Reorder blocks so that the likeliest successor of each falls through."},
+    {"data-layout",    &data_layout,    "Pack globals which are accessed together into aligned pages, and move the most used bytes into HRAM."},
+    {"optimize-size",  &optimize_size,  "Prefer smaller code to faster code, except within loops."},
+    {"instrument-blocks", &instrument_blocks, "Count each run of every block in a 16-bit counter, for use as a profile."},
+    {NULL}
+};
+
+// Options which take a value, given as -f<name>=<value>.
+struct OptimizeParameter {
+    const char* name;
+    const char** value;
+    const char* desc;
+};
+
+const struct OptimizeParameter optimization_parameters[] = {
+    {"profile-use", &profile_path, "Weigh blocks by the execution counts in a profile, and optimize blocks it never saw run for size."},
+    {"profile-symbols", &profile_symbols_path, "Read the profile as counts per address, as an emulator reports them, and find each block's address in this symbol file from the linker."},
+    {"unroll-limit", &unroll_limit, "How many bytes unrolling may add to each function. Defaults to 64."},
+    {"hram-size", &hram_size, "How many bytes of HRAM the data layout may fill with globals. Defaults to 32."},
+    {"bank0-size", &bank0_size, "How many bytes of ROM0 code may fill before functions are moved to switchable banks. Defaults to 16048."},
+    {"interrupt-cycles", &interrupt_cycles, "Warn about interrupt handlers estimated to take more M-cycles than this. Defaults to 1140, the length of VBlank."},
     {NULL}
 };
 
@@ -24,6 +91,11 @@ void print_opt_help() {
     puts("Optimization options:\nPrefix an option with \"no-\" to disable it.");
     for (size_t i = 0; optimization_options[i].name; i++)
         printf("  -f%-16s %s\n", optimization_options[i].name, optimization_options[i].desc);
+    for (size_t i = 0; optimization_parameters[i].name; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "%s=...", optimization_parameters[i].name);
+        printf("  -f%-16s %s\n", name, optimization_parameters[i].desc);
+    }
 }
 
 // Read a -f flag and enable or disable the corresponding option.
@@ -31,6 +103,17 @@ void parse_opt_flag(const char* arg) {
     static bool displayed_help = false;
     bool new_val = true;
 
+    const char* value = strchr(arg, '=');
+    if (value) {
+        for (size_t i = 0; optimization_parameters[i].name; i++) {
+            if (strlen(optimization_parameters[i].name) == (size_t) (value - arg)
+                && strncmp(optimization_parameters[i].name, arg, value - arg) == 0) {
+                *optimization_parameters[i].value = value + 1;
+                return;
+            }
+        }
+    }
+
     if (strncmp(arg, "no-", 3) == 0) {
         new_val = false;
         arg += 3;
@@ -50,69 +133,17 @@ void parse_opt_flag(const char* arg) {
     }
 }
 
-// Add a statement as the final element in a basic block.
-static void append_to_block(BasicBlock* bb, Statement* st) {
-    if (bb->first == NULL) {
-        // If the list is empty set st to both the first and final entry...
-        bb->first = st;
-        bb->final = st;
-        // ...with no links.
-        st->last = NULL;
-        st->next = NULL;
-    } else {
-        // Otherwise set st to the last entry, update the old last entry's next
-        // link to st, and set st's last link to the old last.
-        st->last = bb->final;
-        bb->final->next = st;
-        bb->final = st;
-        st->next = NULL;
+// Count a jump to a label.
+static void reference_label(Function* func, const char* label) {
+    for (size_t k = 0; k < va_len(func->basic_blocks); k++) {
+        if (func->basic_blocks[k].label == NULL)
+            continue;
+        if (strequ(label, func->basic_blocks[k].label)) {
+            func->basic_blocks[k].ref_count += 1;
+            return;
+        }
     }
-    st->parent = bb;
-}
-
-// Remove a statement from a basic block
-static void remove_from_block(BasicBlock* bb, Statement* st) {
-    if (bb->first == st)
-        bb->first = st->next;
-    if (bb->final == st)
-        bb->final = st->last;
-    if (st->next)
-        st->next->last = st->last;
-    if (st->last)
-        st->last->next = st->next;
-}
-
-// Initiallize members of a new basic block.
-static void init_block(BasicBlock* bb, char* label) {
-    bb->label = label;
-    bb->ref_count = 0;
-    bb->first = NULL;
-    bb->final = NULL;
-}
-
-static void init_local(LocalVar** local, Statement* origin, uint8_t type) {
-    *local = malloc(sizeof(LocalVar));
-    LocalVar* this = *local;
-
-    this->origin = origin;
-    this->references = va_new(0);
-    this->type = type;
-    this->lifetime_start = 0;
-    this->lifetime_end = 0;
-    this->active_reg = 0;
-    this->reg_reallocs = va_new(0);
-}
-
-// Check if a local variable has a known, constant value.
-static bool is_local_const(LocalVar* local) {
-    return local->origin && local->origin->type == OPERATION
-           && ((Operation*) local->origin)->type == ASSIGN
-           && ((Operation*) local->origin)->rhs.is_const;
-}
-
-// Get the constant value assigned to a local variable.
-static inline Value* get_local_const(LocalVar* local) {
-    return &((Operation*) local->origin)->rhs;
+    error("Jump references nonexistant label \"%s\"", label);
 }
 
 // Count each time that a basic block is referenced by a jump.
@@ -122,54 +153,30 @@ void count_block_references(Function* func) {
     for (size_t i = 0; i < va_len(func->basic_blocks); i++) {
         for (Statement* this_state = func->basic_blocks[i].first; this_state; this_state = this_state->next) {
             if (this_state->type == JUMP) {
-                Jump* this_jump = ((Jump*) this_state);
-
-                for (size_t k = 0; k < va_len(func->basic_blocks); k++) {
-                    if (func->basic_blocks[k].label == NULL)
-                        continue;
-                    if (strequ(this_jump->label, func->basic_blocks[k].label)) {
-                        func->basic_blocks[k].ref_count += 1;
-                        goto found_label;
-                    }
-                }
-                error("Jump references nonexistant label \"%s\"", this_jump->label);
-            found_label:
-                continue;
+                reference_label(func, ((Jump*) this_state)->label);
+            } else if (this_state->type == BRANCH) {
+                reference_label(func, ((Branch*) this_state)->true_label);
+                reference_label(func, ((Branch*) this_state)->false_label);
             }
         }
     }
 }
 
-// Count each time that a local variable is referenced in a function.
+// Count each time that a local variable is referenced in a function. Any
+// previously collected references are discarded.
 void count_local_references(Function* func) {
+    LocalVar* this_local = NULL;
+    for (size_t i = 0; this_local = iterate_locals(func, &i); i++) {
+        va_free(this_local->references);
+        this_local->references = va_new(0);
+    }
+
     for (size_t i = 0; i < va_len(func->basic_blocks); i++) {
         for (Statement* this_state = func->basic_blocks[i].first; this_state; this_state = this_state->next) {
-            switch (this_state->type) {
-            case OPERATION: {
-                Operation* op = (Operation*) this_state;
-                switch (op->type) {
-                default:
-                    if (!op->rhs.is_const)
-                        va_append(func->locals[op->rhs.local_id]->references, &op->rhs.local_id);
-                    // fallthrough
-                case NOT: case NEGATE: case COMPLEMENT: case ADDRESS: case DEREFERENCE:
-                    va_append(func->locals[op->lhs]->references, &op->lhs);
-                    break; // unops
-                case ASSIGN:
-                    if (!op->rhs.is_const)
-                        va_append(func->locals[op->rhs.local_id]->references, &op->rhs.local_id);
-                    break; //assign
-                }
-            } break;
-            case WRITE:
-                va_append(get_local(func, ((Write*) this_state)->src)->references, &((Write*) this_state)->src);
-                break;
-            case RETURN: {
-                Return* ret = (Return*) this_state;
-                if (!ret->val.is_const)
-                    va_append(get_local(func, ret->val.local_id)->references, &ret->val.local_id);
-            } break;
-            }
+            uint64_t** operands = statement_operands(this_state);
+            for (size_t j = 0; j < va_len(operands); j++)
+                va_append(get_local(func, *operands[j])->references, operands[j]);
+            va_free(operands);
         }
     }
 }
@@ -196,6 +203,12 @@ void generate_local_vars(Function* func) {
                 new_index = ((Operation*) this_state)->dest;
                 type = ((Operation*) this_state)->var_type;
                 break;
+            case CALL:
+                if (((Call*) this_state)->var_type == VOID)
+                    continue;
+                new_index = ((Call*) this_state)->dest;
+                type = ((Call*) this_state)->var_type;
+                break;
             default:
                 continue;
             }
@@ -237,7 +250,7 @@ void generate_basic_blocks(Function* func) {
                 error("Label \"%s\" is not followed by a jump; implicit fallthroughs are not allowed.",
                       new_block->label);
             }
-        } else if (statement_type == JUMP || statement_type == RETURN) {
+        } else if (statement_type == JUMP || statement_type == BRANCH || statement_type == RETURN) {
             append_to_block(last_block, func->statements[i]);
             for (i++; i < va_len(func->statements); i++) {
                 if (func->statements[i]->type != LABEL) {
@@ -254,6 +267,7 @@ void generate_basic_blocks(Function* func) {
         }
     }
 
+    update_block_parents(func);
     count_block_references(func);
 }
 
@@ -270,6 +284,7 @@ void remove_unused_blocks(Function* func) {
         }
     }
     // After removing code, block references must be updated.
+    update_block_parents(func);
     count_block_references(func);
 }
 
@@ -297,6 +312,58 @@ void remove_unused_fallthroughs(Function* func) {
             i -= 1; // Handle the change in size by offsetting i.
         }
     }
+    update_block_parents(func);
+}
+
+// Find the label which a jump to `label` finally reaches, passing through any
+// blocks which do nothing but jump.
+static char* final_target(Function* func, char* label) {
+    // A chain passes through each block at most once unless it loops forever.
+    for (size_t steps = 0; steps < va_len(func->basic_blocks); steps++) {
+        size_t block = find_block(func, label);
+        if (block == NO_BLOCK)
+            break;
+        Statement* first = func->basic_blocks[block].first;
+        if (first == NULL || first->type != JUMP)
+            break;
+        label = ((Jump*) first)->label;
+    }
+    return label;
+}
+
+static void retarget(Function* func, char** label) {
+    char* target = final_target(func, *label);
+    if (target == *label)
+        return;
+    char* copy = malloc(strlen(target) + 1);
+    strcpy(copy, target);
+    free(*label);
+    *label = copy;
+}
+
+// Send jumps and branches which land on a block containing only a jump straight
+// to that jump's target, and remove any blocks which are no longer reached.
+void thread_jumps(Function* func) {
+    for (size_t i = 0; i < va_len(func->basic_blocks); i++) {
+        Statement* final = func->basic_blocks[i].final;
+        if (final == NULL)
+            continue;
+
+        if (final->type == JUMP) {
+            retarget(func, &((Jump*) final)->label);
+        } else if (final->type == BRANCH) {
+            Branch* br = (Branch*) final;
+            retarget(func, &br->true_label);
+            retarget(func, &br->false_label);
+            // A branch whose sides meet needs no condition.
+            if (strequ(br->true_label, br->false_label))
+                replace_with_jump(func, final, br->true_label);
+        }
+    }
+
+    count_block_references(func);
+    remove_unused_blocks(func);
+    remove_unused_fallthroughs(func);
 }
 
 // Remove needless casting assignments, such as `u8 %0 = 1; u8 %1 = %0;`.
@@ -308,124 +375,187 @@ void remove_unused_casts(Function* func) {
         if (this_local->origin && this_local->origin->type == OPERATION) {
             Operation* origin_op = (Operation*) this_local->origin;
 
-            if (origin_op->type == ASSIGN && !origin_op->rhs.is_const && this_local->type == func->locals[origin_op->rhs.local_id]->type) {
-                for (size_t j = 0; j < va_len(this_local->references); j++) {
-                    *this_local->references[j] = origin_op->rhs.local_id;
-                }
+            if (origin_op->type != ASSIGN || origin_op->rhs.is_const)
+                continue;
 
-                remove_from_block(this_local->origin->parent, this_local->origin);
+            LocalVar* src = func->locals[origin_op->rhs.local_id];
+            if (this_local->type == src->type) {
+                replace_local_uses(func, i, origin_op->rhs.local_id);
+                delete_local(func, i);
+                continue;
+            }
 
-                free_local_var(this_local);
-                func->locals[i] = NULL;
+            // Widening a value and truncating it back gives the original value,
+            // such as `u16 %1 = %0; u8 %2 = %1;`.
+            if (src->origin && src->origin->type == OPERATION) {
+                Operation* src_op = (Operation*) src->origin;
+
+                if (src_op->type == ASSIGN && !src_op->rhs.is_const
+                    && this_local->type == func->locals[src_op->rhs.local_id]->type
+                    && type_widths[src->type] >= type_widths[this_local->type]
+                    && this_local->type != F32 && this_local->type != F64) {
+                    replace_local_uses(func, i, src_op->rhs.local_id);
+                    delete_local(func, i);
+                }
             }
         }
 
     }
 }
 
-void fold_constant_operations(Function* func) {
-    LocalVar* this_local = NULL;
-    for (size_t i = 0; this_local = iterate_locals(func, &i); i++) {
-        if (func->locals[i]->origin && func->locals[i]->origin->type == OPERATION) {
-            Operation* origin_op = (Operation*) this_local->origin;
+// Check if a statement must be kept even if nothing reads its result.
+// Dereferences are assumed to touch hardware registers, where reading has an
+// effect of its own. Calls are kept unless the callee is marked `pure`.
+static bool has_side_effects(Statement* statement) {
+    switch (statement->type) {
+    case READ: return false;
+    case OPERATION: return ((Operation*) statement)->type == DEREFERENCE;
+    case CALL: return !has_trait(&((Call*) statement)->callee->declaration, "pure");
+    }
+    return true;
+}
 
-            switch (origin_op->type) {
-            case NOT: case NEGATE: case COMPLEMENT:
-                if (!is_local_const(func->locals[origin_op->lhs]))
-                    break;
-                Value* const_val = get_local_const(func->locals[origin_op->lhs]);
+// Remove statements whose results are never read and which have no side
+// effects. Removing a statement may leave its own operands unused, so those are
+// revisited until nothing else can be removed.
+void remove_dead_code(Function* func) {
+    uint64_t* worklist = va_new(0);
 
-                switch (origin_op->type) {
-                case NOT:
-                    origin_op->rhs.const_unsigned = !const_val->const_unsigned;
-                    break;
-                case NEGATE:
-                    origin_op->rhs.is_signed = true;
-                    origin_op->rhs.const_signed = -const_val->const_signed;
-                    break;
-                case COMPLEMENT:
-                    origin_op->rhs.const_unsigned = ~const_val->const_unsigned;
-                    break;
-                }
-                origin_op->type = ASSIGN;
-                origin_op->rhs.is_const = true;
-                origin_op->rhs.is_signed = false;
-                break;
-            case ASSIGN: case ADDRESS: case DEREFERENCE:
-                continue;
-            default:
-                if (!is_local_const(func->locals[origin_op->lhs]))
-                    break;
-                if (!origin_op->rhs.is_const && !is_local_const(func->locals[origin_op->rhs.local_id]))
-                    break;
+    LocalVar* this_local = NULL;
+    for (size_t i = 0; this_local = iterate_locals(func, &i); i++)
+        va_append(worklist, (uint64_t) i);
 
-                Value* lhs_val = get_local_const(func->locals[origin_op->lhs]);
-                Value* rhs_val = origin_op->rhs.is_const ? &origin_op->rhs : get_local_const(func->locals[origin_op->lhs]);
-                bool is_signed = lhs_val->is_signed || rhs_val->is_signed;
-
-                // This big, ugly macro helps avoid some big, ugly code.
-                // Just imagine 18 of these in a switch statement.
-                #define FOLD_BINOP(type, op) \
-                    case type: \
-                    if (is_signed) \
-                        origin_op->rhs.const_signed = (lhs_val->is_signed ? \
-                                                       lhs_val->const_signed : \
-                                                       lhs_val->const_unsigned) \
-                                                    op (rhs_val->is_signed ? \
-                                                        rhs_val->const_signed : \
-                                                        rhs_val->const_unsigned); \
-                    else \
-                        origin_op->rhs.const_unsigned = lhs_val->const_unsigned \
-                                                        op rhs_val->const_unsigned; \
-                    break
-
-                switch (origin_op->type) {
-                    FOLD_BINOP(ADD, +);
-                    FOLD_BINOP(SUB, -);
-                    FOLD_BINOP(MUL, *);
-                    FOLD_BINOP(DIV, /);
-                    FOLD_BINOP(MOD, %);
-                    FOLD_BINOP(B_AND, &&);
-                    FOLD_BINOP(B_OR, ||);
-                    FOLD_BINOP(B_XOR, ^);
-                    FOLD_BINOP(L_AND, &);
-                    FOLD_BINOP(L_OR, |);
-                    FOLD_BINOP(LSH, <<);
-                    FOLD_BINOP(RSH, >>);
-                    FOLD_BINOP(LESS, <);
-                    FOLD_BINOP(GREATER, >);
-                    FOLD_BINOP(LESS_EQU, <=);
-                    FOLD_BINOP(GREATER_EQU, >=);
-                    FOLD_BINOP(NOT_EQU, !=);
-                    FOLD_BINOP(EQU, ==);
-                }
+    while (va_len(worklist)) {
+        uint64_t id = va_last(worklist);
+        va_remove(worklist, va_len(worklist) - 1);
 
-                #undef FOLD_BINOP
+        LocalVar* local = func->locals[id];
+        // Parameters have no origin, and are never removed.
+        if (local == NULL || local->origin == NULL || va_len(local->references)
+            || has_side_effects(local->origin))
+            continue;
 
-                origin_op->type = ASSIGN;
-                origin_op->rhs.is_const = true;
-                origin_op->rhs.is_signed = is_signed;
-                break;
-            }
-        }
+        uint64_t** operands = statement_operands(local->origin);
+        for (size_t i = 0; i < va_len(operands); i++)
+            va_append(worklist, *operands[i]);
+        va_free(operands);
+
+        delete_local(func, id);
     }
+
+    va_free(worklist);
 }
 
 // Run various optimizations according to the user's options.
 void optimize_ir(Declaration** decls) {
-    // Remove unused basic blocks.
-    for (size_t i = 0; i < va_len(decls); i++) {
-        if (decls[i]->is_fn) {
-            Function* func = (Function*) decls[i];
-
-            if (remove_unused) {
-                remove_unused_blocks(func);
-                remove_unused_fallthroughs(func);
-                remove_unused_casts(func);
-            }
-            if (fold_constants) {
-                fold_constant_operations(func);
-            }
+    if (profile_path)
+        load_profile(profile_path);
+
+    // Each function is optimized after the functions it calls, so that they
+    // are as small as they will get by the time they are considered for
+    // inlining.
+    size_t limit = DEFAULT_UNROLL_LIMIT;
+    if (unroll_limit) {
+        char* end;
+        limit = strtoul(unroll_limit, &end, 0);
+        if (*unroll_limit == '\0' || *end != '\0')
+            error("Invalid unroll limit \"%s\".", unroll_limit);
+    }
+
+    Function** order = order_call_graph(decls);
+    Function** called = find_called_functions(decls);
+    if (forward_memory)
+        summarize_global_writes(decls);
+    // Each function's loops share what is left of its unrolling budget.
+    size_t* budgets = malloc(va_len(order) * sizeof(size_t));
+    for (size_t i = 0; i < va_len(order); i++)
+        budgets[i] = limit;
+
+    for (size_t i = 0; i < va_len(order); i++) {
+        Function* func = order[i];
+
+        if (inline_functions) {
+            inline_calls(func, decls);
+        }
+        // Remove unused basic blocks.
+        if (remove_unused) {
+            remove_unused_blocks(func);
+            remove_unused_fallthroughs(func);
+            remove_unused_casts(func);
+        }
+        if (fold_constants) {
+            propagate_constants(func);
+        }
+        if (thread) {
+            thread_jumps(func);
+        }
+        if (narrow) {
+            narrow_types(func);
+        }
+        if (strength_reduce) {
+            reduce_strength(func);
+        }
+        if (global_value_numbering) {
+            number_values(func);
+        }
+        if (forward_memory) {
+            forward_memory_values(func);
+        }
+        if (loop_invariants) {
+            hoist_invariants(func);
+        }
+        // Each copy of an unrolled loop knows its induction variable, which
+        // leaves plenty to fold.
+        if (unroll && unroll_loops(func, &budgets[i])) {
+            if (forward_memory)
+                forward_memory_values(func);
+            if (fold_constants)
+                propagate_constants(func);
+            if (thread)
+                thread_jumps(func);
+        }
+        if (dead_code) {
+            remove_dead_code(func);
+        }
+        if (merge_tails) {
+            merge_block_tails(func);
+        }
+    }
+
+    // Loop counters are changed in place, which no pass before this point
+    // expects of a local, so they wait until nothing more will be inlined.
+    for (size_t i = 0; i < va_len(order); i++) {
+        Function* func = order[i];
+
+        if (counted_loops && lower_counted_loops(func) && dead_code) {
+            remove_dead_code(func);
+        }
+        // The profile describes blocks as they were when it was
+        // collected, which is after every pass that changes them.
+        apply_profile(func);
+        if (unroll && unroll_hot_loops(func, &budgets[i]) && dead_code) {
+            remove_dead_code(func);
+        }
+        if (block_layout) {
+            layout_blocks(func);
+        }
+    }
+
+    if (inline_functions)
+        remove_uncalled_functions(decls, called);
+    // Forwarding may have taken away the last read of a static global, which
+    // leaves its writes and whatever computed their values dead.
+    if (forward_memory && remove_unread_globals(decls) && dead_code) {
+        for (size_t i = 0; i < va_len(decls); i++) {
+            if (has_body(decls[i]))
+                remove_dead_code((Function*) decls[i]);
         }
     }
+    // Functions are only alike once nothing more will change them.
+    if (merge_functions)
+        fold_identical_functions(decls);
+    va_free(order);
+    va_free(called);
+    free(budgets);
+    free_profile();
 }
@@ -92,11 +92,18 @@ void fexpect(FILE* f, char* str, char* context) {
 }
 
 // Determines if the following value is a local variable, signed constant, or
-// unsigned constant.
+// unsigned constant. A constant may be negative, as folded signed constants are
+// printed.
 void fdetermine_const_value(FILE* infile, Value* val) {
     val->is_const = true;
+    fskip_space(infile);
+    bool negative = fpeek(infile) == '-';
+    if (negative)
+        fgetc(infile);
     // TODO: this does not yet handle unsigned integers which use the 64th bit.
     val->const_signed = fget_int64(infile);
+    if (negative)
+        val->const_signed = -val->const_signed;
     val->is_signed = val->const_signed < 0;
 }
 
@@ -112,9 +119,40 @@ void fdetermine_value(FILE* infile, Value* val) {
     }
 }
 
-// Read a statement from an IR file.
-Statement* fget_statement(FILE* infile) {
-    char* first_token = fmgets(infile);
+// Read the callee and argument list of a call statement, up to and including
+// its semicolon.
+Call* fget_call(FILE* infile, uint8_t var_type, uint64_t dest) {
+    Call* call = malloc(sizeof(Call));
+    call->statement.type = CALL;
+    call->var_type = var_type;
+    call->dest = dest;
+    call->callee = NULL;
+    call->args = va_new(0);
+
+    call->function = fmgetx(infile, "(;" WHITESPACE);
+    fexpect(infile, "(", "function name in call statement");
+    fskip_space(infile);
+    while (fpeek(infile) != ')') {
+        Value arg;
+        fdetermine_value(infile, &arg);
+        va_append(call->args, arg);
+        fskip_space(infile);
+        char next_char = fpeek(infile);
+        if (next_char == ',')
+            fgetc(infile);
+        else if (next_char != ')')
+            fatal("Unexpected character '%c' in arguments of call to \"%s\"", next_char, call->function);
+        fskip_space(infile);
+    }
+    fgetc(infile); // Skip closing parentheses.
+    fexpect(infile, ";", "call statement");
+    return call;
+}
+
+// Read a statement from an IR file, within a function returning `return_type`.
+Statement* fget_statement(FILE* infile, uint8_t return_type) {
+    // A return from a function returning void is followed directly by ';'.
+    char* first_token = fmgetx(infile, ";" WHITESPACE);
 
     if (strinstrs(first_token, TYPE) != -1) {
         fexpect(infile, "%", "local variable declaration.");
@@ -133,7 +171,7 @@ Statement* fget_statement(FILE* infile) {
 
         if (fpeek(infile) == '%') {
             fgetc(infile);
-            Operation* op = malloc(sizeof(Operation));
+            Operation* op = calloc(1, sizeof(Operation));
             op->statement.type = OPERATION;
             op->var_type = strinstrs(first_token, TYPE);
             op->dest = dest;
@@ -173,7 +211,7 @@ Statement* fget_statement(FILE* infile) {
             free(first_token);
             return &op->statement;
         } else if (strchr(NUMBERS, fpeek(infile))) {
-            Operation* op = malloc(sizeof(Operation));
+            Operation* op = calloc(1, sizeof(Operation));
             op->statement.type = OPERATION;
             op->var_type = strinstrs(first_token, TYPE);
             op->dest = dest;
@@ -182,14 +220,31 @@ Statement* fget_statement(FILE* infile) {
             fdetermine_const_value(infile, &op->rhs);
             fexpect(infile, ";", "assign operation");
 
+            // Unary operators on a constant can be applied immediately.
+            switch (unop) {
+            case '-': op->rhs.const_signed = -op->rhs.const_signed; break;
+            case '!': op->rhs.const_signed = !op->rhs.const_signed; break;
+            case '~': op->rhs.const_signed = ~op->rhs.const_signed; break;
+            }
+            op->rhs.is_signed = op->rhs.const_signed < 0;
+
             free(first_token);
             return &op->statement;
         } else {
+            char* src = fmgetx(infile, ";(" WHITESPACE);
+            if (strequ(src, "call")) {
+                Call* call = fget_call(infile, strinstrs(first_token, TYPE), dest);
+                free(src);
+                free(first_token);
+                return &call->statement;
+            }
+
             Read* rd = malloc(sizeof(Read));
             rd->statement.type = READ;
             rd->var_type = strinstrs(first_token, TYPE);
             rd->dest = dest;
-            rd->src = fmgetx(infile, ";" WHITESPACE);
+            rd->src = src;
+            rd->global = NULL;
             fexpect(infile, ";", "variable identifier in read statement");
 
             free(first_token);
@@ -212,11 +267,42 @@ Statement* fget_statement(FILE* infile) {
         Return* ret = malloc(sizeof(Return));
         ret->statement.type = RETURN;
 
-        fdetermine_value(infile, &ret->val);
+        // Functions which return void return nothing, which is held as 0.
+        fskip_space(infile);
+        if (return_type == VOID) {
+            if (fpeek(infile) != ';')
+                fatal("A return from a function which returns void can not have a value.");
+            ret->val = (Value) {.is_const = true, .const_unsigned = 0};
+        } else {
+            if (fpeek(infile) == ';')
+                fatal("A return from a function which returns %s must have a value.", TYPE[return_type]);
+            fdetermine_value(infile, &ret->val);
+        }
         fexpect(infile, ";", "return statement");
 
         free(first_token);
         return &ret->statement;
+    } else if (strequ(first_token, "call")) {
+        // A call whose result, if any, is discarded.
+        Call* call = fget_call(infile, VOID, 0);
+
+        free(first_token);
+        return &call->statement;
+    } else if (strequ(first_token, "jmp") && fpeek(infile) == '%') {
+        Branch* br = malloc(sizeof(Branch));
+        br->statement.type = BRANCH;
+        br->countdown = false;
+
+        fgetc(infile);
+        br->cond = fget_int64x(infile, "?" WHITESPACE SYMBOLS);
+        fexpect(infile, "?", "branch condition");
+        br->true_label = fmgetx(infile, ":" WHITESPACE);
+        fexpect(infile, ":", "branch label");
+        br->false_label = fmgetx(infile, ";" WHITESPACE);
+        fexpect(infile, ";", "branch statement");
+
+        free(first_token);
+        return &br->statement;
     } else if (strequ(first_token, "jmp")) {
         Jump* jmp = malloc(sizeof(Jump));
         jmp->statement.type = JUMP;
@@ -230,6 +316,7 @@ Statement* fget_statement(FILE* infile) {
         Write* wrt = malloc(sizeof(Write));
         wrt->statement.type = WRITE;
         wrt->dest = first_token;
+        wrt->global = NULL;
         fexpect(infile, "=%", "variable identifier");
         wrt->src = fget_int64x(infile, ";");
         fexpect(infile, ";", "local variable in write statement");
@@ -266,8 +353,8 @@ Declaration* fget_declaration(FILE* infile) {
     // Collect name.
     identifier = next_string;
 
-    // Parse parameters.
-    if ((strequ(storage_class, "export") || strequ(storage_class, "static")) && strequ(decl_type, "fn")) {
+    // Parse parameters. Functions defined elsewhere list only their parameters.
+    if (strequ(decl_type, "fn")) {
         if (getc(infile) != '(')
             fatal("Expected ( to begin function parameter list of \"%s\".", identifier);
         if (fpeek(infile) != ')') {
@@ -283,20 +370,25 @@ Declaration* fget_declaration(FILE* infile) {
         }
         fgetc(infile); // Skip closing parentheses.
         fskip_space(infile);
-        char open_brace = fgetc(infile);
-        fskip_space(infile);
-        if (open_brace != '{')
-            fatal("Declaration of function \"%s\" missing opening brace ({).", identifier);
-
-        statement_block = va_new(0);
-        while (fpeek(infile) != '}') {
-            Statement* statement = fget_statement(infile);
+        if (strequ(storage_class, "extern")) {
+            if (getc(infile) != ';')
+                fatal("Declaration of extern function \"%s\" missing closing semicolon (;).", identifier);
+        } else {
+            char open_brace = fgetc(infile);
             fskip_space(infile);
-            va_append(statement_block, statement);
+            if (open_brace != '{')
+                fatal("Declaration of function \"%s\" missing opening brace ({).", identifier);
+
+            statement_block = va_new(0);
+            while (fpeek(infile) != '}') {
+                Statement* statement = fget_statement(infile, strinstrs(var_type, TYPE));
+                fskip_space(infile);
+                va_append(statement_block, statement);
+            }
+            fgetc(infile);
         }
-        fgetc(infile);
     } else if (getc(infile) != ';')
-        fatal("Declaration of %s \"%s\" missing closing semicolon (;).", strequ(decl_type, "fn") ? "function" : "variable", identifier);
+        fatal("Declaration of variable \"%s\" missing closing semicolon (;).", identifier);
 
     Declaration* decl = malloc(sizeof(Declaration));
     decl->storage_class = strinstrs(storage_class, STORAGE_CLASS);
@@ -304,6 +396,7 @@ Declaration* fget_declaration(FILE* infile) {
     decl->traits = trait_list;
     decl->type = strinstrs(var_type, TYPE);
     decl->is_fn = strequ(decl_type, "fn");
+    decl->module = 0;
     if (decl->is_fn) {
         decl = realloc(decl, sizeof(Function));
         Function* func = (Function*) decl;
@@ -313,8 +406,21 @@ Declaration* fget_declaration(FILE* infile) {
             func->parameter_types[i] = strinstrs(parameter_types[i], TYPE);
         }
         func->statements = statement_block;
-        generate_basic_blocks(func);
-        generate_local_vars(func);
+        func->basic_blocks = NULL;
+        func->locals = NULL;
+        func->loops = NULL;
+        func->is_recursive = false;
+        func->parameter_regs = NULL;
+        func->result_reg = NULL;
+        func->clobbers = ALL_REGISTERS;
+        func->cycles = 0;
+        func->bank = 0;
+        func->writes = NULL;
+        func->aliases = NULL;
+        if (statement_block) {
+            generate_basic_blocks(func);
+            generate_local_vars(func);
+        }
     }
 
     free(storage_class);
@@ -325,6 +431,15 @@ Declaration* fget_declaration(FILE* infile) {
     return decl;
 }
 
+// Find the declaration of a global variable. Returns NULL if it is not declared.
+static Declaration* find_global(Declaration** decl_list, const char* identifier) {
+    for (size_t i = 0; i < va_len(decl_list); i++) {
+        if (!decl_list[i]->is_fn && strequ(decl_list[i]->identifier, identifier))
+            return decl_list[i];
+    }
+    return NULL;
+}
+
 // Parse an entire file, including all declarations and statements, and return
 // a VArray of declarations.
 Declaration** fparse_textual_ir(FILE* infile) {
@@ -334,5 +449,55 @@ Declaration** fparse_textual_ir(FILE* infile) {
         Declaration* decl = fget_declaration(infile);
         va_append(decl_list, decl);
     }
+
+    // The CPU enters an interrupt handler with nothing to pass it, and nothing to
+    // return to but the code which was interrupted.
+    for (size_t i = 0; i < va_len(decl_list); i++) {
+        Declaration* decl = decl_list[i];
+        if (is_interrupt_handler(decl) && (decl->type != VOID || ((Function*) decl)->parameter_count))
+            fatal("Interrupt handler \"%s\" must return void and take no parameters.", decl->identifier);
+    }
+
+    // Calls and globals may be declared later in the file, so they are only
+    // resolved once every declaration is known.
+    for (size_t i = 0; i < va_len(decl_list); i++) {
+        if (!has_body(decl_list[i]))
+            continue;
+        Function* func = (Function*) decl_list[i];
+        for (size_t j = 0; j < va_len(func->statements); j++) {
+            if (func->statements[j]->type == READ) {
+                Read* read = (Read*) func->statements[j];
+                read->global = find_global(decl_list, read->src);
+                continue;
+            }
+            if (func->statements[j]->type == WRITE) {
+                Write* write = (Write*) func->statements[j];
+                write->global = find_global(decl_list, write->dest);
+                continue;
+            }
+            if (func->statements[j]->type != CALL)
+                continue;
+            Call* call = (Call*) func->statements[j];
+            for (size_t k = 0; k < va_len(decl_list) && !call->callee; k++) {
+                if (strequ(decl_list[k]->identifier, call->function))
+                    call->callee = (Function*) decl_list[k];
+            }
+            if (!call->callee || !call->callee->declaration.is_fn)
+                fatal("\"%s\" calls \"%s\", which is not a declared function.", func->declaration.identifier, call->function);
+            if (is_interrupt_handler(&call->callee->declaration))
+                fatal("\"%s\" calls \"%s\", which is an interrupt handler.", func->declaration.identifier, call->function);
+            if (va_len(call->args) != call->callee->parameter_count)
+                fatal("\"%s\" calls \"%s\" with %zu arguments, but it takes %zu.", func->declaration.identifier,
+                      call->function, va_len(call->args), call->callee->parameter_count);
+            for (size_t k = 0; k < va_len(call->args); k++) {
+                if (!call->args[k].is_const && type_widths[get_local(func, call->args[k].local_id)->type]
+                                                   != type_widths[call->callee->parameter_types[k]])
+                    fatal("Argument %zu of the call to \"%s\" in \"%s\" does not match the width of its parameter.",
+                          k, call->function, func->declaration.identifier);
+            }
+            if (call->var_type != VOID && call->callee->declaration.type == VOID)
+                fatal("\"%s\" uses the result of \"%s\", which returns void.", func->declaration.identifier, call->function);
+        }
+    }
     return decl_list;
 }
@@ -0,0 +1,277 @@
+#define _POSIX_C_SOURCE 200809L
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "exception.h"
+#include "optimizer.h"
+#include "parser.h"
+#include "varray.h"
+
+// Profile-guided optimization. A profile is a text file giving how many times
+// each block ran, one `<symbol> <count>` pair per line, where the symbol is the
+// block's assembly label as listed in the symbol map. Blank lines and lines
+// beginning with `;` are ignored. Counts are attached to blocks before layout,
+// where they replace the loop-based estimates of `block_weight()`; every block
+// the profile does not mention is taken to be cold.
+//
+// An emulator can instead report how many times each address ran, one
+// `[<bank>:]<address> <count>` line per address, in hexadecimal as the linker
+// writes them. Given the linker's symbol file for the same build, each address
+// is traced to the labels there. A block's count is how many times its first
+// instruction ran, at its label. An address without a bank matches a label in
+// any bank.
+
+typedef struct ProfileEntry {
+    char* symbol;
+    uint64_t count;
+} ProfileEntry;
+
+// Where a label was placed, as listed in the linker's symbol file.
+typedef struct SymbolAddress {
+    char* symbol;
+    unsigned bank;
+    unsigned address;
+} SymbolAddress;
+
+// The path of the profile to use, or NULL.
+const char* profile_path = NULL;
+// The path of the symbol file which addresses in the profile are looked up in,
+// or NULL if the profile names symbols itself.
+const char* profile_symbols_path = NULL;
+// Where the symbol of each block is listed, or NULL.
+FILE* symbol_map = NULL;
+
+static ProfileEntry* profile = NULL;
+
+// Get the assembly label of a block. The entry block is labelled by its
+// function, and every other block by a local label within it. The returned
+// string must be freed.
+char* block_symbol(Function* func, size_t block) {
+    const char* name = func->declaration.identifier;
+    const char* label = func->basic_blocks[block].label;
+    if (block == 0 || label == NULL)
+        return strdup(name);
+
+    size_t length = snprintf(NULL, 0, "%s.%s", name, label) + 1;
+    char* symbol = malloc(length);
+    snprintf(symbol, length, "%s.%s", name, label);
+    return symbol;
+}
+
+static int compare_addresses(const void* a, const void* b) {
+    const SymbolAddress* x = a;
+    const SymbolAddress* y = b;
+
+    if (x->address != y->address)
+        return x->address < y->address ? -1 : 1;
+    return 0;
+}
+
+// Read a symbol file from the linker, which lists one `<bank>:<address>
+// <symbol>` line per label. Returns a new VArray sorted by address, or NULL if
+// the file could not be read.
+static SymbolAddress* read_symbol_file(const char* path) {
+    FILE* in = fopen(path, "r");
+    if (in == NULL) {
+        error("Failed to open symbol file %s.", path);
+        return NULL;
+    }
+
+    SymbolAddress* symbols = va_new(0);
+    char* line = NULL;
+    size_t capacity = 0;
+    for (size_t line_no = 1; getline(&line, &capacity, in) != -1; line_no++) {
+        SymbolAddress entry;
+        char symbol[256];
+        char extra;
+
+        if (sscanf(line, " %c", &extra) != 1 || extra == ';')
+            continue;
+        if (sscanf(line, " %x:%x %255s %c", &entry.bank, &entry.address, symbol, &extra) != 3) {
+            error("%s:%zu: Expected a bank, an address and a symbol.", path, line_no);
+            continue;
+        }
+        entry.symbol = strdup(symbol);
+        va_append(symbols, entry);
+    }
+
+    free(line);
+    fclose(in);
+    qsort(symbols, va_len(symbols), sizeof(SymbolAddress), compare_addresses);
+    return symbols;
+}
+
+// Credit a count to every label at an address, in the given bank unless any
+// bank will do.
+static void add_address_count(SymbolAddress* symbols, bool banked, unsigned bank, unsigned address,
+                              uint64_t count) {
+    SymbolAddress key = {NULL, bank, address};
+    SymbolAddress* found = bsearch(&key, symbols, va_len(symbols), sizeof(SymbolAddress), compare_addresses);
+    if (found == NULL)
+        return;
+
+    while (found > symbols && found[-1].address == address)
+        found--;
+    for (; found < symbols + va_len(symbols) && found->address == address; found++) {
+        if (banked && found->bank != bank)
+            continue;
+        ProfileEntry entry = {strdup(found->symbol), count};
+        va_append(profile, entry);
+    }
+}
+
+void load_profile(const char* path) {
+    SymbolAddress* symbols = NULL;
+    if (profile_symbols_path && (symbols = read_symbol_file(profile_symbols_path)) == NULL)
+        return;
+
+    FILE* in = fopen(path, "r");
+    if (in == NULL) {
+        error("Failed to open profile %s.", path);
+        return;
+    }
+
+    profile = va_new(0);
+    char* line = NULL;
+    size_t capacity = 0;
+    for (size_t line_no = 1; getline(&line, &capacity, in) != -1; line_no++) {
+        char symbol[256];
+        uint64_t count;
+        char extra;
+
+        if (sscanf(line, " %c", &extra) != 1 || extra == ';')
+            continue;
+
+        // Each address is either given with its bank, as in the symbol file,
+        // or on its own.
+        if (symbols) {
+            unsigned bank = 0;
+            unsigned address;
+            bool banked = sscanf(line, " %x:%x %" SCNu64 " %c", &bank, &address, &count, &extra) == 3;
+            if (!banked && sscanf(line, " %x %" SCNu64 " %c", &address, &count, &extra) != 2) {
+                error("%s:%zu: Expected an address and a count.", path, line_no);
+                continue;
+            }
+            add_address_count(symbols, banked, bank, address, count);
+            continue;
+        }
+
+        if (sscanf(line, " %255s %" SCNu64 " %c", symbol, &count, &extra) != 2) {
+            error("%s:%zu: Expected a symbol and a count.", path, line_no);
+            continue;
+        }
+
+        ProfileEntry entry = {strdup(symbol), count};
+        va_append(profile, entry);
+    }
+
+    if (symbols) {
+        for (size_t i = 0; i < va_len(symbols); i++)
+            free(symbols[i].symbol);
+        va_free(symbols);
+    }
+    free(line);
+    fclose(in);
+}
+
+void free_profile() {
+    if (profile == NULL)
+        return;
+    for (size_t i = 0; i < va_len(profile); i++)
+        free(profile[i].symbol);
+    va_free(profile);
+    profile = NULL;
+}
+
+// Look up how many times a block ran. Blocks which the profile does not
+// mention never ran. Repeated symbols are added together, so profiles from
+// several runs may simply be concatenated.
+static uint64_t profile_count(Function* func, size_t block) {
+    char* symbol = block_symbol(func, block);
+    uint64_t count = 0;
+
+    for (size_t i = 0; i < va_len(profile); i++) {
+        if (strequ(profile[i].symbol, symbol))
+            count += profile[i].count;
+    }
+    free(symbol);
+    return count;
+}
+
+// Attach the loaded profile's counts to a function's blocks, and weigh each
+// block by how many times it runs per call. A block which ran at all weighs at
+// least 1, leaving a weight of 0 for cold blocks.
+void apply_profile(Function* func) {
+    if (profile == NULL)
+        return;
+
+    for (size_t i = 0; i < va_len(func->basic_blocks); i++)
+        func->basic_blocks[i].profile_count = profile_count(func, i);
+
+    uint64_t calls = func->basic_blocks[0].profile_count;
+    for (size_t i = 0; i < va_len(func->basic_blocks); i++) {
+        BasicBlock* bb = &func->basic_blocks[i];
+        if (calls == 0 || bb->profile_count == 0) {
+            bb->profile_weight = 0;
+        } else {
+            bb->profile_weight = (bb->profile_count + calls / 2) / calls;
+            if (bb->profile_weight == 0)
+                bb->profile_weight = 1;
+        }
+    }
+}
+
+// List the symbol of each of a function's blocks, so that the addresses an
+// emulator reports can be traced back to blocks.
+void write_symbol_map(FILE* out, Function* func) {
+    for (size_t i = 0; i < va_len(func->basic_blocks); i++) {
+        char* symbol = block_symbol(func, i);
+        const char* label = func->basic_blocks[i].label;
+        fprintf(out, "block %s %s %s\n", symbol, func->declaration.identifier, i == 0 || label == NULL ? "-" : label);
+        free(symbol);
+    }
+}
+
+// Convert a dump of the block counters into a profile. The dump holds each
+// 16-bit counter in little-endian order, starting at `block_counters`, and the
+// symbol map's counter table says which block each one belongs to.
+void convert_counter_dump(FILE* out, FILE* map, FILE* dump) {
+    char** symbols = va_new(0);
+    char* line = NULL;
+    size_t capacity = 0;
+
+    while (getline(&line, &capacity, map) != -1) {
+        size_t index;
+        char symbol[256];
+
+        if (sscanf(line, "counter %zu %255s", &index, symbol) != 2)
+            continue;
+        while (va_len(symbols) <= index) {
+            char* none = NULL;
+            va_append(symbols, none);
+        }
+        free(symbols[index]);
+        symbols[index] = strdup(symbol);
+    }
+
+    for (size_t i = 0; i < va_len(symbols); i++) {
+        int low = fgetc(dump);
+        int high = fgetc(dump);
+        if (low == EOF || high == EOF) {
+            error("The counter dump ends after %zu of %zu counters.", i, va_len(symbols));
+            break;
+        }
+        if (symbols[i])
+            fprintf(out, "%s %u\n", symbols[i], (unsigned) (low | high << 8));
+    }
+    if (va_len(symbols) == 0)
+        warn("The symbol map has no counter table; was it written with -finstrument-blocks?");
+
+    for (size_t i = 0; i < va_len(symbols); i++)
+        free(symbols[i]);
+    va_free(symbols);
+    free(line);
+}
@@ -0,0 +1,564 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "optimizer.h"
+#include "registers.h"
+#include "statements.h"
+#include "varray.h"
+
+// Value-range narrowing. The interval of values each local may hold is found
+// from the operations which compute it, and any local which provably fits in a
+// narrower type is retyped, so that it can be worked on with the far cheaper
+// 8-bit instructions. Narrowed operations read their operands through casts,
+// which truncate for free, while any use which still needs the original width
+// reads a widened copy of the local.
+
+// An inclusive interval of values. If `known` is false, the local may hold any
+// value of its type.
+typedef struct Range {
+    bool known;
+    int64_t min;
+    int64_t max;
+} Range;
+
+enum RangeProgress {
+    RANGE_UNVISITED,
+    RANGE_VISITING,
+    RANGE_DONE,
+};
+
+typedef struct RangeState {
+    Function* func;
+    // The number of locals before narrowing began. Locals created while
+    // rewriting are never narrowed.
+    size_t local_count;
+    // The range of each local, indexed by local ID.
+    Range* ranges;
+    uint8_t* progress;
+    // The original type of each local, and the type it is narrowed to, or VOID.
+    uint8_t* old_types;
+    uint8_t* narrow_types;
+    // For comparisons, the narrower type which both operands are compared at,
+    // or VOID. Indexed by the comparison's destination.
+    uint8_t* compare_types;
+    // The widened copy of each narrowed local, or 0 if none has been made.
+    uint64_t* widened;
+} RangeState;
+
+static inline Range unknown_range() {
+    return (Range) {false, 0, 0};
+}
+
+static inline Range make_range(int64_t min, int64_t max) {
+    return (Range) {true, min, max};
+}
+
+static inline Value local_value(uint64_t id) {
+    return (Value) {.is_const = false, .local_id = id};
+}
+
+static bool is_integer_type(uint8_t type) {
+    return type >= U8 && type <= I64;
+}
+
+// The integer type with the same width as `type` and the given signedness.
+static uint8_t with_signedness(uint8_t type, bool is_signed) {
+    if (is_signed_type(type) == is_signed)
+        return type;
+    return is_signed ? type + (I8 - U8) : type - (I8 - U8);
+}
+
+// Every value of a type. Unsigned 64-bit values do not fit in the interval, so
+// they are unknown.
+static Range type_range(uint8_t type) {
+    unsigned bits = type_widths[type] * 8;
+
+    if (!is_integer_type(type) || type == U64)
+        return unknown_range();
+    if (type == I64)
+        return make_range(INT64_MIN, INT64_MAX);
+    if (is_signed_type(type))
+        return make_range(-((int64_t) 1 << (bits - 1)), ((int64_t) 1 << (bits - 1)) - 1);
+    return make_range(0, ((int64_t) 1 << bits) - 1);
+}
+
+static bool range_fits(Range range, uint8_t type) {
+    if (!range.known || !is_integer_type(type))
+        return false;
+    if (type == U64)
+        return range.min >= 0;
+
+    Range bounds = type_range(type);
+    return range.min >= bounds.min && range.max <= bounds.max;
+}
+
+// The result of an operation wraps around if it does not fit its type, which
+// could leave it anywhere in the type's range.
+static Range clamp_to_type(Range range, uint8_t type) {
+    return range_fits(range, type) ? range : type_range(type);
+}
+
+static Range union_range(Range a, Range b) {
+    if (!a.known || !b.known)
+        return unknown_range();
+    return make_range(a.min < b.min ? a.min : b.min, a.max > b.max ? a.max : b.max);
+}
+
+// The smallest `2^n - 1` which is at least `value`. Every bit which an OR or XOR
+// of non-negative values may set is below it.
+static int64_t bit_mask_above(int64_t value) {
+    int64_t mask = 0;
+    while (mask < value)
+        mask = (mask << 1) | 1;
+    return mask;
+}
+
+static Range local_range(RangeState* st, uint64_t id);
+
+// The range of an operand as the operation sees it. Operations are signed if
+// either operand is, in which case an unsigned operand's high bit is read as
+// the sign, and the reverse.
+static Range operand_range(RangeState* st, uint64_t id, bool is_signed) {
+    uint8_t type = st->func->locals[id]->type;
+    Range range = local_range(st, id);
+
+    if (!is_integer_type(type) || is_signed_type(type) == is_signed)
+        return range;
+    uint8_t seen_as = with_signedness(type, is_signed);
+    return clamp_to_type(range, seen_as);
+}
+
+// The value of a constant operand, read at the width of the lhs.
+static Range const_range(uint8_t lhs_type, bool is_signed, uint64_t value) {
+    if (!is_integer_type(lhs_type))
+        return unknown_range();
+    uint8_t type = with_signedness(lhs_type, is_signed);
+    value = truncate_to_type(type, value);
+    if (!is_signed && value > INT64_MAX)
+        return unknown_range();
+    return make_range((int64_t) value, (int64_t) value);
+}
+
+static bool is_signed_operation(Function* func, Operation* op) {
+    return is_signed_type(func->locals[op->lhs]->type)
+           || (op->rhs.is_const ? op->rhs.is_signed : is_signed_type(func->locals[op->rhs.local_id]->type));
+}
+
+static bool is_unop(uint8_t op_type) {
+    return op_type == NOT || op_type == NEGATE || op_type == COMPLEMENT
+           || op_type == ADDRESS || op_type == DEREFERENCE;
+}
+
+static bool is_comparison(uint8_t op_type) {
+    return op_type >= LESS && op_type <= EQU;
+}
+
+// Check if the low bytes of an operation's result only depend on the low bytes
+// of its operands. These may be computed at any narrower width, whatever their
+// operands hold.
+static bool is_wrapping(uint8_t op_type) {
+    switch (op_type) {
+    case ADD: case SUB: case MUL: case B_AND: case B_OR: case B_XOR: case LSH:
+    case NEGATE: case COMPLEMENT:
+        return true;
+    }
+    return false;
+}
+
+// The range of the lhs and rhs of a binary operation.
+static void binop_ranges(RangeState* st, Operation* op, Range* lhs, Range* rhs) {
+    bool is_signed = is_signed_operation(st->func, op);
+    uint8_t lhs_type = st->func->locals[op->lhs]->type;
+
+    *lhs = operand_range(st, op->lhs, is_signed);
+    *rhs = op->rhs.is_const ? const_range(lhs_type, is_signed, op->rhs.const_unsigned)
+                            : operand_range(st, op->rhs.local_id, is_signed);
+}
+
+static Range evaluate_binop(uint8_t op_type, Range lhs, Range rhs) {
+    int64_t a, b, c, d;
+
+    // Masks bound their result even when the other side is unknown.
+    if (op_type == B_AND) {
+        bool lhs_positive = lhs.known && lhs.min >= 0;
+        bool rhs_positive = rhs.known && rhs.min >= 0;
+        if (lhs_positive && rhs_positive)
+            return make_range(0, lhs.max < rhs.max ? lhs.max : rhs.max);
+        if (lhs_positive)
+            return make_range(0, lhs.max);
+        if (rhs_positive)
+            return make_range(0, rhs.max);
+        return unknown_range();
+    }
+
+    if (!lhs.known || !rhs.known)
+        return unknown_range();
+
+    switch (op_type) {
+    case ADD:
+        if (__builtin_add_overflow(lhs.min, rhs.min, &a) || __builtin_add_overflow(lhs.max, rhs.max, &b))
+            return unknown_range();
+        return make_range(a, b);
+    case SUB:
+        if (__builtin_sub_overflow(lhs.min, rhs.max, &a) || __builtin_sub_overflow(lhs.max, rhs.min, &b))
+            return unknown_range();
+        return make_range(a, b);
+    case MUL:
+        if (__builtin_mul_overflow(lhs.min, rhs.min, &a) || __builtin_mul_overflow(lhs.min, rhs.max, &b)
+            || __builtin_mul_overflow(lhs.max, rhs.min, &c) || __builtin_mul_overflow(lhs.max, rhs.max, &d))
+            return unknown_range();
+        return union_range(union_range(make_range(a, a), make_range(b, b)),
+                           union_range(make_range(c, c), make_range(d, d)));
+    case DIV:
+        // Division truncates, so the quotient moves monotonically with each
+        // operand as long as the divisor keeps its sign.
+        if ((rhs.min <= 0 && rhs.max >= 0) || (lhs.min == INT64_MIN && rhs.max == -1))
+            return unknown_range();
+        a = lhs.min / rhs.min;
+        b = lhs.min / rhs.max;
+        c = lhs.max / rhs.min;
+        d = lhs.max / rhs.max;
+        return union_range(union_range(make_range(a, a), make_range(b, b)),
+                           union_range(make_range(c, c), make_range(d, d)));
+    case MOD: {
+        // The remainder is smaller than the divisor, and takes the sign of the
+        // dividend.
+        if (rhs.min == INT64_MIN || (rhs.min <= 0 && rhs.max >= 0))
+            return unknown_range();
+        int64_t limit = (rhs.min < 0 ? -rhs.min : rhs.max) - 1;
+        if (rhs.min < 0 && -rhs.max - 1 > limit)
+            limit = -rhs.max - 1;
+        int64_t min = lhs.min >= 0 ? 0 : lhs.min < -limit ? -limit : lhs.min;
+        int64_t max = lhs.max <= 0 ? 0 : lhs.max > limit ? limit : lhs.max;
+        return make_range(min, max);
+    }
+    case B_OR: case B_XOR:
+        if (lhs.min < 0 || rhs.min < 0)
+            return unknown_range();
+        a = op_type == B_OR ? (lhs.min > rhs.min ? lhs.min : rhs.min) : 0;
+        return make_range(a, bit_mask_above(lhs.max > rhs.max ? lhs.max : rhs.max));
+    case LSH:
+        if (lhs.min < 0 || rhs.min < 0 || rhs.max >= 63 || lhs.max > (INT64_MAX >> rhs.max))
+            return unknown_range();
+        return make_range(lhs.min << rhs.min, lhs.max << rhs.max);
+    case RSH: {
+        // Shifting moves a value towards 0, or -1 if it is negative.
+        if (rhs.min < 0)
+            return unknown_range();
+        int64_t least = rhs.min > 63 ? 63 : rhs.min;
+        int64_t most = rhs.max > 63 ? 63 : rhs.max;
+        return make_range(lhs.min >> (lhs.min < 0 ? least : most), lhs.max >> (lhs.max < 0 ? most : least));
+    }
+    case L_AND: case L_OR:
+    case LESS: case GREATER: case LESS_EQU: case GREATER_EQU: case NOT_EQU: case EQU:
+        return make_range(0, 1);
+    }
+    return unknown_range();
+}
+
+// Compute the range of an operation's result, before it wraps to its type.
+static Range evaluate_operation(RangeState* st, Operation* op) {
+    Function* func = st->func;
+
+    switch (op->type) {
+    case ASSIGN:
+        if (op->rhs.is_const)
+            return const_range(op->var_type, is_signed_type(op->var_type), op->rhs.const_unsigned);
+        return local_range(st, op->rhs.local_id);
+    case NOT:
+        return make_range(0, 1);
+    case NEGATE: {
+        Range src = local_range(st, op->lhs);
+        if (!src.known || src.min == INT64_MIN)
+            return unknown_range();
+        return make_range(-src.max, -src.min);
+    }
+    case COMPLEMENT: {
+        uint8_t type = func->locals[op->lhs]->type;
+        Range src = local_range(st, op->lhs);
+        Range bounds = type_range(type);
+        if (!src.known || !bounds.known)
+            return unknown_range();
+        if (is_signed_type(type))
+            return make_range(~src.max, ~src.min);
+        return make_range(bounds.max - src.max, bounds.max - src.min);
+    }
+    case ADDRESS: case DEREFERENCE:
+        return unknown_range();
+    default: {
+        Range lhs, rhs;
+        binop_ranges(st, op, &lhs, &rhs);
+        return evaluate_binop(op->type, lhs, rhs);
+    }
+    }
+}
+
+static Range local_range(RangeState* st, uint64_t id) {
+    LocalVar* local = st->func->locals[id];
+
+    if (id >= st->local_count)
+        return type_range(local->type);
+    if (st->progress[id] == RANGE_DONE)
+        return st->ranges[id];
+    // A local which depends on itself could only be reached through a cycle
+    // of uses, and is left unbounded.
+    if (st->progress[id] == RANGE_VISITING)
+        return type_range(local->type);
+
+    st->progress[id] = RANGE_VISITING;
+    Range range = type_range(local->type);
+    if (local->origin && local->origin->type == OPERATION)
+        range = clamp_to_type(evaluate_operation(st, (Operation*) local->origin), local->type);
+
+    st->ranges[id] = range;
+    st->progress[id] = RANGE_DONE;
+    return range;
+}
+
+// Find the narrowest integer type which holds every range, preferring the
+// signedness of `type`. Returns VOID if nothing is narrower than `type`.
+// Operations on values which fit are exact, so the signedness of the new type
+// can not change the result: negative values only fit in signed types.
+static uint8_t narrowest_type(uint8_t type, const Range* ranges, size_t count) {
+    static const uint8_t unsigned_types[] = {U8, U16, U32};
+    bool is_signed = is_signed_type(type);
+
+    for (size_t i = 0; i < sizeof(unsigned_types); i++) {
+        if (type_widths[unsigned_types[i]] >= type_widths[type])
+            break;
+
+        for (size_t j = 0; j < 2; j++) {
+            uint8_t candidate = with_signedness(unsigned_types[i], j ? !is_signed : is_signed);
+            bool fits = true;
+            for (size_t k = 0; k < count; k++)
+                fits &= range_fits(ranges[k], candidate);
+            if (fits)
+                return candidate;
+        }
+    }
+    return VOID;
+}
+
+// Choose the type an operation's result could be narrowed to, or VOID.
+static uint8_t choose_narrow_type(RangeState* st, Operation* op) {
+    Range ranges[3];
+    size_t count = 0;
+
+    if (!is_integer_type(op->var_type) || type_widths[op->var_type] == 1)
+        return VOID;
+    ranges[count++] = local_range(st, op->dest);
+
+    switch (op->type) {
+    case ASSIGN:
+        break;
+    case LSH: case RSH:
+        // Only constant shift amounts have an implementation at any width.
+        if (!op->rhs.is_const)
+            return VOID;
+        if (op->type == RSH)
+            ranges[count++] = operand_range(st, op->lhs, is_signed_operation(st->func, op));
+        break;
+    case DIV: case MOD:
+        binop_ranges(st, op, &ranges[1], &ranges[2]);
+        count = 3;
+        break;
+    default:
+        if (!is_wrapping(op->type))
+            return VOID;
+    }
+    return narrowest_type(op->var_type, ranges, count);
+}
+
+// Choose the type a comparison's operands could both be narrowed to, or VOID.
+static uint8_t choose_compare_type(RangeState* st, Operation* op) {
+    Range ranges[2];
+    uint8_t lhs_type = st->func->locals[op->lhs]->type;
+
+    if (!is_integer_type(lhs_type))
+        return VOID;
+    binop_ranges(st, op, &ranges[0], &ranges[1]);
+    return narrowest_type(lhs_type, ranges, 2);
+}
+
+static bool is_narrowed(RangeState* st, uint64_t id) {
+    return id < st->local_count && st->narrow_types[id] != VOID;
+}
+
+// Check if a statement could read a narrowed local without widening it again.
+static bool reads_narrow(RangeState* st, Statement* statement) {
+    if (statement->type != OPERATION)
+        return false;
+
+    Operation* op = (Operation*) statement;
+    return op->type == ASSIGN || is_narrowed(st, op->dest) || st->compare_types[op->dest] != VOID;
+}
+
+// Narrowing an operation makes it cheaper even if its result is widened again,
+// but a narrowed copy or constant is only worth it if something reads it
+// narrow. Comparisons are only narrowed if one of their operands is. Dropping
+// one candidate may leave others without a narrow use, so this repeats until
+// nothing changes.
+static void prune_candidates(RangeState* st) {
+    Function* func = st->func;
+    bool* narrow_use = malloc(st->local_count * sizeof(bool));
+    bool changed = true;
+
+    while (changed) {
+        changed = false;
+        memset(narrow_use, 0, st->local_count * sizeof(bool));
+
+        for (size_t i = 0; i < va_len(func->basic_blocks); i++) {
+            for (Statement* state = func->basic_blocks[i].first; state; state = state->next) {
+                bool is_narrow = reads_narrow(st, state);
+                uint64_t** operands = statement_operands(state);
+                for (size_t j = 0; j < va_len(operands); j++)
+                    narrow_use[*operands[j]] |= is_narrow;
+                va_free(operands);
+            }
+        }
+
+        for (size_t i = 0; i < st->local_count; i++) {
+            if (st->narrow_types[i] != VOID && !narrow_use[i]
+                && ((Operation*) func->locals[i]->origin)->type == ASSIGN) {
+                st->narrow_types[i] = VOID;
+                changed = true;
+            }
+            if (st->compare_types[i] != VOID) {
+                Operation* op = (Operation*) func->locals[i]->origin;
+                if (!is_narrowed(st, op->lhs) && (op->rhs.is_const || !is_narrowed(st, op->rhs.local_id))) {
+                    st->compare_types[i] = VOID;
+                    changed = true;
+                }
+            }
+        }
+    }
+
+    free(narrow_use);
+}
+
+// Read a local as `type`, inserting a cast before `position` if needed.
+static uint64_t cast_operand(RangeState* st, Statement* position, uint64_t id, uint8_t type) {
+    if (st->func->locals[id]->type == type)
+        return id;
+
+    Operation* cast = new_operation(st->func, ASSIGN, type, 0, local_value(id));
+    insert_before(position, &cast->statement);
+    return cast->dest;
+}
+
+// Get a copy of a narrowed local at its original width. Only one copy is made,
+// directly after the local is computed, so that it dominates every use.
+static uint64_t widen_operand(RangeState* st, uint64_t id) {
+    if (!is_narrowed(st, id))
+        return id;
+
+    if (st->widened[id] == 0) {
+        Statement* origin = st->func->locals[id]->origin;
+        Operation* copy = new_operation(st->func, ASSIGN, st->old_types[id], 0, local_value(id));
+        insert_before(origin->next, &copy->statement);
+        st->widened[id] = copy->dest;
+    }
+    return st->widened[id];
+}
+
+// Rewrite an operation to work at a narrower type.
+static void narrow_operands(RangeState* st, Operation* op, uint8_t type) {
+    Statement* position = &op->statement;
+
+    if (op->type == ASSIGN) {
+        if (op->rhs.is_const)
+            set_const_value(&op->rhs, type, (uint64_t) st->ranges[op->dest].min);
+        return;
+    }
+
+    // Constants are read at the original width of the lhs, which may itself
+    // have been narrowed already.
+    if (op->rhs.is_const && !is_unop(op->type) && op->type != LSH && op->type != RSH) {
+        bool is_signed = is_signed_operation(st->func, op);
+        Range value = const_range(st->old_types[op->lhs], is_signed, op->rhs.const_unsigned);
+        set_const_value(&op->rhs, type, value.known ? (uint64_t) value.min : op->rhs.const_unsigned);
+    }
+
+    op->lhs = cast_operand(st, position, op->lhs, type);
+    if (!op->rhs.is_const && !is_unop(op->type))
+        op->rhs.local_id = cast_operand(st, position, op->rhs.local_id, type);
+}
+
+static void rewrite_statement(RangeState* st, Statement* statement) {
+    if (statement->type == OPERATION) {
+        Operation* op = (Operation*) statement;
+
+        if (is_narrowed(st, op->dest)) {
+            narrow_operands(st, op, op->var_type);
+            return;
+        }
+        if (op->dest < st->local_count && st->compare_types[op->dest] != VOID) {
+            narrow_operands(st, op, st->compare_types[op->dest]);
+            return;
+        }
+        if (op->type == ASSIGN)
+            return;
+    }
+
+    uint64_t** operands = statement_operands(statement);
+    for (size_t i = 0; i < va_len(operands); i++)
+        *operands[i] = widen_operand(st, *operands[i]);
+    va_free(operands);
+}
+
+// Narrow the type of every local whose range fits in a smaller type. Returns the
+// number of locals narrowed.
+size_t narrow_types(Function* func) {
+    RangeState st;
+    size_t narrowed = 0;
+
+    st.func = func;
+    st.local_count = va_len(func->locals);
+    st.ranges = calloc(st.local_count, sizeof(Range));
+    st.progress = calloc(st.local_count, sizeof(uint8_t));
+    st.old_types = calloc(st.local_count, sizeof(uint8_t));
+    st.narrow_types = calloc(st.local_count, sizeof(uint8_t));
+    st.compare_types = calloc(st.local_count, sizeof(uint8_t));
+    st.widened = calloc(st.local_count, sizeof(uint64_t));
+
+    LocalVar* this_local = NULL;
+    for (size_t i = 0; this_local = iterate_locals(func, &i); i++) {
+        st.old_types[i] = this_local->type;
+        if (!this_local->origin || this_local->origin->type != OPERATION)
+            continue;
+
+        Operation* op = (Operation*) this_local->origin;
+        if (is_comparison(op->type))
+            st.compare_types[i] = choose_compare_type(&st, op);
+        else
+            st.narrow_types[i] = choose_narrow_type(&st, op);
+    }
+
+    prune_candidates(&st);
+
+    for (size_t i = 0; i < st.local_count; i++) {
+        if (st.narrow_types[i] == VOID)
+            continue;
+        func->locals[i]->type = st.narrow_types[i];
+        ((Operation*) func->locals[i]->origin)->var_type = st.narrow_types[i];
+        narrowed++;
+    }
+
+    if (narrowed) {
+        for (size_t i = 0; i < va_len(func->basic_blocks); i++) {
+            for (Statement* state = func->basic_blocks[i].first; state; state = state->next)
+                rewrite_statement(&st, state);
+        }
+        count_local_references(func);
+        remove_unused_casts(func);
+    }
+
+    free(st.ranges);
+    free(st.progress);
+    free(st.old_types);
+    free(st.narrow_types);
+    free(st.compare_types);
+    free(st.widened);
+    return narrowed;
+}
@@ -1,5 +1,8 @@
+#include "cfg.h"
 #include "exception.h"
 #include "gb/operations.h"
+#include "gb/runtime.h"
+#include "optimizer.h"
 #include "registers.h"
 #include "statements.h"
 #include "varray.h"
@@ -36,10 +39,14 @@ CPUReg hl_reg = {"hl", 2, hl_components};
 // Note: 24-bit register unions are very much feasible, and would likely be a
 // useful addition. Please look into this ASAP.
 
-// 32-bit register unions
-CPUReg bcde_reg = {NULL, 4, bcde_components};
-CPUReg dehl_reg = {NULL, 4, dehl_components};
-CPUReg hlbc_reg = {NULL, 4, hlbc_components};
+// 32-bit register unions. These never appear in output code, but are named for
+// diagnostics.
+CPUReg bcde_reg = {"bcde", 4, bcde_components};
+CPUReg dehl_reg = {"dehl", 4, dehl_components};
+CPUReg hlbc_reg = {"hlbc", 4, hlbc_components};
+
+// Each 8-bit register, in the order of their bits in a `RegisterSet`.
+static CPUReg* base_regs[] = {&a_reg, &b_reg, &c_reg, &d_reg, &e_reg, &h_reg, &l_reg, NULL};
 
 // Register pools
 static CPUReg* regs8[] = {&a_reg, &c_reg, &b_reg, &e_reg, &d_reg, &l_reg, &h_reg, NULL};
@@ -60,18 +67,15 @@ static bool is_reg_used(CPUReg* reg) {
 // Recursively set a register's base components' usage states.
 static void set_reg_usage(CPUReg* reg, bool usage) {
     for (size_t i = 0; reg->components[i]; i++) {
-        reg->_in_use = usage;
+        reg->components[i]->_in_use = usage;
     }
 }
 
 // Returns true if reg1 and reg2 have components in common.
-static bool match_registers(CPUReg* reg1, CPUReg* reg2) {
-    CPUReg** reg1_components = reg1->components;
-    CPUReg** reg2_components = reg2->components;
-
-    for (; *reg1_components; reg1_components++) {
-        for (; *reg2_components; reg2_components++) {
-            if (*reg1_components == * reg2_components)
+bool match_registers(CPUReg* reg1, CPUReg* reg2) {
+    for (CPUReg** reg1_components = reg1->components; *reg1_components; reg1_components++) {
+        for (CPUReg** reg2_components = reg2->components; *reg2_components; reg2_components++) {
+            if (*reg1_components == *reg2_components)
                 return true;
         }
     }
@@ -79,101 +83,360 @@ static bool match_registers(CPUReg* reg1, CPUReg* reg2) {
     return false;
 }
 
-static void allocate_register(LocalVar* local, CPUReg** reg_pool, size_t when) {
-    for (size_t j = 0; reg_pool[j]; j++) {
-        if (!is_reg_used(reg_pool[j])) {
-            set_reg_usage(reg_pool[j], true);
-            va_expand(&local->reg_reallocs, sizeof(RegRealloc));
-            RegRealloc* new_reg = &va_last(local->reg_reallocs);
-            new_reg->reg = reg_pool[j];
-            new_reg->when = when;
-            return;
+// Find the 8-bit registers which make up a register.
+RegisterSet register_set(CPUReg* reg) {
+    RegisterSet set = 0;
+    for (size_t i = 0; reg->components[i]; i++) {
+        for (size_t j = 0; base_regs[j]; j++) {
+            if (reg->components[i] == base_regs[j])
+                set |= 1 << j;
         }
     }
+    return set;
+}
+
+// Choose a register pool according to the size of a type. Returns NULL if no
+// pool can hold the type.
+static CPUReg** get_reg_pool(uint8_t type) {
+    switch (type_widths[type]) {
+    case 1: return regs8;
+    case 2: return regs16;
+    case 4: return regs32;
+    }
+    return NULL;
+}
+
+// The register which a function returns values of a given type in.
+CPUReg* return_reg(uint8_t type) {
+    switch (type_widths[type]) {
+    case 1: return &a_reg;
+    case 2: return &hl_reg;
+    case 4: return &dehl_reg;
+    }
+    return NULL;
+}
+
+// Find the register which each parameter of a function is passed in. Each
+// parameter takes the first register of its size which no earlier parameter
+// overlaps. A parameter which does not fit is passed in memory, in the
+// callee's slot for it, and given NULL. Returns a new VArray.
+CPUReg** parameter_registers(const uint8_t* types, size_t count) {
+    CPUReg** regs = va_new(0);
+
+    for (size_t i = 0; i < count; i++) {
+        CPUReg** reg_pool = get_reg_pool(types[i]);
+        CPUReg* reg = NULL;
+
+        for (size_t j = 0; reg_pool && reg_pool[j] && reg == NULL; j++) {
+            reg = reg_pool[j];
+            for (size_t k = 0; k < va_len(regs) && reg; k++) {
+                if (regs[k] && match_registers(reg_pool[j], regs[k]))
+                    reg = NULL;
+            }
+        }
+        va_append(regs, reg);
+    }
+    return regs;
+}
+
+// Get the register a local variable currently occupies. Returns NULL if the
+// local has not been allocated yet or has been spilled to memory.
+static CPUReg* current_reg(LocalVar* local) {
+    if (va_len(local->reg_reallocs) == 0)
+        return NULL;
+    return va_last(local->reg_reallocs).reg;
+}
+
+// Record that a local variable moves into a register (or memory, if `reg` is
+// NULL) beginning at statement `when`.
+static void place_local(LocalVar* local, CPUReg* reg, size_t when) {
+    // Moving twice during the same statement only needs the final location.
+    // A parameter's first register is kept though, since that is where the
+    // caller passes it.
+    if (va_len(local->reg_reallocs) && va_last(local->reg_reallocs).when == when
+        && !(local->origin == NULL && va_len(local->reg_reallocs) == 1)) {
+        va_last(local->reg_reallocs).reg = reg;
+        return;
+    }
+    va_expand(&local->reg_reallocs, sizeof(RegRealloc));
+    RegRealloc* new_reg = &va_last(local->reg_reallocs);
+    new_reg->reg = reg;
+    new_reg->when = when;
+}
+
+// Get the register a local occupies while statement `when` runs. Returns NULL
+// if the local is in memory.
+CPUReg* local_location(LocalVar* local, size_t when) {
+    CPUReg* reg = NULL;
+    for (size_t i = 0; i < va_len(local->reg_reallocs) && local->reg_reallocs[i].when <= when; i++)
+        reg = local->reg_reallocs[i].reg;
+    return reg;
+}
+
+// Get the register a local occupied before any moves made for statement
+// `when`. Returns NULL if the local is in memory.
+CPUReg* local_location_before(LocalVar* local, size_t when) {
+    if (va_len(local->reg_reallocs) == 0)
+        return NULL;
+
+    CPUReg* reg = local->reg_reallocs[0].reg;
+    for (size_t i = 0; i < va_len(local->reg_reallocs) && local->reg_reallocs[i].when < when; i++)
+        reg = local->reg_reallocs[i].reg;
+    return reg;
+}
+
+// Check if a local is read by the statement at `when`.
+static bool is_used_at(LocalVar* local, size_t when) {
+    for (size_t i = 0; i < va_len(local->uses); i++) {
+        if (local->uses[i].when == when)
+            return true;
+    }
+    return false;
+}
+
+// Scale a distance down by the weight of the block at its end. A block which a
+// profile never saw run is as far away as possible, short of never.
+static uint64_t weigh_distance(size_t distance, uint64_t weight) {
+    if (weight == 0)
+        return UINT64_MAX - 1;
+    return ((uint64_t) distance << 32) / weight;
+}
+
+// Find the distance from `when` to the next read of a local, scaled down by the
+// weight of the block which reads it. This makes a use inside of a loop appear
+// much closer than one outside of it. Returns UINT64_MAX if the local is never
+// read again.
+static uint64_t next_use_distance(LocalVar* local, size_t when) {
+    for (size_t i = 0; i < va_len(local->uses); i++) {
+        if (local->uses[i].when >= when)
+            return weigh_distance(local->uses[i].when - when, local->uses[i].weight);
+    }
+
+    // A local may outlive its final read if an enclosing loop reads it again
+    // on the next iteration. Treat the loop's back edge as the next use.
+    if (local->lifetime_end > when && va_len(local->uses))
+        return weigh_distance(local->lifetime_end - when + 1, va_last(local->uses).weight);
+
+    return UINT64_MAX;
+}
+
+// Choose a local to evict from a register pool, according to Belady's
+// algorithm: the local whose next use is farthest away loses its register.
+// Locals in `protected_regs` (which may be NULL) are never chosen. Returns NULL
+// if no local occupies the pool.
+static LocalVar* choose_spill_victim(Function* func, LocalVar* exclude, CPUReg** reg_pool,
+                                     CPUReg** protected_regs, size_t when) {
+    LocalVar* victim = NULL;
+    uint64_t victim_distance = 0;
+    LocalVar* this_local = NULL;
+
+    for (size_t i = 0; this_local = iterate_locals(func, &i); i++) {
+        CPUReg* reg = current_reg(this_local);
+
+        if (this_local == exclude || reg == NULL || !is_reg_used(reg) || this_local->lifetime_end < when)
+            continue;
+
+        bool in_pool = false;
+        for (size_t j = 0; reg_pool[j] && !in_pool; j++)
+            in_pool = match_registers(reg, reg_pool[j]);
+        for (size_t j = 0; protected_regs && protected_regs[j] && in_pool; j++)
+            in_pool = !match_registers(reg, protected_regs[j]);
+        if (!in_pool)
+            continue;
+
+        uint64_t distance = next_use_distance(this_local, when);
+        if (victim == NULL || distance > victim_distance) {
+            victim = this_local;
+            victim_distance = distance;
+        }
+    }
+
+    return victim;
+}
+
+// Split a local's live range at `when`, releasing its register. The local stays
+// in memory until its next use, where it is reloaded.
+static void evict_local(LocalVar* local, size_t when) {
+    set_reg_usage(current_reg(local), false);
+    place_local(local, NULL, when);
+}
+
+// Place a local variable into a free register from a pool. If the pool is full,
+// evict whichever local is needed farthest in the future, other than those in
+// `protected_regs`.
+static void allocate_register(Function* func, LocalVar* local, CPUReg** reg_pool,
+                              CPUReg** protected_regs, size_t when) {
+    while (1) {
+        for (size_t j = 0; reg_pool[j]; j++) {
+            if (!is_reg_used(reg_pool[j])) {
+                set_reg_usage(reg_pool[j], true);
+                place_local(local, reg_pool[j], when);
+                return;
+            }
+        }
 
-    fatal("Ran out of CPU registers. Stack variables are not yet supported.");
+        LocalVar* victim = choose_spill_victim(func, local, reg_pool, protected_regs, when);
+        if (victim == NULL)
+            fatal("Ran out of CPU registers in %s.", func->declaration.identifier);
+        evict_local(victim, when);
+    }
 }
 
-// Reallocate a local variable to a different register. This does not set the
-// previous register to 'unused', so that the calling code can claim it.
-static void spill_local(LocalVar* local, size_t when) {
-    CPUReg** reg_pool = NULL;
+// Move a local variable out of its register, splitting its live range at
+// `when`. The local moves to a free register if one exists, and to memory
+// otherwise. This does not set the previous register to 'unused', so that the
+// calling code can claim it.
+static void relocate_local(LocalVar* local, size_t when) {
+    CPUReg** reg_pool = get_reg_pool(local->type);
 
-    // Choose a register pool according to the local's size.
-    switch (type_widths[local->type]) {
-    case 1: reg_pool = regs8; break;
-    case 2: reg_pool = regs16; break;
-    case 4: reg_pool = regs32; break;
+    for (size_t j = 0; reg_pool && reg_pool[j]; j++) {
+        if (!is_reg_used(reg_pool[j])) {
+            set_reg_usage(reg_pool[j], true);
+            place_local(local, reg_pool[j], when);
+            return;
+        }
     }
 
-    if (reg_pool)
-        allocate_register(local, reg_pool, when);
-    else
-        fatal("Ran out of CPU registers. Stack variables are not yet supported.");
+    place_local(local, NULL, when);
 }
 
-// Checks if a register is being used by a local variable and relocates that
-// variable if it exists.
+// Checks if a register is being used by local variables and relocates any that
+// are still live after `when`. Any part of a relocated local's register which
+// lies outside of `reg` is released, since nothing else claims it.
 static void open_register(Function* func, CPUReg* reg, size_t when) {
     if (!is_reg_used(reg))
         return;
 
     // We know the register is currently used, but not by which variable. Search
     // the function's locals for a variable which is currently using this
-    // register.
+    // register. Locals created by this statement are placed by the operation
+    // itself, and locals which die here do not need to be preserved.
     LocalVar* this_local = NULL;
 
     for (size_t i = 0; this_local = iterate_locals(func, &i); i++) {
-        if (match_registers(va_last(this_local->reg_reallocs).reg, reg)) {
-            // Move the local variable once found.
-            warn("Spilling local in register %s.", reg->name);
-            spill_local(this_local, when);
-            break;
+        CPUReg* local_reg = current_reg(this_local);
+        if (local_reg == NULL || this_local->lifetime_end <= when
+            || (this_local->origin && this_local->lifetime_start == when))
+            continue;
+        if (match_registers(local_reg, reg)) {
+            relocate_local(this_local, when);
+            for (size_t j = 0; local_reg->components[j]; j++) {
+                if (!match_registers(local_reg->components[j], reg))
+                    local_reg->components[j]->_in_use = false;
+            }
         }
     }
 }
 
+// Add a read to a local's next-use table and extend its lifetime to cover it.
+static void record_use(Function* func, uint64_t id, size_t when, size_t block_id) {
+    LocalVar* local = get_local(func, id);
+    LocalUse use = {when, block_weight(&func->basic_blocks[block_id])};
+
+    local->lifetime_end = when;
+    va_append(local->uses, use);
+}
+
+// Check if a local is declared within a block. Parameters are declared before
+// any block.
+static bool is_declared_in(Function* func, uint64_t id, size_t block) {
+    Statement* origin = func->locals[id]->origin;
+    return origin && origin->parent == &func->basic_blocks[block];
+}
+
 void analyze_var_usage(Function* func) {
-    for (size_t i = 0; i < func->parameter_count; i++) {
-        func->locals[i]->lifetime_start = 0;
+    compute_loop_depths(func);
+
+    LocalVar* this_local = NULL;
+    for (size_t i = 0; this_local = iterate_locals(func, &i); i++) {
+        va_free(this_local->uses);
+        this_local->uses = va_new(0);
+        this_local->lifetime_start = 0;
+        this_local->lifetime_end = 0;
     }
 
+    // The last statement index of each block, used to extend lifetimes across
+    // the blocks which locals are live out of.
+    size_t* block_ends = calloc(va_len(func->basic_blocks), sizeof(size_t));
+
     Statement* statement = NULL;
     size_t i = 0;
     size_t block_id = 0;
 
     while (statement = iterate_statements(func, statement, &i, &block_id)) {
-        switch (statement->type) {
-        case OPERATION: {
-            Operation* op = (Operation*) statement;
-            func->locals[op->dest]->lifetime_start = i;
-            switch (op->type) {
-            default: // binops
-                if (!op->rhs.is_const)
-                    func->locals[op->rhs.local_id]->lifetime_end = i;
-                // fallthrough
-            case NOT: case NEGATE: case COMPLEMENT: case ADDRESS: case DEREFERENCE:
-                func->locals[op->lhs]->lifetime_end = i;
-                break; // unops
-            case ASSIGN:
-                if (!op->rhs.is_const)
-                    func->locals[op->rhs.local_id]->lifetime_end = i;
-                break; //assign
+        block_ends[block_id] = i;
+
+        uint64_t dest;
+        if (statement_dest(statement, &dest))
+            func->locals[dest]->lifetime_start = i;
+
+        uint64_t** operands = statement_operands(statement);
+        for (size_t j = 0; j < va_len(operands); j++)
+            record_use(func, *operands[j], i, block_id);
+        va_free(operands);
+    }
+
+    // A local which is never read still occupies its register for the
+    // statement which declares it.
+    for (size_t l = 0; this_local = iterate_locals(func, &l); l++) {
+        if (this_local->lifetime_end < this_local->lifetime_start)
+            this_local->lifetime_end = this_local->lifetime_start;
+    }
+
+    // A local must also survive any block which it is live out of, such as
+    // the back edge of a loop which reads it again on the next iteration.
+    // Each block's live locals are found by iterating backwards until nothing
+    // changes. Since a local's declaration dominates every block it is live
+    // in, only its lifetime's end needs to be extended.
+    size_t block_count = va_len(func->basic_blocks);
+    size_t local_count = va_len(func->locals);
+    bool* live_in = calloc(block_count * local_count, sizeof(bool));
+
+    for (size_t j = 0; j < block_count; j++) {
+        for (Statement* state = func->basic_blocks[j].first; state; state = state->next) {
+            uint64_t** operands = statement_operands(state);
+            for (size_t k = 0; k < va_len(operands); k++) {
+                if (!is_declared_in(func, *operands[k], j))
+                    live_in[j * local_count + *operands[k]] = true;
             }
-        } break;
-        case READ: {
-        } break;
-        case WRITE: {
-            Write* write = (Write*) statement;
-            func->locals[write->src]->lifetime_end = i;
-        } break;
-        case RETURN: {
-            Return* ret = (Return*) statement;
-            if (!ret->val.is_const)
-                func->locals[ret->val.local_id]->lifetime_end = i;
-        } break;
+            va_free(operands);
         }
     }
+
+    for (bool changed = true; changed;) {
+        changed = false;
+        for (size_t j = block_count; j-- > 0;) {
+            bool* live = &live_in[j * local_count];
+            size_t successors[2];
+            size_t count = block_successors(func, j, successors);
+
+            for (size_t k = 0; k < count; k++) {
+                bool* succ_live = &live_in[successors[k] * local_count];
+                for (size_t l = 0; l < local_count; l++) {
+                    if (succ_live[l] && !live[l] && !is_declared_in(func, l, j)) {
+                        live[l] = true;
+                        changed = true;
+                    }
+                }
+            }
+        }
+    }
+
+    for (size_t j = 0; j < block_count; j++) {
+        size_t successors[2];
+        size_t count = block_successors(func, j, successors);
+
+        for (size_t k = 0; k < count; k++) {
+            bool* succ_live = &live_in[successors[k] * local_count];
+            for (size_t l = 0; l < local_count; l++) {
+                if (succ_live[l] && func->locals[l]->lifetime_end < block_ends[j])
+                    func->locals[l]->lifetime_end = block_ends[j];
+            }
+        }
+    }
+
+    free(live_in);
+    free(block_ends);
 }
 
 // Iterate through an operation pool until all valid operations have been found.
@@ -187,10 +450,6 @@ const CpuOp* search_for_operation(const CpuOp** operation_pool, size_t* index,
     for (; operation_pool[*index]; (*index)++) {
         const CpuOp* cpu_op = operation_pool[*index];
 
-        warn("Attempting to match d:%u l:%u r:%u c:%s == d:%u l:%u r:%u c:%s.",
-             dest_width, lhs_width, rhs_width, is_const ? "true" : "false",
-             cpu_op->result_width, cpu_op->lhs_width, cpu_op->rhs_width, cpu_op->is_const ? "true" : "false");
-
         if (cpu_op->result_width == dest_width && cpu_op->lhs_width == lhs_width
          && cpu_op->rhs_width == rhs_width && cpu_op->is_const == is_const)
             return cpu_op;
@@ -198,6 +457,349 @@ const CpuOp* search_for_operation(const CpuOp** operation_pool, size_t* index,
     return NULL;
 }
 
+// Search an operation pool for the fastest operation which can handle a given
+// constant operand. Returns NULL if none of them can.
+static const CpuOp* search_for_const_operation(const CpuOp** operation_pool, uint8_t dest_width,
+                                               uint8_t lhs_width, uint64_t constant) {
+    const CpuOp* best = NULL;
+    uint16_t best_cycles = UINT16_MAX;
+
+    for (size_t i = 0;; i++) {
+        const CpuOp* cpu_op = search_for_operation(operation_pool, &i, dest_width, lhs_width, 0, true);
+        uint16_t bytes, cycles;
+
+        if (cpu_op == NULL)
+            break;
+        if (get_operation_cost(cpu_op, constant, &bytes, &cycles) && cycles < best_cycles) {
+            best = cpu_op;
+            best_cycles = cycles;
+        }
+    }
+    return best;
+}
+
+// Check if an operand must be moved out of the way of an operation's
+// registers. An operand may stay in a required register only if that is where
+// the operation expects it, or if the operation reads it before it uses the
+// register.
+static bool is_operand_in_way(LocalVar* operand, const CpuOp* cpu_op, CPUReg* target, CPUReg* other_target) {
+    CPUReg* reg = current_reg(operand);
+
+    if (reg == NULL || reg == target || reg == other_target)
+        return false;
+    if (cpu_op->reads_operands_first)
+        return match_registers(reg, &a_reg);
+    for (CPUReg** required_regs = cpu_op->required_regs; *required_regs; required_regs++) {
+        if (match_registers(reg, *required_regs))
+            return true;
+    }
+    return false;
+}
+
+// Check if the result of an operation partially overlaps either operand, or
+// overlaps any of the operation's registers.
+static bool is_result_in_way(LocalVar* dest, LocalVar* lhs, LocalVar* rhs, const CpuOp* cpu_op) {
+    CPUReg* reg = current_reg(dest);
+
+    if (reg == NULL)
+        return false;
+    for (CPUReg** required_regs = cpu_op->required_regs; *required_regs; required_regs++) {
+        if (match_registers(reg, *required_regs))
+            return true;
+    }
+
+    CPUReg* lhs_reg = current_reg(lhs);
+    CPUReg* rhs_reg = rhs ? current_reg(rhs) : NULL;
+    return (lhs_reg && lhs_reg != reg && match_registers(lhs_reg, reg))
+           || (rhs_reg && rhs_reg != reg && match_registers(rhs_reg, reg));
+}
+
+// Claim the registers an operation requires, spilling any locals which occupy
+// them.
+static void claim_operation_registers(Function* func, Operation* op, const CpuOp* cpu_op, size_t when) {
+    LocalVar* dest = func->locals[op->dest];
+    LocalVar* lhs = func->locals[op->lhs];
+    LocalVar* rhs = NULL;
+    CPUReg* lhs_target = cpu_op->lhs_reg ? cpu_op->lhs_reg : cpu_op->result_reg;
+
+    switch (op->type) {
+    case NOT: case NEGATE: case COMPLEMENT: case ADDRESS: case DEREFERENCE:
+        break;
+    default:
+        if (!op->rhs.is_const)
+            rhs = func->locals[op->rhs.local_id];
+    }
+
+    op->cpu_info.operation = cpu_op;
+    // Select registers, cause spills as needed.
+
+    // Claim the operation's required registers.
+    for (CPUReg** required_regs = cpu_op->required_regs; *required_regs; required_regs++) {
+        set_reg_usage(*required_regs, true);
+    }
+
+    // Operands which die here have already released their registers, but they
+    // must not be overwritten before the operation reads them.
+    if (current_reg(lhs))
+        set_reg_usage(current_reg(lhs), true);
+    if (rhs && current_reg(rhs))
+        set_reg_usage(current_reg(rhs), true);
+
+    // Then for each of these registers, spill any locals that may be using
+    // them.
+    for (CPUReg** required_regs = cpu_op->required_regs; *required_regs; required_regs++) {
+        open_register(func, *required_regs, when);
+    }
+
+    // Move operands out of each other's way, so that placing one operand can
+    // not overwrite the other.
+    if (is_operand_in_way(lhs, cpu_op, lhs_target, rhs == lhs ? cpu_op->rhs_reg : NULL))
+        relocate_local(lhs, when);
+    if (rhs && is_operand_in_way(rhs, cpu_op, cpu_op->rhs_reg, rhs == lhs ? lhs_target : NULL))
+        relocate_local(rhs, when);
+
+    // An operation which reads its rhs from any register can not read it from
+    // memory, so make room for it outside of the operation's registers. The
+    // same goes for in-place operations which can not read their lhs from
+    // memory. Registers holding the operands are protected as well, since the
+    // result may share one, and evicting the result would release it.
+    CPUReg* protected_regs[8];
+    size_t protected_count = 0;
+    for (CPUReg** required_regs = cpu_op->required_regs; *required_regs; required_regs++)
+        protected_regs[protected_count++] = *required_regs;
+    if (current_reg(lhs))
+        protected_regs[protected_count++] = current_reg(lhs);
+    if (rhs && current_reg(rhs))
+        protected_regs[protected_count++] = current_reg(rhs);
+    protected_regs[protected_count] = NULL;
+
+    if (rhs && current_reg(rhs) == NULL && cpu_op->rhs_reg == NULL && !cpu_op->rhs_in_memory)
+        allocate_register(func, rhs, get_reg_pool(rhs->type), protected_regs, when);
+    if (cpu_op->in_place && current_reg(lhs) == NULL && !cpu_op->lhs_in_memory)
+        allocate_register(func, lhs, get_reg_pool(lhs->type), protected_regs, when);
+
+    // A result which is written a byte at a time must not overwrite operand
+    // bytes which are yet to be read.
+    if (cpu_op->bytewise_result && is_result_in_way(dest, lhs, rhs, cpu_op)) {
+        CPUReg* reg = current_reg(dest);
+        relocate_local(dest, when);
+        set_reg_usage(reg, false);
+        if (current_reg(lhs))
+            set_reg_usage(current_reg(lhs), true);
+        if (rhs && current_reg(rhs))
+            set_reg_usage(current_reg(rhs), true);
+    }
+
+    // The required registers are only needed while the operation runs, so
+    // release them again unless the result was placed in one of them.
+    for (CPUReg** required_regs = cpu_op->required_regs; *required_regs; required_regs++) {
+        set_reg_usage(*required_regs, false);
+    }
+    if (lhs->lifetime_end <= when && current_reg(lhs))
+        set_reg_usage(current_reg(lhs), false);
+    if (rhs && rhs->lifetime_end <= when && current_reg(rhs))
+        set_reg_usage(current_reg(rhs), false);
+    if (current_reg(dest))
+        set_reg_usage(current_reg(dest), true);
+
+    // Once this is done the operation's registers have been acounted for
+    // and it can later be compiled into assembly code after further
+    // processing.
+}
+
+// The register pair which saves a register on the stack. `a` is saved along
+// with the flags, which nothing is kept in.
+static CPUReg* stack_pair(CPUReg* reg) {
+    for (size_t i = 0; reg->size == 1 && reg != &a_reg && regs16[i]; i++) {
+        if (match_registers(reg, regs16[i]))
+            return regs16[i];
+    }
+    return reg;
+}
+
+// Give a function the standard calling convention, unless it already has one.
+static void use_standard_convention(Function* func) {
+    if (func->parameter_regs)
+        return;
+    func->parameter_regs = parameter_registers(func->parameter_types, func->parameter_count);
+    func->result_reg = return_reg(func->declaration.type);
+}
+
+// Choose the register a static function returns its result in, while
+// allocating a call to it. A call whose result the caller returns straight
+// away uses the caller's result register, so that it can become a jump. The
+// standard register is kept if nothing occupies it, and otherwise the first
+// free register of the result's size is used. A register is only free if the
+// rest of its pair is too, since the caller may need to restore that pair once
+// the call returns.
+static CPUReg* choose_result_reg(Function* caller, Call* call) {
+    uint8_t type = call->callee->declaration.type;
+    CPUReg* standard = return_reg(type);
+    CPUReg** reg_pool = get_reg_pool(type);
+
+    if (tail_calls && is_tail_call(caller, call) && caller->declaration.type == type)
+        return caller->result_reg;
+    if (standard == NULL || !is_reg_used(stack_pair(standard)))
+        return standard;
+    for (size_t i = 0; reg_pool[i]; i++) {
+        if (!is_reg_used(stack_pair(reg_pool[i])))
+            return reg_pool[i];
+    }
+    return standard;
+}
+
+static bool overlaps_any(CPUReg* reg, CPUReg** regs, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        if (regs[i] && match_registers(reg, regs[i]))
+            return true;
+    }
+    return false;
+}
+
+// Choose the registers a static function takes its parameters in, while
+// allocating a call to it. Each argument which is held in a register is passed
+// where it is, and the rest take the first registers of their size which no
+// other parameter overlaps. Parameters too wide for any register are passed in
+// memory.
+static CPUReg** choose_parameter_regs(Function* caller, Call* call) {
+    Function* callee = call->callee;
+    CPUReg** regs = va_new(0);
+
+    for (size_t i = 0; i < callee->parameter_count; i++) {
+        CPUReg* reg = call->args[i].is_const ? NULL : current_reg(caller->locals[call->args[i].local_id]);
+        if (reg && overlaps_any(reg, regs, i))
+            reg = NULL;
+        va_append(regs, reg);
+    }
+
+    for (size_t i = 0; i < callee->parameter_count; i++) {
+        CPUReg** reg_pool = get_reg_pool(callee->parameter_types[i]);
+        for (size_t j = 0; reg_pool && reg_pool[j] && regs[i] == NULL; j++) {
+            if (!overlaps_any(reg_pool[j], regs, callee->parameter_count))
+                regs[i] = reg_pool[j];
+        }
+        // Where the arguments are may leave no room for a later parameter,
+        // which the standard convention may still fit.
+        if (regs[i] == NULL && reg_pool) {
+            va_free(regs);
+            return parameter_registers(callee->parameter_types, callee->parameter_count);
+        }
+    }
+    return regs;
+}
+
+// Make room for a call. The callee may overwrite any register, so the caller
+// saves those holding locals which live through the call, except for the
+// register which the result is returned in. Locals there are moved elsewhere.
+// Locals in memory are left alone, since each function has its own memory
+// slots, unless the callee may call this function again.
+//
+// Static functions have their calling convention chosen by the first call to
+// them which is allocated. Callers are allocated before the functions they
+// call, so this is usually before the function itself.
+static void claim_call_registers(Function* func, Call* call, size_t when) {
+    Function* callee = call->callee;
+    bool is_custom = callee->parameter_regs == NULL && custom_conventions
+                     && callee->declaration.storage_class == STATIC;
+    if (!is_custom)
+        use_standard_convention(callee);
+
+    // The result may take the place of arguments which die here.
+    if (is_custom && callee->declaration.type != VOID)
+        callee->result_reg = choose_result_reg(func, call);
+
+    // Arguments which die here have already released their registers, but
+    // nothing may be moved on top of them before they are passed.
+    for (size_t i = 0; i < va_len(call->args); i++) {
+        if (!call->args[i].is_const && current_reg(func->locals[call->args[i].local_id]))
+            set_reg_usage(current_reg(func->locals[call->args[i].local_id]), true);
+    }
+    if (call->var_type != VOID && callee->result_reg == NULL) {
+        // A result too wide for any register is returned in memory, and copied
+        // from there to the local's own slot.
+        place_local(func->locals[call->dest], NULL, when);
+    } else if (call->var_type != VOID) {
+        CPUReg* reg = callee->result_reg;
+
+        // Whatever shares the result's pair can not be restored around it.
+        set_reg_usage(stack_pair(reg), true);
+        open_register(func, stack_pair(reg), when);
+        set_reg_usage(stack_pair(reg), false);
+        set_reg_usage(reg, true);
+        place_local(func->locals[call->dest], reg, when);
+    }
+    if (is_custom)
+        callee->parameter_regs = choose_parameter_regs(func, call);
+
+    for (size_t i = 0; i < va_len(call->args); i++) {
+        if (call->args[i].is_const)
+            continue;
+        LocalVar* arg = func->locals[call->args[i].local_id];
+        if (arg->lifetime_end <= when && current_reg(arg))
+            set_reg_usage(current_reg(arg), false);
+    }
+    if (call->var_type != VOID && callee->result_reg)
+        set_reg_usage(callee->result_reg, true);
+
+    // Passing arguments to the function itself overwrites its parameters in
+    // memory, so none of them may be read from there for another parameter.
+    for (size_t i = 0; callee == func && i < va_len(call->args); i++) {
+        uint64_t id = call->args[i].local_id;
+        if (!call->args[i].is_const && id < func->parameter_count && id != i && func->parameter_regs[id] == NULL
+            && current_reg(func->locals[id]) == NULL
+            && (call->args[id].is_const || call->args[id].local_id != id))
+            error("%s passes its parameters in memory to itself in another order; this is not yet supported.",
+                  func->declaration.identifier);
+    }
+
+    // Nothing is needed after a call whose result is returned straight away,
+    // even if a local's lifetime appears to reach past it.
+    if (!func->is_recursive || is_tail_call(func, call))
+        return;
+    LocalVar* this_local = NULL;
+    for (size_t i = 0; this_local = iterate_locals(func, &i); i++) {
+        if ((this_local->origin == NULL || this_local->lifetime_start < when) && this_local->lifetime_end > when
+            && va_len(this_local->reg_reallocs) && current_reg(this_local) == NULL)
+            error("%s keeps a local in memory across a call which may reach %s again; this is not yet supported.",
+                  func->declaration.identifier, func->declaration.identifier);
+    }
+}
+
+// Choose an in-place operation, which reads its operands wherever they are
+// allocated. If either operand is in memory, and the operation can not read it
+// from there, the variant which reads memory through `hl` is chosen. Returns
+// NULL if the operand widths do not match.
+static const CpuOp* select_chain_operation(Function* func, Operation* op) {
+    LocalVar* lhs = func->locals[op->lhs];
+    LocalVar* rhs = NULL;
+    bool is_comparison = (op->type >= LESS && op->type <= EQU) || op->type == NOT
+                         || op->type == L_AND || op->type == L_OR;
+
+    switch (op->type) {
+    case NOT: case NEGATE: case COMPLEMENT:
+        break;
+    default:
+        if (!op->rhs.is_const)
+            rhs = func->locals[op->rhs.local_id];
+    }
+
+    if (rhs && type_widths[rhs->type] != type_widths[lhs->type])
+        return NULL;
+    if (!is_comparison && type_widths[op->var_type] != type_widths[lhs->type])
+        return NULL;
+
+    bool is_signed = is_signed_type(lhs->type) || (rhs ? is_signed_type(rhs->type) : op->rhs.is_const && op->rhs.is_signed);
+    // A shift keeps the sign of its lhs, whatever its amount.
+    if (op->type == RSH)
+        is_signed = is_signed_type(lhs->type);
+    const CpuOp* cpu_op = get_chain_operation(op->type, is_signed, false);
+
+    if (cpu_op && ((current_reg(lhs) == NULL && !cpu_op->lhs_in_memory)
+                   || (rhs && current_reg(rhs) == NULL && !cpu_op->rhs_in_memory)))
+        cpu_op = get_chain_operation(op->type, is_signed, true);
+    return cpu_op;
+}
+
 void select_operation(Function* func, Operation* op, size_t when) {
     // When choosing an operation consider the operation and the width of the
     // operands and result. Attempt to choose an operation which uses the
@@ -207,7 +809,7 @@ void select_operation(Function* func, Operation* op, size_t when) {
     // then insert a move instruction and select a normal operation.
 
     switch (op->type) {
-    case ADD: {
+    case ADD: case SUB: case B_AND: case B_OR: case B_XOR: {
         // Determine initial base properties of an operation.
         size_t i = 0;
         uint8_t dest_width = type_widths[op->var_type];
@@ -222,29 +824,102 @@ void select_operation(Function* func, Operation* op, size_t when) {
         }
         bool is_const = op->rhs.is_const;
 
-        const CpuOp* cpu_op = search_for_operation(add_operations, &i, dest_width, lhs_width, rhs_width, is_const);
+        // Operations on constants may only handle certain values, so they
+        // are chosen by cost.
+        const CpuOp* cpu_op = is_const ? search_for_const_operation(get_operation_pool(op->type), dest_width,
+                                                                    lhs_width, op->rhs.const_unsigned)
+                                       : search_for_operation(get_operation_pool(op->type), &i, dest_width,
+                                                              lhs_width, rhs_width, is_const);
 
+        // Anything without a dedicated instruction is worked through a byte at
+        // a time.
+        if (cpu_op == NULL)
+            cpu_op = select_chain_operation(func, op);
         if (cpu_op == NULL)
             fatal("Failed to find operation for variable %%%zu. Variable promotion is not yet supported.",
                   op->dest);
 
-        op->cpu_info.operation = cpu_op;
-        // Select registers, cause spills as needed.
+        op->cpu_info.constant = op->rhs.const_unsigned;
+        claim_operation_registers(func, op, cpu_op, when);
 
-        // Claim the operation's required registers.
-        for (CPUReg** required_regs = cpu_op->required_regs; *required_regs; required_regs++) {
-            set_reg_usage(*required_regs, true);
+        // A pointer which is stepped stays in `hl` if it can, so that a walk
+        // through memory keeps it there and loads through it can step it.
+        LocalVar* dest = func->locals[op->dest];
+        if (cpu_op->hl_step && current_reg(dest) && current_reg(dest) != &hl_reg && !is_reg_used(&hl_reg)) {
+            set_reg_usage(current_reg(dest), false);
+            set_reg_usage(&hl_reg, true);
+            place_local(dest, &hl_reg, when);
         }
+    } break;
+    case DEREFERENCE: {
+        uint8_t width = type_widths[op->var_type];
+        const CpuOp* cpu_op = get_dereference_operation(width, current_reg(func->locals[op->lhs]) == &hl_reg);
+        if (cpu_op == NULL)
+            fatal("Failed to find operation for variable %%%zu. %u-byte dereferences are not yet supported.",
+                  op->dest, width);
 
-        // Then for each of these registers, spill any locals that may be using
-        // them.
-        for (CPUReg** required_regs = cpu_op->required_regs; *required_regs; required_regs++) {
-            open_register(func, *required_regs, when);
-        }
+        claim_operation_registers(func, op, cpu_op, when);
+    } break;
+    case LESS: case GREATER: case LESS_EQU: case GREATER_EQU: case NOT_EQU: case EQU:
+    case L_AND: case L_OR: case NOT: case NEGATE: case COMPLEMENT: {
+        // Comparisons are decided from the flags left by a byte-wise
+        // subtraction, and logical operations by testing each operand against
+        // zero. Unops are worked through a byte at a time as well.
+        const CpuOp* cpu_op = select_chain_operation(func, op);
+        if (cpu_op == NULL)
+            fatal("Failed to find operation for variable %%%zu. Variable promotion is not yet supported.",
+                  op->dest);
 
-        // Once this is done the operation's registers have been acounted for
-        // and it can later be compiled into assembly code after further
-        // processing.
+        op->cpu_info.constant = op->rhs.const_unsigned;
+        claim_operation_registers(func, op, cpu_op, when);
+    } break;
+    case LSH: case RSH: {
+        // Only shifts by a constant amount have a direct implementation. The
+        // cheapest sequence for the amount is chosen.
+        if (!op->rhs.is_const)
+            fatal("Failed to find operation for variable %%%zu. Shifts by a variable are not yet supported.",
+                  op->dest);
+
+        uint8_t dest_width = type_widths[op->var_type];
+        uint8_t lhs_width = type_widths[func->locals[op->lhs]->type];
+        const CpuOp** pool = op->type == LSH ? lsh_operations
+                           : is_signed_type(func->locals[op->lhs]->type) ? sra_operations
+                           : rsh_operations;
+
+        const CpuOp* cpu_op = search_for_const_operation(pool, dest_width, lhs_width, op->rhs.const_unsigned);
+
+        // Wider values are shifted a byte at a time.
+        if (cpu_op == NULL)
+            cpu_op = select_chain_operation(func, op);
+        if (cpu_op == NULL)
+            fatal("Failed to find operation for variable %%%zu. Variable promotion is not yet supported.",
+                  op->dest);
+
+        op->cpu_info.constant = op->rhs.const_unsigned;
+        claim_operation_registers(func, op, cpu_op, when);
+    } break;
+    case MUL: case DIV: case MOD: {
+        // The SM83 has no instructions for these, so they are left to the
+        // runtime library, which may be called or expanded inline.
+        uint8_t dest_width = type_widths[op->var_type];
+        uint8_t lhs_type = func->locals[op->lhs]->type;
+        bool is_signed = is_signed_type(lhs_type)
+                         || (op->rhs.is_const ? op->rhs.is_signed
+                                              : is_signed_type(func->locals[op->rhs.local_id]->type));
+
+        if (type_widths[lhs_type] != dest_width
+            || (!op->rhs.is_const && type_widths[func->locals[op->rhs.local_id]->type] != dest_width))
+            fatal("Failed to find operation for variable %%%zu. Variable promotion is not yet supported.",
+                  op->dest);
+
+        const CpuOp* cpu_op = select_runtime_operation(&op->cpu_info.operation, op->type, dest_width,
+                                                       is_signed, block_weight(op->statement.parent));
+        if (cpu_op == NULL)
+            fatal("Failed to find operation for variable %%%zu. No runtime routine handles it.",
+                  op->dest);
+
+        op->cpu_info.constant = op->rhs.const_unsigned;
+        claim_operation_registers(func, op, cpu_op, when);
     } break;
     }
 }
@@ -254,56 +929,63 @@ void assign_registers(Function* func) {
     for (size_t i = 0; regs8[i]; i++)
         set_reg_usage(regs8[i], false);
 
-    // Assign arguments according to the ABI.
+    // Assign arguments according to the function's calling convention, which
+    // is the ABI unless a call to it has already chosen otherwise.
+    use_standard_convention(func);
     for (size_t i = 0; i < func->parameter_count; i++) {
-        CPUReg** reg_pool = NULL;
-
-        switch (type_widths[func->parameter_types[i]]) {
-        case 1: reg_pool = regs8; break; // The ABI skips `a`
-        case 2: reg_pool = regs16; break;
-        case 4: reg_pool = regs32; break;
-        }
-
-        if (reg_pool) {
-            allocate_register(func->locals[i], reg_pool, 0);
-        } else {
-            fatal("No valid CPU registers for paremeter %%%zu in %s", i, func->declaration.identifier);
-        }
+        if (func->parameter_regs[i])
+            set_reg_usage(func->parameter_regs[i], true);
+        place_local(func->locals[i], func->parameter_regs[i], 0);
     }
 
     Statement* statement = NULL;
     size_t cur_statement = 0;
     size_t block_id = 0;
     while (statement = iterate_statements(func, statement, &cur_statement, &block_id)) {
-        //  Begin by allocating any locals needed by this statement.
+        // Reload any spilled locals which this statement reads. This is done
+        // before freeing any registers, so that a reloaded local can not be
+        // placed on top of another operand.
+        // Calls pass arguments straight from memory, and place their result
+        // themselves.
         LocalVar* this_local = NULL;
         for (size_t i = 0; this_local = iterate_locals(func, &i); i++) {
-            // This is a bit hacky, as it was made before spilling was accounted
-            // for.
-            if (!va_size(this_local->reg_reallocs) && this_local->lifetime_start == cur_statement) {
-                CPUReg** reg_pool = NULL;
-
-                // Choose a register pool according to the local's size.
-                switch (type_widths[this_local->type]) {
-                case 1: reg_pool = regs8; break;
-                case 2: reg_pool = regs16; break;
-                case 4: reg_pool = regs32; break;
-                }
+            if (va_len(this_local->reg_reallocs) && current_reg(this_local) == NULL && statement->type != CALL
+                && get_reg_pool(this_local->type) && is_used_at(this_local, cur_statement))
+                allocate_register(func, this_local, get_reg_pool(this_local->type), NULL, cur_statement);
+        }
+
+        // When a local variable is no longer used, free its register (if it
+        // still has one). A local which is never read keeps its register
+        // until the statement declaring it has been placed. Parameters are
+        // declared before any statement, even when the first one is their
+        // last use. This is done before allocating the locals declared here,
+        // so that they may take the place of operands which die here, whatever
+        // order the locals are numbered in.
+        for (size_t i = 0; this_local = iterate_locals(func, &i); i++) {
+            if (this_local->lifetime_end == cur_statement
+                && (this_local->origin == NULL || this_local->lifetime_start != cur_statement)
+                && current_reg(this_local))
+                set_reg_usage(current_reg(this_local), false);
+        }
 
-                // If no pool was available, skip straight to the stack.
-                if (reg_pool) {
-                    allocate_register(this_local, reg_pool, cur_statement);
+        //  Allocate any locals declared by this statement.
+        for (size_t i = 0; this_local = iterate_locals(func, &i); i++) {
+            if (!va_size(this_local->reg_reallocs) && this_local->lifetime_start == cur_statement
+                && statement->type != CALL) {
+                CPUReg** reg_pool = get_reg_pool(this_local->type);
+
+                // Pointers are placed in `hl` when it is free, since they can
+                // only be loaded through there. If no pool was available, skip
+                // straight to memory.
+                if (this_local->type == PTR && !is_reg_used(&hl_reg)) {
+                    set_reg_usage(&hl_reg, true);
+                    place_local(this_local, &hl_reg, cur_statement);
+                } else if (reg_pool) {
+                    allocate_register(func, this_local, reg_pool, NULL, cur_statement);
                 } else {
-                    fatal("No valid CPU registers for variable %%%zu in %s", i, func->declaration.identifier);
+                    place_local(this_local, NULL, cur_statement);
                 }
             }
-
-            // When a local variable is no longer used, free its register (if it
-            // still has one).
-            if (this_local->lifetime_end == cur_statement) {
-                if (va_len(this_local->reg_reallocs))
-                    set_reg_usage(va_last(this_local->reg_reallocs).reg, false);
-            }
         }
 
         // Choose a register layout for this statement, if one is needed.
@@ -315,40 +997,30 @@ void assign_registers(Function* func) {
             break;
         case READ: break;
         case WRITE: break;
-        }
-    }
-
-    // Temporarily output some debug info to show how registers were allocated.
-    printf("Begin regalloc graph of %s.\n====================\n0  1  2  3  4  5  6  7  8  9\n",
-            func->declaration.identifier);
-    statement = NULL;
-    cur_statement = 0;
-    block_id = 0;
-    while (statement = iterate_statements(func, statement, &cur_statement, &block_id)) {
-        for (size_t i = 0; i < va_len(func->locals); i++) {
-            LocalVar* this_local = func->locals[i];
-
-            if (this_local == NULL) {
-                fputs("   ", stdout);
-            } else if (this_local->lifetime_start <= cur_statement
-                       && this_local->lifetime_end >= cur_statement) {
-                const char* reg_name = NULL;
-
-                for (size_t i = 0; i < va_len(this_local->reg_reallocs); i++) {
-                    if (this_local->reg_reallocs[i].when <= cur_statement) {
-                        reg_name = this_local->reg_reallocs[i].reg->name;
-                    }
+        case CALL:
+            claim_call_registers(func, (Call*) statement, cur_statement);
+            break;
+        case BRANCH: {
+            // Conditions wider than a byte are tested by combining their bytes
+            // in `a`, which those in memory reach through `hl`. A counter in
+            // memory is decremented in `a`.
+            Branch* br = (Branch*) statement;
+            LocalVar* cond = func->locals[br->cond];
+            if (type_widths[cond->type] > 1 || (br->countdown && current_reg(cond) == NULL)) {
+                open_register(func, &a_reg, cur_statement);
+                set_reg_usage(&a_reg, false);
+                if (type_widths[cond->type] > 1 && current_reg(cond) == NULL) {
+                    open_register(func, &hl_reg, cur_statement);
+                    set_reg_usage(&hl_reg, false);
                 }
-
-                if (reg_name)
-                    printf("%-3s", reg_name);
-                else
-                    fputs("err", stdout);
-            } else {
-                fputs(".  ", stdout);
             }
+        } break;
+        }
+
+        for (size_t i = 0; this_local = iterate_locals(func, &i); i++) {
+            if (this_local->origin && this_local->lifetime_start == cur_statement
+                && this_local->lifetime_end == cur_statement && current_reg(this_local))
+                set_reg_usage(current_reg(this_local), false);
         }
-        putchar('\n');
     }
-    puts("====================");
 }
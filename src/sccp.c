@@ -0,0 +1,393 @@
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "cfg.h"
+#include "exception.h"
+#include "optimizer.h"
+#include "statements.h"
+#include "varray.h"
+
+// Sparse conditional constant propagation. Every local begins as undefined and
+// only moves down the lattice (undefined -> constant -> varying), while blocks
+// are only visited once an executable edge reaches them. This finds constants
+// through chains of operations and across blocks, and proves blocks
+// unreachable when every path to them depends on a constant condition.
+
+enum LatticeState {
+    LATTICE_UNDEFINED,
+    LATTICE_CONSTANT,
+    LATTICE_VARYING,
+};
+
+typedef struct LatticeCell {
+    uint8_t state;
+    // The local's constant value, truncated to the local's type.
+    uint64_t value;
+} LatticeCell;
+
+typedef struct SCCPState {
+    Function* func;
+    // The lattice cell of each local, indexed by local ID.
+    LatticeCell* cells;
+    // VArrays of the statements which read each local, indexed by local ID.
+    Statement*** users;
+    // Whether each basic block has been reached by an executable edge.
+    bool* executable;
+    // VArray of blocks which have become executable and must be visited.
+    size_t* block_worklist;
+    // VArray of statements whose operands have changed.
+    Statement** ssa_worklist;
+} SCCPState;
+
+// Floating point values are never folded, since the target has no support for
+// them yet.
+static bool is_foldable_type(uint8_t type) {
+    return type != VOID && type != F32 && type != F64;
+}
+
+static inline LatticeCell varying_cell() {
+    return (LatticeCell) {LATTICE_VARYING, 0};
+}
+
+static inline LatticeCell constant_cell(uint8_t type, uint64_t value) {
+    return (LatticeCell) {LATTICE_CONSTANT, truncate_to_type(type, value)};
+}
+
+// Get the lattice cell of a value, which may be either a constant or a local.
+static LatticeCell value_cell(SCCPState* st, Value* val) {
+    if (val->is_const)
+        return (LatticeCell) {LATTICE_CONSTANT, val->const_unsigned};
+    return st->cells[val->local_id];
+}
+
+// Record which statements read each local, so that only those need to be
+// revisited when the local's cell changes.
+static void collect_users(SCCPState* st) {
+    for (size_t i = 0; i < va_len(st->func->basic_blocks); i++) {
+        for (Statement* this_state = st->func->basic_blocks[i].first; this_state; this_state = this_state->next) {
+            uint64_t** operands = statement_operands(this_state);
+            for (size_t j = 0; j < va_len(operands); j++)
+                va_append(st->users[*operands[j]], this_state);
+            va_free(operands);
+        }
+    }
+}
+
+static void mark_executable(SCCPState* st, size_t block) {
+    if (block == NO_BLOCK || st->executable[block])
+        return;
+    st->executable[block] = true;
+    va_append(st->block_worklist, block);
+}
+
+// Lower a local's cell to the meet of its current state and `cell`. If this
+// changes the cell, every statement which reads the local is queued.
+static void set_cell(SCCPState* st, uint64_t id, LatticeCell cell) {
+    LatticeCell* old = &st->cells[id];
+
+    if (old->state == LATTICE_VARYING || cell.state == LATTICE_UNDEFINED)
+        return;
+    if (old->state == LATTICE_CONSTANT) {
+        if (cell.state == LATTICE_CONSTANT && cell.value == old->value)
+            return;
+        cell = varying_cell();
+    }
+
+    *old = cell;
+    for (size_t i = 0; i < va_len(st->users[id]); i++)
+        va_append(st->ssa_worklist, st->users[id][i]);
+}
+
+// Evaluate a binary operation on two constants. `lhs` and `rhs` must already be
+// truncated to the width of their types. Returns false if the operation can not
+// be evaluated at compile time, such as a division by zero.
+static bool fold_binop(uint8_t op_type, bool is_signed, uint64_t lhs, uint64_t rhs, uint64_t* result) {
+    int64_t signed_lhs = lhs;
+    int64_t signed_rhs = rhs;
+
+    // This big, ugly macro helps avoid some big, ugly code.
+    #define FOLD_COMPARISON(type, op) \
+        case type: \
+            *result = is_signed ? signed_lhs op signed_rhs : lhs op rhs; \
+            break
+
+    switch (op_type) {
+    case ADD: *result = lhs + rhs; break;
+    case SUB: *result = lhs - rhs; break;
+    case MUL: *result = lhs * rhs; break;
+    case DIV: case MOD:
+        if (rhs == 0 || (is_signed && signed_lhs == INT64_MIN && signed_rhs == -1))
+            return false;
+        if (is_signed)
+            *result = op_type == DIV ? signed_lhs / signed_rhs : signed_lhs % signed_rhs;
+        else
+            *result = op_type == DIV ? lhs / rhs : lhs % rhs;
+        break;
+    case B_AND: *result = lhs & rhs; break;
+    case B_OR: *result = lhs | rhs; break;
+    case B_XOR: *result = lhs ^ rhs; break;
+    case L_AND: *result = lhs && rhs; break;
+    case L_OR: *result = lhs || rhs; break;
+    case LSH: *result = rhs >= 64 ? 0 : lhs << rhs; break;
+    case RSH:
+        if (is_signed)
+            *result = rhs >= 64 ? (signed_lhs < 0 ? -1 : 0) : signed_lhs >> rhs;
+        else
+            *result = rhs >= 64 ? 0 : lhs >> rhs;
+        break;
+    FOLD_COMPARISON(LESS, <);
+    FOLD_COMPARISON(GREATER, >);
+    FOLD_COMPARISON(LESS_EQU, <=);
+    FOLD_COMPARISON(GREATER_EQU, >=);
+    FOLD_COMPARISON(NOT_EQU, !=);
+    FOLD_COMPARISON(EQU, ==);
+    default:
+        return false;
+    }
+
+    #undef FOLD_COMPARISON
+
+    return true;
+}
+
+// Compute the lattice cell of an operation's destination from its operands.
+static LatticeCell evaluate_operation(SCCPState* st, Operation* op) {
+    Function* func = st->func;
+
+    if (!is_foldable_type(op->var_type))
+        return varying_cell();
+
+    switch (op->type) {
+    case ADDRESS: case DEREFERENCE:
+        return varying_cell();
+    case ASSIGN: {
+        if (!op->rhs.is_const && !is_foldable_type(func->locals[op->rhs.local_id]->type))
+            return varying_cell();
+        LatticeCell src = value_cell(st, &op->rhs);
+        if (src.state != LATTICE_CONSTANT)
+            return src;
+        return constant_cell(op->var_type, src.value);
+    }
+    case NOT: case NEGATE: case COMPLEMENT: {
+        LatticeCell src = st->cells[op->lhs];
+        if (!is_foldable_type(func->locals[op->lhs]->type))
+            return varying_cell();
+        if (src.state != LATTICE_CONSTANT)
+            return src;
+        switch (op->type) {
+        case NOT: return constant_cell(op->var_type, !src.value);
+        case NEGATE: return constant_cell(op->var_type, -src.value);
+        default: return constant_cell(op->var_type, ~src.value);
+        }
+    }
+    default: {
+        LatticeCell lhs = st->cells[op->lhs];
+        LatticeCell rhs = value_cell(st, &op->rhs);
+
+        if (!is_foldable_type(func->locals[op->lhs]->type)
+            || (!op->rhs.is_const && !is_foldable_type(func->locals[op->rhs.local_id]->type)))
+            return varying_cell();
+
+        // A few operations have a known result even when one side varies.
+        bool lhs_zero = lhs.state == LATTICE_CONSTANT && lhs.value == 0;
+        bool rhs_zero = rhs.state == LATTICE_CONSTANT && rhs.value == 0;
+        if ((op->type == MUL || op->type == B_AND || op->type == L_AND) && (lhs_zero || rhs_zero))
+            return constant_cell(op->var_type, 0);
+
+        if (lhs.state == LATTICE_VARYING || rhs.state == LATTICE_VARYING)
+            return varying_cell();
+        if (lhs.state == LATTICE_UNDEFINED || rhs.state == LATTICE_UNDEFINED)
+            return (LatticeCell) {LATTICE_UNDEFINED, 0};
+
+        bool is_signed = is_signed_type(func->locals[op->lhs]->type)
+                         || (op->rhs.is_const ? op->rhs.is_signed
+                                              : is_signed_type(func->locals[op->rhs.local_id]->type));
+        uint64_t result;
+        if (!fold_binop(op->type, is_signed, lhs.value, rhs.value, &result))
+            return varying_cell();
+        return constant_cell(op->var_type, result);
+    }
+    }
+}
+
+static void visit_statement(SCCPState* st, Statement* statement) {
+    switch (statement->type) {
+    case OPERATION: {
+        Operation* op = (Operation*) statement;
+        set_cell(st, op->dest, evaluate_operation(st, op));
+    } break;
+    case READ:
+        set_cell(st, ((Read*) statement)->dest, varying_cell());
+        break;
+    case CALL:
+        if (((Call*) statement)->var_type != VOID)
+            set_cell(st, ((Call*) statement)->dest, varying_cell());
+        break;
+    case JUMP: {
+        size_t successors[2];
+        size_t block = statement->parent - st->func->basic_blocks;
+        size_t count = block_successors(st->func, block, successors);
+        for (size_t i = 0; i < count; i++)
+            mark_executable(st, successors[i]);
+    } break;
+    case BRANCH: {
+        // Only the side which a constant condition selects can be taken.
+        Branch* br = (Branch*) statement;
+        LatticeCell cond = st->cells[br->cond];
+        if (cond.state != LATTICE_VARYING && cond.state != LATTICE_CONSTANT)
+            break;
+        if (cond.state == LATTICE_VARYING || cond.value)
+            mark_executable(st, find_block(st->func, br->true_label));
+        if (cond.state == LATTICE_VARYING || !cond.value)
+            mark_executable(st, find_block(st->func, br->false_label));
+    } break;
+    }
+}
+
+// Replace branches on a constant with a jump to the side which is taken. This
+// must happen before removing unexecutable blocks, which the other side may
+// refer to.
+static void fold_branches(SCCPState* st) {
+    Function* func = st->func;
+
+    for (size_t i = 0; i < va_len(func->basic_blocks); i++) {
+        Statement* final = func->basic_blocks[i].final;
+        if (!st->executable[i] || final == NULL || final->type != BRANCH)
+            continue;
+
+        Branch* br = (Branch*) final;
+        LatticeCell cond = st->cells[br->cond];
+        if (cond.state != LATTICE_CONSTANT)
+            continue;
+
+        replace_with_jump(func, final, cond.value ? br->true_label : br->false_label);
+    }
+}
+
+// Remove blocks which were never reached, along with any locals they declare.
+static void remove_unexecutable_blocks(SCCPState* st) {
+    Function* func = st->func;
+
+    for (size_t i = va_len(func->basic_blocks) - 1; i > 0; i--) {
+        if (st->executable[i])
+            continue;
+
+        for (Statement* state = func->basic_blocks[i].first; state; state = state->next) {
+            uint64_t dest;
+            if (!statement_dest(state, &dest))
+                continue;
+            free_local_var(func->locals[dest]);
+            func->locals[dest] = NULL;
+        }
+        va_remove(func->basic_blocks, i);
+    }
+
+    update_block_parents(func);
+    count_block_references(func);
+}
+
+// Replace a value which refers to a constant local with the constant itself.
+static void replace_const_value(SCCPState* st, Value* val) {
+    if (val->is_const || st->cells[val->local_id].state != LATTICE_CONSTANT)
+        return;
+    uint8_t type = st->func->locals[val->local_id]->type;
+    set_const_value(val, type, st->cells[val->local_id].value);
+}
+
+// Rewrite the function using the solved lattice.
+static void apply_constants(SCCPState* st) {
+    Function* func = st->func;
+
+    for (size_t i = 0; i < va_len(func->basic_blocks); i++) {
+        for (Statement* this_state = func->basic_blocks[i].first; this_state; this_state = this_state->next) {
+            switch (this_state->type) {
+            case OPERATION: {
+                Operation* op = (Operation*) this_state;
+                LatticeCell dest = st->cells[op->dest];
+
+                // Constant results become constant assignments.
+                if (dest.state == LATTICE_CONSTANT) {
+                    op->type = ASSIGN;
+                    set_const_value(&op->rhs, op->var_type, dest.value);
+                    break;
+                }
+
+                switch (op->type) {
+                case ASSIGN: case NOT: case NEGATE: case COMPLEMENT: case ADDRESS: case DEREFERENCE:
+                    break;
+                default:
+                    // The left operand must be a local, so a constant on the
+                    // left can only be substituted by swapping the operands.
+                    if (is_commutative(op->type) && !op->rhs.is_const
+                        && st->cells[op->lhs].state == LATTICE_CONSTANT) {
+                        uint64_t const_id = op->lhs;
+                        op->lhs = op->rhs.local_id;
+                        op->rhs.local_id = const_id;
+                    }
+                    replace_const_value(st, &op->rhs);
+                    break;
+                }
+            } break;
+            case RETURN:
+                replace_const_value(st, &((Return*) this_state)->val);
+                break;
+            case CALL: {
+                Call* call = (Call*) this_state;
+                for (size_t j = 0; j < va_len(call->args); j++)
+                    replace_const_value(st, &call->args[j]);
+            } break;
+            }
+        }
+    }
+
+    count_local_references(func);
+}
+
+void propagate_constants(Function* func) {
+    SCCPState st;
+    size_t local_count = va_len(func->locals);
+
+    st.func = func;
+    st.cells = calloc(local_count, sizeof(LatticeCell));
+    st.users = malloc(local_count * sizeof(Statement**));
+    st.executable = calloc(va_len(func->basic_blocks), sizeof(bool));
+    st.block_worklist = va_new(0);
+    st.ssa_worklist = va_new(0);
+
+    for (size_t i = 0; i < local_count; i++)
+        st.users[i] = va_new(0);
+
+    // Parameters are unknown at compile time.
+    for (size_t i = 0; i < func->parameter_count; i++)
+        st.cells[i] = varying_cell();
+
+    collect_users(&st);
+    mark_executable(&st, 0);
+
+    while (va_len(st.block_worklist) || va_len(st.ssa_worklist)) {
+        while (va_len(st.block_worklist)) {
+            size_t block = va_last(st.block_worklist);
+            va_remove(st.block_worklist, va_len(st.block_worklist) - 1);
+            for (Statement* state = func->basic_blocks[block].first; state; state = state->next)
+                visit_statement(&st, state);
+        }
+        while (va_len(st.ssa_worklist)) {
+            Statement* state = va_last(st.ssa_worklist);
+            va_remove(st.ssa_worklist, va_len(st.ssa_worklist) - 1);
+            if (st.executable[state->parent - func->basic_blocks])
+                visit_statement(&st, state);
+        }
+    }
+
+    fold_branches(&st);
+    remove_unexecutable_blocks(&st);
+    apply_constants(&st);
+
+    for (size_t i = 0; i < local_count; i++)
+        va_free(st.users[i]);
+    free(st.users);
+    free(st.cells);
+    free(st.executable);
+    va_free(st.block_worklist);
+    va_free(st.ssa_worklist);
+}
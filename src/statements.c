@@ -2,6 +2,7 @@
 #include <stdio.h>
 #include <inttypes.h>
 
+#include "cfg.h"
 #include "exception.h"
 #include "parser.h"
 #include "statements.h"
@@ -48,12 +49,352 @@ LocalVar* iterate_locals(Function* func, size_t* i) {
 }
 
 LocalVar* get_local(Function* func, size_t i) {
-    if (func->locals[i])
+    if (i < va_len(func->locals) && func->locals[i])
         return func->locals[i];
     fatal("Attempted to access undeclared local variable, %%%zu, in %s.", i, func->declaration.identifier);
     return NULL;
 }
 
+// Add a statement as the final element in a basic block.
+void append_to_block(BasicBlock* bb, Statement* st) {
+    if (bb->first == NULL) {
+        // If the list is empty set st to both the first and final entry...
+        bb->first = st;
+        bb->final = st;
+        // ...with no links.
+        st->last = NULL;
+        st->next = NULL;
+    } else {
+        // Otherwise set st to the last entry, update the old last entry's next
+        // link to st, and set st's last link to the old last.
+        st->last = bb->final;
+        bb->final->next = st;
+        bb->final = st;
+        st->next = NULL;
+    }
+    st->parent = bb;
+}
+
+// Link a statement into a basic block directly before another statement.
+void insert_before(Statement* position, Statement* st) {
+    BasicBlock* bb = position->parent;
+
+    st->last = position->last;
+    st->next = position;
+    if (position->last)
+        position->last->next = st;
+    else
+        bb->first = st;
+    position->last = st;
+    st->parent = bb;
+}
+
+// Remove a statement from a basic block
+void remove_from_block(BasicBlock* bb, Statement* st) {
+    if (bb->first == st)
+        bb->first = st->next;
+    if (bb->final == st)
+        bb->final = st->last;
+    if (st->next)
+        st->next->last = st->last;
+    if (st->last)
+        st->last->next = st->next;
+}
+
+// Initiallize members of a new basic block.
+void init_block(BasicBlock* bb, char* label) {
+    bb->label = label;
+    bb->ref_count = 0;
+    bb->loop_depth = 0;
+    bb->idom = 0;
+    bb->profile_count = UNPROFILED;
+    bb->profile_weight = UNPROFILED;
+    bb->first = NULL;
+    bb->final = NULL;
+}
+
+// Create a label owned by a function, for a new block.
+char* new_label(Function* func, const char* prefix, const char* suffix) {
+    size_t length = strlen(prefix) + strlen(suffix) + 1;
+    Label* label = malloc(sizeof(Label));
+    label->statement.type = LABEL;
+    label->identifier = malloc(length);
+    snprintf(label->identifier, length, "%s%s", prefix, suffix);
+    va_append(func->statements, &label->statement);
+    return label->identifier;
+}
+
+// Create a label made of a block's label and a suffix, adding underscores to
+// the suffix until no block uses the label.
+char* unique_label(Function* func, const char* base, const char* suffix) {
+    char extended[256];
+    snprintf(extended, sizeof(extended), "%s", suffix);
+
+    while (strlen(base) + strlen(extended) < 255) {
+        char name[512];
+        snprintf(name, sizeof(name), "%s%s", base, extended);
+        if (find_block(func, name) == NO_BLOCK)
+            break;
+        strcat(extended, "_");
+    }
+    return new_label(func, base, extended);
+}
+
+// Point each statement back at the block which contains it. Blocks are stored
+// by value, so this must be called whenever the block array is resized or
+// reordered.
+void update_block_parents(Function* func) {
+    for (size_t i = 0; i < va_len(func->basic_blocks); i++) {
+        for (Statement* state = func->basic_blocks[i].first; state; state = state->next)
+            state->parent = &func->basic_blocks[i];
+    }
+}
+
+void init_local(LocalVar** local, Statement* origin, uint8_t type) {
+    *local = malloc(sizeof(LocalVar));
+    LocalVar* this = *local;
+
+    this->origin = origin;
+    this->references = va_new(0);
+    this->type = type;
+    this->lifetime_start = 0;
+    this->lifetime_end = 0;
+    this->active_reg = 0;
+    this->reg_reallocs = va_new(0);
+    this->uses = va_new(0);
+}
+
+// Create a new operation along with the local it declares. The operation is
+// owned by the function, but is not yet linked into any block.
+Operation* new_operation(Function* func, uint8_t op_type, uint8_t var_type, uint64_t lhs, Value rhs) {
+    Operation* op = malloc(sizeof(Operation));
+
+    op->statement.type = OPERATION;
+    op->statement.last = NULL;
+    op->statement.next = NULL;
+    op->statement.parent = NULL;
+    op->type = op_type;
+    op->var_type = var_type;
+    op->dest = va_len(func->locals);
+    op->lhs = lhs;
+    op->rhs = rhs;
+    op->cpu_info = (struct CpuOpInfo) {0};
+
+    va_append(func->statements, (Statement*) op);
+    va_append(func->locals, (LocalVar*) NULL);
+    init_local(&func->locals[op->dest], (Statement*) op, var_type);
+    return op;
+}
+
+// Rewrite every reference to a local so that it refers to another local
+// instead. The old local is left without any references.
+void replace_local_uses(Function* func, uint64_t old_id, uint64_t new_id) {
+    LocalVar* old_local = get_local(func, old_id);
+    LocalVar* new_local = get_local(func, new_id);
+
+    for (size_t i = 0; i < va_len(old_local->references); i++) {
+        *old_local->references[i] = new_id;
+        va_append(new_local->references, old_local->references[i]);
+    }
+    va_free(old_local->references);
+    old_local->references = va_new(0);
+}
+
+// Collect a pointer to each local ID which a statement reads into a new VArray.
+uint64_t** statement_operands(Statement* statement) {
+    uint64_t** operands = va_new(0);
+
+    switch (statement->type) {
+    case OPERATION: {
+        Operation* op = (Operation*) statement;
+        switch (op->type) {
+        default:
+            if (!op->rhs.is_const)
+                va_append(operands, &op->rhs.local_id);
+            // fallthrough
+        case NOT: case NEGATE: case COMPLEMENT: case ADDRESS: case DEREFERENCE:
+            va_append(operands, &op->lhs);
+            break; // unops
+        case ASSIGN:
+            if (!op->rhs.is_const)
+                va_append(operands, &op->rhs.local_id);
+            break; //assign
+        }
+    } break;
+    case WRITE:
+        va_append(operands, &((Write*) statement)->src);
+        break;
+    case BRANCH:
+        va_append(operands, &((Branch*) statement)->cond);
+        break;
+    case RETURN: {
+        Return* ret = (Return*) statement;
+        if (!ret->val.is_const)
+            va_append(operands, &ret->val.local_id);
+    } break;
+    case CALL: {
+        Call* call = (Call*) statement;
+        for (size_t i = 0; i < va_len(call->args); i++) {
+            if (!call->args[i].is_const)
+                va_append(operands, &call->args[i].local_id);
+        }
+    } break;
+    }
+
+    return operands;
+}
+
+// Get the ID of the local a statement declares. Returns false if the statement
+// does not declare a local.
+bool statement_dest(Statement* statement, uint64_t* dest) {
+    switch (statement->type) {
+    case OPERATION: *dest = ((Operation*) statement)->dest; return true;
+    case READ: *dest = ((Read*) statement)->dest; return true;
+    case CALL:
+        *dest = ((Call*) statement)->dest;
+        return ((Call*) statement)->var_type != VOID;
+    }
+    return false;
+}
+
+// Check if a call is immediately followed by a return of its result, so that
+// the callee could return straight to the caller's caller. In functions which
+// return nothing, any call followed by a return qualifies. Interrupt handlers
+// must restore what they saved before they return, so they make no tail calls.
+bool is_tail_call(Function* func, Call* call) {
+    Return* ret = (Return*) call->statement.next;
+
+    if (ret == NULL || ret->statement.type != RETURN || is_interrupt_handler(&func->declaration))
+        return false;
+    if (func->declaration.type == VOID)
+        return true;
+    return call->var_type == func->declaration.type && !ret->val.is_const && ret->val.local_id == call->dest;
+}
+
+static char* copy_string(const char* str) {
+    char* copy = malloc(strlen(str) + 1);
+    strcpy(copy, str);
+    return copy;
+}
+
+// Make a copy of a statement which is not linked into any block. Any strings
+// and arrays it holds are copied as well.
+Statement* copy_statement(Statement* statement) {
+    static const size_t sizes[] = {
+        [OPERATION] = sizeof(Operation), [READ] = sizeof(Read), [WRITE] = sizeof(Write),
+        [JUMP] = sizeof(Jump), [BRANCH] = sizeof(Branch), [RETURN] = sizeof(Return),
+        [CALL] = sizeof(Call), [LABEL] = sizeof(Label),
+    };
+    Statement* copy = malloc(sizes[statement->type]);
+
+    memcpy(copy, statement, sizes[statement->type]);
+    copy->last = NULL;
+    copy->next = NULL;
+    copy->parent = NULL;
+
+    switch (copy->type) {
+    case READ: ((Read*) copy)->src = copy_string(((Read*) copy)->src); break;
+    case WRITE: ((Write*) copy)->dest = copy_string(((Write*) copy)->dest); break;
+    case JUMP: ((Jump*) copy)->label = copy_string(((Jump*) copy)->label); break;
+    case BRANCH:
+        ((Branch*) copy)->true_label = copy_string(((Branch*) copy)->true_label);
+        ((Branch*) copy)->false_label = copy_string(((Branch*) copy)->false_label);
+        break;
+    case CALL:
+        ((Call*) copy)->function = copy_string(((Call*) copy)->function);
+        ((Call*) copy)->args = va_dup(((Call*) copy)->args);
+        break;
+    case LABEL: ((Label*) copy)->identifier = copy_string(((Label*) copy)->identifier); break;
+    }
+    return copy;
+}
+
+// Remove a statement from its block, along with each reference it holds to
+// other locals. The statement itself is still owned by the function's statement
+// list.
+void delete_statement(Function* func, Statement* statement) {
+    uint64_t** operands = statement_operands(statement);
+
+    for (size_t i = 0; i < va_len(operands); i++) {
+        LocalVar* operand = func->locals[*operands[i]];
+        if (operand == NULL)
+            continue;
+        for (size_t j = 0; j < va_len(operand->references); j++) {
+            if (operand->references[j] == operands[i]) {
+                va_remove(operand->references, j);
+                break;
+            }
+        }
+    }
+    va_free(operands);
+
+    remove_from_block(statement->parent, statement);
+}
+
+// Replace a statement which ends a block with a jump to a label.
+void replace_with_jump(Function* func, Statement* statement, const char* label) {
+    Jump* jmp = malloc(sizeof(Jump));
+    jmp->statement.type = JUMP;
+    jmp->label = malloc(strlen(label) + 1);
+    strcpy(jmp->label, label);
+
+    va_append(func->statements, &jmp->statement);
+    insert_before(statement, &jmp->statement);
+    delete_statement(func, statement);
+}
+
+// Remove a local variable and the statement which declares it.
+void delete_local(Function* func, uint64_t id) {
+    LocalVar* local = get_local(func, id);
+
+    if (local->origin)
+        delete_statement(func, local->origin);
+    free_local_var(local);
+    func->locals[id] = NULL;
+}
+
+// Check if the operands of a binary operation may be swapped.
+bool is_commutative(uint8_t op_type) {
+    switch (op_type) {
+    case ADD: case MUL: case B_AND: case B_OR: case B_XOR: case L_AND: case L_OR:
+    case NOT_EQU: case EQU:
+        return true;
+    }
+    return false;
+}
+
+// Swap a comparison's direction so that its operands may be exchanged.
+uint8_t mirror_comparison(uint8_t op_type) {
+    switch (op_type) {
+    case LESS: return GREATER;
+    case GREATER: return LESS;
+    case LESS_EQU: return GREATER_EQU;
+    case GREATER_EQU: return LESS_EQU;
+    }
+    return op_type;
+}
+
+// Truncate a constant to the width of a type. Signed types are sign-extended
+// back to 64 bits, so that the result can be read through `const_signed`.
+uint64_t truncate_to_type(uint8_t type, uint64_t value) {
+    unsigned bits = type_widths[type] * 8;
+    if (bits == 0 || bits >= 64)
+        return value;
+
+    uint64_t mask = ((uint64_t) 1 << bits) - 1;
+    value &= mask;
+    if (is_signed_type(type) && (value >> (bits - 1)) & 1)
+        value |= ~mask;
+    return value;
+}
+
+// Replace a value with a constant of a given type.
+void set_const_value(Value* val, uint8_t type, uint64_t value) {
+    val->is_const = true;
+    val->const_unsigned = truncate_to_type(type, value);
+    val->is_signed = is_signed_type(type) && val->const_signed < 0;
+}
+
 void fprint_value(FILE* out, Value* val) {
     if (!val->is_const)
         fprintf(out, "%%%" PRIu64, val->local_id);
@@ -63,8 +404,9 @@ void fprint_value(FILE* out, Value* val) {
         fprintf(out, "%" PRIu64, val->const_unsigned);
 }
 
-// Convert a statement structure into valid textual IR.
-void fprint_statement(FILE* out, Statement* statement) {
+// Convert a statement structure into valid textual IR, within a function
+// returning `return_type`.
+void fprint_statement(FILE* out, uint8_t return_type, Statement* statement) {
     switch (statement->type) {
     case OPERATION: {
         Operation* op = (Operation*) statement;
@@ -94,30 +436,51 @@ void fprint_statement(FILE* out, Statement* statement) {
     case JUMP:
         fprintf(out, "    jmp %s;\n", ((Jump*) statement)->label);
         break;
+    case BRANCH: {
+        Branch* br = (Branch*) statement;
+        fprintf(out, "    jmp %s%%%" PRIu64 " ? %s : %s;\n", br->countdown ? "--" : "", br->cond, br->true_label,
+                br->false_label);
+    } break;
     case RETURN: {
         Return* ret = (Return*) statement;
-        fputs("    return ", out);
-        fprint_value(out, &ret->val);
+        fputs("    return", out);
+        if (return_type != VOID) {
+            fputc(' ', out);
+            fprint_value(out, &ret->val);
+        }
         fputs(";\n", out);
     } break;
+    case CALL: {
+        Call* call = (Call*) statement;
+        fputs("    ", out);
+        if (call->var_type != VOID)
+            fprintf(out, "%s %%%" PRIu64 " = ", TYPE[call->var_type], call->dest);
+        fprintf(out, "call %s(", call->function);
+        for (size_t i = 0; i < va_len(call->args); i++) {
+            if (i)
+                fputs(", ", out);
+            fprint_value(out, &call->args[i]);
+        }
+        fputs(");\n", out);
+    } break;
     case LABEL:
         fprintf(out, "  @%s:\n", ((Label*) statement)->identifier);
         break;
     }
 }
 
-// Convert a declaration structure into valid textual IR. If a function is
-// encountered, its statements will be printed as well.
-void fprint_declaration(FILE* out, Declaration* declaration) {
+// Print a declaration under the given storage class and name.
+static void fprint_declaration_as(FILE* out, Declaration* declaration, uint8_t storage_class,
+                                  const char* identifier) {
     fprintf(out, "%s %s %s [[ ",
-            STORAGE_CLASS[declaration->storage_class],
+            STORAGE_CLASS[storage_class],
             declaration->is_fn ? "fn" : "var",
             TYPE[declaration->type]);
 
     for (size_t i = 0; i < va_len(declaration->traits); i++)
         fprintf(out, "%s ", declaration->traits[i]);
 
-    fprintf(out, "]] %s", declaration->identifier);
+    fprintf(out, "]] %s", identifier);
 
     if (declaration->is_fn) {
         Function* func = (Function*) declaration;
@@ -130,6 +493,11 @@ void fprint_declaration(FILE* out, Declaration* declaration) {
                 fprintf(out, ", %s", TYPE[func->parameter_types[i]]);
         }
 
+        // Functions defined elsewhere have no body.
+        if (storage_class == EXTERN) {
+            fputs(");\n", out);
+            return;
+        }
         fputs(") {\n", out);
 
         // Print statements using basic blocks, since this is the "optimized"
@@ -139,7 +507,7 @@ void fprint_declaration(FILE* out, Declaration* declaration) {
                 fprintf(out, "  @%s:\n", func->basic_blocks[i].label);
 
             for (Statement* state = func->basic_blocks[i].first; state; state = state->next)
-                fprint_statement(out, state);
+                fprint_statement(out, declaration->type, state);
         }
         fputs("}\n", out);
     } else {
@@ -147,9 +515,24 @@ void fprint_declaration(FILE* out, Declaration* declaration) {
     }
 }
 
+// Convert a declaration structure into valid textual IR. If a function is
+// encountered, its statements will be printed as well. The IR has no aliases,
+// so each name which was folded into a function is printed as an exported
+// copy of it, which folding will join with it again.
+void fprint_declaration(FILE* out, Declaration* declaration) {
+    fprint_declaration_as(out, declaration, declaration->storage_class, declaration->identifier);
+    if (!declaration->is_fn)
+        return;
+
+    Function* func = (Function*) declaration;
+    for (size_t i = 0; func->aliases && i < va_len(func->aliases); i++)
+        fprint_declaration_as(out, declaration, EXPORT, func->aliases[i]);
+}
+
 void free_local_var(LocalVar* local) {
     va_free(local->references);
     va_free(local->reg_reallocs);
+    va_free(local->uses);
     free(local);
 }
 
@@ -158,13 +541,21 @@ void free_statement(Statement* statement) {
     case READ: free(((Read*) statement)->src); break;
     case WRITE: free(((Write*) statement)->dest); break;
     case JUMP: free(((Jump*) statement)->label); break;
+    case BRANCH:
+        free(((Branch*) statement)->true_label);
+        free(((Branch*) statement)->false_label);
+        break;
+    case CALL:
+        free(((Call*) statement)->function);
+        va_free(((Call*) statement)->args);
+        break;
     case LABEL: free(((Label*) statement)->identifier); break;
     }
     free(statement);
 }
 
 void free_declaration(Declaration* declaration) {
-    if (declaration->is_fn) {
+    if (has_body(declaration)) {
         Function* func = (Function*) declaration;
 
         for (size_t i = 0; i < va_len(func->statements); i++)
@@ -174,11 +565,21 @@ void free_declaration(Declaration* declaration) {
         for (size_t i = 0; this_local = iterate_locals(func, &i); i++)
             free_local_var(this_local);
 
-        free(func->parameter_types);
+        free_loops(func);
         va_free(func->basic_blocks);
         va_free(func->statements);
         va_free(func->locals);
     }
+    if (declaration->is_fn) {
+        Function* func = (Function*) declaration;
+        free(func->parameter_types);
+        if (func->parameter_regs)
+            va_free(func->parameter_regs);
+        if (func->writes)
+            va_free(func->writes);
+        if (func->aliases)
+            va_free_contents(func->aliases);
+    }
 
     free(declaration->identifier);
     va_free_contents(declaration->traits);
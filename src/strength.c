@@ -0,0 +1,410 @@
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "gb/operations.h"
+#include "gb/runtime.h"
+#include "optimizer.h"
+#include "registers.h"
+#include "statements.h"
+#include "varray.h"
+
+// Strength reduction. The SM83 has no multiply or divide instructions, so
+// these are normally compiled into calls to slow runtime routines. When one
+// operand is a constant, the operation can usually be rewritten as a short
+// sequence of shifts, adds, and masks instead. Each sequence is only used when
+// its estimated cost beats the fastest runtime routine.
+
+// The replacement sequence for a single operation. New operations are inserted
+// before the original, and the final step of the sequence is moved into the
+// original so that its local keeps the same ID.
+typedef struct Rewrite {
+    Function* func;
+    Operation* op;
+    // The local being multiplied or divided.
+    uint64_t input;
+    // The most recently inserted operation.
+    Operation* last;
+} Rewrite;
+
+static inline Value local_value(uint64_t id) {
+    return (Value) {.is_const = false, .local_id = id};
+}
+
+static inline Value const_value(uint8_t type, uint64_t value) {
+    Value val;
+    set_const_value(&val, type, value);
+    return val;
+}
+
+// Insert a new operation before the one being rewritten, returning its local.
+static uint64_t emit(Rewrite* rw, uint8_t op_type, uint8_t var_type, uint64_t lhs, Value rhs) {
+    Operation* op = new_operation(rw->func, op_type, var_type, lhs, rhs);
+    insert_before(&rw->op->statement, &op->statement);
+    rw->last = op;
+    return op->dest;
+}
+
+// Replace the original operation with the final step of the sequence, whose
+// result is in `result`.
+static void finish(Rewrite* rw, uint64_t result) {
+    Operation* op = rw->op;
+
+    if (rw->last && rw->last->dest == result) {
+        op->type = rw->last->type;
+        op->lhs = rw->last->lhs;
+        op->rhs = rw->last->rhs;
+        delete_local(rw->func, result);
+    } else {
+        // The result is an existing local. The copy is cleaned up once every
+        // operation has been rewritten.
+        op->type = ASSIGN;
+        op->rhs = local_value(result);
+    }
+}
+
+static bool is_power_of_two(uint64_t value) {
+    return value && !(value & (value - 1));
+}
+
+static unsigned log2_floor(uint64_t value) {
+    unsigned result = 0;
+    while (value >>= 1)
+        result++;
+    return result;
+}
+
+// The unsigned type with the same width as an integer type.
+static uint8_t unsigned_type(uint8_t type) {
+    return is_signed_type(type) ? type - (I8 - U8) : type;
+}
+
+// The unsigned type twice as wide as an integer type. Returns VOID if there is
+// none.
+static uint8_t widened_type(uint8_t type) {
+    switch (unsigned_type(type)) {
+    case U8: return U16;
+    case U16: return U32;
+    case U32: return U64;
+    }
+    return VOID;
+}
+
+// The speed of leaving an operation to the runtime library. Any sequence beats
+// an operation which the library has no routine for.
+static unsigned runtime_cost(uint8_t op_type, uint8_t type, bool is_signed) {
+    unsigned cycles = estimate_runtime_cycles(op_type, type_widths[type], is_signed);
+    return cycles ? cycles : UINT_MAX;
+}
+
+/*
+ * Multiplication
+ */
+
+// A multiplier broken into signed digits, least significant first. Each
+// non-zero digit costs an add or subtract, and each run of zeros a shift.
+typedef struct Multiplier {
+    int8_t digits[65];
+    unsigned top;
+} Multiplier;
+
+static void binary_digits(Multiplier* m, uint64_t value) {
+    m->top = 0;
+    for (unsigned i = 0; i < 64; i++) {
+        m->digits[i] = (value >> i) & 1;
+        if (m->digits[i])
+            m->top = i;
+    }
+    m->digits[64] = 0;
+}
+
+// Non-adjacent form, which replaces each run of ones with a single subtract,
+// such as 15 = 16 - 1.
+static void naf_digits(Multiplier* m, uint64_t value) {
+    // The digits may need one more bit than the value itself.
+    unsigned __int128 n = value;
+
+    m->top = 0;
+    for (unsigned i = 0; i < 65; i++) {
+        m->digits[i] = 0;
+        if (n & 1) {
+            m->digits[i] = (n & 3) == 3 ? -1 : 1;
+            n -= m->digits[i];
+        }
+        if (m->digits[i])
+            m->top = i;
+        n >>= 1;
+    }
+}
+
+static unsigned multiplier_cost(Multiplier* m, uint8_t width) {
+    unsigned cost = 0;
+    unsigned shift = 0;
+
+    for (unsigned i = m->top; i-- > 0;) {
+        shift++;
+        if (m->digits[i]) {
+            cost += estimate_shift_cycles(width, true, false, shift);
+            cost += estimate_add_cycles(width, m->digits[i] < 0);
+            shift = 0;
+        }
+    }
+    if (shift)
+        cost += estimate_shift_cycles(width, true, false, shift);
+    return cost;
+}
+
+// Choose the cheapest way to multiply by a constant. Returns its cost in
+// M-cycles.
+static unsigned plan_multiply(Multiplier* m, uint8_t type, uint64_t value) {
+    Multiplier naf;
+    uint8_t width = type_widths[type];
+
+    binary_digits(m, value);
+    naf_digits(&naf, value);
+
+    unsigned cost = multiplier_cost(m, width);
+    unsigned naf_cost = multiplier_cost(&naf, width);
+    if (naf_cost < cost) {
+        *m = naf;
+        cost = naf_cost;
+    }
+    return cost;
+}
+
+// Multiply a local by a constant using Horner's method: starting from the
+// highest digit, the running total is shifted up to each following digit and
+// the local is added or subtracted.
+static uint64_t emit_multiply(Rewrite* rw, uint8_t type, uint64_t lhs, Multiplier* m) {
+    uint64_t result = lhs;
+    unsigned shift = 0;
+
+    for (unsigned i = m->top; i-- > 0;) {
+        shift++;
+        if (m->digits[i]) {
+            result = emit(rw, LSH, type, result, const_value(type, shift));
+            result = emit(rw, m->digits[i] > 0 ? ADD : SUB, type, result, local_value(lhs));
+            shift = 0;
+        }
+    }
+    if (shift)
+        result = emit(rw, LSH, type, result, const_value(type, shift));
+    return result;
+}
+
+/*
+ * Division
+ */
+
+// Find a multiplier and shift such that `x / divisor == (x * multiplier) >>
+// (bits + shift)` for every `bits`-wide unsigned x, following Granlund and
+// Montgomery. The multiplier must fit in `bits`, so that the product fits in a
+// type twice as wide. Returns false if there is no such multiplier.
+static bool find_reciprocal(uint64_t divisor, unsigned bits, uint64_t* multiplier, unsigned* shift) {
+    for (unsigned l = 0; l <= bits; l++) {
+        unsigned __int128 power = (unsigned __int128) 1 << (bits + l);
+        unsigned __int128 m = (power + divisor - 1) / divisor;
+
+        if (m >> bits)
+            return false;
+        // The rounding error must stay small enough to never reach the next
+        // multiple of the divisor.
+        if (m * divisor <= power + ((unsigned __int128) 1 << l)) {
+            *multiplier = m;
+            *shift = l;
+            return true;
+        }
+    }
+    return false;
+}
+
+typedef struct Reciprocal {
+    uint8_t wide_type;
+    uint64_t shift;
+    Multiplier multiplier;
+    unsigned cost;
+} Reciprocal;
+
+// Plan an unsigned division by multiplying with a reciprocal in a wider type.
+// Returns false if this is not possible.
+static bool plan_reciprocal(Reciprocal* r, uint8_t type, uint64_t divisor) {
+    unsigned bits = type_widths[type] * 8;
+    uint64_t multiplier;
+    unsigned shift;
+
+    r->wide_type = widened_type(type);
+    if (r->wide_type == VOID || !find_reciprocal(divisor, bits, &multiplier, &shift))
+        return false;
+
+    r->shift = bits + shift;
+    r->cost = plan_multiply(&r->multiplier, r->wide_type, multiplier)
+              + estimate_shift_cycles(type_widths[r->wide_type], false, false, r->shift)
+              // Widening and narrowing the value.
+              + 2 * type_widths[r->wide_type];
+    return true;
+}
+
+static uint64_t emit_reciprocal(Rewrite* rw, uint8_t type, uint64_t lhs, Reciprocal* r) {
+    uint64_t wide = emit(rw, ASSIGN, r->wide_type, 0, local_value(lhs));
+    uint64_t product = emit_multiply(rw, r->wide_type, wide, &r->multiplier);
+    uint64_t quotient = emit(rw, RSH, r->wide_type, product, const_value(r->wide_type, r->shift));
+    return emit(rw, ASSIGN, type, 0, local_value(quotient));
+}
+
+// Divide a signed local by 2^k, rounding towards zero. Negative values are
+// biased by 2^k - 1 first, since shifting alone rounds towards negative
+// infinity. Returns the biased value rather than the quotient, so that the
+// remainder can reuse it.
+static uint64_t emit_signed_bias(Rewrite* rw, uint8_t type, uint64_t lhs, unsigned k) {
+    uint8_t utype = unsigned_type(type);
+    unsigned bits = type_widths[type] * 8;
+    uint64_t sign = lhs;
+
+    // The bias is the top k bits of the sign fill, which for k == 1 is simply
+    // the sign bit itself.
+    if (k > 1)
+        sign = emit(rw, RSH, type, lhs, const_value(type, bits - 1));
+    uint64_t bias = emit(rw, ASSIGN, utype, 0, local_value(sign));
+    bias = emit(rw, RSH, utype, bias, const_value(utype, bits - k));
+    bias = emit(rw, ASSIGN, type, 0, local_value(bias));
+    return emit(rw, ADD, type, lhs, local_value(bias));
+}
+
+// Rewrite an operation with a constant right hand side. Returns true if it was
+// replaced.
+static bool reduce_operation(Function* func, Operation* op) {
+    uint8_t type = op->var_type;
+
+    switch (op->type) {
+    case MUL: case DIV: case MOD: case LSH: case RSH: break;
+    default: return false;
+    }
+    if (op->rhs.is_const == false || type < U8 || type > I64 || func->locals[op->lhs]->type != type)
+        return false;
+
+    Rewrite rw = {func, op, op->lhs, NULL};
+    unsigned bits = type_widths[type] * 8;
+    bool is_signed = is_signed_type(type) || op->rhs.is_signed;
+    uint64_t constant = truncate_to_type(type, op->rhs.const_unsigned);
+    // The magnitude of the constant, within the type's width.
+    uint64_t magnitude = truncate_to_type(unsigned_type(type),
+                                          is_signed && (int64_t) constant < 0 ? -constant : constant);
+    bool negative = is_signed && (int64_t) constant < 0;
+    // The constant's bits within the type's width, which are all that matter
+    // to a product.
+    uint64_t magnitude_bits = truncate_to_type(unsigned_type(type), constant);
+
+    switch (op->type) {
+    case MUL: {
+        if (constant == 0) {
+            op->type = ASSIGN;
+            op->rhs = const_value(type, 0);
+            return true;
+        }
+        Multiplier m;
+        if (plan_multiply(&m, type, magnitude_bits) >= runtime_cost(MUL, type, is_signed))
+            return false;
+        finish(&rw, emit_multiply(&rw, type, rw.input, &m));
+        return true;
+    }
+    case DIV: {
+        if (magnitude == 0)
+            return false;
+        if (magnitude == 1) {
+            if (negative)
+                finish(&rw, emit(&rw, NEGATE, type, rw.input, const_value(type, 0)));
+            else
+                finish(&rw, rw.input);
+            return true;
+        }
+        if (is_power_of_two(magnitude)) {
+            unsigned k = log2_floor(magnitude);
+            if (!is_signed) {
+                finish(&rw, emit(&rw, RSH, type, rw.input, const_value(type, k)));
+                return true;
+            }
+            uint64_t biased = emit_signed_bias(&rw, type, rw.input, k);
+            uint64_t quotient = emit(&rw, RSH, type, biased, const_value(type, k));
+            if (negative)
+                quotient = emit(&rw, NEGATE, type, quotient, const_value(type, 0));
+            finish(&rw, quotient);
+            return true;
+        }
+        // Signed division by other constants still uses the runtime routine.
+        if (is_signed)
+            return false;
+        // At most one multiple of a large divisor fits in the type.
+        if (constant > ((uint64_t) 1 << (bits - 1))) {
+            finish(&rw, emit(&rw, GREATER_EQU, type, rw.input, const_value(type, constant)));
+            return true;
+        }
+        Reciprocal r;
+        if (!plan_reciprocal(&r, type, constant)
+            || r.cost >= runtime_cost(DIV, type, is_signed))
+            return false;
+        finish(&rw, emit_reciprocal(&rw, type, rw.input, &r));
+        return true;
+    }
+    case MOD: {
+        if (magnitude == 0)
+            return false;
+        if (magnitude == 1) {
+            op->type = ASSIGN;
+            op->rhs = const_value(type, 0);
+            return true;
+        }
+        if (is_power_of_two(magnitude)) {
+            unsigned k = log2_floor(magnitude);
+            if (!is_signed) {
+                finish(&rw, emit(&rw, B_AND, type, rw.input, const_value(type, magnitude - 1)));
+                return true;
+            }
+            // The remainder takes the sign of the dividend, so subtract the
+            // truncated quotient's multiple rather than masking.
+            uint64_t biased = emit_signed_bias(&rw, type, rw.input, k);
+            uint64_t multiple = emit(&rw, B_AND, type, biased, const_value(type, -magnitude));
+            finish(&rw, emit(&rw, SUB, type, rw.input, local_value(multiple)));
+            return true;
+        }
+        if (is_signed)
+            return false;
+        Reciprocal r;
+        Multiplier m;
+        if (!plan_reciprocal(&r, type, constant))
+            return false;
+        unsigned cost = r.cost + plan_multiply(&m, type, constant)
+                        + estimate_add_cycles(type_widths[type], true);
+        if (cost >= runtime_cost(MOD, type, is_signed))
+            return false;
+        uint64_t quotient = emit_reciprocal(&rw, type, rw.input, &r);
+        uint64_t multiple = emit_multiply(&rw, type, quotient, &m);
+        finish(&rw, emit(&rw, SUB, type, rw.input, local_value(multiple)));
+        return true;
+    }
+    case LSH: case RSH:
+        // Shifting by nothing is a copy.
+        if (constant == 0) {
+            finish(&rw, rw.input);
+            return true;
+        }
+        return false;
+    }
+    return false;
+}
+
+// Replace multiplication, division, and remainder by constants with cheaper
+// sequences. Returns the number of operations replaced.
+size_t reduce_strength(Function* func) {
+    size_t reduced = 0;
+
+    for (size_t i = 0; i < va_len(func->basic_blocks); i++) {
+        for (Statement* state = func->basic_blocks[i].first; state; state = state->next) {
+            if (state->type == OPERATION && reduce_operation(func, (Operation*) state))
+                reduced++;
+        }
+    }
+
+    count_local_references(func);
+    remove_unused_casts(func);
+    return reduced;
+}